@@ -53,26 +53,25 @@ static uint8_t joystick_button_state = 0;
 static uint8_t carib_x = 130;
 static uint8_t carib_y = 130;
 
-// MIDI データ (チャルメラ)
-static const uint8_t CHARUMERA_LEN = 39;
-static uint8_t CHARUMERA_DATA[CHARUMERA_LEN] = {
-  3,             // Type of Sound control (MIDI)
-  1,             // Repeat count
-  12,            // Number of operations
-  14,  69, 255,  // 140ms, A5
-  14,  71, 255,  // 140ms, B5
-  56,  73, 255,  // 560ms, C#6
-  14,  71, 255,  // 140ms, B5
-  14,  69, 255,  // 140ms, A5
-  114, 128, 255, // no sound
-  14,  69, 255,  // 140ms, A5
-  14,  71, 255,  // 140ms, B5
-  14,  73, 255,  // 560ms, C#6
-  14,  71, 255,  // 140ms, B5
-  14,  69, 255,  // 140ms, A5
-  56,  71, 255   // 560ms, B5
+// MIDI データ (チャルメラ。コンパイル時に書き込みのデータの並びに変換される)
+static constexpr ToioNote CHARUMERA[] = {
+  toioNote(toioPitch('A', 5), 140),
+  toioNote(toioPitch('B', 5), 140),
+  toioNote(toioPitch('C', 6, 1), 560),
+  toioNote(toioPitch('B', 5), 140),
+  toioNote(toioPitch('A', 5), 140),
+  toioRest(1140),
+  toioNote(toioPitch('A', 5), 140),
+  toioNote(toioPitch('B', 5), 140),
+  toioNote(toioPitch('C', 6, 1), 140),
+  toioNote(toioPitch('B', 5), 140),
+  toioNote(toioPitch('A', 5), 140),
+  toioNote(toioPitch('B', 5), 560)
 };
 
+// MIDI の再生
+static ToioSequencer sequencer;
+
 void displayCaptionButtonA(String caption) {
   M5.Lcd.setCursor(30, 215, 2);
   M5.Lcd.print("[" + caption + "]");
@@ -136,6 +135,7 @@ void setup() {
 
   // 最初に見つかった Toio Core Cube の ToioCore オブジェクト
   toiocore = toiocore_list.at(0);
+  sequencer.begin(toiocore);
 
   // Toio　Core のデバイス名と MAC アドレスを表示
   M5.Lcd.setCursor(0, 50, 2);
@@ -164,6 +164,7 @@ void loop() {
   // イベントを扱う場合は、必ずここで Toio オブジェクトの
   // loop() メソッドを呼び出すこと
   toio.loop();
+  sequencer.loop();
 
   // ジョイスティックの状態を取得
   uint8_t x = Wire.read();
@@ -218,7 +219,7 @@ void loop() {
 
   // z 軸が押された場合、チャルメラを再生
   if (joystick_button_state == 0 && z == 1) {
-    toiocore->playSoundRaw(CHARUMERA_DATA, CHARUMERA_LEN);
+    sequencer.play(CHARUMERA);
   }
   joystick_button_state = z;
 
@@ -0,0 +1,181 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_codec.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  ToioCodec.h だけをインクルードし (BLE もシミュレータも使わない)、
+  書き込むデータの組み立てと通知の解釈を toio コア キューブ通信仕様の
+  バイト列と突き合わせます。長さが決まっているデータはコンパイル時に
+  組み立てられることも static_assert で確かめ、最後に組み立てと解釈の
+  1 回あたりの所要時間を計ります。
+
+  [使い方]
+
+  ./build/sim_codec [計測の回数]
+  -------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <ToioCodec.h>
+#include <ToioSimCheck.h>
+
+// コンパイル時に組み立てる
+constexpr ToioPacket<7> kRed = toioEncodeLed(0xff, 0x00, 0x00);
+static_assert(kRed.length == 7 && kRed.data[0] == 0x03 && kRed.data[4] == 0xff, "LED packet");
+constexpr ToioPacket<8> kTimed = toioEncodeMotor(false, 0x64, true, 0x14, true, 0x50);
+static_assert(kTimed.length == 8 && kTimed.data[0] == 0x02 && kTimed.data[5] == 0x02 && kTimed.data[7] == 0x50, "motor packet");
+static_assert(toioEncodeMotor(false, 10, false, 10).length == 7, "motor packet without duration");
+static_assert(toioEncodeConnInterval(0x0006, 0x000c).data[2] == 0x06, "connection interval packet");
+
+template <size_t N>
+static void expect(const char* name, const ToioPacket<N>& packet, const uint8_t* bytes, size_t length) {
+  bool ok = packet.length == length && memcmp(packet.data, bytes, length) == 0;
+  check(name, ok);
+  if (!ok) {
+    printf("   %-18s:", name);
+    for (size_t i = 0; i < packet.length; i++) {
+      printf(" %02x", packet.data[i]);
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t rounds = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+  // ---- 組み立て (通信仕様の例と同じバイト列になる) ----
+  {
+    const uint8_t led[] = {0x03, 0x00, 0x01, 0x01, 0xff, 0x00, 0x00};
+    expect("led", kRed, led, sizeof(led));
+    const uint8_t effect[] = {0x02, 0x03, 0xff};
+    expect("sound effect", toioEncodeSoundEffect(0x03, 0xff), effect, sizeof(effect));
+    const uint8_t stop[] = {0x01};
+    expect("sound stop", toioEncodeSoundStop(), stop, sizeof(stop));
+    const uint8_t motor[] = {0x01, 0x01, 0x01, 0x64, 0x02, 0x02, 0x14};
+    expect("motor", toioEncodeMotor(false, 0x64, true, 0x14), motor, sizeof(motor));
+    const uint8_t timed[] = {0x02, 0x01, 0x01, 0x64, 0x02, 0x02, 0x14, 0x50};
+    expect("motor timed", kTimed, timed, sizeof(timed));
+
+    ToioCoreTarget target = {0x02bc, 0x0190, 0x005a, TOIO_CORE_ANGLE_ABSOLUTE};
+    ToioCoreTargetParams params = {0x05, TOIO_CORE_MOVE_ROTATE_WHILE_MOVING, 0x50, TOIO_CORE_SPEED_ACCELERATE};
+    const uint8_t move[] = {0x03, 0x00, 0x05, 0x00, 0x50, 0x01, 0x00, 0xbc, 0x02, 0x90, 0x01, 0x5a, 0x00};
+    expect("move to target", toioEncodeMoveToTarget(0x00, target, params), move, sizeof(move));
+
+    ToioCoreTarget targets[2] = {{0x00fa, 0x00fa, 0x005a, TOIO_CORE_ANGLE_ABSOLUTE},
+                                 {0x0190, 0x00fa, 0x0000, TOIO_CORE_ANGLE_NONE}};
+    ToioPacket<TOIO_TARGETS_PACKET_SIZE> multi;
+    toioEncodeMoveToTargets(0x01, targets, 2, params, true, multi);
+    const uint8_t moves[] = {0x04, 0x01, 0x05, 0x00, 0x50, 0x01, 0x00, 0x01,
+                             0xfa, 0x00, 0xfa, 0x00, 0x5a, 0x00,
+                             0x90, 0x01, 0xfa, 0x00, 0x00, 0xa0};
+    expect("move to targets", multi, moves, sizeof(moves));
+
+    const uint8_t accel[] = {0x05, 0x32, 0x0f, 0x1e, 0x00, 0x00, 0x00, 0x01, 0x64};
+    expect("acceleration", toioEncodeAcceleration(0x32, 0x0f, 0x1e, false, false, true, 1000), accel, sizeof(accel));
+
+    ToioCoreLedStep steps[2] = {{300, 0xff, 0x00, 0x00}, {5, 0x00, 0x00, 0xff}};
+    ToioPacket<TOIO_LED_PACKET_SIZE> scenario;
+    toioEncodeLedScenario(steps, 2, 0x00, scenario);
+    const uint8_t scene[] = {0x04, 0x00, 0x02, 0x1e, 0x01, 0x01, 0xff, 0x00, 0x00, 0x01, 0x01, 0x01, 0x00, 0x00, 0xff};
+    expect("led scenario", scenario, scene, sizeof(scene));
+
+    ToioNote notes[2] = {toioNote(toioPitch('C', 5), 300), toioRest(100)};
+    ToioPacket<TOIO_MIDI_PACKET_SIZE> midi;
+    toioEncodeMidi(notes, 2, 1, midi);
+    const uint8_t song[] = {0x03, 0x01, 0x02, 0x1e, 0x3c, 0xff, 0x0a, 0x80, 0x00};
+    expect("midi", midi, song, sizeof(song));
+
+    const uint8_t flat[] = {0x05, 0x00, 0x2d};
+    expect("flat threshold", toioEncodeFlatThreshold(45), flat, sizeof(flat));
+    const uint8_t posture[] = {0x1d, 0x00, 0x03, 0x05, 0x01};
+    expect("posture notify", toioEncodePostureNotify(TOIO_CORE_POSTURE_EULER_PRECISE, 5, TOIO_CORE_NOTIFY_ON_CHANGE),
+           posture, sizeof(posture));
+    const uint8_t speed_notify[] = {0x1c, 0x00, 0x01};
+    expect("motor speed notify", toioEncodeMotorSpeedNotify(true), speed_notify, sizeof(speed_notify));
+    const uint8_t interval[] = {0x30, 0x00, 0x18, 0x00, 0x28, 0x00};
+    expect("conn interval", toioEncodeConnInterval(24, 40), interval, sizeof(interval));
+  }
+
+  // ---- 解釈 ----
+  {
+    const uint8_t pos[] = {0x01, 0x61, 0x01, 0xa0, 0x00, 0x2c, 0x01, 0x5f, 0x01, 0x9f, 0x00, 0x2d, 0x01};
+    ToioCorePositionData position;
+    check("position", toioDecodePosition(pos, sizeof(pos), position) && position.x == 0x0161 && position.y == 0x00a0 &&
+                      position.angle == 300 && position.sensor_angle == 301);
+    check("position too short", !toioDecodePosition(pos, 12, position));
+
+    const uint8_t sid[] = {0x02, 0x00, 0x00, 0x38, 0x00, 0x0f, 0x00};
+    ToioCoreStandardIdData standard_id;
+    check("standard id", toioDecodeStandardId(sid, sizeof(sid), standard_id) && standard_id.id == 0x380000 &&
+                         standard_id.angle == 15);
+
+    const uint8_t missed[] = {0x03};
+    ToioCoreIdType type;
+    check("id missed", toioDecodeIdMissed(missed, 1, type) && type == TOIO_CORE_ID_POSITION);
+
+    const uint8_t button[] = {0x01, 0x80};
+    bool pressed = false;
+    check("button", toioDecodeButton(button, 2, pressed) && pressed);
+
+    const uint8_t motion[] = {0x01, 0x01, 0x00, 0x01, 0x05, 0x03};
+    ToioCoreMotionData m;
+    check("motion", toioDecodeMotion(motion, sizeof(motion), m) && m.flat && !m.clash && m.dtap && m.attitude == 5 &&
+                    m.shake == 3);
+
+    // 高精度オイラー角 (roll 12.5, pitch -90.0, yaw 179.99)
+    const uint8_t euler[] = {0x03, 0x03, 0x00, 0x00, 0x48, 0x41, 0x00, 0x00, 0xb4, 0xc2, 0x71, 0xfd, 0x33, 0x43};
+    ToioCorePostureData p;
+    check("posture", toioDecodePosture(euler, sizeof(euler), p) && p.roll == 1250 && p.pitch == -9000 && p.yaw == 17999);
+
+    const uint8_t magnet[] = {0x02, 0x00, 0x0a, 0xfe, 0x03, 0x00};
+    ToioCoreMagneticData mag;
+    check("magnetic", toioDecodeMagnetic(magnet, sizeof(magnet), mag) && mag.strength == 10 && mag.x == -2 && mag.y == 3);
+    check("magnetic is not posture", !toioDecodePosture(magnet, sizeof(magnet), p));
+
+    const uint8_t response[] = {0x83, 0x07, 0x00};
+    ToioCoreMotorResponse r;
+    check("motor response", toioDecodeMotorResponse(response, 3, r) && r.request_id == 7 &&
+                            r.result == TOIO_CORE_MOTOR_RESULT_SUCCESS);
+
+    const uint8_t speed[] = {0xe0, 0x32, 0x14};
+    ToioCoreMotorSpeed sp;
+    check("motor speed", toioDecodeMotorSpeed(speed, 3, sp) && sp.left == 0x32 && sp.right == 0x14);
+    check("motor speed is not response", !toioDecodeMotorResponse(speed, 3, r));
+
+    const uint8_t requested[] = {0xb1, 0x00, 0x18, 0x00, 0x28, 0x00};
+    uint16_t min_interval = 0;
+    uint16_t max_interval = 0;
+    check("conn interval", toioDecodeConnInterval(requested, sizeof(requested), min_interval, max_interval) &&
+                           min_interval == 24 && max_interval == 40);
+    const uint8_t result[] = {0x9d, 0x00, 0x00};
+    check("config result", toioDecodeConfigResult(result, 3) && !toioDecodeConfigResult(result, 2));
+  }
+
+  // ---- 所要時間 ----
+  typedef std::chrono::steady_clock Clock;
+  volatile uint32_t sink = 0;
+  Clock::time_point t0 = Clock::now();
+  for (uint32_t i = 0; i < rounds; i++) {
+    ToioPacket<8> packet = toioEncodeMotor(i & 1, (uint8_t)i, i & 2, (uint8_t)(i >> 8), i & 4, (uint8_t)(i >> 16));
+    sink = sink + packet.data[3] + packet.length;
+  }
+  Clock::time_point t1 = Clock::now();
+  uint8_t pos[13] = {0x01};
+  ToioCorePositionData position;
+  for (uint32_t i = 0; i < rounds; i++) {
+    pos[1] = (uint8_t)i;
+    if (toioDecodePosition(pos, sizeof(pos), position)) {
+      sink = sink + position.x;
+    }
+  }
+  Clock::time_point t2 = Clock::now();
+  double encode_ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / rounds;
+  double decode_ns = std::chrono::duration<double, std::nano>(t2 - t1).count() / rounds;
+  printf("encode motor : %6.2f ns\n", encode_ns);
+  printf("decode pos   : %6.2f ns\n", decode_ns);
+  return checkResult();
+}
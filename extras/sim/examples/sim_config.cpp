@@ -0,0 +1,89 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_config.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブに BLE プロトコルバージョンを
+  繰り返し要求し、応答までの時間を表示します。続けて非同期の要求を
+  重ねて送り、すべての応答が届くことと、応答のない要求がタイムアウト
+  で失敗として通知されることを確認します。
+
+  [使い方]
+
+  ./build/sim_config [要求の回数] [書き込みの遅延 (ミリ秒)]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+
+int main(int argc, char* argv[]) {
+  uint32_t count = (argc > 1) ? atoi(argv[1]) : 20;
+  uint32_t write_latency = (argc > 2) ? atoi(argv[2]) : 5;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  link.write_latency_ms = write_latency;
+  ToioSim::setLinkConfig(link);
+  ToioSim::addCube();
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  if (toiocore_list.empty()) {
+    Serial.println("No cube found");
+    return 1;
+  }
+  ToioCore* toiocore = toiocore_list.at(0);
+  toiocore->connect();
+
+  // 同期: 応答が届いた時点で処理が戻る
+  uint32_t total_us = 0;
+  uint32_t max_us = 0;
+  uint32_t failed = 0;
+  std::string version;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t start = micros();
+    version = toiocore->getBleProtocolVersion();
+    uint32_t elapsed = micros() - start;
+    total_us += elapsed;
+    max_us = (elapsed > max_us) ? elapsed : max_us;
+    failed += version.empty() ? 1 : 0;
+  }
+  Serial.printf("sync   : version %s, %u requests, avg %u us, max %u us, %u failed\n",
+                version.c_str(), count, total_us / count, max_us, failed);
+
+  // 非同期: 同じ種類の要求は送った順に応答と対応づけられる
+  uint32_t succeeded = 0;
+  uint32_t timed_out = 0;
+  std::vector<int> order;
+  for (int i = 0; i < 3; i++) {
+    uint8_t data[2] = {0x01, 0x00};
+    toiocore->requestConfigAsync(data, 2, 0x81, [i, &succeeded, &order](bool success, const uint8_t* res, size_t len) {
+      succeeded += success ? 1 : 0;
+      order.push_back(i);
+    });
+  }
+  // 応答のない種類の要求はタイムアウトで失敗になる
+  uint8_t unknown[2] = {0x7f, 0x00};
+  toiocore->requestConfigAsync(unknown, 2, 0xff, [&timed_out](bool success, const uint8_t* res, size_t len) {
+    timed_out += success ? 0 : 1;
+  }, 200);
+
+  unsigned long start = millis();
+  while (millis() - start < 500) {
+    toio.loop();
+    delay(5);
+  }
+  Serial.printf("async  : %u/3 succeeded in order", succeeded);
+  for (int i : order) {
+    Serial.printf(" %d", i);
+  }
+  Serial.printf(", %u/1 timed out\n", timed_out);
+
+  toiocore->disconnect();
+  delay(10);
+  return (failed == 0 && succeeded == 3 && timed_out == 1) ? 0 : 1;
+}
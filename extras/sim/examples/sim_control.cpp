@@ -0,0 +1,139 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_control.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブごとに ToioController を起動し、
+  円周上の経路を Pure Pursuit でたどらせます。loop() 側では画面描画の
+  代わりに重い処理 (40 ミリ秒の待ち) を入れ、それでも制御ループの周期が
+  保たれることを、周期の揺らぎと遅れの統計で確認します。
+
+  最後に、loop() 側 (制御タスクより優先度の低いタスク) が指示を書き込んで
+  いる途中で止まった状態を、シグナルでこのスレッドを止めて再現し、
+  制御タスクが読み直し続けずに前回の指示で制御を続けることを確認します。
+
+  [使い方]
+
+  ./build/sim_control [キューブの数] [制御周波数 (Hz)] [実行秒数]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+#include <ToioSimCheck.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <thread>
+
+// loop() のタスクが制御タスクに割り込まれている時間 (マイクロ秒)
+#define PREEMPT_STALL_US 40000
+
+static void stall(int sig) {
+  usleep(PREEMPT_STALL_US);
+}
+
+int main(int argc, char* argv[]) {
+  size_t cube_num = (argc > 1) ? atoi(argv[1]) : 4;
+  uint16_t rate_hz = (argc > 2) ? atoi(argv[2]) : 50;
+  uint32_t seconds = (argc > 3) ? atoi(argv[3]) : 5;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  ToioSim::setLinkConfig(link);
+  std::vector<ToioSimCube*> sim_cubes = ToioSim::addCubes(cube_num);
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->connect();
+  }
+
+  // キューブごとに位置をずらした円周上の経路
+  std::vector<ToioController*> controllers;
+  for (size_t i = 0; i < toiocore_list.size(); i++) {
+    double cx = 150 + (i % 3) * 100;
+    double cy = 150 + (i / 3 % 3) * 100;
+    sim_cubes[i]->setPose(cx + 40, cy, 90);
+
+    ToioControllerPoint path[17];
+    for (int p = 0; p < 17; p++) {
+      double rad = 2.0 * M_PI * (p + 1) / 16;
+      path[p].x = (uint16_t)lround(cx + 40 * cos(rad));
+      path[p].y = (uint16_t)lround(cy + 40 * sin(rad));
+    }
+    ToioController* controller = new ToioController(toiocore_list[i]);
+    controller->setMaxSpeed(50);
+    controller->follow(path, 17, 20);
+    controller->start(rate_hz);
+    controllers.push_back(controller);
+  }
+
+  // loop() 側は重い処理で 40 ミリ秒ずつ止まる
+  unsigned long start = millis();
+  while (millis() - start < seconds * 1000) {
+    toio.loop();
+    delay(40);
+  }
+
+  Serial.printf("rate %u Hz, %u cubes\n", rate_hz, (unsigned int)controllers.size());
+  Serial.println("address            iter overrun stale period-us jitter-avg jitter-max exec-max arrived");
+  for (size_t i = 0; i < controllers.size(); i++) {
+    ToioController* controller = controllers[i];
+    controller->stop();
+    ToioControllerStats stats = controller->getStats();
+    Serial.printf("%s %6u %7u %5u %9u %10u %10u %8u %7s\n",
+                  toiocore_list[i]->getAddress().c_str(), stats.iterations, stats.overruns, stats.stale_poses,
+                  stats.period_us, stats.avg_jitter_us, stats.max_jitter_us, stats.max_exec_us,
+                  controller->isArrived() ? "yes" : "no");
+    delete controller;
+  }
+
+  // ---- 指示の書き込み中に割り込まれる ----
+  {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stall;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, nullptr);
+
+    ToioController* controller = new ToioController(toiocore_list[0]);
+    controller->setMaxSpeed(30);
+    controller->moveTo(250, 250);
+    controller->start(rate_hz);
+
+    // このスレッドは指示を書き込み続け、別のスレッドが 50 ミリ秒ごとにシグナルで止める
+    pthread_t self = pthread_self();
+    std::atomic<bool> preempting(true);
+    std::thread preempter([&preempting, self]() {
+      while (preempting) {
+        pthread_kill(self, SIGUSR1);
+        delay(50);
+      }
+    });
+    unsigned long start = millis();
+    for (uint16_t i = 0; millis() - start < 3000; i++) {
+      controller->setTolerance(10 + i % 10);
+    }
+    preempting = false;
+    preempter.join();
+
+    controller->stop();
+    ToioControllerStats stats = controller->getStats();
+    Serial.printf("preempt: %u stale commands in %u iterations, exec max %u us (writer stalled %u us)\n",
+                  stats.stale_commands, stats.iterations, stats.max_exec_us, PREEMPT_STALL_US);
+    check("stale commands", stats.stale_commands > 0);
+    // 読み直し続けると、1 周期の処理時間が書き込みが止まっている時間と同じくらいになる
+    check("no spin", stats.max_exec_us < PREEMPT_STALL_US / 2);
+    delete controller;
+  }
+
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->disconnect();
+  }
+  delay(10);
+  return checkResult();
+}
@@ -0,0 +1,137 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_dispatch.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の多数の仮想 toio コア キューブから位置の通知を受け
+  ながら、コールバックの処理が重い状況で Toio::loop() に時間の予算を
+  与えます。loop() の所要時間が予算の範囲に収まること、ボタンの
+  イベントは通常のイベントより先に処理されること、マットから外れて
+  何も起きていないキューブは loop() で処理されないことを確認します。
+
+  [使い方]
+
+  ./build/sim_dispatch [キューブの数] [予算 (マイクロ秒)] [1 イベントの処理時間 (マイクロ秒)]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+
+int main(int argc, char* argv[]) {
+  size_t cube_num = (argc > 1) ? atoi(argv[1]) : 12;
+  uint32_t budget_us = (argc > 2) ? atoi(argv[2]) : 3000;
+  uint32_t work_us = (argc > 3) ? atoi(argv[3]) : 600;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  ToioSim::setLinkConfig(link);
+  std::vector<ToioSimCube*> sim_cubes = ToioSim::addCubes(cube_num);
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  if (toiocore_list.size() != cube_num) {
+    Serial.println("Not all cubes found");
+    return 1;
+  }
+
+  uint32_t positions = 0;
+  uint32_t pressed_at = 0;
+  uint32_t button_us = 0;
+  uint32_t handled = 0;
+  for (size_t i = 0; i < cube_num; i++) {
+    ToioCore* toiocore = toiocore_list[i];
+    toiocore->onPosition([&positions, work_us](ToioCorePositionData pos) {
+      positions++;
+      delayMicroseconds(work_us);
+    });
+    toiocore->onButton([&](bool state) {
+      if (state) {
+        button_us += micros() - pressed_at;
+        handled++;
+      }
+    });
+    toiocore->connect();
+    sim_cubes[i]->setPose(60 + 30 * (i % 12), 100 + 60 * (i / 12), 0);
+    toiocore->controlMotor(true, 30, false, 30); // その場で回して位置の通知を出し続ける
+  }
+
+  // 1. 全台がマット上: 位置の通知を処理しきれない中でボタンを押す
+  //    (ボタンの優先度を通常にした場合と、既定の高い優先度の場合を比べる)
+  const ToioCoreEventPriority priorities[2] = {TOIO_CORE_PRIORITY_NORMAL, TOIO_CORE_PRIORITY_HIGH};
+  const char* names[2] = {"normal", "high"};
+  uint32_t latency_us[2];
+  // 予算を超えるのは、予算を確かめた後に処理した 1 イベント分まで
+  // (シミュレータのタスクに割り込まれることがあるので、超えた回数の割合で確かめる)
+  uint32_t limit = budget_us + work_us + 2000;
+  uint32_t loops = 0;
+  uint32_t over = 0;
+  uint32_t dropped = 0;
+  for (ToioCore* toiocore : toiocore_list) {
+    dropped -= toiocore->getEventQueueStats().dropped;
+  }
+  ToioLoopStats busy;
+  for (int p = 0; p < 2; p++) {
+    toio.setEventPriority(TOIO_CORE_EVENT_BUTTON, priorities[p]);
+    button_us = 0;
+    handled = 0;
+    uint32_t presses = 0;
+    for (uint32_t step = 0; step < 400; step++) {
+      if (step % 40 == 0) {
+        sim_cubes[presses % cube_num]->setButtonState(true);
+        pressed_at = micros();
+        presses++;
+      } else if (step % 40 == 20) {
+        sim_cubes[(presses - 1) % cube_num]->setButtonState(false);
+      }
+      toio.loop(budget_us);
+      busy = toio.getLoopStats();
+      loops++;
+      over += (busy.last_us > limit);
+      delay(1);
+    }
+    latency_us[p] = handled ? button_us / handled : 0;
+    Serial.printf("button %-6s: %u/%u presses handled, %6u us on average\n", names[p], handled, presses, latency_us[p]);
+
+    // 溜まったイベントを予算なしで処理し、押したボタンの処理を次に持ち越さない
+    for (ToioSimCube* sim_cube : sim_cubes) {
+      sim_cube->setButtonState(false);
+    }
+    delay(20);
+    toio.loop();
+  }
+  for (ToioCore* toiocore : toiocore_list) {
+    dropped += toiocore->getEventQueueStats().dropped;
+  }
+  Serial.printf("busy : %u positions, %u deferred, %u dropped, %u/%u loops over %u us (budget %u us)\n",
+                positions, busy.deferred, dropped, over, loops, limit, budget_us);
+
+  // 2. 全台がマットから外れる: 何も起きていないキューブは処理しない
+  for (ToioSimCube* sim_cube : sim_cubes) {
+    sim_cube->setOnMat(false);
+  }
+  delay(100);
+  toio.loop();
+  toio.loop();
+  uint32_t idle_cubes = 0;
+  uint32_t idle_loops = 200;
+  for (uint32_t i = 0; i < idle_loops; i++) {
+    toio.loop();
+    idle_cubes += toio.getLoopStats().cubes;
+    delay(1);
+  }
+  ToioLoopStats idle = toio.getLoopStats();
+  Serial.printf("idle : %.2f cubes serviced per loop, loop %u us\n", (double)idle_cubes / idle_loops, idle.last_us);
+
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->disconnect();
+  }
+  delay(10);
+
+  bool ok = busy.deferred > 0 && over * 10 < loops && latency_us[1] > 0 && latency_us[1] < latency_us[0] && idle_cubes == 0;
+  Serial.println(ok ? "result : ok" : "result : NG");
+  return ok ? 0 : 1;
+}
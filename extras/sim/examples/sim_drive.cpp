@@ -0,0 +1,211 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_drive.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  ToioDriveMixer (drive() の入力の変換) を確かめます。
+
+  1. 既定の設定の出力が、従来の drive() (double で計算していたもの) と
+     すべての入力で ±1 以内に収まることを確認し、1 回の変換の所要時間を
+     比べる
+  2. 加速の制限をかけると、停止から最大まで単調に、指定した時間で
+     加速すること、前進から後退に切り替えるときは一度 0 を通ることを
+     確認する
+  3. シミュレータの仮想キューブで、TOIO_DRIVE_ARCADE の drive(0, 100) が
+     その場で旋回すること、timeout_ms を指定すると時間指定付きの
+     モーター制御が送られ、指示が途切れるとキューブが止まることを確認する
+
+  [使い方]
+
+  ./build/sim_drive [計測の回数]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+#include <ToioSimCheck.h>
+#include <chrono>
+#include <math.h>
+
+// 従来の drive() の計算 (左右の速度指示値。後退なら負)
+static void legacyDrive(int8_t throttle, int8_t steering, int16_t& left, int16_t& right) {
+  bool back = (throttle < 0);
+  throttle = abs(throttle);
+  if (throttle > 100) {
+    throttle = 100;
+  }
+  if (steering < -100) {
+    steering = -100;
+  } else if (steering > 100) {
+    steering = 100;
+  }
+  double speed = 115.0 * (double)throttle / 100.0;
+  double lspeed = speed;
+  double rspeed = speed;
+  if (steering < 0) {
+    lspeed = speed * (100 - abs(steering)) / 100.0;
+  } else if (steering > 0) {
+    rspeed = speed * (100 - abs(steering)) / 100.0;
+  }
+  left = (uint8_t)lspeed;
+  right = (uint8_t)rspeed;
+  if (back) {
+    left = -left;
+    right = -right;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t rounds = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+  // ---- 1. 従来の drive() との比較 ----
+  {
+    ToioDriveMixer mixer;
+    int max_diff = 0;
+    bool untimed = true;
+    for (int a = -127; a <= 127; a++) {
+      for (int b = -127; b <= 127; b++) {
+        int16_t left;
+        int16_t right;
+        legacyDrive(a, b, left, right);
+        ToioDriveOutput out = mixer.mix(a, b, 0);
+        int d = std::max(abs(out.left - left), abs(out.right - right));
+        max_diff = std::max(max_diff, d);
+        if ((left < 0) != (out.left < 0) && left != 0 && out.left != 0) {
+          max_diff = 999;
+        }
+        untimed = untimed && out.duration_ms == 0;
+      }
+    }
+    check("legacy compatible", max_diff <= 1);
+    check("untimed", untimed);
+
+    typedef std::chrono::steady_clock Clock;
+    volatile int32_t sink = 0;
+    Clock::time_point t0 = Clock::now();
+    for (uint32_t i = 0; i < rounds; i++) {
+      int16_t left;
+      int16_t right;
+      legacyDrive((int8_t)i, (int8_t)(i >> 8), left, right);
+      sink = sink + left + right;
+    }
+    Clock::time_point t1 = Clock::now();
+    for (uint32_t i = 0; i < rounds; i++) {
+      ToioDriveOutput out = mixer.mix((int8_t)i, (int8_t)(i >> 8), i);
+      sink = sink + out.left + out.right;
+    }
+    Clock::time_point t2 = Clock::now();
+    Serial.printf("legacy : %6.2f ns per drive()\n", std::chrono::duration<double, std::nano>(t1 - t0).count() / rounds);
+    Serial.printf("mixer  : %6.2f ns per mix(), max diff %d\n",
+                  std::chrono::duration<double, std::nano>(t2 - t1).count() / rounds, max_diff);
+  }
+
+  // ---- 2. 加減速の制限 ----
+  {
+    ToioDriveConfig config = toioDriveDefaults();
+    config.accel_ms = 500;
+    config.decel_ms = 250;
+    ToioDriveMixer mixer;
+    mixer.setConfig(config);
+    int16_t prev = 0;
+    bool monotonic = true;
+    uint32_t full_at = 0;
+    uint32_t now = 1000;
+    for (uint32_t t = 0; t <= 1000; t += 10, now += 10000) {
+      ToioDriveOutput out = mixer.mix(100, 0, now);
+      monotonic = monotonic && out.left >= prev && out.left == out.right;
+      if (full_at == 0 && out.left == TOIO_DRIVE_MAX_SPEED) {
+        full_at = t;
+      }
+      prev = out.left;
+    }
+    Serial.printf("accel  : full speed after %u ms (accel_ms %u)\n", full_at, config.accel_ms);
+    check("accel monotonic", monotonic);
+    check("accel time", full_at >= 490 && full_at <= 510);
+
+    bool stopped = false;
+    bool skipped = false;
+    uint32_t reversed_at = 0;
+    for (uint32_t t = 0; t <= 1000; t += 10, now += 10000) {
+      ToioDriveOutput out = mixer.mix(-100, 0, now);
+      stopped = stopped || out.left == 0;
+      skipped = skipped || (out.left < 0 && !stopped);
+      if (reversed_at == 0 && out.left == -TOIO_DRIVE_MAX_SPEED) {
+        reversed_at = t;
+      }
+    }
+    Serial.printf("reverse: full reverse after %u ms (decel_ms %u + accel_ms %u)\n", reversed_at, config.decel_ms,
+                  config.accel_ms);
+    check("reverse through zero", stopped && !skipped);
+    check("reverse time", reversed_at >= 740 && reversed_at <= 770);
+  }
+
+  // ---- 3. 仮想キューブ ----
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  ToioSim::setLinkConfig(link);
+  ToioSimCube* sim_cube = ToioSim::addCube();
+  sim_cube->setPose(250, 250, 0);
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  if (toiocore_list.size() != 1 || !toiocore_list[0]->connect()) {
+    Serial.println("No cube connected");
+    return 1;
+  }
+  ToioCore* toiocore = toiocore_list[0];
+
+  {
+    ToioDriveConfig config = toioDriveDefaults();
+    config.mode = TOIO_DRIVE_ARCADE;
+    toiocore->setDriveConfig(config);
+    double x0, y0, a0;
+    sim_cube->getPose(x0, y0, a0);
+    for (int i = 0; i < 100; i++) {
+      toiocore->drive(0, 100);
+      run(toio, 10);
+    }
+    toiocore->drive(0, 0);
+    run(toio, 50);
+    double x1, y1, a1;
+    sim_cube->getPose(x1, y1, a1);
+    double moved = hypot(x1 - x0, y1 - y0);
+    double turned = fabs(fmod(a1 - a0 + 540.0, 360.0) - 180.0);
+    Serial.printf("pivot  : moved %.1f, turned %.1f deg\n", moved, turned);
+    check("pivot in place", moved < 3.0 && turned > 20.0);
+  }
+
+  {
+    ToioDriveConfig config = toioDriveDefaults();
+    config.timeout_ms = 200;
+    toiocore->setDriveConfig(config);
+    double xs, ys, as;
+    sim_cube->getPose(xs, ys, as);
+    for (int i = 0; i < 20; i++) {
+      toiocore->drive(40, 0);
+      run(toio, 10);
+    }
+    std::vector<uint8_t> last = sim_cube->getLastWrite(TOIO_SIM_CHAR_MOTOR);
+    check("timed command", last.size() == 8 && last[0] == 0x02 && last[7] == 20);
+
+    // 指示を止める (ループが止まった場合を想定)
+    run(toio, 300);
+    double x0, y0, a0;
+    sim_cube->getPose(x0, y0, a0);
+    run(toio, 300);
+    double x1, y1, a1;
+    sim_cube->getPose(x1, y1, a1);
+    double driven = hypot(x0 - xs, y0 - ys);
+    double moved = hypot(x1 - x0, y1 - y0);
+    Serial.printf("timeout: moved %.1f while driving, %.1f after commands stopped\n", driven, moved);
+    check("stopped by timeout", driven > 5.0 && moved < 0.5);
+  }
+
+  toiocore->disconnect();
+  delay(10);
+
+  return checkResult();
+}
@@ -0,0 +1,165 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_feedback.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータの仮想 toio コア キューブでモーターの速度情報 (0xe0) を
+  有効にし、指示した速度と測った速度を並べて確かめます。
+
+  1. 前進中に車輪を止め、速度情報で止まったことに気付くまでの時間と、
+     位置の通知が途絶えたことで気付くまでの時間を比べる
+  2. マットから持ち上げても車輪は回り続ける (速度情報は指示どおり) ことを
+     確認する
+  3. 時間指定付きの指示が切れると、指示した速度も 0 として記録される
+     ことを確認する
+  4. 目標指定付きモーター制御の間は、キューブが速度を決めていると
+     記録され、応答の数と失敗の数が数えられることを確認する
+  5. 接続し直しても速度情報の設定が再送されることを確認する
+
+  [使い方]
+
+  ./build/sim_feedback [位置の通知が途絶えたとみなす時間 (ミリ秒)]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+#include <ToioSimCheck.h>
+
+int main(int argc, char* argv[]) {
+  uint32_t pose_timeout_ms = (argc > 1) ? atoi(argv[1]) : 100;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  ToioSim::setLinkConfig(link);
+  ToioSimCube* sim_cube = ToioSim::addCube();
+  sim_cube->setPose(150, 250, 0);
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  if (toiocore_list.size() != 1 || !toiocore_list[0]->connect()) {
+    Serial.println("No cube connected");
+    return 1;
+  }
+  ToioCore* toiocore = toiocore_list[0];
+  toiocore->setMotorWriteInterval(0);
+  check("enable", toiocore->setMotorSpeedNotify(true));
+
+  ToioCoreMotorFeedback feedback;
+  check("no feedback before moving", !toiocore->getMotorFeedback(feedback));
+
+  // ---- 1. 車輪を止める ----
+  {
+    toiocore->controlMotor(true, 50, true, 50);
+    run(toio, 200);
+    check("feedback", toiocore->getMotorFeedback(feedback) && feedback.measured.left == 50 &&
+                      feedback.measured.right == 50 && feedback.commanded && feedback.commanded_left == 50 &&
+                      feedback.commanded_right == 50);
+
+    sim_cube->setStalled(true);
+    uint32_t stalled_at = micros();
+    uint32_t by_speed_us = 0;
+    uint32_t by_pose_us = 0;
+    while ((by_speed_us == 0 || by_pose_us == 0) && micros() - stalled_at < 2000000) {
+      toio.loop();
+      uint32_t now = micros();
+      // 速度情報: 指示しているのに測った速度が 0
+      if (by_speed_us == 0 && toiocore->getMotorFeedback(feedback) && feedback.commanded_left != 0 &&
+          feedback.measured.left == 0) {
+        by_speed_us = now - stalled_at;
+      }
+      // 位置: 指示しているのに位置の通知が pose_timeout_ms 届かない
+      ToioCorePose pose;
+      if (by_pose_us == 0 && toiocore->getLatestPose(pose) && now - pose.timestamp > pose_timeout_ms * 1000) {
+        by_pose_us = now - stalled_at;
+      }
+      delay(1);
+    }
+    Serial.printf("stall  : detected by speed in %5u us, by position in %6u us\n", by_speed_us, by_pose_us);
+    check("stall detected", by_speed_us > 0 && by_speed_us < by_pose_us);
+    sim_cube->setStalled(false);
+    run(toio, 50);
+  }
+
+  // ---- 2. マットから持ち上げる ----
+  {
+    sim_cube->setOnMat(false);
+    run(toio, 100);
+    ToioCorePose pose;
+    check("lifted", toiocore->getMotorFeedback(feedback) && feedback.measured.left == 50 &&
+                    toiocore->getLatestPose(pose) && !pose.on_mat);
+    Serial.printf("lifted : measured %u/%u, commanded %d/%d, on mat %d\n", feedback.measured.left,
+                  feedback.measured.right, feedback.commanded_left, feedback.commanded_right, pose.on_mat);
+    sim_cube->setOnMat(true);
+  }
+
+  // ---- 3. 時間指定付きの指示 ----
+  {
+    toiocore->controlMotor(false, 40, true, 40, 100);
+    run(toio, 50);
+    check("timed running", toiocore->getMotorFeedback(feedback) && feedback.commanded_left == -40 &&
+                           feedback.commanded_right == 40 && feedback.measured.left == 40);
+    run(toio, 150);
+    check("timed expired", toiocore->getMotorFeedback(feedback) && feedback.commanded_left == 0 &&
+                           feedback.measured.left == 0 && feedback.command_age_us >= 100000);
+    ToioCoreMotorFeedback history[TOIO_CORE_MOTOR_FEEDBACK_SIZE];
+    size_t n = toiocore->getMotorFeedbackHistory(history, TOIO_CORE_MOTOR_FEEDBACK_SIZE);
+    bool ordered = n > 1;
+    for (size_t i = 1; i < n; i++) {
+      ordered = ordered && history[i].seq + 1 == history[i - 1].seq;
+    }
+    check("history", ordered);
+    Serial.printf("history: %u samples, latest seq %u\n", (unsigned)n, history[0].seq);
+  }
+
+  // ---- 4. 目標指定付きモーター制御 ----
+  {
+    ToioCoreMotorStats before = toiocore->getMotorStats();
+    int result = -1;
+    toiocore->onMotorResponse([&result](uint8_t request_id, ToioCoreMotorResult r) {
+      result = r;
+    });
+    ToioCoreTarget target = {200, 250, 0, TOIO_CORE_ANGLE_NONE};
+    ToioCoreTargetParams params = {5, TOIO_CORE_MOVE_ROTATE_WHILE_MOVING, 60, TOIO_CORE_SPEED_CONSTANT};
+    toiocore->moveToTarget(target, params);
+    run(toio, 100);
+    check("cube controlled", toiocore->getMotorFeedback(feedback) && !feedback.commanded && feedback.measured.left > 0);
+    unsigned long start = millis();
+    while (result < 0 && millis() - start < 5000) {
+      run(toio, 10);
+    }
+    check("arrived", result == TOIO_CORE_MOTOR_RESULT_SUCCESS);
+
+    result = -1;
+    sim_cube->setOnMat(false);
+    run(toio, 50);
+    toiocore->moveToTarget(target, params);
+    run(toio, 100);
+    ToioCoreMotorStats after = toiocore->getMotorStats();
+    Serial.printf("target : %u responses, %u failed, %u speed notifications\n", after.responses - before.responses,
+                  after.failures - before.failures, after.speed_notifications);
+    check("responses", after.responses - before.responses == 2 && after.failures - before.failures == 1);
+    sim_cube->setOnMat(true);
+  }
+
+  // ---- 5. 接続し直す ----
+  {
+    toiocore->disconnect();
+    run(toio, 50);
+    toiocore->connect();
+    toiocore->controlMotor(true, 30, true, 30);
+    run(toio, 100);
+    check("restored", toiocore->getMotorFeedback(feedback) && feedback.measured.left == 30 &&
+                      feedback.commanded_left == 30);
+    toiocore->controlMotor(true, 0, true, 0);
+    run(toio, 50);
+  }
+
+  toiocore->disconnect();
+  delay(10);
+
+  return checkResult();
+}
@@ -0,0 +1,225 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_fleet.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブを多数用意し、スキャン、接続、
+  イベント処理、モーター制御を一通り実行して、その結果を表示します。
+  全キューブに接続でき、イベントを受信し、モーター制御の書き込みが
+  届いていることを確認します。
+
+  [使い方]
+
+  ./build/sim_fleet [キューブの数] [実行秒数] [通知のロス率]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+#include <ToioSimCheck.h>
+
+// キューブごとの受信イベント数
+struct CubeCounter {
+  uint32_t battery;
+  uint32_t button;
+  uint32_t motion;
+  uint32_t position;
+};
+
+// 接続済みのキューブの数
+static size_t countConnected(std::vector<ToioCore*>& toiocore_list) {
+  size_t connected = 0;
+  for (ToioCore* toiocore : toiocore_list) {
+    connected += toiocore->isConnected() ? 1 : 0;
+  }
+  return connected;
+}
+
+// 全キューブの接続処理が終わるまで loop() を回す
+static void waitForConnections(Toio& toio, std::vector<ToioCore*>& toiocore_list) {
+  while (true) {
+    toio.loop();
+    size_t pending = 0;
+    for (ToioCore* toiocore : toiocore_list) {
+      ToioCoreConnectionState state = toiocore->getConnectionState();
+      if (state != TOIO_CORE_CONNECTION_CONNECTED && state != TOIO_CORE_CONNECTION_DISCONNECTED) {
+        pending++;
+      }
+    }
+    if (pending == 0) {
+      break;
+    }
+    delay(1);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  size_t cube_num = (argc > 1) ? atoi(argv[1]) : 12;
+  uint32_t seconds = (argc > 2) ? atoi(argv[2]) : 5;
+  float loss_rate = (argc > 3) ? atof(argv[3]) : 0.01f;
+
+  // リンクの特性 (スキャンは 1/10 の時間で完了させる)
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.notify_loss_rate = loss_rate;
+  link.write_loss_rate = loss_rate;
+  link.scan_time_scale = 0.1f;
+  ToioSim::setLinkConfig(link);
+
+  // 仮想キューブを用意 (モーションは 50 Hz、ボタンは 10 Hz で通知)
+  std::vector<ToioSimCube*> sim_cubes = ToioSim::addCubes(cube_num);
+  for (ToioSimCube* cube : sim_cubes) {
+    cube->setNotifyInterval(TOIO_SIM_CHAR_MOTION, 20);
+    cube->setNotifyInterval(TOIO_SIM_CHAR_BUTTON, 100);
+    cube->setNotifyInterval(TOIO_SIM_CHAR_BATTERY, 1000);
+  }
+
+  // バックグラウンドスキャンで全キューブが見つかるまで待つ
+  Toio toio;
+  Serial.printf("Scanning %u virtual cubes...\n", (unsigned int)cube_num);
+  std::vector<ToioCore*> toiocore_list;
+  toio.startScan([&toiocore_list](ToioCore* toiocore, int rssi) {
+    if (std::find(toiocore_list.begin(), toiocore_list.end(), toiocore) == toiocore_list.end()) {
+      toiocore_list.push_back(toiocore);
+    }
+  });
+  unsigned long scan_start = millis();
+  while (toiocore_list.size() < cube_num && millis() - scan_start < 5000) {
+    toio.loop();
+    delay(1);
+  }
+  toio.stopScan();
+  Serial.printf("- %u cubes found in %lu ms\n", (unsigned int)toiocore_list.size(), millis() - scan_start);
+
+  // 同じキューブを再スキャンしても ToioCore オブジェクトは増えない
+  std::vector<ToioCore*> rescan_list = toio.scan(1);
+  size_t reused = 0;
+  for (ToioCore* toiocore : rescan_list) {
+    if (std::find(toiocore_list.begin(), toiocore_list.end(), toiocore) != toiocore_list.end()) {
+      reused++;
+    }
+  }
+  Serial.printf("- rescan: %u cubes, %u reused\n", (unsigned int)rescan_list.size(), (unsigned int)reused);
+  check("all cubes found", toiocore_list.size() == cube_num);
+  check("rescan reused", reused == rescan_list.size());
+
+  // 接続
+  std::vector<CubeCounter> counters(toiocore_list.size());
+  unsigned long t0 = millis();
+  for (size_t i = 0; i < toiocore_list.size(); i++) {
+    ToioCore* toiocore = toiocore_list[i];
+    CubeCounter* counter = &counters[i];
+    memset(counter, 0, sizeof(CubeCounter));
+    toiocore->onBattery([counter](uint8_t level) {
+      counter->battery++;
+    });
+    toiocore->onButton([counter](bool state) {
+      counter->button++;
+    });
+    toiocore->onMotion([counter](ToioCoreMotionData motion) {
+      counter->motion++;
+    });
+    toiocore->onPosition([counter](ToioCorePositionData position) {
+      counter->position++;
+    });
+    toiocore->onConnection([toiocore](ToioCoreConnectionState state, ToioCoreConnectionError error) {
+      if (error != TOIO_CORE_CONNECTION_ERROR_NONE) {
+        Serial.printf("- failed to connect to %s (error %d)\n", toiocore->getAddress().c_str(), (int)error);
+      }
+    });
+    toiocore->useGattCache(true);
+    toiocore->connectAsync();
+  }
+  waitForConnections(toio, toiocore_list);
+  Serial.printf("- connected in %lu ms\n", millis() - t0);
+  check("all cubes connected", countConnected(toiocore_list) == cube_num);
+
+  // イベント処理とモーター制御 (ジョイスティック操作を想定して毎回指示する)
+  unsigned long start = millis();
+  uint32_t loops = 0;
+  while (millis() - start < seconds * 1000) {
+    toio.loop();
+    loops++;
+    int8_t throttle = (int8_t)((millis() / 50) % 40);
+    for (ToioCore* toiocore : toiocore_list) {
+      toiocore->drive(throttle, 10);
+    }
+    delay(1);
+  }
+
+  // 結果
+  Serial.printf("Results (%u s, %u loops)\n", (unsigned int)seconds, (unsigned int)loops);
+  Serial.println("address            battery button motion position  dropped  sim-lost  motor sent/coalesced  max-lat-us  pose");
+  size_t received = 0;
+  size_t written = 0;
+  for (size_t i = 0; i < toiocore_list.size(); i++) {
+    ToioCore* toiocore = toiocore_list[i];
+    ToioCoreEventQueueStats qstats = toiocore->getEventQueueStats();
+    ToioSimCubeStats sstats = {};
+    for (ToioSimCube* cube : sim_cubes) {
+      if (cube->getAddress() == toiocore->getAddress()) {
+        sstats = cube->getStats();
+      }
+    }
+    uint32_t lost = 0;
+    for (int c = 0; c < TOIO_SIM_CHAR_NUM; c++) {
+      lost += sstats.lost[c];
+    }
+    ToioCoreMotorStats mstats = toiocore->getMotorStats();
+    ToioCorePose pose = {};
+    toiocore->getLatestPose(pose);
+    Serial.printf("%s  %7u %6u %6u %8u  %7u  %8u  %10u/%-9u  %10u  (%u, %u, %u)%s\n",
+                  toiocore->getAddress().c_str(),
+                  counters[i].battery, counters[i].button, counters[i].motion, counters[i].position,
+                  qstats.dropped, lost, mstats.sent, mstats.coalesced, mstats.max_latency_us,
+                  pose.position.x, pose.position.y, pose.position.angle, pose.on_mat ? "" : " off-mat");
+
+    // 通知を受信し、書き込んだモーター制御はロスした分を除いて仮想キューブに届いている
+    if (counters[i].motion > 0 && counters[i].button > 0 && counters[i].battery > 0) {
+      received++;
+    }
+    if (mstats.sent > 0 && mstats.submitted == loops &&
+        sstats.written[TOIO_SIM_CHAR_MOTOR] + sstats.lost[TOIO_SIM_CHAR_MOTOR] == mstats.sent) {
+      written++;
+    }
+  }
+  check("all cubes received events", received == cube_num);
+  check("all cubes received motor writes", written == cube_num);
+
+  // 切断して再接続 (2 回目はキャッシュした GATT ハンドルを使う)
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->disconnect();
+  }
+  for (ToioCore* toiocore : toiocore_list) {
+    while (toiocore->getConnectionState() != TOIO_CORE_CONNECTION_DISCONNECTED) {
+      toio.loop();
+      delay(1);
+    }
+  }
+  t0 = millis();
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->connectAsync();
+  }
+  waitForConnections(toio, toiocore_list);
+  Serial.printf("Reconnected in %lu ms\n", millis() - t0);
+  check("all cubes reconnected", countConnected(toiocore_list) == cube_num);
+  Serial.println("address            hits misses fallbacks  full-us  cached-us");
+  size_t hits = 0;
+  for (ToioCore* toiocore : toiocore_list) {
+    ToioCoreGattCacheStats cstats = toiocore->getGattCacheStats();
+    hits += (cstats.hits > 0) ? 1 : 0;
+    Serial.printf("%s  %4u %6u %9u  %7u  %9u\n",
+                  toiocore->getAddress().c_str(),
+                  cstats.hits, cstats.misses, cstats.fallbacks,
+                  cstats.full_discovery_us, cstats.cached_discovery_us);
+  }
+  check("all cubes used GATT cache", hits == cube_num);
+
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->disconnect();
+  }
+  delay(10);
+  return checkResult();
+}
@@ -0,0 +1,158 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_group.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブに、1 台ずつ順番に送る場合と
+  ToioGroup で一斉に送る場合とで、全キューブにコマンドが届くまでの
+  時間差 (スキュー) を比較します。一斉送信が接続中の全キューブに届くこと、
+  書き込む順番がずれること、未接続のキューブを飛ばすことも確認します。
+
+  [使い方]
+
+  ./build/sim_group [キューブの数] [繰り返し回数]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+#include <ToioSimCheck.h>
+#include <set>
+
+// 全キューブに最後に書き込まれた時刻の差 (マイクロ秒)
+static unsigned long arrivalSkew(std::vector<ToioSimCube*>& cubes, ToioSimChar ch) {
+  unsigned long first = 0;
+  unsigned long last = 0;
+  for (size_t i = 0; i < cubes.size(); i++) {
+    unsigned long t = cubes[i]->getLastWriteTime(ch);
+    if (i == 0 || (long)(t - first) < 0) {
+      first = t;
+    }
+    if (i == 0 || (long)(t - last) > 0) {
+      last = t;
+    }
+  }
+  return last - first;
+}
+
+// 最初に書き込まれたキューブの番号
+static size_t firstWritten(std::vector<ToioSimCube*>& cubes, ToioSimChar ch) {
+  size_t first = 0;
+  for (size_t i = 1; i < cubes.size(); i++) {
+    if ((long)(cubes[i]->getLastWriteTime(ch) - cubes[first]->getLastWriteTime(ch)) < 0) {
+      first = i;
+    }
+  }
+  return first;
+}
+
+// キューブごとの書き込み数
+static std::vector<uint32_t> writeCounts(std::vector<ToioSimCube*>& cubes, ToioSimChar ch) {
+  std::vector<uint32_t> counts;
+  for (ToioSimCube* cube : cubes) {
+    counts.push_back(cube->getStats().written[ch]);
+  }
+  return counts;
+}
+
+int main(int argc, char* argv[]) {
+  size_t cube_num = (argc > 1) ? atoi(argv[1]) : 8;
+  uint32_t rounds = (argc > 2) ? atoi(argv[2]) : 10;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  ToioSim::setLinkConfig(link);
+  std::vector<ToioSimCube*> sim_cubes = ToioSim::addCubes(cube_num);
+
+  // スキャンして全キューブに接続
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->connectAsync();
+  }
+  while (true) {
+    toio.loop();
+    size_t connected = 0;
+    for (ToioCore* toiocore : toiocore_list) {
+      connected += toiocore->isConnected() ? 1 : 0;
+    }
+    if (connected == toiocore_list.size()) {
+      break;
+    }
+    delay(1);
+  }
+  Serial.printf("%u cubes connected\n", (unsigned int)toiocore_list.size());
+  check("all cubes connected", toiocore_list.size() == cube_num);
+
+  // 1 台ずつ順番に送る (効果音はレスポンスありで書き込まれる)
+  unsigned long seq_total = 0;
+  for (uint32_t r = 0; r < rounds; r++) {
+    for (ToioCore* toiocore : toiocore_list) {
+      toiocore->playSoundEffect(r % 11);
+    }
+    seq_total += arrivalSkew(sim_cubes, TOIO_SIM_CHAR_SOUND);
+    toio.loop();
+  }
+
+  // ToioGroup で一斉に送る
+  ToioGroup group(toio);
+  group.addAll();
+  std::vector<uint32_t> sound_before = writeCounts(sim_cubes, TOIO_SIM_CHAR_SOUND);
+  std::vector<uint32_t> light_before = writeCounts(sim_cubes, TOIO_SIM_CHAR_LIGHT);
+  std::set<size_t> first_cubes;
+  unsigned long group_total = 0;
+  for (uint32_t r = 0; r < rounds; r++) {
+    group.playSoundEffect(r % 11);
+    group_total += arrivalSkew(sim_cubes, TOIO_SIM_CHAR_SOUND);
+    first_cubes.insert(firstWritten(sim_cubes, TOIO_SIM_CHAR_SOUND));
+    group.turnOnLed(r * 20, 0, 255 - r * 20);
+    group.drive(30, 0);
+    toio.loop();
+    delay(30);
+  }
+  group.drive(0, 0);
+
+  ToioGroupDispatchStats stats = group.getDispatchStats();
+  Serial.printf("sequential : avg arrival skew %lu us\n", seq_total / rounds);
+  Serial.printf("ToioGroup  : avg arrival skew %lu us (dispatch skew avg %u us, max %u us, %u dispatches)\n",
+                group_total / rounds, stats.avg_skew_us, stats.max_skew_us, stats.dispatches);
+
+  // 接続中の全キューブに毎回書き込まれ、書き込む順番は一斉送信ごとにずれる
+  std::vector<uint32_t> sound_after = writeCounts(sim_cubes, TOIO_SIM_CHAR_SOUND);
+  std::vector<uint32_t> light_after = writeCounts(sim_cubes, TOIO_SIM_CHAR_LIGHT);
+  bool all_written = true;
+  for (size_t i = 0; i < sim_cubes.size(); i++) {
+    all_written = all_written && sound_after[i] - sound_before[i] == rounds && light_after[i] - light_before[i] == rounds;
+  }
+  check("all cubes written", all_written);
+  check("dispatch stats", stats.dispatches == rounds * 3 + 1 && stats.last_members == cube_num && stats.last_skipped == 0);
+  check("rotated", cube_num < 2 || rounds < 2 || first_cubes.size() > 1);
+  check("less skew", group_total <= seq_total);
+
+  // 未接続のキューブは飛ばして数える
+  if (cube_num >= 2) {
+    toiocore_list[0]->disconnect();
+    delay(50);
+    toio.loop();
+    sound_before = writeCounts(sim_cubes, TOIO_SIM_CHAR_SOUND);
+    group.playSoundEffect(0);
+    sound_after = writeCounts(sim_cubes, TOIO_SIM_CHAR_SOUND);
+    stats = group.getDispatchStats();
+    size_t written = 0;
+    for (size_t i = 0; i < sim_cubes.size(); i++) {
+      written += sound_after[i] - sound_before[i];
+    }
+    Serial.printf("skipped    : %u members, %u skipped, %u cubes written\n", stats.last_members, stats.last_skipped,
+                  (unsigned int)written);
+    check("skipped", stats.last_members == cube_num - 1 && stats.last_skipped == 1 && written == cube_num - 1);
+  }
+
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->disconnect();
+  }
+  delay(10);
+  return checkResult();
+}
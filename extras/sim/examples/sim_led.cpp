@@ -0,0 +1,94 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_led.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブの LED を、同じ時間だけ
+  3 つの方法で点滅させ、ライトへの書き込み数を比べます。
+
+  - host     : 毎フレーム turnOnLed() で点灯・消灯を書き込む
+  - scenario : 毎フレーム blinkLed() を呼ぶ (同じシナリオなら書き込まない)
+  - frame    : 毎フレーム setLedFrame() で色を変える (書き込み間隔ごとに最新の色だけ)
+
+  [使い方]
+
+  ./build/sim_led [秒数] [フレームの間隔 (ミリ秒)]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+
+static uint32_t lightWrites(ToioSimCube* sim_cube) {
+  return sim_cube->getStats().written[TOIO_SIM_CHAR_LIGHT];
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t seconds = (argc > 1) ? atoi(argv[1]) : 2;
+  uint32_t frame_ms = (argc > 2) ? atoi(argv[2]) : 16;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  ToioSim::setLinkConfig(link);
+  ToioSimCube* sim_cube = ToioSim::addCube();
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  if (toiocore_list.empty()) {
+    Serial.println("No cube found");
+    return 1;
+  }
+  ToioCore* toiocore = toiocore_list.at(0);
+  toiocore->connect();
+
+  const char* names[3] = {"host", "scenario", "frame"};
+  uint32_t writes[3];
+  for (int mode = 0; mode < 3; mode++) {
+    uint32_t before = lightWrites(sim_cube);
+    uint32_t frames = 0;
+    unsigned long start = millis();
+    while (millis() - start < seconds * 1000) {
+      bool on = ((millis() - start) / 250) % 2 == 0;
+      uint8_t level = (millis() - start) % 256;
+      if (mode == 0) {
+        toiocore->turnOnLed(on ? 255 : 0, 0, 0);
+      } else if (mode == 1) {
+        toiocore->blinkLed(255, 0, 0, 250, 250);
+      } else {
+        toiocore->setLedFrame(level, 0, 255 - level);
+      }
+      toio.loop();
+      frames++;
+      delay(frame_ms);
+    }
+    writes[mode] = lightWrites(sim_cube) - before;
+    Serial.printf("%-8s: %4u frames, %4u light writes\n", names[mode], frames, writes[mode]);
+  }
+  std::vector<uint8_t> last = sim_cube->getLastWrite(TOIO_SIM_CHAR_LIGHT);
+  ToioCoreLedStats stats = toiocore->getLedStats();
+  Serial.printf("led stats: %u frames, %u coalesced, %u skipped, %u writes\n",
+                stats.frames, stats.coalesced, stats.skipped, stats.writes);
+
+  // シナリオは 1 回だけ書き込まれ、フレームは書き込み間隔ごとに間引かれる
+  uint32_t frame_limit = seconds * 1000 / TOIO_CORE_LED_WRITE_INTERVAL + 2;
+  bool ok = writes[1] == 1 && writes[2] <= frame_limit && writes[2] < writes[0] && !last.empty() && last[0] == 0x03;
+
+  // 点灯中のシナリオは接続し直したときに再送される
+  toiocore->breatheLed(0, 255, 0, 2000);
+  sim_cube->dropConnection();
+  delay(50);
+  toio.loop();
+  toiocore->connect();
+  last = sim_cube->getLastWrite(TOIO_SIM_CHAR_LIGHT);
+  bool restored = !last.empty() && last[0] == 0x04 && last[2] == 28;
+  Serial.printf("restore  : %s\n", restored ? "scenario re-sent" : "NOT re-sent");
+
+  toiocore->disconnect();
+  delay(10);
+  ok = ok && restored;
+  Serial.println(ok ? "result : ok" : "result : NG");
+  return ok ? 0 : 1;
+}
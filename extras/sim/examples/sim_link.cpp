@@ -0,0 +1,94 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_link.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブに接続パラメーターの
+  プリセットを適用し、プリセットごとに往復時間、モーター制御の
+  書き込み数、通知の受信数を実測します。計測の途中で切断されたら
+  計測を打ち切ることと、接続し直したときに接続間隔の要求が再送される
+  ことも確認します。
+
+  [使い方]
+
+  ./build/sim_link [計測の秒数] [1 回の接続イベントで送れるパケット数]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+#include <thread>
+
+static const char* kPresetNames[3] = {"default", "low-latency", "many-cubes"};
+
+int main(int argc, char* argv[]) {
+  uint32_t seconds = (argc > 1) ? atoi(argv[1]) : 1;
+  uint32_t packets = (argc > 2) ? atoi(argv[2]) : 2;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  link.jitter_ms = 0;
+  link.packets_per_event = packets;
+  ToioSim::setLinkConfig(link);
+  ToioSimCube* sim_cube = ToioSim::addCube();
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  if (toiocore_list.empty()) {
+    Serial.println("No cube found");
+    return 1;
+  }
+  ToioCore* toiocore = toiocore_list.at(0);
+  toiocore->connect();
+
+  const ToioCoreLinkPreset presets[2] = {TOIO_CORE_LINK_LOW_LATENCY, TOIO_CORE_LINK_MANY_CUBES};
+  ToioCoreLinkBenchmark results[2];
+  bool ok = true;
+  for (int i = 0; i < 2; i++) {
+    ok = toiocore->applyLinkPreset(presets[i]) && ok;
+    results[i] = toiocore->benchmarkLink(seconds * 1000);
+    ToioCoreLinkBenchmark& r = results[i];
+    Serial.printf("%-11s: interval %5.2f ms (requested %u-%u), mtu %u, rtt %5u us, %4u cmd/s, %4u notify/s\n",
+                  kPresetNames[presets[i]], r.params.interval * 1.25, r.params.min_interval, r.params.max_interval,
+                  r.params.mtu, r.round_trip_us, r.commands_per_sec, r.notifications_per_sec);
+  }
+  ok = ok && results[0].params.interval == 6 && results[0].params.mtu == 247 && results[1].params.interval == 24;
+  ok = ok && results[0].commands_per_sec > results[1].commands_per_sec;
+  ok = ok && results[0].notifications_per_sec >= results[1].notifications_per_sec;
+  ok = ok && results[0].round_trip_us < results[1].round_trip_us;
+
+  // 計測の途中で切断されたら、そこで計測を打ち切る
+  std::thread dropper([sim_cube]() {
+    delay(1000);
+    sim_cube->dropConnection();
+  });
+  unsigned long started = millis();
+  ToioCoreLinkBenchmark dropped = toiocore->benchmarkLink(5000);
+  unsigned long elapsed = millis() - started;
+  dropper.join();
+  bool aborted = elapsed < 3000 && dropped.commands_per_sec > 0;
+  Serial.printf("dropped    : returned after %lu ms, %4u cmd/s\n", elapsed, dropped.commands_per_sec);
+  delay(50);
+  toio.loop();
+
+  // 接続し直したときに接続間隔の要求が再送される
+  toiocore->connect();
+  ToioCoreConnParams params;
+  bool restored = toiocore->getConnectionParams(params) && params.min_interval == 24 && params.max_interval == 40 &&
+                  sim_cube->getConnectionInterval() == 24 && params.mtu == 247;
+  Serial.printf("restore    : %s\n", restored ? "parameters re-sent" : "NOT re-sent");
+
+  // 要求を取り消すとセントラルの既定値に戻る
+  toiocore->applyLinkPreset(TOIO_CORE_LINK_DEFAULT);
+  bool cleared = toiocore->getConnectionParams(params) && params.min_interval == TOIO_CORE_CONN_INTERVAL_NONE;
+  Serial.printf("default    : interval %5.2f ms, %s\n", params.interval * 1.25, cleared ? "request cleared" : "NOT cleared");
+
+  toiocore->disconnect();
+  delay(10);
+  ok = ok && aborted && restored && cleared;
+  Serial.println(ok ? "result : ok" : "result : NG");
+  return ok ? 0 : 1;
+}
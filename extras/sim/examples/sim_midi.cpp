@@ -0,0 +1,89 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_midi.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  コンパイル時に組み立てた 85 音の曲 (1 回の書き込みの上限 59 音を
+  超える) を ToioSequencer でシミュレータ上の仮想 toio コア キューブに
+  流し、区切りのつなぎ目で音が途切れた時間と打ち切られた時間を表示します。
+
+  [使い方]
+
+  ./build/sim_midi [繰り返す回数] [loop() の間隔 (ミリ秒)] [書き込みの遅延 (ミリ秒)]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+
+#define N(name, octave, ms) toioNote(toioPitch(name, octave), ms)
+
+// きらきら星 (2 番は 1 オクターブ上)
+static constexpr ToioNote SONG[] = {
+  N('C', 5, 60), N('C', 5, 60), N('G', 5, 60), N('G', 5, 60), N('A', 5, 60), N('A', 5, 60), N('G', 5, 120),
+  N('F', 5, 60), N('F', 5, 60), N('E', 5, 60), N('E', 5, 60), N('D', 5, 60), N('D', 5, 60), N('C', 5, 120),
+  N('G', 5, 60), N('G', 5, 60), N('F', 5, 60), N('F', 5, 60), N('E', 5, 60), N('E', 5, 60), N('D', 5, 120),
+  N('G', 5, 60), N('G', 5, 60), N('F', 5, 60), N('F', 5, 60), N('E', 5, 60), N('E', 5, 60), N('D', 5, 120),
+  N('C', 5, 60), N('C', 5, 60), N('G', 5, 60), N('G', 5, 60), N('A', 5, 60), N('A', 5, 60), N('G', 5, 120),
+  N('F', 5, 60), N('F', 5, 60), N('E', 5, 60), N('E', 5, 60), N('D', 5, 60), N('D', 5, 60), N('C', 5, 120),
+  toioRest(120),
+  N('C', 6, 60), N('C', 6, 60), N('G', 6, 60), N('G', 6, 60), N('A', 6, 60), N('A', 6, 60), N('G', 6, 120),
+  N('F', 6, 60), N('F', 6, 60), N('E', 6, 60), N('E', 6, 60), N('D', 6, 60), N('D', 6, 60), N('C', 6, 120),
+  N('G', 6, 60), N('G', 6, 60), N('F', 6, 60), N('F', 6, 60), N('E', 6, 60), N('E', 6, 60), N('D', 6, 120),
+  N('G', 6, 60), N('G', 6, 60), N('F', 6, 60), N('F', 6, 60), N('E', 6, 60), N('E', 6, 60), N('D', 6, 120),
+  N('C', 6, 60), N('C', 6, 60), N('G', 6, 60), N('G', 6, 60), N('A', 6, 60), N('A', 6, 60), N('G', 6, 120),
+  N('F', 6, 60), N('F', 6, 60), N('E', 6, 60), N('E', 6, 60), N('D', 6, 60), N('D', 6, 60), N('C', 6, 120)
+};
+
+static_assert(sizeof(SONG) / sizeof(SONG[0]) > TOIO_MIDI_MAX_NOTES, "the song must need more than one packet");
+static_assert(SONG[0].duration == 6 && SONG[0].note == 60, "notes are encoded at compile time");
+
+int main(int argc, char* argv[]) {
+  uint8_t repeat = (argc > 1) ? atoi(argv[1]) : 1;
+  uint32_t loop_interval = (argc > 2) ? atoi(argv[2]) : 2;
+  uint32_t write_latency = (argc > 3) ? atoi(argv[3]) : 30;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  link.write_latency_ms = write_latency;
+  ToioSim::setLinkConfig(link);
+  ToioSimCube* sim_cube = ToioSim::addCube();
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  if (toiocore_list.empty()) {
+    Serial.println("No cube found");
+    return 1;
+  }
+  ToioCore* toiocore = toiocore_list.at(0);
+  toiocore->connect();
+
+  ToioSequencer sequencer;
+  sequencer.begin(toiocore);
+  unsigned long start = millis();
+  sequencer.play(SONG, repeat);
+  while (sequencer.isPlaying()) {
+    toio.loop();
+    sequencer.loop();
+    delay(loop_interval);
+  }
+  unsigned long elapsed = millis() - start;
+
+  ToioSequencerStats stats = sequencer.getStats();
+  ToioSimSoundStats sound = sim_cube->getSoundStats();
+  Serial.printf("sequencer: %u segments, %u notes in %lu ms, write %u us, max late %u us\n",
+                stats.segments, stats.notes, elapsed, stats.last_write_us, stats.max_late_us);
+  Serial.printf("cube     : %u plays, %u gaps (max %u us), %u cuts (max %u us)\n",
+                sound.plays, sound.gaps, sound.gap_max_us, sound.cuts, sound.cut_max_us);
+
+  toiocore->disconnect();
+  delay(10);
+  // つなぎ目の途切れ・打ち切りが loop() の間隔と遅延の揺らぎの範囲に収まっていれば成功
+  uint32_t limit_us = (loop_interval + 2 * link.jitter_ms + 2) * 1000;
+  bool ok = sound.plays == stats.segments && sound.gap_max_us <= limit_us && sound.cut_max_us <= limit_us;
+  Serial.println(ok ? "result : gapless" : "result : GAPS");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,183 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_path.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブに、目標指定付きモーター制御で
+  円周上の経路を走らせます。経路は MTU に合わせて複数目標指定の
+  パケットに分けて書き込まれ、完了は最後のパケットの応答で通知されます。
+  追跡できる経路の数を超えて書き込んだときと、要求 ID が一周するほど
+  長い経路を書き込んだときの戻り値も確かめます。
+
+  [使い方]
+
+  ./build/sim_path [目標地点の数] [最大速度]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+#include <ToioSimCheck.h>
+
+static const char* RESULT_NAMES[] = {
+  "success", "timeout", "id missed", "invalid params",
+  "invalid state", "overwritten", "not supported", "append failed"
+};
+
+static volatile bool g_done = false;
+static volatile ToioCoreMotorResult g_result = TOIO_CORE_MOTOR_RESULT_SUCCESS;
+static volatile int g_done_id = -1;
+static volatile int g_results[256];  // 要求 ID ごとに受け取った結果 (-1 ならまだ)
+
+// 応答が届くまで loop() を回す (タイムアウトなら false)
+static bool waitForResponse(Toio& toio, int id, uint32_t timeout_ms) {
+  unsigned long start = millis();
+  while (millis() - start < timeout_ms) {
+    toio.loop();
+    if (g_done && g_done_id == id) {
+      return true;
+    }
+    delay(1);
+  }
+  return false;
+}
+
+// ids のすべての応答が届くまで loop() を回す (タイムアウトなら false)
+static bool waitForResults(Toio& toio, const int* ids, size_t n, uint32_t timeout_ms) {
+  unsigned long start = millis();
+  while (millis() - start < timeout_ms) {
+    toio.loop();
+    size_t received = 0;
+    for (size_t i = 0; i < n; i++) {
+      received += (ids[i] >= 0 && g_results[ids[i]] >= 0);
+    }
+    if (received == n) {
+      return true;
+    }
+    delay(1);
+  }
+  return false;
+}
+
+int main(int argc, char* argv[]) {
+  size_t point_num = (argc > 1) ? atoi(argv[1]) : 12;
+  uint8_t max_speed = (argc > 2) ? atoi(argv[2]) : 80;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  ToioSim::setLinkConfig(link);
+  ToioSimCube* sim_cube = ToioSim::addCube();
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  if (toiocore_list.empty()) {
+    Serial.println("No cube found");
+    return 1;
+  }
+  ToioCore* toiocore = toiocore_list.at(0);
+  toiocore->connect();
+
+  toiocore->onMotorResponse([](uint8_t request_id, ToioCoreMotorResult result) {
+    g_done_id = request_id;
+    g_results[request_id] = result;
+    g_result = result;
+    g_done = true;
+  });
+
+  ToioCoreTargetParams params = {
+    10,                                  // timeout (秒)
+    TOIO_CORE_MOVE_ROTATE_WHILE_MOVING,  // move_type
+    max_speed,                           // max_speed
+    TOIO_CORE_SPEED_CONSTANT             // speed_type
+  };
+
+  // 円周上の経路 (最後に 0 度を向く)
+  std::vector<ToioCoreTarget> path;
+  for (size_t i = 1; i <= point_num; i++) {
+    double rad = 2.0 * M_PI * i / point_num;
+    ToioCoreTarget target;
+    target.x = (uint16_t)lround(250 + 100 * cos(rad));
+    target.y = (uint16_t)lround(250 + 100 * sin(rad));
+    target.angle = 0;
+    target.angle_type = (i == point_num) ? TOIO_CORE_ANGLE_ABSOLUTE : TOIO_CORE_ANGLE_NONE;
+    path.push_back(target);
+  }
+
+  // 円周上に置いてから経路を走らせる
+  sim_cube->setPose(350, 250, 90);
+  unsigned long start = millis();
+  g_done = false;
+  int id = toiocore->moveToTargets(path.data(), path.size(), params);
+  bool responded = waitForResponse(toio, id, 15000);
+  double x, y, angle;
+  sim_cube->getPose(x, y, angle);
+  Serial.printf("path    : %u points, %u packets, id %d -> %s in %lu ms, pose (%.0f, %.0f, %.0f)\n",
+                (unsigned int)path.size(), (unsigned int)(sim_cube->getStats().written[TOIO_SIM_CHAR_MOTOR]),
+                id, responded ? RESULT_NAMES[g_result] : "no response", millis() - start, x, y, angle);
+  check("path completed", responded && g_result == TOIO_CORE_MOTOR_RESULT_SUCCESS);
+
+  // 単一の目標地点に向かう途中で drive() を送ると上書きされる
+  ToioCoreTarget target = {400, 400, 0, TOIO_CORE_ANGLE_NONE};
+  g_done = false;
+  id = toiocore->moveToTarget(target, params);
+  delay(200);
+  toiocore->drive(0, 0);
+  responded = waitForResponse(toio, id, 1000);
+  Serial.printf("single  : id %d -> %s\n", id, responded ? RESULT_NAMES[g_result] : "no response");
+  check("single overwritten", responded && g_result == TOIO_CORE_MOTOR_RESULT_OVERWRITTEN);
+
+  // 加速度指定で 500 ミリ秒だけ旋回しながら前進
+  sim_cube->getPose(x, y, angle);
+  toiocore->controlAcceleration(50, 0, 90, false, false, false, 500);
+  delay(600);
+  double x2, y2, angle2;
+  sim_cube->getPose(x2, y2, angle2);
+  double moved = sqrt((x2 - x) * (x2 - x) + (y2 - y) * (y2 - y));
+  double turned = fmod(angle2 - angle + 360.0, 360.0);
+  Serial.printf("accel   : moved %.0f units, turned %.0f deg\n", moved, turned);
+  check("accel moved", moved > 20 && turned > 10 && turned < 180);
+
+  // 複数パケットの経路を続けて書き込むと、追跡できるのは 4 つまで
+  // (マットから持ち上げて打ち切り、応答を受け取って空きができれば、また書き込める)
+  for (size_t i = 0; i < 256; i++) {
+    g_results[i] = -1;
+  }
+  int ids[5];
+  for (size_t i = 0; i < 5; i++) {
+    ids[i] = toiocore->moveToTargets(path.data(), path.size(), params, true);
+  }
+  sim_cube->setOnMat(false);
+  responded = waitForResults(toio, ids, 4, 1000);
+  bool missed = responded;
+  for (size_t i = 0; i < 4 && responded; i++) {
+    missed = missed && g_results[ids[i]] == TOIO_CORE_MOTOR_RESULT_ID_MISSED;
+  }
+  sim_cube->setOnMat(true);
+  sim_cube->setPose(350, 250, 90);
+  int again = toiocore->moveToTargets(path.data(), path.size(), params);
+  delay(100);
+  toiocore->drive(0, 0);
+  bool again_responded = waitForResults(toio, &again, 1, 1000);
+  Serial.printf("paths   : ids %d %d %d %d, 5th %d, %s, then %d -> %s\n", ids[0], ids[1], ids[2], ids[3], ids[4],
+                missed ? "all id missed" : "NOT all id missed", again,
+                again_responded ? RESULT_NAMES[g_results[again]] : "no response");
+  check("4 paths accepted", ids[0] >= 0 && ids[1] >= 0 && ids[2] >= 0 && ids[3] >= 0);
+  check("5th rejected", ids[4] == -1);
+  check("paths id missed", missed);
+  check("slot reclaimed", again >= 0 && again_responded &&
+                          g_results[again] == TOIO_CORE_MOTOR_RESULT_OVERWRITTEN);
+
+  // 要求 ID が一周するほど長い経路は、何も書き込まずに断る
+  std::vector<ToioCoreTarget> long_path(511, path[0]);
+  uint32_t written = sim_cube->getStats().written[TOIO_SIM_CHAR_MOTOR];
+  int long_id = toiocore->moveToTargets(long_path.data(), long_path.size(), params);
+  Serial.printf("long    : %u points -> %d\n", (unsigned)long_path.size(), long_id);
+  check("too long rejected", long_id == -1 && sim_cube->getStats().written[TOIO_SIM_CHAR_MOTOR] == written);
+
+  toiocore->disconnect();
+  delay(10);
+  return checkResult();
+}
@@ -0,0 +1,116 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_posture.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブの姿勢角を 3 つの形式で通知
+  させ、固定小数点にデコードした値が仮想キューブの姿勢と一致することを
+  確認します。loop() を通知より遅い間隔で呼び、通知がまとめられて
+  イベントキューがあふれないことも確認します。あわせて磁気センサーと
+  シェイクの値も表示します。
+
+  [使い方]
+
+  ./build/sim_posture [通知の間隔 (ミリ秒)] [loop() の間隔 (ミリ秒)]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+
+static const char* kTypeNames[4] = {"", "euler", "quaternion", "precise"};
+
+int main(int argc, char* argv[]) {
+  uint16_t interval = (argc > 1) ? atoi(argv[1]) : 10;
+  uint32_t loop_interval = (argc > 2) ? atoi(argv[2]) : 30;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  link.write_latency_ms = 5;
+  ToioSim::setLinkConfig(link);
+  ToioSimCube* sim_cube = ToioSim::addCube();
+  sim_cube->setPosture(12.25, -30.5, 135.75);
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  if (toiocore_list.empty()) {
+    Serial.println("No cube found");
+    return 1;
+  }
+  ToioCore* toiocore = toiocore_list.at(0);
+  toiocore->connect();
+
+  uint32_t callbacks = 0;
+  ToioCorePostureData last;
+  toiocore->onPosture([&callbacks, &last](ToioCorePostureData posture) {
+    callbacks++;
+    last = posture;
+  });
+
+  bool ok = true;
+  const ToioCorePostureType types[3] = {
+    TOIO_CORE_POSTURE_EULER, TOIO_CORE_POSTURE_EULER_PRECISE, TOIO_CORE_POSTURE_QUATERNION
+  };
+  for (ToioCorePostureType type : types) {
+    if (!toiocore->setPostureNotify(type, interval)) {
+      Serial.printf("%-10s: config failed\n", kTypeNames[type]);
+      ok = false;
+      continue;
+    }
+    toio.loop();
+    callbacks = 0;
+    ToioCoreLinkStats before = toiocore->getLinkStats();
+    ToioCoreEventQueueStats qbefore = toiocore->getEventQueueStats();
+    unsigned long start = millis();
+    while (millis() - start < 1000) {
+      toio.loop();
+      delay(loop_interval);
+    }
+    ToioCoreLinkStats after = toiocore->getLinkStats();
+    ToioCoreEventQueueStats qafter = toiocore->getEventQueueStats();
+    uint32_t notified = after.chars[TOIO_CORE_CHAR_MOTION].notifications - before.chars[TOIO_CORE_CHAR_MOTION].notifications;
+    uint32_t dropped = qafter.dropped - qbefore.dropped;
+    Serial.printf("%-10s: %u notifications, %u callbacks, %u dropped, ", kTypeNames[type], notified, callbacks, dropped);
+    if (type == TOIO_CORE_POSTURE_QUATERNION) {
+      Serial.printf("q = (%d, %d, %d, %d) / 16384\n", last.qw, last.qx, last.qy, last.qz);
+      ok = ok && last.type == type && last.qw != 0;
+    } else {
+      Serial.printf("roll %d, pitch %d, yaw %d (1/100 deg)\n", last.roll, last.pitch, last.yaw);
+      int32_t expected[3] = {1225, -3050, 13575};
+      if (type == TOIO_CORE_POSTURE_EULER) {
+        expected[0] = 1200;
+        expected[1] = -3100;
+        expected[2] = 13600;
+      }
+      ok = ok && last.type == type && last.roll == expected[0] && last.pitch == expected[1] && last.yaw == expected[2];
+    }
+    ok = ok && callbacks > 0 && dropped == 0;
+  }
+  toiocore->setPostureNotify(TOIO_CORE_POSTURE_EULER, 0);
+
+  // 磁気センサーとシェイク
+  sim_cube->setMagnet(0, 120, -5, 10, 3);
+  toiocore->setMagneticNotify(TOIO_CORE_MAGNETIC_FORCE, 20, TOIO_CORE_NOTIFY_ON_CHANGE);
+  uint8_t shake = 0;
+  toiocore->onMotion([&shake](ToioCoreMotionData motion) {
+    shake = motion.shake;
+  });
+  sim_cube->setMotion(true, false, false, 1, 7);
+  delay(100);
+  toio.loop();
+  ToioCoreMagneticData magnetic;
+  uint32_t age_ms = 0;
+  bool has_magnetic = toiocore->getMagnetic(magnetic, age_ms);
+  Serial.printf("magnetic  : %s, strength %u, (%d, %d, %d), age %u ms\n", has_magnetic ? "valid" : "none",
+                magnetic.strength, magnetic.x, magnetic.y, magnetic.z, age_ms);
+  Serial.printf("shake     : %u\n", shake);
+  ok = ok && has_magnetic && magnetic.strength == 120 && magnetic.x == -5 && shake == 7;
+
+  toiocore->disconnect();
+  delay(10);
+  Serial.println(ok ? "result : ok" : "result : NG");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_reconnect.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブの接続を繰り返し切り、自動再接続
+  で復旧するまでの時間と、LED やしきい値の設定が再送されたことを確認
+  します。接続の失敗率を指定すると、待ち時間を延ばしながらの再試行も
+  確認できます。最後に、Toio を通さずに作ったキューブを接続中に
+  delete できることを確認します。
+
+  [使い方]
+
+  ./build/sim_reconnect [キューブの数] [切断の回数] [接続の失敗率]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+
+int main(int argc, char* argv[]) {
+  size_t cube_num = (argc > 1) ? atoi(argv[1]) : 4;
+  uint32_t rounds = (argc > 2) ? atoi(argv[2]) : 5;
+  float failure_rate = (argc > 3) ? atof(argv[3]) : 0.0f;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  ToioSim::setLinkConfig(link);
+  std::vector<ToioSimCube*> sim_cubes = ToioSim::addCubes(cube_num);
+
+  Toio toio;
+  toio.setAutoReconnect(true);
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  for (size_t i = 0; i < toiocore_list.size(); i++) {
+    ToioCore* toiocore = toiocore_list[i];
+    toiocore->useGattCache(true);
+    toiocore->connect();
+    toiocore->turnOnLed(0, 32 * i, 255);
+    toiocore->setFlatThreshold(10);
+    toiocore->setClashThreshold(3);
+  }
+
+  // 接続の失敗率は初回の接続のあとから適用する
+  link.connect_failure_rate = failure_rate;
+  ToioSim::setLinkConfig(link);
+
+  for (uint32_t r = 0; r < rounds; r++) {
+    for (ToioSimCube* cube : sim_cubes) {
+      cube->dropConnection();
+    }
+    // loop() だけを回し、スケッチ側では再接続の処理をしない
+    // (切断は BLE タスクから非同期に通知されるので、まず全キューブの切断を待つ)
+    bool dropped = false;
+    unsigned long start = millis();
+    while (millis() - start < 5000) {
+      toio.loop();
+      size_t connected = 0;
+      for (ToioCore* toiocore : toiocore_list) {
+        connected += toiocore->isConnected() ? 1 : 0;
+      }
+      if (connected == 0) {
+        dropped = true;
+      } else if (dropped && connected == toiocore_list.size()) {
+        break;
+      }
+      delay(1);
+    }
+  }
+
+  Serial.println("address            drops tries recov last-ms max-ms avg-ms restore-us led           conf-writes");
+  for (size_t i = 0; i < toiocore_list.size(); i++) {
+    ToioCoreReconnectStats stats = toiocore_list[i]->getReconnectStats();
+    std::vector<uint8_t> led = sim_cubes[i]->getLastWrite(TOIO_SIM_CHAR_LIGHT);
+    char led_str[16] = "-";
+    if (led.size() >= 7) {
+      snprintf(led_str, sizeof(led_str), "%u,%u,%u", led[4], led[5], led[6]);
+    }
+    Serial.printf("%s %5u %5u %5u %7u %6u %6u %10u %-13s %11u\n",
+                  toiocore_list[i]->getAddress().c_str(), stats.disconnects, stats.attempts, stats.recoveries,
+                  stats.last_recovery_ms, stats.max_recovery_ms, stats.avg_recovery_ms, stats.last_restore_us,
+                  led_str, sim_cubes[i]->getStats().written[TOIO_SIM_CHAR_CONF]);
+  }
+
+  // Toio を通さずに作ったキューブは、接続中でも delete できる
+  // (ワーカータスクを止めて切断してから解放する)
+  bool deleted = false;
+  if (!toiocore_list.empty()) {
+    toiocore_list[0]->disconnect();
+    unsigned long start = millis();
+    while (millis() - start < 200) {
+      toio.loop();
+      delay(1);
+    }
+    BLEScanResults results = BLEDevice::getScan()->start(1);
+    for (int i = 0; i < results.getCount(); i++) {
+      BLEAdvertisedDevice device = results.getDevice(i);
+      if (device.getAddress().toString() != sim_cubes[0]->getAddress()) {
+        continue;
+      }
+      ToioCore* standalone = new ToioCore(device);
+      bool connected = standalone->connect();
+      standalone->setReadMode(TOIO_CORE_READ_CACHED);
+      standalone->getBatteryLevel();
+      delay(50);
+      // 通知が届いている最中に delete しても、外したコールバックは呼ばれない
+      for (int n = 0; n < 10; n++) {
+        sim_cubes[0]->setButtonState(n % 2);
+      }
+      delete standalone;
+      for (int n = 0; n < 10; n++) {
+        sim_cubes[0]->setButtonState(n % 2);
+      }
+      delay(50);
+      deleted = connected && !sim_cubes[0]->isConnected();
+    }
+  }
+  Serial.printf("delete   : %s\n", deleted ? "worker stopped and disconnected" : "NG");
+
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->disconnect();
+  }
+  delay(10);
+  return deleted ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_replay.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブを走らせながら、ToioRecorder で
+  通知と書き込みをメモリ上のログに記録します。そのあと切断し、ログを
+  ToioReplay で同じ ToioCore に流し込んで、記録中と同じ回数・同じ内容で
+  コールバックが呼ばれることを確認します。
+
+  [使い方]
+
+  ./build/sim_replay [キューブの数] [記録する秒数] [再生速度 (0 なら待たない)]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+
+// メモリ上のログ (ToioRecorder の出力先と ToioReplay の入力元を兼ねる)
+class MemoryLog : public Stream {
+  private:
+    std::vector<uint8_t> _data;
+    size_t _pos = 0;
+
+  public:
+    size_t write(uint8_t c) override {
+      this->_data.push_back(c);
+      return 1;
+    }
+    size_t write(const uint8_t* buffer, size_t size) override {
+      this->_data.insert(this->_data.end(), buffer, buffer + size);
+      return size;
+    }
+    int available() override {
+      return this->_data.size() - this->_pos;
+    }
+    int read() override {
+      return (this->_pos < this->_data.size()) ? this->_data[this->_pos++] : -1;
+    }
+    int peek() override {
+      return (this->_pos < this->_data.size()) ? this->_data[this->_pos] : -1;
+    }
+};
+
+// キューブごとの、コールバックが呼ばれた回数と受け取った値のチェックサム
+// (キューブ間の順番は loop() の呼び方で、種類の異なるイベントの順番は
+//  イベントの優先度で変わるので、キューブごと・種類ごとに比べる)
+struct Counts {
+  uint32_t position = 0;
+  uint32_t missed = 0;
+  uint32_t button = 0;
+  uint32_t motion = 0;
+  uint32_t battery = 0;
+  uint32_t sums[4] = {0, 0, 0, 0};
+
+  uint32_t checksum() const {
+    return sums[0] ^ (sums[1] * 3) ^ (sums[2] * 5) ^ (sums[3] * 7);
+  }
+};
+
+static std::vector<Counts> g_counts;
+
+int main(int argc, char* argv[]) {
+  size_t cube_num = (argc > 1) ? atoi(argv[1]) : 4;
+  uint32_t seconds = (argc > 2) ? atoi(argv[2]) : 3;
+  float speed = (argc > 3) ? atof(argv[3]) : 0.0f;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  ToioSim::setLinkConfig(link);
+  std::vector<ToioSimCube*> sim_cubes = ToioSim::addCubes(cube_num);
+
+  MemoryLog log;
+  ToioRecorder recorder;
+  recorder.begin(&log, 20);
+
+  Toio toio;
+  toio.setRecorder(&recorder);
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  g_counts.resize(toiocore_list.size());
+  for (size_t i = 0; i < toiocore_list.size(); i++) {
+    ToioCore* toiocore = toiocore_list[i];
+    toiocore->onPosition([i](ToioCorePositionData pos) {
+      Counts& c = g_counts[i];
+      c.position++;
+      c.sums[0] = c.sums[0] * 31 + pos.x + pos.y * 7 + pos.angle * 13;
+    });
+    toiocore->onIdMissed([i](ToioCoreIdType type) {
+      g_counts[i].missed++;
+    });
+    toiocore->onButton([i](bool state) {
+      Counts& c = g_counts[i];
+      c.button++;
+      c.sums[1] = c.sums[1] * 31 + state;
+    });
+    toiocore->onMotion([i](ToioCoreMotionData motion) {
+      Counts& c = g_counts[i];
+      c.motion++;
+      c.sums[2] = c.sums[2] * 31 + motion.attitude;
+    });
+    toiocore->onBattery([i](uint8_t level) {
+      Counts& c = g_counts[i];
+      c.battery++;
+      c.sums[3] = c.sums[3] * 31 + level;
+    });
+    toiocore->connect();
+    toiocore->turnOnLed(0, 255, 0);
+    sim_cubes[i]->setPose(100 + 60 * i, 250, 0);
+  }
+
+  // 記録: 走らせながらボタン・モーション・マットからの持ち上げを起こす
+  unsigned long start = millis();
+  uint32_t step = 0;
+  while (millis() - start < seconds * 1000) {
+    toio.loop();
+    if (step % 20 == 0) {
+      for (size_t i = 0; i < toiocore_list.size(); i++) {
+        toiocore_list[i]->drive(30, (step / 20 + i) % 2 ? 20 : -20);
+        sim_cubes[i]->setButtonState((step / 20) % 2);
+        sim_cubes[i]->setMotion(true, false, false, 1 + (step / 20) % 6);
+        sim_cubes[i]->setOnMat((step / 20) % 5 != 4);
+      }
+    }
+    step++;
+    delay(5);
+  }
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->disconnect();
+  }
+  delay(50);
+  toio.loop();
+  recorder.end();
+  toio.setRecorder(nullptr);
+
+  std::vector<Counts> recorded = g_counts;
+  ToioRecorderStats rstats = recorder.getStats();
+  Serial.printf("record : %u records, %u dropped, %u bytes in %u flushes, high water %u bytes\n",
+                rstats.records, rstats.dropped, rstats.bytes, rstats.flushes, rstats.high_water);
+
+  // 再生: 接続していない同じ ToioCore に流し込み、Toio::loop() でコールバックを呼ぶ
+  g_counts.assign(toiocore_list.size(), Counts());
+  ToioReplay replay;
+  if (!replay.begin(&log, speed)) {
+    Serial.println("invalid log");
+    return 1;
+  }
+  replay.bindAll(toio);
+  start = millis();
+  while (!replay.isDone()) {
+    replay.feed();
+    toio.loop();
+    if (speed > 0) {
+      delay(1);
+    }
+  }
+  toio.loop();
+  unsigned long elapsed = millis() - start;
+  ToioReplayStats pstats = replay.getStats();
+  Serial.printf("replay : %u records, %u notifications, %u writes, %u unbound, %u errors in %lu ms\n",
+                pstats.records, pstats.notifications, pstats.writes, pstats.unbound, pstats.errors, elapsed);
+
+  Serial.println("address                    position missed button motion battery checksum");
+  bool same = true;
+  for (size_t i = 0; i < toiocore_list.size(); i++) {
+    const char* phases[2] = {"record", "replay"};
+    const Counts* counts[2] = {&recorded[i], &g_counts[i]};
+    for (int p = 0; p < 2; p++) {
+      const Counts& c = *counts[p];
+      Serial.printf("%s %s : %8u %6u %6u %6u %7u %08x\n", toiocore_list[i]->getAddress().c_str(), phases[p],
+                    c.position, c.missed, c.button, c.motion, c.battery, c.checksum());
+    }
+    same = same && memcmp(&recorded[i], &g_counts[i], sizeof(Counts)) == 0;
+  }
+  Serial.println(same ? "result : identical" : "result : DIFFERENT");
+  return same ? 0 : 1;
+}
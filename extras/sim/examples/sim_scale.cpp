@@ -0,0 +1,250 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_scale.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  一度に 1 つの接続しか確立できず、無線を全接続で共有するセントラルを
+  シミュレータで再現し、多数の仮想 toio コア キューブへの接続と通信を
+  計測します。
+
+  1. 全キューブを connectAsync() したとき、接続の順番待ちがなければ
+     接続に失敗し、順番待ちがあれば全台が接続できることを確認する
+  2. キューブの数を 1 台から増やしながら、位置の通知とモーター制御の
+     合計のスループット、通知のロス、1 フレーム (全台へのモーター制御の
+     指示と loop()) の最大の所要時間、キューブごとの書き込み数の偏りを
+     計る。
+     各キューブが低遅延のプリセットを要求する場合 (free) と、Toio が
+     台数に合わせて共通の接続間隔を決める場合 (planned) を比べる
+  3. 共通の接続間隔の計画を無効にしたとき、キューブが自分で要求していた
+     接続間隔に戻ることを確認する
+  4. 最大接続数を超える接続が断られ、接続中の台数が正しく数えられる
+     ことを確認する
+
+  [使い方]
+
+  ./build/sim_scale [最大のキューブの数] [1 段階の計測の秒数] [1 回の接続イベントの時間 (マイクロ秒)]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+#include <ToioSimCheck.h>
+
+// 1 段階の計測結果
+struct StepResult {
+  uint32_t notifications_per_sec;
+  uint32_t commands_per_sec;
+  uint32_t lost;
+  uint32_t max_frame_us;
+  float fairness;  // キューブごとの書き込み数の最小値 / 最大値
+};
+
+// 接続処理が終わるまで loop() を回す
+static void waitForConnections(Toio& toio, std::vector<ToioCore*>& toiocore_list) {
+  while (true) {
+    toio.loop();
+    size_t pending = 0;
+    for (ToioCore* toiocore : toiocore_list) {
+      ToioCoreConnectionState state = toiocore->getConnectionState();
+      if (state != TOIO_CORE_CONNECTION_CONNECTED && state != TOIO_CORE_CONNECTION_DISCONNECTED) {
+        pending++;
+      }
+    }
+    if (pending == 0) {
+      break;
+    }
+    delay(1);
+  }
+}
+
+static size_t countConnected(std::vector<ToioCore*>& toiocore_list) {
+  size_t n = 0;
+  for (ToioCore* toiocore : toiocore_list) {
+    n += toiocore->isConnected();
+  }
+  return n;
+}
+
+static void disconnectAll(Toio& toio, std::vector<ToioCore*>& toiocore_list) {
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->disconnect();
+  }
+  delay(50);
+  toio.loop();
+}
+
+// 接続中の n 台を回しながら、モーター制御を毎回の loop() で送り続ける
+static StepResult measure(Toio& toio, std::vector<ToioCore*>& cubes, std::vector<ToioSimCube*>& sim_cubes,
+                          uint32_t& positions, uint32_t seconds) {
+  StepResult r;
+  std::vector<ToioSimCubeStats> before(cubes.size());
+  for (size_t i = 0; i < cubes.size(); i++) {
+    before[i] = sim_cubes[i]->getStats();
+  }
+  uint32_t positions_before = positions;
+  r.max_frame_us = 0;
+  uint32_t step = 0;
+  unsigned long start = millis();
+  while (millis() - start < seconds * 1000) {
+    uint32_t t = micros();
+    for (ToioCore* toiocore : cubes) {
+      toiocore->controlMotor(true, 30 + (step & 1), false, 30);
+    }
+    toio.loop();
+    t = micros() - t;
+    r.max_frame_us = (t > r.max_frame_us) ? t : r.max_frame_us;
+    step++;
+    delay(1);
+  }
+  uint32_t written = 0;
+  uint32_t min_written = UINT32_MAX;
+  uint32_t max_written = 0;
+  r.lost = 0;
+  for (size_t i = 0; i < cubes.size(); i++) {
+    ToioSimCubeStats stats = sim_cubes[i]->getStats();
+    uint32_t w = stats.written[TOIO_SIM_CHAR_MOTOR] - before[i].written[TOIO_SIM_CHAR_MOTOR];
+    written += w;
+    min_written = (w < min_written) ? w : min_written;
+    max_written = (w > max_written) ? w : max_written;
+    r.lost += stats.lost[TOIO_SIM_CHAR_ID] - before[i].lost[TOIO_SIM_CHAR_ID];
+  }
+  r.notifications_per_sec = (positions - positions_before) / seconds;
+  r.commands_per_sec = written / seconds;
+  r.fairness = max_written ? (float)min_written / max_written : 0.0f;
+  return r;
+}
+
+int main(int argc, char* argv[]) {
+  size_t cube_num = (argc > 1) ? atoi(argv[1]) : 8;
+  uint32_t seconds = (argc > 2) ? atoi(argv[2]) : 1;
+  uint32_t event_us = (argc > 3) ? atoi(argv[3]) : 2500;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  link.connect_latency_ms = 100;
+  link.jitter_ms = 0;
+  link.event_length_us = event_us;
+  link.max_connecting = 1;
+  ToioSim::setLinkConfig(link);
+  std::vector<ToioSimCube*> sim_cubes = ToioSim::addCubes(cube_num);
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  if (toiocore_list.size() != cube_num) {
+    Serial.println("Not all cubes found");
+    return 1;
+  }
+  uint32_t positions = 0;
+  for (size_t i = 0; i < cube_num; i++) {
+    toiocore_list[i]->onPosition([&positions](ToioCorePositionData pos) {
+      positions++;
+    });
+    toiocore_list[i]->setMotorWriteInterval(0);
+    sim_cubes[i]->setPose(80 + 40 * (i % 8), 100 + 60 * (i / 8), 0);
+  }
+
+  // 1. 全台を一度に connectAsync() する
+  const char* connect_names[2] = {"unscheduled", "scheduled"};
+  size_t connected[2];
+  for (int mode = 0; mode < 2; mode++) {
+    toio.setConnectConcurrency(mode == 0 ? 0 : 1);
+    uint32_t rejected = ToioSim::getRejectedConnects();
+    unsigned long start = millis();
+    for (ToioCore* toiocore : toiocore_list) {
+      toiocore->connectAsync();
+    }
+    waitForConnections(toio, toiocore_list);
+    connected[mode] = countConnected(toiocore_list);
+    Serial.printf("connect %-11s: %2u/%u cubes in %4lu ms, %u rejected by the central\n", connect_names[mode],
+                  (unsigned)connected[mode], (unsigned)cube_num, millis() - start, ToioSim::getRejectedConnects() - rejected);
+    disconnectAll(toio, toiocore_list);
+  }
+  ToioSchedulerStats sstats = toio.getSchedulerStats();
+  Serial.printf("scheduler : %u granted, max wait %u ms\n", sstats.granted, sstats.max_wait_ms);
+
+  // 2. 台数を増やしながら計測する
+  const char* mode_names[2] = {"free", "planned"};
+  StepResult last[2];
+  Serial.println("mode    cubes interval notify/s  cmd/s  lost  max frame  fairness");
+  for (int mode = 0; mode < 2; mode++) {
+    toio.setLinkPlan(mode == 1);
+    std::vector<ToioCore*> cubes;
+    std::vector<ToioSimCube*> sims;
+    for (size_t n = 1; n <= cube_num; n++) {
+      ToioCore* toiocore = toiocore_list[n - 1];
+      toiocore->connectAsync();
+      waitForConnections(toio, toiocore_list);
+      if (mode == 0) {
+        toiocore->applyLinkPreset(TOIO_CORE_LINK_LOW_LATENCY);
+      }
+      toiocore->setMotorWriteInterval(0);
+      cubes.push_back(toiocore);
+      sims.push_back(sim_cubes[n - 1]);
+      if (n != 1 && n != cube_num && (n & (n - 1)) != 0) {
+        continue;
+      }
+      // 接続間隔の要求が届くのを待ってから計る
+      for (int i = 0; i < 20; i++) {
+        toio.loop();
+        delay(10);
+      }
+      StepResult r = measure(toio, cubes, sims, positions, seconds);
+      Serial.printf("%-7s %5u %6.2fms %8u %6u %5u %7u us %9.2f\n", mode_names[mode], (unsigned)n,
+                    sim_cubes[0]->getConnectionInterval() * 1.25, r.notifications_per_sec, r.commands_per_sec,
+                    r.lost, r.max_frame_us, r.fairness);
+      last[mode] = r;
+    }
+    for (ToioCore* toiocore : cubes) {
+      toiocore->controlMotor(true, 0, true, 0);
+    }
+    toio.loop();
+    disconnectAll(toio, toiocore_list);
+    for (ToioCore* toiocore : toiocore_list) {
+      toiocore->applyLinkPreset(TOIO_CORE_LINK_DEFAULT);
+    }
+  }
+
+  // 3. 計画を無効にすると、キューブが要求していた接続間隔に戻る
+  toio.setLinkPlan(false);
+  ToioCore* toiocore = toiocore_list[0];
+  toiocore->connectAsync();
+  waitForConnections(toio, toiocore_list);
+  toiocore->requestConnectionInterval(12, 20);
+  toio.setLinkPlan(true);
+  run(toio, 200);
+  uint16_t planned = sim_cubes[0]->getConnectionInterval();
+  toio.setLinkPlan(false);
+  run(toio, 200);
+  uint16_t restored = sim_cubes[0]->getConnectionInterval();
+  Serial.printf("plan off  : interval %5.2f ms while planned, %5.2f ms after (requested 12-20)\n", planned * 1.25,
+                restored * 1.25);
+  disconnectAll(toio, toiocore_list);
+
+  // 4. 最大接続数を超える接続は断る (接続中の台数は接続状態の変化から数える)
+  size_t max_connections = std::min<size_t>(cube_num, 2);
+  toio.setMaxConnections(max_connections);
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->connectAsync();
+  }
+  waitForConnections(toio, toiocore_list);
+  size_t limited = countConnected(toiocore_list);
+  uint32_t counted = toio.getSchedulerStats().connected;
+  disconnectAll(toio, toiocore_list);
+  uint32_t remaining = toio.getSchedulerStats().connected;
+  toio.setMaxConnections(TOIO_MAX_CONNECTIONS);
+  Serial.printf("limit     : %u/%u cubes connected (max %u), %u counted, %u after disconnecting\n", (unsigned)limited,
+                (unsigned)cube_num, (unsigned)max_connections, counted, remaining);
+
+  // 順番待ちがあれば全台が接続できる。共通の接続間隔なら、接続イベントに載りきらない
+  // 書き込みでフレームが待たされず、全台の書き込みの合計も減らない
+  bool ok = connected[1] == cube_num && (cube_num < 2 || connected[0] < cube_num);
+  ok = ok && last[1].max_frame_us < last[0].max_frame_us && last[1].commands_per_sec >= last[0].commands_per_sec;
+  ok = ok && last[1].lost <= last[0].lost;
+  ok = ok && planned != 12 && restored == 12;
+  ok = ok && limited == max_connections && counted == limited && remaining == 0;
+  Serial.println(ok ? "result : ok" : "result : NG");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,222 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_spatial.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の多数の仮想 toio コア キューブで、空間インデックス
+  (findNeighbors() / findCubesNear()) と衝突回避を確かめます。
+
+  1. キューブをマット上に散らばらせては少し走らせることを繰り返し、
+     止まったところで findNeighbors() の結果が全キューブの位置を総当たりで
+     比べた結果と一致することを確認する。1 台あたりの探索の所要時間と、
+     距離を比べたキューブの数を総当たりと比べる
+  2. 向かい合った 2 台を前進させ、衝突回避なしではすれ違う (重なる) こと、
+     衝突回避ありでは止まる距離の手前で止まること、後退は制限されないこと
+     を確認する
+
+  [使い方]
+
+  ./build/sim_spatial [キューブの数] [探す半径]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+#include <ToioSimCheck.h>
+#include <chrono>
+#include <math.h>
+
+// 全キューブの最新の位置を総当たりで比べて、toiocore から radius 以内の他のキューブを探す
+static size_t bruteForce(std::vector<ToioCore*>& toiocore_list, ToioCore* toiocore, uint16_t radius,
+                         ToioCore** cubes, size_t max) {
+  ToioCorePose self;
+  if (!toiocore->getLatestPose(self) || !self.on_mat) {
+    return 0;
+  }
+  size_t n = 0;
+  for (ToioCore* other : toiocore_list) {
+    ToioCorePose pose;
+    if (other == toiocore || !other->getLatestPose(pose) || !pose.on_mat) {
+      continue;
+    }
+    int32_t dx = pose.position.x - self.position.x;
+    int32_t dy = pose.position.y - self.position.y;
+    if (dx * dx + dy * dy <= radius * radius && n < max) {
+      cubes[n++] = other;
+    }
+  }
+  return n;
+}
+
+static double distance(ToioSimCube* a, ToioSimCube* b) {
+  double ax, ay, aa;
+  double bx, by, ba;
+  a->getPose(ax, ay, aa);
+  b->getPose(bx, by, ba);
+  return hypot(ax - bx, ay - by);
+}
+
+// 向かい合った 2 台を前進させ、最も近づいた距離を返す
+static double approach(Toio& toio, ToioSimCube* sim_a, ToioSimCube* sim_b, ToioCore* a, ToioCore* b) {
+  sim_a->setPose(150, 250, 0);
+  sim_b->setPose(350, 250, 180);
+  run(toio, 50);
+  a->controlMotor(true, 50, true, 50);
+  b->controlMotor(true, 50, true, 50);
+  double closest = distance(sim_a, sim_b);
+  unsigned long start = millis();
+  while (millis() - start < 3000) {
+    toio.loop();
+    closest = std::min(closest, distance(sim_a, sim_b));
+    delay(1);
+  }
+  return closest;
+}
+
+int main(int argc, char* argv[]) {
+  size_t cube_num = (argc > 1) ? atoi(argv[1]) : 24;
+  uint16_t radius = (argc > 2) ? atoi(argv[2]) : 80;
+  uint32_t repeat = 1000;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  ToioSim::setLinkConfig(link);
+  std::vector<ToioSimCube*> sim_cubes = ToioSim::addCubes(cube_num);
+
+  Toio toio;
+  std::vector<ToioCore*> found = toio.scan(1);
+  std::vector<ToioCore*> toiocore_list;
+  for (ToioSimCube* sim_cube : sim_cubes) {
+    for (ToioCore* toiocore : found) {
+      if (toiocore->getAddress() == sim_cube->getAddress() && toiocore->connect()) {
+        toiocore->setMotorWriteInterval(0);
+        toiocore_list.push_back(toiocore);
+      }
+    }
+  }
+  if (toiocore_list.size() != cube_num) {
+    Serial.println("No cube connected");
+    return 1;
+  }
+  toio.setSpatialIndex(true);
+
+  // ---- 1. 総当たりとの比較 ----
+  {
+    srand(1);
+    std::vector<ToioCore*> by_index(cube_num);
+    std::vector<ToioCore*> by_brute(cube_num);
+    bool same = true;
+    uint32_t pairs = 0;
+    double index_ns = 0;
+    double brute_ns = 0;
+    uint32_t queries = 0;
+    ToioSpatialStats before = toio.getSpatialStats();
+    for (int round = 0; round < 5; round++) {
+      // 散らばらせて少し走らせる (セルをまたぐ移動をインデックスに反映させる)
+      for (size_t i = 0; i < cube_num; i++) {
+        sim_cubes[i]->setPose(60 + rand() % 380, 60 + rand() % 380, rand() % 360);
+        toiocore_list[i]->controlMotor(true, 20 + rand() % 40, true, 20 + rand() % 40, 200);
+      }
+      run(toio, 300);
+
+      typedef std::chrono::steady_clock Clock;
+      for (size_t i = 0; i < cube_num; i++) {
+        ToioCore* toiocore = toiocore_list[i];
+        size_t n = 0;
+        size_t m = 0;
+        Clock::time_point t0 = Clock::now();
+        for (uint32_t k = 0; k < repeat; k++) {
+          n = toio.findNeighbors(toiocore, radius, by_index.data(), cube_num);
+        }
+        Clock::time_point t1 = Clock::now();
+        for (uint32_t k = 0; k < repeat; k++) {
+          m = bruteForce(toiocore_list, toiocore, radius, by_brute.data(), cube_num);
+        }
+        Clock::time_point t2 = Clock::now();
+        index_ns += std::chrono::duration<double, std::nano>(t1 - t0).count() / repeat;
+        brute_ns += std::chrono::duration<double, std::nano>(t2 - t1).count() / repeat;
+        queries++;
+        std::sort(by_index.begin(), by_index.begin() + n);
+        std::sort(by_brute.begin(), by_brute.begin() + m);
+        same = same && n == m && std::equal(by_index.begin(), by_index.begin() + n, by_brute.begin());
+        pairs += n;
+      }
+    }
+    ToioSpatialStats after = toio.getSpatialStats();
+    double candidates = (double)(after.candidates - before.candidates) / (after.queries - before.queries);
+    Serial.printf("index  : %u cubes, radius %u, %u neighbors found in %u queries\n", after.indexed, radius, pairs,
+                  queries);
+    Serial.printf("query  : index %7.1f ns (%.1f candidates), brute force %7.1f ns (%u candidates)\n",
+                  index_ns / queries, candidates, brute_ns / queries, (unsigned)cube_num - 1);
+    Serial.printf("update : %u updates, %u cell moves\n", after.updates - before.updates,
+                  after.cell_moves - before.cell_moves);
+    check("indexed", after.indexed == cube_num);
+    check("same as brute force", same && pairs > 0);
+    check("fewer candidates", candidates < cube_num - 1);
+    check("incremental", after.cell_moves - before.cell_moves < after.updates - before.updates);
+
+    // 座標から探す
+    ToioCore* at[1];
+    sim_cubes[0]->setPose(250, 250, 0);
+    for (size_t i = 1; i < cube_num; i++) {
+      sim_cubes[i]->setPose(60 + (i % 2) * 380, 60 + (i % 3) * 190, 0);
+    }
+    run(toio, 50);
+    check("near point", toio.findCubesNear(255, 245, 20, at, 1) == 1 && at[0] == toiocore_list[0]);
+
+    // マットから外すとインデックスからも外れる
+    sim_cubes[0]->setOnMat(false);
+    run(toio, 50);
+    check("lifted", toio.findCubesNear(250, 250, 20, at, 1) == 0 &&
+                    toio.getSpatialStats().indexed == cube_num - 1);
+  }
+
+  // ---- 2. 衝突回避 ----
+  {
+    for (size_t i = 2; i < cube_num; i++) {
+      sim_cubes[i]->setOnMat(false);
+    }
+    ToioSimCube* sim_a = sim_cubes[0];
+    ToioSimCube* sim_b = sim_cubes[1];
+    ToioCore* a = toiocore_list[0];
+    ToioCore* b = toiocore_list[1];
+
+    double without = approach(toio, sim_a, sim_b, a, b);
+    a->controlMotor(true, 0, true, 0);
+    b->controlMotor(true, 0, true, 0);
+    run(toio, 50);
+
+    toio.setCollisionAvoidance(true);
+    double with = approach(toio, sim_a, sim_b, a, b);
+    double stopped = distance(sim_a, sim_b);
+    ToioCoreMotorStats stats = a->getMotorStats();
+    Serial.printf("avoid  : closest %.1f without avoidance, %.1f with (stop %u, slow %u), %u limited writes\n",
+                  without, with, TOIO_SPATIAL_STOP_DISTANCE, TOIO_SPATIAL_SLOW_DISTANCE, stats.limited);
+    check("pass through", without < 20.0);
+    check("stop before", with > TOIO_SPATIAL_STOP_DISTANCE - 10 && with < TOIO_SPATIAL_SLOW_DISTANCE);
+    check("stopped", fabs(stopped - with) < 1.0 && stats.limited > 0);
+
+    // 後ろは空いているので後退は制限されない
+    b->controlMotor(true, 0, true, 0);
+    a->controlMotor(false, 50, false, 50);
+    run(toio, 500);
+    double backed = distance(sim_a, sim_b);
+    Serial.printf("back   : distance %.1f after backing away\n", backed);
+    check("back away", backed > with + 30);
+
+    a->controlMotor(true, 0, true, 0);
+    b->controlMotor(true, 0, true, 0);
+    toio.setCollisionAvoidance(false);
+    run(toio, 50);
+  }
+
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->disconnect();
+  }
+  delay(10);
+
+  return checkResult();
+}
@@ -0,0 +1,133 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_state.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブのバッテリー・ボタン・モーション
+  センサーの状態を毎フレーム取得し、1 フレームにかかる時間を、毎回
+  GATT の読み出しを待つ場合 (TOIO_CORE_READ_BLOCKING) と、通知された
+  値を返す場合 (TOIO_CORE_READ_CACHED) で比べます。ボタンとバッテリー
+  残量が正しく取得できることと、TOIO_CORE_READ_CACHED では GATT の
+  読み出しが起きないことをあわせて確認します。
+
+  [使い方]
+
+  ./build/sim_state [フレーム数] [読み出しの往復時間 (ミリ秒)]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+#include <ToioSimCheck.h>
+
+// 1 回の計測結果
+struct PollResult {
+  uint32_t avg_us;
+  uint32_t max_us;
+  uint32_t pressed_frames;     // ボタンが押されていると取得できたフレーム数
+  uint32_t pressed_expected;   // ボタンを押していたフレーム数
+  uint32_t button_mismatch;    // 直前・1 つ前のフレームで設定したボタンの状態のどちらとも違う値を取得したフレーム数
+  uint32_t battery_mismatch;   // 同じく、バッテリー残量が違ったフレーム数
+  uint32_t reads[TOIO_SIM_CHAR_NUM]; // 仮想キューブが受信した読み出し数
+};
+
+// 毎フレームボタン・バッテリー残量・モーションセンサーの値を通知させながら状態を取得し、1 フレームの平均・最大時間 (マイクロ秒) を表示
+static PollResult pollFrames(Toio& toio, ToioCore* toiocore, ToioSimCube* sim_cube, const char* title, uint32_t frames) {
+  PollResult result = {};
+  uint32_t total_us = 0;
+  ToioSimCubeStats before = sim_cube->getStats();
+  bool last_press = false;
+  uint8_t last_battery = 80;
+  sim_cube->setButtonState(last_press);
+  sim_cube->setBatteryLevel(last_battery);
+  delay(50);
+  for (uint32_t f = 0; f < frames; f++) {
+    bool press = (f / 20) % 2;
+    uint8_t battery = 80 - (f / 10);
+    sim_cube->setButtonState(press);
+    sim_cube->setBatteryLevel(battery);
+    sim_cube->setMotion(true, false, false, 1, f % 2);
+    toio.loop();
+    delay(10);
+
+    uint32_t start = micros();
+    uint8_t level = toiocore->getBatteryLevel();
+    bool pressed = toiocore->getButtonState();
+    ToioCoreMotionData motion = toiocore->getMotion();
+    uint32_t elapsed = micros() - start;
+    (void)motion;
+
+    total_us += elapsed;
+    result.max_us = (elapsed > result.max_us) ? elapsed : result.max_us;
+    result.pressed_frames += pressed ? 1 : 0;
+    result.pressed_expected += press ? 1 : 0;
+    // 通知は 1 フレーム遅れて届くことがある
+    result.button_mismatch += (pressed != press && pressed != last_press) ? 1 : 0;
+    result.battery_mismatch += (level != battery && level != last_battery) ? 1 : 0;
+    last_press = press;
+    last_battery = battery;
+  }
+  ToioSimCubeStats after = sim_cube->getStats();
+  for (size_t i = 0; i < TOIO_SIM_CHAR_NUM; i++) {
+    result.reads[i] = after.read[i] - before.read[i];
+  }
+  result.avg_us = total_us / frames;
+
+  uint8_t level = 0;
+  uint32_t age_ms = 0;
+  bool valid = toiocore->getBatteryLevel(level, age_ms);
+  Serial.printf("%-8s: frame avg %6u us, max %6u us, button pressed %u/%u frames, battery %u%% (%s, age %u ms)\n",
+                title, result.avg_us, result.max_us, result.pressed_frames, result.pressed_expected, level,
+                valid ? "valid" : "none", age_ms);
+  Serial.printf("          reads: button %u, battery %u, motion %u, mismatch: button %u, battery %u frames\n",
+                result.reads[TOIO_SIM_CHAR_BUTTON], result.reads[TOIO_SIM_CHAR_BATTERY],
+                result.reads[TOIO_SIM_CHAR_MOTION], result.button_mismatch, result.battery_mismatch);
+  return result;
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t frames = (argc > 1) ? atoi(argv[1]) : 100;
+  uint32_t read_latency = (argc > 2) ? atoi(argv[2]) : 20;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  link.write_latency_ms = read_latency;
+  ToioSim::setLinkConfig(link);
+  ToioSimCube* sim_cube = ToioSim::addCube();
+  sim_cube->setBatteryLevel(80);
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  if (toiocore_list.empty()) {
+    Serial.println("No cube found");
+    return 1;
+  }
+  ToioCore* toiocore = toiocore_list.at(0);
+  check("connected", toiocore->connect());
+
+  toiocore->setReadMode(TOIO_CORE_READ_BLOCKING);
+  PollResult blocking = pollFrames(toio, toiocore, sim_cube, "blocking", frames);
+  check("blocking button", blocking.button_mismatch == 0);
+  check("blocking battery", blocking.battery_mismatch == 0);
+  check("blocking reads", blocking.reads[TOIO_SIM_CHAR_BUTTON] >= frames &&
+                          blocking.reads[TOIO_SIM_CHAR_BATTERY] >= frames &&
+                          blocking.reads[TOIO_SIM_CHAR_MOTION] >= frames);
+
+  // バッテリーは通知の間隔が長いので、1 秒より古ければ読み直す
+  // (毎フレームすべての値を通知させているので、読み直しは起きない)
+  toiocore->setReadMode(TOIO_CORE_READ_CACHED, 1000);
+  PollResult cached = pollFrames(toio, toiocore, sim_cube, "cached", frames);
+  check("cached button", cached.button_mismatch == 0);
+  check("cached battery", cached.battery_mismatch == 0);
+  check("cached no reads", cached.reads[TOIO_SIM_CHAR_BUTTON] == 0 &&
+                           cached.reads[TOIO_SIM_CHAR_BATTERY] == 0 &&
+                           cached.reads[TOIO_SIM_CHAR_MOTION] == 0);
+  check("cached faster", cached.avg_us * 10 < blocking.avg_us);
+
+  toiocore->disconnect();
+  delay(10);
+  return checkResult();
+}
@@ -0,0 +1,154 @@
+/* ----------------------------------------------------------------
+  m5stack-toio - sim_stats.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータ上の仮想 toio コア キューブを走らせながら、キャラクタ
+  リスティックごとの通信の計測結果を 1 秒ごとに表示します。最後に
+  1 台目のキューブの Position ID の到着間隔と、通知の受信から
+  コールバックまでの時間のヒストグラムを表示し、通知間隔が仮想キューブの
+  設定どおりに数えられていることと、既知の値のバケットとパーセンタイルを
+  確認します。
+
+  [使い方]
+
+  ./build/sim_stats [キューブの数] [実行秒数] [書き込みの遅延 (ミリ秒)]
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <ToioSim.h>
+#include <Toio.h>
+#include <ToioSimCheck.h>
+
+static void printHistogram(const char* title, const ToioStatsHistogram& histogram) {
+  Serial.printf("%s: %u samples, avg %u us, p50 %u us, p99 %u us, max %u us\n", title, histogram.count,
+                histogram.avg_us, toioStatsPercentile(histogram, 50), toioStatsPercentile(histogram, 99),
+                histogram.max_us);
+  for (size_t i = 0; i < TOIO_STATS_BUCKETS; i++) {
+    if (histogram.buckets[i] == 0) {
+      continue;
+    }
+    int bar = histogram.buckets[i] * 50 / histogram.count;
+    Serial.printf("  < %7u us %6u ", toioStatsBucketLimit(i), histogram.buckets[i]);
+    for (int b = 0; b < bar; b++) {
+      Serial.print('#');
+    }
+    Serial.println();
+  }
+}
+
+// バケットの合計が回数と一致し、平均 <= 最大、p50 <= p99 <= 最大であること
+static bool consistent(const ToioStatsHistogram& histogram) {
+  uint32_t total = 0;
+  for (size_t i = 0; i < TOIO_STATS_BUCKETS; i++) {
+    total += histogram.buckets[i];
+  }
+  uint32_t p50 = toioStatsPercentile(histogram, 50);
+  uint32_t p99 = toioStatsPercentile(histogram, 99);
+  return total == histogram.count && histogram.avg_us <= histogram.max_us && p50 <= p99 && p99 <= histogram.max_us;
+}
+
+int main(int argc, char* argv[]) {
+  size_t cube_num = (argc > 1) ? atoi(argv[1]) : 4;
+  uint32_t seconds = (argc > 2) ? atoi(argv[2]) : 3;
+  uint32_t write_latency = (argc > 3) ? atoi(argv[3]) : 5;
+
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  link.scan_time_scale = 0.1f;
+  link.write_latency_ms = write_latency;
+  ToioSim::setLinkConfig(link);
+  std::vector<ToioSimCube*> sim_cubes = ToioSim::addCubes(cube_num);
+
+  Toio toio;
+  std::vector<ToioCore*> toiocore_list = toio.scan(1);
+  for (size_t i = 0; i < toiocore_list.size(); i++) {
+    toiocore_list[i]->connect();
+    toiocore_list[i]->onPosition([](ToioCorePositionData pos) {});
+    toiocore_list[i]->onMotion([](ToioCoreMotionData motion) {});
+    sim_cubes[i]->setPose(100 + 60 * i, 250, 0);
+    sim_cubes[i]->setNotifyInterval(TOIO_SIM_CHAR_MOTION, 50);
+  }
+
+  // 接続処理の通信と、接続中に溜まった通知は含めずに計測する
+  toio.loop();
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->resetLinkStats();
+  }
+  toio.setLinkStatsDump(&Serial, 1000);
+
+  unsigned long start = millis();
+  uint32_t step = 0;
+  while (millis() - start < seconds * 1000) {
+    toio.loop();
+    for (size_t i = 0; i < toiocore_list.size(); i++) {
+      toiocore_list[i]->drive(30, ((step / 100 + i) % 2) ? 20 : -20);
+    }
+    if (step % 200 == 0) {
+      for (ToioCore* toiocore : toiocore_list) {
+        toiocore->turnOnLed(0, step % 256, 255);
+      }
+    }
+    step++;
+    delay(5);
+  }
+  toio.setLinkStatsDump(nullptr);
+
+  check("all cubes connected", toiocore_list.size() == cube_num);
+  if (!toiocore_list.empty()) {
+    ToioCoreLinkStats stats = toiocore_list[0]->getLinkStats();
+    Serial.printf("\n%s, %u ms\n", toiocore_list[0]->getAddress().c_str(), stats.elapsed_ms);
+    printHistogram("motor write time", stats.chars[TOIO_CORE_CHAR_MOTOR].write_time);
+    printHistogram("id notify interval", stats.chars[TOIO_CORE_CHAR_ID].notify_interval);
+    printHistogram("id dispatch latency", stats.chars[TOIO_CORE_CHAR_ID].dispatch_latency);
+
+    // 仮想キューブの通知間隔 (Position ID 10 ミリ秒、モーションセンサー 50 ミリ秒) どおりに数えている
+    const ToioStatsHistogram& id_interval = stats.chars[TOIO_CORE_CHAR_ID].notify_interval;
+    const ToioStatsHistogram& motion_interval = stats.chars[TOIO_CORE_CHAR_MOTION].notify_interval;
+    check("histograms consistent", consistent(stats.chars[TOIO_CORE_CHAR_MOTOR].write_time) &&
+                                   consistent(id_interval) && consistent(motion_interval) &&
+                                   consistent(stats.chars[TOIO_CORE_CHAR_ID].dispatch_latency));
+    check("id notify count", id_interval.count > seconds * 1000 / 10 * 8 / 10);
+    check("id notify interval", id_interval.avg_us > 9000 && id_interval.avg_us < 12000);
+    check("motion notify interval", motion_interval.avg_us > 45000 && motion_interval.avg_us < 60000);
+    check("motor writes counted", stats.chars[TOIO_CORE_CHAR_MOTOR].writes > 0 &&
+                                  stats.chars[TOIO_CORE_CHAR_MOTOR].write_time.count ==
+                                  stats.chars[TOIO_CORE_CHAR_MOTOR].writes);
+
+    // レスポンスありの書き込みは、仮想キューブの往復時間以上かかる
+    toiocore_list[0]->resetLinkStats();
+    for (int i = 0; i < 5; i++) {
+      toiocore_list[0]->setFlatThreshold(10 + i);
+    }
+    ToioStatsHistogram conf = toiocore_list[0]->getLinkStats().chars[TOIO_CORE_CHAR_CONF].write_time;
+    printHistogram("conf write time", conf);
+    check("conf write time", conf.count == 5 && conf.avg_us >= write_latency * 1000 &&
+                             toioStatsPercentile(conf, 50) >= write_latency * 1000);
+  }
+
+  // 既知の値を数えたときのバケットとパーセンタイル
+  {
+    ToioStatsCounter counter;
+    for (int i = 0; i < 90; i++) {
+      counter.record(100);
+    }
+    for (int i = 0; i < 10; i++) {
+      counter.record(3000);
+    }
+    ToioStatsHistogram known;
+    counter.snapshot(known);
+    printHistogram("known values", known);
+    check("known buckets", known.count == 100 && known.buckets[3] == 90 && known.buckets[8] == 10 &&
+                           known.avg_us == 390 && known.max_us == 3000);
+    check("known percentiles", toioStatsPercentile(known, 50) == 128 && toioStatsPercentile(known, 90) == 128 &&
+                               toioStatsPercentile(known, 99) == 3000);
+  }
+
+  for (ToioCore* toiocore : toiocore_list) {
+    toiocore->disconnect();
+  }
+  delay(10);
+  return checkResult();
+}
@@ -0,0 +1,119 @@
+/* ----------------------------------------------------------------
+  Arduino.h (M5StackToio シミュレータ用)
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  Linux 上で M5StackToio をビルドするために、ライブラリが利用する
+  Arduino (ESP32) の API のうち必要最小限だけを実装したもの。
+  -------------------------------------------------------------- */
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+using std::abs;
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t msec);
+void delayMicroseconds(uint32_t usec);
+void yield();
+long random(long max);
+long random(long min, long max);
+
+// ---------------------------------------------------------------
+// String クラス (Arduino の String の一部のみ)
+// ---------------------------------------------------------------
+class String {
+  private:
+    std::string _str;
+
+  public:
+    String() {}
+    String(const char* str) : _str(str ? str : "") {}
+    String(const std::string& str) : _str(str) {}
+    String(char c) : _str(1, c) {}
+    String(int value) : _str(std::to_string(value)) {}
+    String(unsigned int value) : _str(std::to_string(value)) {}
+    String(long value) : _str(std::to_string(value)) {}
+    String(unsigned long value) : _str(std::to_string(value)) {}
+    String(float value, unsigned int decimals = 2);
+    String(double value, unsigned int decimals = 2);
+
+    const char* c_str() const { return this->_str.c_str(); }
+    unsigned int length() const { return this->_str.size(); }
+
+    String& operator+=(const String& rhs) { this->_str += rhs._str; return *this; }
+    friend String operator+(const String& lhs, const String& rhs) { String s(lhs); s += rhs; return s; }
+    friend String operator+(const String& lhs, const char* rhs) { String s(lhs); s += String(rhs); return s; }
+    friend String operator+(const char* lhs, const String& rhs) { String s(lhs); s += rhs; return s; }
+    bool operator==(const String& rhs) const { return this->_str == rhs._str; }
+    bool operator!=(const String& rhs) const { return this->_str != rhs._str; }
+};
+
+// ---------------------------------------------------------------
+// Print クラス
+// ---------------------------------------------------------------
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    size_t write(const char* str) { return this->write((const uint8_t*)str, strlen(str)); }
+
+    size_t print(const String& s) { return this->write(s.c_str()); }
+    size_t print(const char* s) { return this->write(s); }
+    size_t print(char c) { return this->write((uint8_t)c); }
+    size_t print(int n) { return this->print(String(n)); }
+    size_t print(unsigned int n) { return this->print(String(n)); }
+    size_t print(long n) { return this->print(String(n)); }
+    size_t print(unsigned long n) { return this->print(String(n)); }
+    size_t print(double n, int digits = 2) { return this->print(String(n, digits)); }
+    size_t println() { return this->write("\n"); }
+    template <typename T>
+    size_t println(const T& value) { size_t n = this->print(value); return n + this->println(); }
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+// ---------------------------------------------------------------
+// Stream クラス
+// ---------------------------------------------------------------
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual size_t readBytes(uint8_t* buffer, size_t length);
+};
+
+// ---------------------------------------------------------------
+// シリアル (標準出力に書き出す)
+// ---------------------------------------------------------------
+class HardwareSerial : public Stream {
+  public:
+    void begin(unsigned long baud) {}
+    size_t write(uint8_t c);
+    size_t write(const uint8_t* buffer, size_t size);
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,10 @@
+/* ----------------------------------------------------------------
+  BLEScan.h (M5StackToio シミュレータ用)
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include "ToioSimBle.h"
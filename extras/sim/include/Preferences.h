@@ -0,0 +1,40 @@
+/* ----------------------------------------------------------------
+  Preferences.h (M5StackToio シミュレータ用)
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  ESP32 の Preferences (NVS) のうちバイト列の読み書きだけを実装した
+  もの。データはプロセス内のメモリに保持する (プロセスを終了すると
+  消える)。
+  -------------------------------------------------------------- */
+#ifndef Preferences_h
+#define Preferences_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+class Preferences {
+  private:
+    std::string _namespace;
+    bool _started;
+    bool _read_only;
+
+  public:
+    Preferences() : _started(false), _read_only(false) {}
+    ~Preferences() { this->end(); }
+
+    bool begin(const char* name, bool readOnly = false);
+    void end();
+    bool clear();
+    bool remove(const char* key);
+    size_t putBytes(const char* key, const void* value, size_t len);
+    size_t getBytes(const char* key, void* buf, size_t maxLen);
+    size_t getBytesLength(const char* key);
+};
+
+#endif
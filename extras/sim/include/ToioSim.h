@@ -0,0 +1,313 @@
+/* ----------------------------------------------------------------
+  ToioSim.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  Linux 上で M5StackToio を動かすためのシミュレータ。仮想 toio コア
+  キューブ (ToioSimCube) は toio のサービス UUID をアドバタイズし、
+  ToioCore が参照する Characteristic を公開する。通知は BLE タスクに
+  相当するスレッドから、指定した間隔・遅延・ロス率で送信される。
+  -------------------------------------------------------------- */
+#ifndef ToioSim_h
+#define ToioSim_h
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include "ToioSimBle.h"
+
+// 仮想キューブの Characteristic
+enum ToioSimChar {
+  TOIO_SIM_CHAR_ID = 0,
+  TOIO_SIM_CHAR_MOTOR,
+  TOIO_SIM_CHAR_LIGHT,
+  TOIO_SIM_CHAR_SOUND,
+  TOIO_SIM_CHAR_MOTION,
+  TOIO_SIM_CHAR_BUTTON,
+  TOIO_SIM_CHAR_BATTERY,
+  TOIO_SIM_CHAR_CONF,
+  TOIO_SIM_CHAR_NUM
+};
+
+// BLE リンクの特性 (すべての仮想キューブに共通)
+struct ToioSimLinkConfig {
+  uint32_t connect_latency_ms;     // 接続完了までの時間
+  uint32_t discovery_latency_ms;   // サービス探索 1 回あたりの時間
+  uint32_t char_lookup_latency_ms; // Characteristic 探索 1 回あたりの時間
+  uint32_t write_latency_ms;       // レスポンスあり書き込み / 読み出しの往復時間
+  uint32_t notify_latency_ms;      // 通知が届くまでの時間
+  uint32_t jitter_ms;              // 上記の遅延に加わる揺らぎの最大値
+  float notify_loss_rate;          // 通知が失われる確率 (0.0 ～ 1.0)
+  float write_loss_rate;           // レスポンスなし書き込みが失われる確率 (0.0 ～ 1.0)
+  float connect_failure_rate;      // 接続に失敗する確率 (0.0 ～ 1.0)
+  float scan_time_scale;           // スキャン時間の倍率 (CI で時間を短縮するため)
+  uint32_t packets_per_event;      // 1 回の接続イベントで送れるパケット数 (方向ごと。接続間隔の要求後に使う)
+  uint32_t event_length_us;        // 1 回の接続イベントが無線を占める時間 (0 なら無線の共有を考えない)
+  uint8_t max_connections;         // セントラルが同時に接続できる数 (0 なら制限なし)
+  uint8_t max_connecting;          // セントラルが同時に確立できる接続の数 (0 なら制限なし。超えると接続に失敗)
+};
+
+// 接続パラメーター
+// (キューブが接続間隔を要求するまでは、上記のリンクの特性の遅延だけで動く。
+//  要求すると、書き込み・通知・往復時間は接続イベントの時刻に合わせられる)
+#define TOIO_SIM_DEFAULT_CONN_INTERVAL 24 // 要求がないときの接続間隔 (1.25 ミリ秒単位)
+#define TOIO_SIM_MAX_MTU 247              // 仮想キューブが受け入れる MTU の最大値
+#define TOIO_SIM_NOTIFY_BACKLOG_EVENTS 4  // 通知を先送りできる接続イベントの数 (超えたらロス)
+
+// マットと車体の寸法 (マットの座標単位)
+#define TOIO_SIM_MAT_MIN     45
+#define TOIO_SIM_MAT_MAX     455
+#define TOIO_SIM_WHEEL_TRACK 19.0 // 左右の車輪の間隔
+#define TOIO_SIM_SPEED_SCALE 2.04 // 速度指示値 1 あたりの速さ (座標単位/秒)
+#define TOIO_SIM_SPEED_NOTIFY_INTERVAL 10 // モーターの速度情報の変化を確かめる間隔 (ミリ秒)
+
+// 目標指定付きモーター制御 (0x03 / 0x04) の 1 コマンド分
+struct ToioSimNavCommand {
+  uint8_t response;          // 応答の種類 (0x83 / 0x84)
+  uint8_t id;                // 制御識別値
+  uint32_t timeout_ms;       // タイムアウト (ミリ秒)
+  uint8_t move_type;         // 移動タイプ
+  int max_speed;             // 最大速度の指示値
+  std::vector<uint16_t> xs;  // 目標地点の X 座標
+  std::vector<uint16_t> ys;  // 目標地点の Y 座標
+  std::vector<uint16_t> angles; // 目標地点の角度 (上位 3 ビットが角度の意味)
+};
+
+// 姿勢角・磁気センサーの通知 (設定の 0x1d / 0x1b で有効になる)
+enum ToioSimSensor {
+  TOIO_SIM_SENSOR_POSTURE = 0,
+  TOIO_SIM_SENSOR_MAGNETIC,
+  TOIO_SIM_SENSOR_NUM
+};
+
+// MIDI 再生のつなぎ目の統計情報
+// (再生中に次の MIDI が書き込まれると、前の再生は途中で打ち切られる)
+struct ToioSimSoundStats {
+  uint32_t plays;          // MIDI の書き込み数
+  uint32_t gaps;           // 前の再生が終わってから次が書き込まれた回数
+  uint32_t gap_max_us;     // 音が途切れた時間の最大値 (マイクロ秒)
+  uint64_t gap_total_us;   // 音が途切れた時間の合計 (マイクロ秒)
+  uint32_t cuts;           // 前の再生が終わる前に次が書き込まれた回数
+  uint32_t cut_max_us;     // 打ち切られた時間の最大値 (マイクロ秒)
+  uint64_t cut_total_us;   // 打ち切られた時間の合計 (マイクロ秒)
+};
+
+// 仮想キューブの統計情報
+struct ToioSimCubeStats {
+  uint32_t notified[TOIO_SIM_CHAR_NUM]; // 送信した通知数
+  uint32_t lost[TOIO_SIM_CHAR_NUM];     // ロスした通知数 (レスポンスなし書き込みのロスを含む)
+  uint32_t written[TOIO_SIM_CHAR_NUM];  // 受信した書き込み数
+  uint32_t read[TOIO_SIM_CHAR_NUM];     // 受信した読み出し数
+  uint32_t connections;                 // 接続回数
+};
+
+// ---------------------------------------------------------------
+// ToioSimCube クラス (仮想 toio コア キューブ)
+// ---------------------------------------------------------------
+class ToioSimCube {
+  private:
+    std::string _address;
+    std::string _name;
+    int _rssi;
+    bool _powered;
+    BLEClient* _client;
+
+    // Characteristic の値と通知の購読状態
+    std::vector<uint8_t> _values[TOIO_SIM_CHAR_NUM];
+    std::vector<uint8_t> _last_write[TOIO_SIM_CHAR_NUM];
+    unsigned long _last_write_at[TOIO_SIM_CHAR_NUM];
+    uint32_t _notify_interval[TOIO_SIM_CHAR_NUM];
+    unsigned long _notify_next[TOIO_SIM_CHAR_NUM];
+
+    ToioSimCubeStats _stats;
+    std::string _ble_version;
+
+    // 姿勢角・磁気センサー
+    double _posture[3];           // ロール、ピッチ、ヨー (度)
+    uint8_t _magnet[5];           // 磁石の状態、磁力の強さ、X、Y、Z
+    uint8_t _sensor_mode[TOIO_SIM_SENSOR_NUM];        // 姿勢角の形式 / 磁気センサーの機能 (0 なら無効)
+    uint32_t _sensor_interval[TOIO_SIM_SENSOR_NUM];   // 通知の間隔 (ミリ秒)
+    bool _sensor_on_change[TOIO_SIM_SENSOR_NUM];      // 値が変化したときだけ通知する
+    unsigned long _sensor_next[TOIO_SIM_SENSOR_NUM];
+    std::vector<uint8_t> _sensor_sent[TOIO_SIM_SENSOR_NUM];
+
+    // モーターの速度情報 (設定の 0x1c で有効になり、速度が変わると通知する)
+    bool _speed_notify;
+    unsigned long _speed_next;    // 次に速度を確かめる時刻 (ミリ秒)
+    uint8_t _speed_sent[2];       // 最後に通知した左右の速度
+
+    // 接続パラメーター (接続間隔は 1.25 ミリ秒単位。要求がなければ 0xffff)
+    uint16_t _conn_request[2];    // 要求された接続間隔の最小値・最大値
+    uint16_t _conn_interval;      // 現在の接続間隔
+    bool _conn_requested;         // 接続間隔が要求され、接続イベントに合わせて動いている
+    unsigned long _conn_anchor;   // 接続イベントの基準時刻 (マイクロ秒)
+    uint32_t _tx_event;           // 最後にセントラルからの書き込みを載せた接続イベント
+    uint32_t _tx_count;           // その接続イベントに載せた書き込みの数
+    uint32_t _rx_event;           // 最後に通知を載せた接続イベント
+    uint32_t _rx_count;           // その接続イベントに載せた通知の数
+    uint32_t _radio_slot;         // 無線を共有するときに使える接続イベントを決める番号
+
+    // MIDI の再生 (音が鳴り終わる時刻。0 なら再生していない)
+    unsigned long _sound_end;
+    ToioSimSoundStats _sound_stats;
+
+    // マット上の位置とモーターの状態 (ID 情報の通知に使う)
+    double _pose_x;
+    double _pose_y;
+    double _pose_angle;
+    bool _on_mat;
+    int _motor_left;              // 左モーターの速度指示値 (後退は負)
+    int _motor_right;             // 右モーターの速度指示値 (後退は負)
+    unsigned long _motor_until;   // モーターを止める時刻 (ミリ秒, 0 なら時間指定なし)
+    unsigned long _pose_updated;  // 最後に位置を計算した時刻 (マイクロ秒)
+    bool _stalled;                // 車輪が何かに当たって回らない
+
+    // 目標指定付きモーター制御 (先頭が実行中のコマンド)
+    std::deque<ToioSimNavCommand> _nav;
+    size_t _nav_index;            // 実行中のコマンドで向かっている目標地点
+    unsigned long _nav_started;   // 実行中のコマンドを開始した時刻 (ミリ秒)
+    double _nav_write_angle;      // 実行中のコマンドを開始したときの角度
+    bool _nav_rotating;           // 目標地点に着き、角度を合わせている
+    double _nav_goal_angle;       // 合わせる角度
+    int _nav_rotate_dir;          // 回転方向 (0: 近い方, 1: 正, -1: 負)
+
+    friend class ToioSim;
+    friend class BLEScan;
+    friend class BLEClient;
+    friend class BLERemoteService;
+    friend class BLERemoteCharacteristic;
+
+    void _onWrite(ToioSimChar ch, const uint8_t* data, size_t length);
+    void _notify(ToioSimChar ch);
+    void _step(unsigned long now_us);
+    void _startNav(const ToioSimNavCommand& command, bool overwrite);
+    void _cancelNav(uint8_t result);
+    void _finishNav(uint8_t result);
+    void _steerNav();
+    void _stopMotor();
+    void _updateIdValue();
+    std::vector<uint8_t> _sensorValue(ToioSimSensor sensor);
+    void _notifySensors(unsigned long now_ms);
+    void _notifySpeed(unsigned long now_ms);
+    void _onSoundWrite(const uint8_t* data, size_t length);
+    void _onConnParamWrite(const uint8_t* data, size_t length);
+    uint32_t _connEvent(unsigned long now_us);
+    unsigned long _connEventTime(uint32_t event);
+    uint32_t _radioShare();
+    uint32_t _usableEvent(uint32_t event, uint32_t share);
+    uint32_t _reserveWrite(bool response, unsigned long now_us);
+    bool _scheduleNotify(unsigned long now_us, unsigned long& at);
+
+  public:
+    ToioSimCube(const std::string& address, const std::string& name);
+
+    std::string getAddress();
+    std::string getName();
+
+    // 電源 ON/OFF (OFF にすると接続が切れ、アドバタイズも止まる)
+    void powerOn();
+    void powerOff();
+    bool isPowered();
+
+    // 電源は入れたまま接続だけを切る (電波が途切れた場合など。アドバタイズは続ける)
+    void dropConnection();
+    bool isConnected();
+
+    // 受信電波強度 (スキャン結果に反映される)
+    void setRssi(int rssi);
+
+    // 定期的な通知の間隔を設定 (0 なら定期的には通知しない)
+    // (ID 情報は位置が変化したときだけ、この間隔以上空けて通知する)
+    void setNotifyInterval(ToioSimChar ch, uint32_t msec);
+
+    // 状態を変更し、購読されていれば即座に通知する
+    void setBatteryLevel(uint8_t level);
+    void setButtonState(bool pressed);
+    void setMotion(bool flat, bool clash, bool dtap, uint8_t attitude, uint8_t shake = 0);
+
+    // 姿勢角 (度) と磁気センサーの値。通知は設定の書き込みで有効にされた
+    // 形式・間隔・条件で送られる
+    void setPosture(double roll, double pitch, double yaw);
+    void setMagnet(uint8_t state, uint8_t strength, int8_t x, int8_t y, int8_t z);
+
+    // マット上の位置 (マットの座標と角度)。モーターの書き込みに応じて
+    // 位置が変わり、変化すると ID 情報 (Position ID) を通知する
+    void setPose(double x, double y, double angle);
+    void getPose(double& x, double& y, double& angle);
+
+    // マットに置く / マットから持ち上げる (持ち上げると Position ID missed を通知)
+    void setOnMat(bool on_mat);
+
+    // 車輪を止める / 放す (止めている間はモーターに指示しても動かず、速度情報は 0 になる)
+    void setStalled(bool stalled);
+
+    // Standard ID を読み取らせる
+    void setStandardId(uint32_t id, uint16_t angle);
+
+    // BLE プロトコルバージョン
+    void setBleProtocolVersion(const std::string& version);
+
+    // 最後に書き込まれたデータ
+    std::vector<uint8_t> getLastWrite(ToioSimChar ch);
+
+    // 最後に書き込まれた時刻 (マイクロ秒)
+    unsigned long getLastWriteTime(ToioSimChar ch);
+
+    // 統計情報
+    ToioSimCubeStats getStats();
+
+    // MIDI 再生のつなぎ目の統計情報
+    ToioSimSoundStats getSoundStats();
+
+    // 現在の接続間隔 (1.25 ミリ秒単位)
+    uint16_t getConnectionInterval();
+};
+
+// ---------------------------------------------------------------
+// ToioSim クラス (仮想キューブの集合と BLE タスクの代わりのスレッド)
+// ---------------------------------------------------------------
+class ToioSim {
+  public:
+    // toio の Characteristic の UUID
+    static const char* SERVICE_UUID;
+    static const char* CHAR_UUIDS[TOIO_SIM_CHAR_NUM];
+
+    // 仮想キューブを追加 (address が空なら自動採番)
+    static ToioSimCube* addCube(const std::string& address = "", const std::string& name = "toio Core Cube");
+
+    // 仮想キューブを n 個まとめて追加
+    static std::vector<ToioSimCube*> addCubes(size_t n);
+
+    // 追加済みの仮想キューブ
+    static std::vector<ToioSimCube*> getCubes();
+
+    // リンクの特性
+    static void setLinkConfig(const ToioSimLinkConfig& config);
+    static ToioSimLinkConfig getLinkConfig();
+
+    // max_connections / max_connecting を超えたために失敗させた接続の数
+    static uint32_t getRejectedConnects();
+
+    // 以下はシミュレータ内部から呼ばれる
+    static void _lock();
+    static void _unlock();
+    static void _start();
+    static void _task();
+    static ToioSimCube* _findCube(const std::string& address);
+    static bool _chance(float rate);
+    static uint32_t _latency(uint32_t base);
+    static void _sleep(uint32_t msec);
+    static ToioSimChar _charFromUuid(const std::string& uuid);
+    static void _queueNotify(BLEClient* client, ToioSimChar ch, const std::vector<uint8_t>& data);
+    static void _queueDisconnect(BLEClient* client);
+    static void _startScan(BLEScan* scan, uint32_t duration, void (*cb)(BLEScanResults));
+    static void _stopScan(BLEScan* scan);
+    static std::vector<BLEAdvertisedDevice> _advertisingDevices();
+};
+
+#endif
@@ -0,0 +1,260 @@
+/* ----------------------------------------------------------------
+  ToioSimBle.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  ESP32 の BLE ライブラリ (BLEDevice, BLEClient, BLERemoteCharacteristic
+  など) のうち M5StackToio が利用する API を、シミュレータ (ToioSim) 上の
+  仮想 toio コア キューブに対して実装したもの。ライブラリ側のソースは
+  変更せずに、インクルードパスを切り替えるだけで Linux 上でビルドできる。
+  -------------------------------------------------------------- */
+#ifndef ToioSimBle_h
+#define ToioSimBle_h
+
+#include <Arduino.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <functional>
+
+class BLEClient;
+class BLERemoteService;
+class BLERemoteCharacteristic;
+class ToioSimCube;
+class ToioSim;
+
+// ---------------------------------------------------------------
+// BLEAddress クラス
+// ---------------------------------------------------------------
+class BLEAddress {
+  private:
+    std::string _str;
+
+  public:
+    BLEAddress(std::string str) : _str(str) {}
+    std::string toString() const { return this->_str; }
+    bool equals(const BLEAddress& other) const { return this->_str == other._str; }
+};
+
+// ---------------------------------------------------------------
+// BLEUUID クラス
+// ---------------------------------------------------------------
+class BLEUUID {
+  private:
+    std::string _str;
+
+  public:
+    BLEUUID() {}
+    BLEUUID(const char* str) : _str(str) {}
+    BLEUUID(std::string str) : _str(str) {}
+    std::string toString() const { return this->_str; }
+    bool equals(const BLEUUID& other) const { return this->_str == other._str; }
+};
+
+// ---------------------------------------------------------------
+// BLEAdvertisedDevice クラス
+// ---------------------------------------------------------------
+class BLEAdvertisedDevice {
+  private:
+    std::string _address;
+    std::string _name;
+    std::string _service_uuid;
+    int _rssi;
+
+    friend class ToioSim;
+    friend class ToioSimCube;
+    friend class BLEScan;
+    friend class BLEClient;
+    friend class BLERemoteService;
+    friend class BLERemoteCharacteristic;
+
+  public:
+    BLEAdvertisedDevice() : _rssi(0) {}
+    BLEAddress getAddress() { return BLEAddress(this->_address); }
+    std::string getName() { return this->_name; }
+    int getRSSI() { return this->_rssi; }
+    bool haveName() { return !this->_name.empty(); }
+    bool haveRSSI() { return true; }
+    bool haveServiceUUID() { return !this->_service_uuid.empty(); }
+    BLEUUID getServiceUUID() { return BLEUUID(this->_service_uuid); }
+    bool isAdvertisingService(BLEUUID uuid) { return uuid.toString() == this->_service_uuid; }
+    std::string toString() { return this->_name + " (" + this->_address + ")"; }
+};
+
+class BLEAdvertisedDeviceCallbacks {
+  public:
+    virtual ~BLEAdvertisedDeviceCallbacks() {}
+    virtual void onResult(BLEAdvertisedDevice advertisedDevice) = 0;
+};
+
+// ---------------------------------------------------------------
+// BLEScanResults クラス
+// ---------------------------------------------------------------
+class BLEScanResults {
+  private:
+    std::vector<BLEAdvertisedDevice> _devices;
+
+    friend class ToioSim;
+    friend class ToioSimCube;
+    friend class BLEScan;
+    friend class BLEClient;
+    friend class BLERemoteService;
+    friend class BLERemoteCharacteristic;
+
+  public:
+    int getCount() { return this->_devices.size(); }
+    BLEAdvertisedDevice getDevice(uint32_t i) { return this->_devices.at(i); }
+};
+
+// ---------------------------------------------------------------
+// BLEScan クラス
+// ---------------------------------------------------------------
+class BLEScan {
+  private:
+    BLEScanResults _results;
+    BLEAdvertisedDeviceCallbacks* _callbacks;
+    bool _want_duplicates;
+    unsigned long _interval;
+    unsigned long _window;
+
+    friend class ToioSim;
+    friend class ToioSimCube;
+    friend class BLEClient;
+    friend class BLERemoteService;
+    friend class BLERemoteCharacteristic;
+    void _onAdvertisement(BLEAdvertisedDevice& device);
+
+  public:
+    BLEScan() : _callbacks(nullptr), _want_duplicates(false), _interval(100), _window(100) {}
+    void setActiveScan(bool active) { (void)active; }
+    void setInterval(uint16_t msec) { this->_interval = msec; }
+    void setWindow(uint16_t msec) { this->_window = msec; }
+    void setAdvertisedDeviceCallbacks(BLEAdvertisedDeviceCallbacks* callbacks, bool wantDuplicates = false);
+    BLEScanResults start(uint32_t duration, bool is_continue = false);
+    bool start(uint32_t duration, void (*scanCompleteCB)(BLEScanResults), bool is_continue = false);
+    void stop();
+    void clearResults();
+};
+
+// ---------------------------------------------------------------
+// BLEClientCallbacks クラス
+// ---------------------------------------------------------------
+class BLEClientCallbacks {
+  public:
+    virtual ~BLEClientCallbacks() {}
+    virtual void onConnect(BLEClient* client) = 0;
+    virtual void onDisconnect(BLEClient* client) = 0;
+};
+
+// ---------------------------------------------------------------
+// BLERemoteCharacteristic クラス
+// ---------------------------------------------------------------
+typedef std::function<void(BLERemoteCharacteristic* rchar, uint8_t* data, size_t length, bool is_notify)> notify_callback;
+
+class BLERemoteCharacteristic {
+  private:
+    BLERemoteService* _service;
+    std::string _uuid;
+    uint16_t _handle;
+    notify_callback _notify;
+
+    friend class ToioSim;
+    friend class ToioSimCube;
+    friend class BLEScan;
+    friend class BLEClient;
+    friend class BLERemoteService;
+    BLERemoteCharacteristic(BLERemoteService* service, std::string uuid, uint16_t handle);
+
+  public:
+    BLEUUID getUUID() { return BLEUUID(this->_uuid); }
+    uint16_t getHandle() { return this->_handle; }
+    BLERemoteService* getRemoteService() { return this->_service; }
+    bool canNotify() { return true; }
+    bool canWriteNoResponse() { return true; }
+
+    void writeValue(uint8_t* data, size_t length, bool response = false);
+    void writeValue(std::string value, bool response = false);
+    void writeValue(uint8_t value, bool response = false);
+    std::string readValue();
+    uint8_t readUInt8();
+    void registerForNotify(notify_callback callback, bool notifications = true);
+};
+
+// ---------------------------------------------------------------
+// BLERemoteService クラス
+// ---------------------------------------------------------------
+class BLERemoteService {
+  private:
+    BLEClient* _client;
+    std::string _uuid;
+    std::map<std::string, BLERemoteCharacteristic*> _chars;
+    std::map<uint16_t, BLERemoteCharacteristic*> _chars_by_handle;
+    bool _chars_retrieved;
+
+    friend class ToioSim;
+    friend class ToioSimCube;
+    friend class BLEScan;
+    friend class BLEClient;
+    friend class BLERemoteCharacteristic;
+    BLERemoteService(BLEClient* client, std::string uuid);
+
+  public:
+    ~BLERemoteService();
+    BLEUUID getUUID() { return BLEUUID(this->_uuid); }
+    BLEClient* getClient() { return this->_client; }
+    BLERemoteCharacteristic* getCharacteristic(const char* uuid);
+    BLERemoteCharacteristic* getCharacteristic(BLEUUID uuid);
+    std::map<uint16_t, BLERemoteCharacteristic*>* getCharacteristicsByHandle();
+};
+
+// ---------------------------------------------------------------
+// BLEClient クラス
+// ---------------------------------------------------------------
+class BLEClient {
+  private:
+    BLEClientCallbacks* _callbacks;
+    ToioSimCube* _cube;
+    bool _connected;
+    uint16_t _mtu;
+    std::map<std::string, BLERemoteService*> _services;
+
+    friend class ToioSim;
+    friend class ToioSimCube;
+    friend class BLEScan;
+    friend class BLERemoteService;
+    friend class BLERemoteCharacteristic;
+    void _clearServices();
+
+  public:
+    BLEClient();
+    ~BLEClient();
+    bool connect(BLEAdvertisedDevice* device);
+    bool connect(BLEAddress address);
+    void disconnect();
+    bool isConnected();
+    BLEAddress getPeerAddress();
+    int getRssi();
+    uint16_t getMTU() { return this->_mtu; }
+    int setMTU(uint16_t mtu);
+    void setClientCallbacks(BLEClientCallbacks* callbacks) { this->_callbacks = callbacks; }
+    BLERemoteService* getService(const char* uuid);
+    BLERemoteService* getService(BLEUUID uuid);
+};
+
+// ---------------------------------------------------------------
+// BLEDevice クラス
+// ---------------------------------------------------------------
+class BLEDevice {
+  public:
+    static void init(std::string deviceName);
+    static void deinit(bool release_memory = false);
+    static bool getInitialized();
+    static BLEScan* getScan();
+    static BLEClient* createClient();
+};
+
+#endif
@@ -0,0 +1,61 @@
+/* ----------------------------------------------------------------
+  ToioSimCheck.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  シミュレータの examples で共通に使う確認の仕組み。check() で確かめた
+  結果を数え、最後に checkResult() で件数と結果 (ok / NG) を表示する。
+  Toio.h の後にインクルードすると、loop() を回しながら待つ run() も使える。
+  -------------------------------------------------------------- */
+#ifndef ToioSimCheck_h
+#define ToioSimCheck_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+// 確かめた数と、そのうち失敗した数
+struct ToioSimCheckCounts {
+  uint32_t checked;
+  uint32_t failed;
+};
+
+inline ToioSimCheckCounts& toioSimCheckCounts() {
+  static ToioSimCheckCounts counts = {0, 0};
+  return counts;
+}
+
+// 確かめた結果を数える (失敗したら名前を表示する)
+inline void check(const char* name, bool ok) {
+  ToioSimCheckCounts& counts = toioSimCheckCounts();
+  counts.checked++;
+  if (!ok) {
+    counts.failed++;
+    printf("NG %s\n", name);
+  }
+}
+
+// 件数と結果を表示し、main() の戻り値 (すべて成功なら 0) を返す
+inline int checkResult() {
+  ToioSimCheckCounts& counts = toioSimCheckCounts();
+  printf("checked : %u, failed %u\n", counts.checked, counts.failed);
+  bool ok = counts.failed == 0;
+  printf(ok ? "result : ok\n" : "result : NG\n");
+  return ok ? 0 : 1;
+}
+
+#ifdef Toio_h
+// loop() を回しながら待つ
+inline void run(Toio& toio, uint32_t msec) {
+  unsigned long start = millis();
+  while (millis() - start < msec) {
+    toio.loop();
+    delay(1);
+  }
+}
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+/* ----------------------------------------------------------------
+  freertos/FreeRTOS.h (M5StackToio シミュレータ用)
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+
+  ESP32 の FreeRTOS のうち M5StackToio が利用する API だけを、
+  std::thread などを使って実装したもの。1 tick は 1 ミリ秒。
+  -------------------------------------------------------------- */
+#ifndef FreeRTOS_h
+#define FreeRTOS_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL 0
+#define pdPASS 1
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define tskNO_AFFINITY 0x7fffffff
+
+// ESP32 のクリティカルセクション (portMUX)
+// (実機では割り込みを止めて他のコアとはスピンロックで排他する。シミュレータでは
+//  タスクはすべてスレッドなので、再帰可能なミューテックスで代用する)
+struct portMUX_TYPE {
+  std::recursive_mutex mutex;
+};
+#define portMUX_INITIALIZER_UNLOCKED {}
+#define portENTER_CRITICAL(mux) ((mux)->mutex.lock())
+#define portEXIT_CRITICAL(mux) ((mux)->mutex.unlock())
+
+#endif
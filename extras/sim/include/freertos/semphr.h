@@ -0,0 +1,24 @@
+/* ----------------------------------------------------------------
+  freertos/semphr.h (M5StackToio シミュレータ用)
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef FreeRTOS_semphr_h
+#define FreeRTOS_semphr_h
+
+#include "FreeRTOS.h"
+
+struct ToioSimSemaphore;
+typedef ToioSimSemaphore* SemaphoreHandle_t;
+
+// ミューテックスのみ対応 (優先度継承はない。シミュレータのタスクはすべてスレッドなので不要)
+SemaphoreHandle_t xSemaphoreCreateMutex();
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+
+#endif
@@ -0,0 +1,1531 @@
+/* ----------------------------------------------------------------
+  ToioSim.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include "ToioSim.h"
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <set>
+#include <deque>
+#include <chrono>
+
+// ===============================================================
+// シミュレータの内部状態
+// ===============================================================
+
+// 未処理の通知・切断イベント
+struct ToioSimDelivery {
+  unsigned long at;      // 配送する時刻 (マイクロ秒)
+  BLEClient* client;
+  bool disconnect;       // true なら切断イベント
+  ToioSimChar ch;
+  std::vector<uint8_t> data;
+};
+
+// 実行中の非同期スキャン
+struct ToioSimScanSession {
+  BLEScan* scan;
+  unsigned long end;     // 終了時刻 (ミリ秒, 0 なら無期限)
+  unsigned long next;    // 次にアドバタイズを受信する時刻 (ミリ秒)
+  void (*cb)(BLEScanResults);
+  std::set<std::string> seen;
+};
+
+static std::recursive_mutex g_sim_mutex;
+static std::vector<ToioSimCube*> g_sim_cubes;
+static std::deque<ToioSimDelivery> g_sim_deliveries;
+static std::vector<ToioSimScanSession> g_sim_scans;
+static std::mt19937 g_sim_random(0x70106);
+static std::thread g_sim_thread;
+static std::atomic<bool> g_sim_running(false);
+static uint32_t g_sim_next_address = 1;
+static std::atomic<uint32_t> g_sim_connecting(0);
+static std::atomic<uint32_t> g_sim_connect_rejected(0);
+
+static ToioSimLinkConfig g_sim_link = {
+  300,   // connect_latency_ms
+  60,    // discovery_latency_ms
+  15,    // char_lookup_latency_ms
+  30,    // write_latency_ms
+  8,     // notify_latency_ms
+  4,     // jitter_ms
+  0.0f,  // notify_loss_rate
+  0.0f,  // write_loss_rate
+  0.0f,  // connect_failure_rate
+  1.0f,  // scan_time_scale
+  4,     // packets_per_event
+  0,     // event_length_us
+  0,     // max_connections
+  0      // max_connecting
+};
+
+const char* ToioSim::SERVICE_UUID = "10b20100-5b3b-4571-9508-cf3efcd7bbae";
+const char* ToioSim::CHAR_UUIDS[TOIO_SIM_CHAR_NUM] = {
+  "10b20101-5b3b-4571-9508-cf3efcd7bbae", // ID
+  "10b20102-5b3b-4571-9508-cf3efcd7bbae", // Motor
+  "10b20103-5b3b-4571-9508-cf3efcd7bbae", // Light
+  "10b20104-5b3b-4571-9508-cf3efcd7bbae", // Sound
+  "10b20106-5b3b-4571-9508-cf3efcd7bbae", // Motion
+  "10b20107-5b3b-4571-9508-cf3efcd7bbae", // Button
+  "10b20108-5b3b-4571-9508-cf3efcd7bbae", // Battery
+  "10b201ff-5b3b-4571-9508-cf3efcd7bbae"  // Configuration
+};
+
+// ===============================================================
+// ToioSimCube クラス
+// ===============================================================
+
+ToioSimCube::ToioSimCube(const std::string& address, const std::string& name) {
+  this->_address = address;
+  this->_name = name;
+  this->_rssi = -60;
+  this->_powered = true;
+  this->_client = nullptr;
+  this->_ble_version = "2.4.0";
+  memset(&this->_stats, 0, sizeof(this->_stats));
+  for (int i = 0; i < TOIO_SIM_CHAR_NUM; i++) {
+    this->_notify_interval[i] = 0;
+    this->_notify_next[i] = 0;
+    this->_last_write_at[i] = 0;
+  }
+  this->_values[TOIO_SIM_CHAR_BATTERY] = {100};
+  this->_values[TOIO_SIM_CHAR_BUTTON] = {0x01, 0x00};
+  this->_values[TOIO_SIM_CHAR_MOTION] = {0x01, 0x01, 0x00, 0x00, 0x01, 0x00};
+  this->_conn_request[0] = 0xffff;
+  this->_conn_request[1] = 0xffff;
+  this->_conn_interval = TOIO_SIM_DEFAULT_CONN_INTERVAL;
+  this->_conn_requested = false;
+  this->_conn_anchor = 0;
+  this->_tx_event = 0;
+  this->_tx_count = 0;
+  this->_rx_event = 0;
+  this->_rx_count = 0;
+  this->_radio_slot = 0;
+  this->_sound_end = 0;
+  memset(&this->_sound_stats, 0, sizeof(this->_sound_stats));
+  memset(this->_posture, 0, sizeof(this->_posture));
+  memset(this->_magnet, 0, sizeof(this->_magnet));
+  for (int i = 0; i < TOIO_SIM_SENSOR_NUM; i++) {
+    this->_sensor_mode[i] = 0;
+    this->_sensor_interval[i] = 0;
+    this->_sensor_on_change[i] = false;
+    this->_sensor_next[i] = 0;
+  }
+  this->_speed_notify = false;
+  this->_speed_next = 0;
+  memset(this->_speed_sent, 0, sizeof(this->_speed_sent));
+  this->_notify_interval[TOIO_SIM_CHAR_ID] = 10;
+  this->_pose_x = (TOIO_SIM_MAT_MIN + TOIO_SIM_MAT_MAX) / 2;
+  this->_pose_y = (TOIO_SIM_MAT_MIN + TOIO_SIM_MAT_MAX) / 2;
+  this->_pose_angle = 0;
+  this->_on_mat = true;
+  this->_motor_left = 0;
+  this->_motor_right = 0;
+  this->_motor_until = 0;
+  this->_pose_updated = micros();
+  this->_stalled = false;
+  this->_nav_index = 0;
+  this->_nav_started = 0;
+  this->_nav_write_angle = 0;
+  this->_nav_rotating = false;
+  this->_nav_goal_angle = 0;
+  this->_nav_rotate_dir = 0;
+  this->_updateIdValue();
+}
+
+std::string ToioSimCube::getAddress() {
+  return this->_address;
+}
+
+std::string ToioSimCube::getName() {
+  return this->_name;
+}
+
+void ToioSimCube::powerOn() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_powered = true;
+}
+
+void ToioSimCube::powerOff() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_powered = false;
+  this->_stopMotor();
+  if (this->_client) {
+    BLEClient* client = this->_client;
+    client->_connected = false;
+    this->_client = nullptr;
+    ToioSim::_queueDisconnect(client);
+  }
+}
+
+void ToioSimCube::dropConnection() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_stopMotor();
+  if (this->_client) {
+    BLEClient* client = this->_client;
+    client->_connected = false;
+    this->_client = nullptr;
+    ToioSim::_queueDisconnect(client);
+  }
+}
+
+bool ToioSimCube::isPowered() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return this->_powered;
+}
+
+bool ToioSimCube::isConnected() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return this->_client != nullptr;
+}
+
+void ToioSimCube::setRssi(int rssi) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_rssi = rssi;
+}
+
+void ToioSimCube::setNotifyInterval(ToioSimChar ch, uint32_t msec) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_notify_interval[ch] = msec;
+  this->_notify_next[ch] = millis() + msec;
+}
+
+void ToioSimCube::setBatteryLevel(uint8_t level) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_values[TOIO_SIM_CHAR_BATTERY] = {level};
+  this->_notify(TOIO_SIM_CHAR_BATTERY);
+}
+
+void ToioSimCube::setButtonState(bool pressed) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_values[TOIO_SIM_CHAR_BUTTON] = {0x01, (uint8_t)(pressed ? 0x80 : 0x00)};
+  this->_notify(TOIO_SIM_CHAR_BUTTON);
+}
+
+void ToioSimCube::setMotion(bool flat, bool clash, bool dtap, uint8_t attitude, uint8_t shake) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_values[TOIO_SIM_CHAR_MOTION] = {0x01, flat, clash, dtap, attitude, shake};
+  this->_notify(TOIO_SIM_CHAR_MOTION);
+}
+
+void ToioSimCube::setPosture(double roll, double pitch, double yaw) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_posture[0] = roll;
+  this->_posture[1] = pitch;
+  this->_posture[2] = yaw;
+}
+
+void ToioSimCube::setMagnet(uint8_t state, uint8_t strength, int8_t x, int8_t y, int8_t z) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_magnet[0] = state;
+  this->_magnet[1] = strength;
+  this->_magnet[2] = (uint8_t)x;
+  this->_magnet[3] = (uint8_t)y;
+  this->_magnet[4] = (uint8_t)z;
+}
+
+void ToioSimCube::setPose(double x, double y, double angle) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_pose_x = x;
+  this->_pose_y = y;
+  this->_pose_angle = fmod(fmod(angle, 360.0) + 360.0, 360.0);
+  this->_on_mat = true;
+  this->_updateIdValue();
+  this->_notify(TOIO_SIM_CHAR_ID);
+}
+
+void ToioSimCube::getPose(double& x, double& y, double& angle) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  x = this->_pose_x;
+  y = this->_pose_y;
+  angle = this->_pose_angle;
+}
+
+void ToioSimCube::setOnMat(bool on_mat) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  if (this->_on_mat == on_mat) {
+    return;
+  }
+  this->_on_mat = on_mat;
+  this->_updateIdValue();
+  this->_notify(TOIO_SIM_CHAR_ID);
+}
+
+void ToioSimCube::setStalled(bool stalled) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_step(micros());
+  this->_stalled = stalled;
+}
+
+void ToioSimCube::setStandardId(uint32_t id, uint16_t angle) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_on_mat = false;
+  this->_values[TOIO_SIM_CHAR_ID] = {
+    0x02,
+    (uint8_t)(id & 0xff), (uint8_t)((id >> 8) & 0xff), (uint8_t)((id >> 16) & 0xff), (uint8_t)((id >> 24) & 0xff),
+    (uint8_t)(angle & 0xff), (uint8_t)(angle >> 8)
+  };
+  this->_notify(TOIO_SIM_CHAR_ID);
+}
+
+void ToioSimCube::setBleProtocolVersion(const std::string& version) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_ble_version = version;
+}
+
+std::vector<uint8_t> ToioSimCube::getLastWrite(ToioSimChar ch) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return this->_last_write[ch];
+}
+
+unsigned long ToioSimCube::getLastWriteTime(ToioSimChar ch) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return this->_last_write_at[ch];
+}
+
+ToioSimCubeStats ToioSimCube::getStats() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return this->_stats;
+}
+
+ToioSimSoundStats ToioSimCube::getSoundStats() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return this->_sound_stats;
+}
+
+uint16_t ToioSimCube::getConnectionInterval() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return this->_conn_interval;
+}
+
+// 書き込みを受信 (ロック中に呼ばれる)
+void ToioSimCube::_onWrite(ToioSimChar ch, const uint8_t* data, size_t length) {
+  this->_stats.written[ch]++;
+  this->_last_write[ch].assign(data, data + length);
+  this->_last_write_at[ch] = micros();
+  if (ch == TOIO_SIM_CHAR_CONF && length >= 1) {
+    // BLE プロトコルバージョンの要求
+    if (data[0] == 0x01) {
+      std::vector<uint8_t> res = {0x81, 0x00};
+      res.insert(res.end(), this->_ble_version.begin(), this->_ble_version.end());
+      this->_values[TOIO_SIM_CHAR_CONF] = res;
+      this->_notify(TOIO_SIM_CHAR_CONF);
+    }
+    // 接続間隔の変更要求 (0x30) / 読み出し (0x31, 0x32)
+    if (data[0] >= 0x30 && data[0] <= 0x32) {
+      this->_onConnParamWrite(data, length);
+    }
+    // モーターの速度情報の取得の設定 (0x1c)
+    if (data[0] == 0x1c && length >= 3) {
+      bool valid = (data[2] <= 1);
+      if (valid) {
+        this->_speed_notify = (data[2] == 0x01);
+        this->_speed_next = millis();
+        memset(this->_speed_sent, 0, sizeof(this->_speed_sent));
+      }
+      this->_values[TOIO_SIM_CHAR_CONF] = {0x9c, 0x00, (uint8_t)(valid ? 0x00 : 0x01)};
+      this->_notify(TOIO_SIM_CHAR_CONF);
+    }
+    // 姿勢角 (0x1d) / 磁気センサー (0x1b) の設定
+    if ((data[0] == 0x1d || data[0] == 0x1b) && length >= 5) {
+      ToioSimSensor sensor = (data[0] == 0x1d) ? TOIO_SIM_SENSOR_POSTURE : TOIO_SIM_SENSOR_MAGNETIC;
+      bool valid = (sensor == TOIO_SIM_SENSOR_POSTURE) ? (data[2] >= 1 && data[2] <= 3) : (data[2] <= 2);
+      if (valid) {
+        this->_sensor_mode[sensor] = data[2];
+        this->_sensor_interval[sensor] = data[3] * ((sensor == TOIO_SIM_SENSOR_POSTURE) ? 10 : 20);
+        this->_sensor_on_change[sensor] = (data[4] == 0x01);
+        this->_sensor_next[sensor] = millis();
+        this->_sensor_sent[sensor].clear();
+      }
+      this->_values[TOIO_SIM_CHAR_CONF] = {(uint8_t)(data[0] | 0x80), 0x00, (uint8_t)(valid ? 0x00 : 0x01)};
+      this->_notify(TOIO_SIM_CHAR_CONF);
+    }
+  }
+  if (ch == TOIO_SIM_CHAR_SOUND) {
+    this->_onSoundWrite(data, length);
+  }
+  if (ch != TOIO_SIM_CHAR_MOTOR || length < 1) {
+    return;
+  }
+  this->_step(micros());
+  if (length >= 7 && (data[0] == 0x01 || data[0] == 0x02)) {
+    // モーター制御 (0x01) / 時間指定付きモーター制御 (0x02)
+    this->_cancelNav(0x05);
+    for (int i = 0; i < 2; i++) {
+      const uint8_t* m = data + 1 + i * 3;
+      int speed = (m[2] < 10) ? 0 : std::min<int>(m[2], 115);
+      if (m[1] == 0x02) {
+        speed = -speed;
+      }
+      if (m[0] == 0x01) {
+        this->_motor_left = speed;
+      } else if (m[0] == 0x02) {
+        this->_motor_right = speed;
+      }
+    }
+    this->_motor_until = 0;
+    if (data[0] == 0x02 && length >= 8 && data[7] > 0) {
+      this->_motor_until = millis() + data[7] * 10;
+    }
+  } else if ((data[0] == 0x03 && length >= 13) || (data[0] == 0x04 && length >= 14)) {
+    // 目標指定付きモーター制御 (0x03) / 複数目標指定付きモーター制御 (0x04)
+    ToioSimNavCommand command;
+    command.response = data[0] | 0x80;
+    command.id = data[1];
+    command.timeout_ms = (data[2] == 0 ? 10 : data[2]) * 1000;
+    command.move_type = data[3];
+    command.max_speed = std::min<int>(std::max<int>(data[4], 10), 115);
+    size_t offset = (data[0] == 0x03) ? 7 : 8;
+    for (; offset + 6 <= length; offset += 6) {
+      command.xs.push_back(data[offset] | (data[offset + 1] << 8));
+      command.ys.push_back(data[offset + 2] | (data[offset + 3] << 8));
+      command.angles.push_back(data[offset + 4] | (data[offset + 5] << 8));
+    }
+    bool overwrite = (data[0] == 0x03 || data[7] == 0x00);
+    this->_startNav(command, overwrite);
+  } else if (data[0] == 0x05 && length >= 9) {
+    // 加速度指定モーター制御 (0x05)
+    // (加速度は模擬せず、指定した速度にすぐ達するものとする)
+    this->_cancelNav(0x05);
+    double v = data[1] * ((data[6] == 0x01) ? -1 : 1);
+    double rotation = (data[3] | (data[4] << 8)) * ((data[5] == 0x01) ? -1 : 1);
+    double diff = rotation * M_PI / 180.0 * TOIO_SIM_WHEEL_TRACK / TOIO_SIM_SPEED_SCALE / 2.0;
+    this->_motor_left = (int)lround(v + diff);
+    this->_motor_right = (int)lround(v - diff);
+    this->_motor_until = (data[8] > 0) ? millis() + data[8] * 10 : 0;
+  }
+}
+
+// 目標指定付きモーター制御を受け付ける (ロック中に呼ばれる)
+void ToioSimCube::_startNav(const ToioSimNavCommand& command, bool overwrite) {
+  if (command.xs.empty()) {
+    this->_values[TOIO_SIM_CHAR_MOTOR] = {command.response, command.id, 0x03};
+    this->_notify(TOIO_SIM_CHAR_MOTOR);
+    return;
+  }
+  if (!this->_on_mat) {
+    this->_values[TOIO_SIM_CHAR_MOTOR] = {command.response, command.id, 0x04};
+    this->_notify(TOIO_SIM_CHAR_MOTOR);
+    return;
+  }
+  if (overwrite) {
+    this->_cancelNav(0x05);
+  }
+  this->_nav.push_back(command);
+  if (this->_nav.size() == 1) {
+    this->_nav_index = 0;
+    this->_nav_started = millis();
+    this->_nav_write_angle = this->_pose_angle;
+    this->_nav_rotating = false;
+    this->_motor_until = 0;
+  }
+}
+
+// 実行中・実行待ちの目標指定付きモーター制御をすべて打ち切る (ロック中に呼ばれる)
+void ToioSimCube::_cancelNav(uint8_t result) {
+  while (!this->_nav.empty()) {
+    this->_finishNav(result);
+  }
+}
+
+// 実行中の目標指定付きモーター制御を終え、応答を通知する (ロック中に呼ばれる)
+void ToioSimCube::_finishNav(uint8_t result) {
+  const ToioSimNavCommand& command = this->_nav.front();
+  this->_values[TOIO_SIM_CHAR_MOTOR] = {command.response, command.id, result};
+  this->_notify(TOIO_SIM_CHAR_MOTOR);
+  this->_nav.pop_front();
+  this->_motor_left = 0;
+  this->_motor_right = 0;
+  this->_nav_index = 0;
+  this->_nav_started = millis();
+  this->_nav_write_angle = this->_pose_angle;
+  this->_nav_rotating = false;
+}
+
+// 目標地点に向かうように左右のモーターの速度を決める (ロック中に呼ばれる)
+void ToioSimCube::_steerNav() {
+  if (!this->_on_mat) {
+    this->_cancelNav(0x02);
+    return;
+  }
+  ToioSimNavCommand& command = this->_nav.front();
+  if (millis() - this->_nav_started >= command.timeout_ms) {
+    this->_finishNav(0x01);
+    return;
+  }
+
+  uint16_t angle = command.angles[this->_nav_index];
+  uint8_t angle_type = angle >> 13;
+  double dx = command.xs[this->_nav_index] - this->_pose_x;
+  double dy = command.ys[this->_nav_index] - this->_pose_y;
+  double dist = sqrt(dx * dx + dy * dy);
+
+  if (!this->_nav_rotating && dist < 3.0) {
+    // 目標地点に着いた。必要なら角度を合わせる
+    double a = angle & 0x1fff;
+    this->_nav_rotating = true;
+    this->_nav_rotate_dir = 0;
+    switch (angle_type) {
+      case 0x00: this->_nav_goal_angle = a; break;
+      case 0x01: this->_nav_goal_angle = a; this->_nav_rotate_dir = 1; break;
+      case 0x02: this->_nav_goal_angle = a; this->_nav_rotate_dir = -1; break;
+      case 0x03: this->_nav_goal_angle = this->_pose_angle + a; this->_nav_rotate_dir = 1; break;
+      case 0x04: this->_nav_goal_angle = this->_pose_angle - a; this->_nav_rotate_dir = -1; break;
+      case 0x06: this->_nav_goal_angle = this->_nav_write_angle; break;
+      default: this->_nav_rotating = false; break;
+    }
+    if (!this->_nav_rotating) {
+      dist = 0;
+    }
+  }
+
+  if (this->_nav_rotating || dist < 3.0) {
+    double err = 0;
+    if (this->_nav_rotating) {
+      err = fmod(this->_nav_goal_angle - this->_pose_angle + 540.0, 360.0) - 180.0;
+      if (this->_nav_rotate_dir > 0 && err < -3.0) {
+        err += 360.0;
+      } else if (this->_nav_rotate_dir < 0 && err > 3.0) {
+        err -= 360.0;
+      }
+    }
+    if (fabs(err) < 3.0) {
+      // 次の目標地点へ (最後ならコマンド完了)
+      this->_nav_rotating = false;
+      this->_nav_index++;
+      if (this->_nav_index >= command.xs.size()) {
+        this->_finishNav(0x00);
+      }
+      return;
+    }
+    int turn = std::max(10, std::min(command.max_speed, (int)fabs(err)));
+    this->_motor_left = (err > 0) ? turn : -turn;
+    this->_motor_right = -this->_motor_left;
+    return;
+  }
+
+  double err = fmod(atan2(dy, dx) * 180.0 / M_PI - this->_pose_angle + 540.0, 360.0) - 180.0;
+  if (command.move_type == 0x02 && fabs(err) > 10.0) {
+    // 回転してから移動
+    int turn = std::max(10, std::min(command.max_speed, (int)fabs(err)));
+    this->_motor_left = (err > 0) ? turn : -turn;
+    this->_motor_right = -this->_motor_left;
+    return;
+  }
+  double v = command.max_speed * std::max(0.0, cos(err * M_PI / 180.0));
+  if (this->_nav_index + 1 >= command.xs.size() && this->_nav.size() == 1) {
+    // 最後の目標地点の手前で減速する
+    v = std::min(v, std::max(10.0, dist * 2.0));
+  }
+  double diff = std::max(-v, std::min(v, err));
+  this->_motor_left = (int)lround(v + diff);
+  this->_motor_right = (int)lround(v - diff);
+}
+
+// モーターを止め、目標指定付きモーター制御も応答なしで破棄する (ロック中に呼ばれる)
+void ToioSimCube::_stopMotor() {
+  this->_nav.clear();
+  this->_motor_left = 0;
+  this->_motor_right = 0;
+  this->_motor_until = 0;
+}
+
+// モーターの速度に応じて位置を進める (ロック中に呼ばれる)
+void ToioSimCube::_step(unsigned long now_us) {
+  double dt = (uint32_t)(now_us - this->_pose_updated) / 1000000.0;
+  this->_pose_updated = now_us;
+  if (this->_motor_until != 0 && (int32_t)(millis() - this->_motor_until) >= 0) {
+    this->_motor_left = 0;
+    this->_motor_right = 0;
+    this->_motor_until = 0;
+  }
+  if (!this->_nav.empty()) {
+    this->_steerNav();
+  }
+  if (!this->_on_mat || this->_stalled || (this->_motor_left == 0 && this->_motor_right == 0)) {
+    return;
+  }
+  double vl = this->_motor_left * TOIO_SIM_SPEED_SCALE;
+  double vr = this->_motor_right * TOIO_SIM_SPEED_SCALE;
+  double rad = this->_pose_angle * M_PI / 180.0;
+  double v = (vl + vr) / 2.0;
+  this->_pose_x += v * cos(rad) * dt;
+  this->_pose_y += v * sin(rad) * dt;
+  // 座標系は Y 軸が下向きなので、左の車輪が速いと角度が増える (時計回り)
+  double omega = (vl - vr) / TOIO_SIM_WHEEL_TRACK;
+  this->_pose_angle = fmod(this->_pose_angle + omega * dt * 180.0 / M_PI + 360.0, 360.0);
+  if (this->_pose_x < TOIO_SIM_MAT_MIN || this->_pose_x > TOIO_SIM_MAT_MAX ||
+      this->_pose_y < TOIO_SIM_MAT_MIN || this->_pose_y > TOIO_SIM_MAT_MAX) {
+    // マットの外に出た
+    this->_on_mat = false;
+  }
+}
+
+// 現在の位置から ID 情報の値を作る (ロック中に呼ばれる)
+void ToioSimCube::_updateIdValue() {
+  if (!this->_on_mat) {
+    this->_values[TOIO_SIM_CHAR_ID] = {0x03};
+    return;
+  }
+  uint16_t x = (uint16_t)lround(this->_pose_x);
+  uint16_t y = (uint16_t)lround(this->_pose_y);
+  uint16_t a = (uint16_t)lround(this->_pose_angle) % 360;
+  this->_values[TOIO_SIM_CHAR_ID] = {
+    0x01,
+    (uint8_t)(x & 0xff), (uint8_t)(x >> 8),
+    (uint8_t)(y & 0xff), (uint8_t)(y >> 8),
+    (uint8_t)(a & 0xff), (uint8_t)(a >> 8),
+    (uint8_t)(x & 0xff), (uint8_t)(x >> 8),
+    (uint8_t)(y & 0xff), (uint8_t)(y >> 8),
+    (uint8_t)(a & 0xff), (uint8_t)(a >> 8)
+  };
+}
+
+// 現在の値を通知 (ロック中に呼ばれる)
+// サウンドの書き込み (ロック中に呼ばれる)
+// (MIDI の書き込みごとに、前の再生とのつなぎ目の途切れ・打ち切りを数える)
+void ToioSimCube::_onSoundWrite(const uint8_t* data, size_t length) {
+  if (length < 1) {
+    return;
+  }
+  unsigned long now = micros();
+  if (data[0] == 0x01) {
+    this->_sound_end = 0; // 再生停止
+    return;
+  }
+  if (data[0] != 0x03 || length < 3 || length < 3 + (size_t)data[2] * 3) {
+    return;
+  }
+  if (this->_sound_end != 0) {
+    int32_t diff = (int32_t)(now - this->_sound_end);
+    if (diff > 0) {
+      this->_sound_stats.gaps++;
+      this->_sound_stats.gap_total_us += diff;
+      this->_sound_stats.gap_max_us = std::max(this->_sound_stats.gap_max_us, (uint32_t)diff);
+    } else if (diff < 0) {
+      this->_sound_stats.cuts++;
+      this->_sound_stats.cut_total_us += -diff;
+      this->_sound_stats.cut_max_us = std::max(this->_sound_stats.cut_max_us, (uint32_t)-diff);
+    }
+  }
+  this->_sound_stats.plays++;
+  uint32_t duration_ms = 0;
+  for (size_t i = 0; i < data[2]; i++) {
+    duration_ms += data[3 + i * 3] * 10;
+  }
+  uint32_t repeat = (data[1] == 0) ? 1000 : data[1];
+  this->_sound_end = (now + duration_ms * repeat * 1000) | 1;
+}
+
+// 接続間隔の変更要求・読み出し (ロック中に呼ばれる)
+// (セントラルは要求された範囲の最小値を採用するものとする)
+void ToioSimCube::_onConnParamWrite(const uint8_t* data, size_t length) {
+  if (data[0] == 0x30 && length >= 6) {
+    uint16_t min = data[2] | (data[3] << 8);
+    uint16_t max = data[4] | (data[5] << 8);
+    if (min == 0xffff && max == 0xffff) {
+      this->_conn_request[0] = 0xffff;
+      this->_conn_request[1] = 0xffff;
+      this->_conn_interval = TOIO_SIM_DEFAULT_CONN_INTERVAL;
+      this->_conn_requested = false;
+    } else if (min >= 0x0006 && max <= 0x0c80 && min <= max) {
+      this->_conn_request[0] = min;
+      this->_conn_request[1] = max;
+      this->_conn_interval = min;
+      this->_conn_requested = true;
+      this->_conn_anchor = micros();
+      this->_tx_event = 0;
+      this->_tx_count = 0;
+      this->_rx_event = 0;
+      this->_rx_count = 0;
+    }
+    return;
+  }
+  std::vector<uint8_t> res;
+  if (data[0] == 0x31) {
+    res = {0xb1, 0x00,
+           (uint8_t)(this->_conn_request[0] & 0xff), (uint8_t)(this->_conn_request[0] >> 8),
+           (uint8_t)(this->_conn_request[1] & 0xff), (uint8_t)(this->_conn_request[1] >> 8)};
+  } else if (data[0] == 0x32) {
+    res = {0xb2, 0x00, (uint8_t)(this->_conn_interval & 0xff), (uint8_t)(this->_conn_interval >> 8)};
+  } else {
+    return;
+  }
+  this->_values[TOIO_SIM_CHAR_CONF] = res;
+  this->_notify(TOIO_SIM_CHAR_CONF);
+}
+
+// 現在の接続イベントの番号と、その開始時刻 (ロック中に呼ばれる)
+uint32_t ToioSimCube::_connEvent(unsigned long now_us) {
+  return (uint32_t)(now_us - this->_conn_anchor) / (this->_conn_interval * 1250UL);
+}
+
+unsigned long ToioSimCube::_connEventTime(uint32_t event) {
+  return this->_conn_anchor + (unsigned long)event * this->_conn_interval * 1250UL;
+}
+
+// 無線を共有する接続の数から、このキューブが使える接続イベントの割合を求める (ロック中に呼ばれる)
+// (接続間隔を要求しているすべての接続の、接続イベントが無線を占める時間の割合の合計が 1 を
+//  超えると、接続イベントがぶつかる。そのとき各接続は share 回に 1 回の接続イベントしか使えない)
+uint32_t ToioSimCube::_radioShare() {
+  if (g_sim_link.event_length_us == 0) {
+    return 1;
+  }
+  double load = 0.0;
+  for (ToioSimCube* cube : g_sim_cubes) {
+    if (cube->_client && cube->_conn_requested) {
+      load += (double)g_sim_link.event_length_us / (cube->_conn_interval * 1250.0);
+    }
+  }
+  return (load <= 1.0) ? 1 : (uint32_t)ceil(load);
+}
+
+// event 以降で、このキューブが使える最初の接続イベント
+uint32_t ToioSimCube::_usableEvent(uint32_t event, uint32_t share) {
+  if (share <= 1) {
+    return event;
+  }
+  uint32_t slot = this->_radio_slot % share;
+  return event + (slot + share - event % share) % share;
+}
+
+// セントラルからの書き込みを接続イベントに載せ、書き込みが戻るまでの時間
+// (マイクロ秒) を返す (ロック中に呼ばれる。接続間隔の要求がなければ 0)
+// - レスポンスなし: 空きのある接続イベントに載せる (空きがなければ次のイベントまで待つ)
+// - レスポンスあり / 読み出し: 次の接続イベントで送り、その次のイベントで応答を受け取る
+uint32_t ToioSimCube::_reserveWrite(bool response, unsigned long now_us) {
+  if (!this->_conn_requested) {
+    return 0;
+  }
+  uint32_t share = this->_radioShare();
+  uint32_t event = this->_connEvent(now_us);
+  if (response) {
+    uint32_t sent = this->_usableEvent(event + 1, share);
+    return this->_connEventTime(this->_usableEvent(sent + 1, share)) - now_us;
+  }
+  uint32_t first = this->_usableEvent(event, share);
+  if ((int32_t)(first - this->_tx_event) > 0) {
+    this->_tx_event = first;
+    this->_tx_count = 0;
+  }
+  if (this->_tx_count >= g_sim_link.packets_per_event) {
+    this->_tx_event = this->_usableEvent(this->_tx_event + 1, share);
+    this->_tx_count = 0;
+  }
+  this->_tx_count++;
+  return (this->_tx_event == event) ? 0 : this->_connEventTime(this->_tx_event) - now_us;
+}
+
+// 通知を空きのある接続イベントに載せ、配送する時刻を決める
+// (ロック中に呼ばれる。先送りが多すぎれば false を返してロスとする)
+bool ToioSimCube::_scheduleNotify(unsigned long now_us, unsigned long& at) {
+  uint32_t share = this->_radioShare();
+  uint32_t event = this->_usableEvent(this->_connEvent(now_us) + 1, share);
+  if ((int32_t)(event - this->_rx_event) > 0) {
+    this->_rx_event = event;
+    this->_rx_count = 0;
+  }
+  if (this->_rx_count >= g_sim_link.packets_per_event) {
+    uint32_t next = this->_usableEvent(this->_rx_event + 1, share);
+    if ((next - event) / share >= TOIO_SIM_NOTIFY_BACKLOG_EVENTS) {
+      return false;
+    }
+    this->_rx_event = next;
+    this->_rx_count = 0;
+  }
+  this->_rx_count++;
+  at = this->_connEventTime(this->_rx_event);
+  return true;
+}
+
+// 姿勢角・磁気センサーの通知の値
+static void toioSimPushFloat(std::vector<uint8_t>& v, float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, 4);
+  for (int i = 0; i < 4; i++) {
+    v.push_back((bits >> (8 * i)) & 0xff);
+  }
+}
+
+std::vector<uint8_t> ToioSimCube::_sensorValue(ToioSimSensor sensor) {
+  if (sensor == TOIO_SIM_SENSOR_MAGNETIC) {
+    if (this->_sensor_mode[sensor] == 1) {
+      return {0x02, this->_magnet[0], 0x00, 0x00, 0x00, 0x00};
+    }
+    return {0x02, 0x00, this->_magnet[1], this->_magnet[2], this->_magnet[3], this->_magnet[4]};
+  }
+  std::vector<uint8_t> v = {0x03, this->_sensor_mode[sensor]};
+  if (this->_sensor_mode[sensor] == 1) {
+    for (int i = 0; i < 3; i++) {
+      int16_t deg = (int16_t)lround(this->_posture[i]);
+      v.push_back(deg & 0xff);
+      v.push_back((deg >> 8) & 0xff);
+    }
+  } else if (this->_sensor_mode[sensor] == 2) {
+    // ロール・ピッチ・ヨー (X・Y・Z 軸まわり) の順の回転をクォータニオンにする
+    double r = this->_posture[0] * M_PI / 360.0;
+    double p = this->_posture[1] * M_PI / 360.0;
+    double y = this->_posture[2] * M_PI / 360.0;
+    toioSimPushFloat(v, cos(r) * cos(p) * cos(y) + sin(r) * sin(p) * sin(y));
+    toioSimPushFloat(v, sin(r) * cos(p) * cos(y) - cos(r) * sin(p) * sin(y));
+    toioSimPushFloat(v, cos(r) * sin(p) * cos(y) + sin(r) * cos(p) * sin(y));
+    toioSimPushFloat(v, cos(r) * cos(p) * sin(y) - sin(r) * sin(p) * cos(y));
+  } else {
+    for (int i = 0; i < 3; i++) {
+      toioSimPushFloat(v, this->_posture[i]);
+    }
+  }
+  return v;
+}
+
+// 有効な姿勢角・磁気センサーの通知を間隔ごとに送る (ロック中に呼ばれる)
+void ToioSimCube::_notifySensors(unsigned long now_ms) {
+  for (int i = 0; i < TOIO_SIM_SENSOR_NUM; i++) {
+    if (this->_sensor_mode[i] == 0 || this->_sensor_interval[i] == 0 ||
+        (int32_t)(now_ms - this->_sensor_next[i]) < 0) {
+      continue;
+    }
+    this->_sensor_next[i] = now_ms + this->_sensor_interval[i];
+    std::vector<uint8_t> value = this->_sensorValue((ToioSimSensor)i);
+    if (this->_sensor_on_change[i] && value == this->_sensor_sent[i]) {
+      continue;
+    }
+    this->_sensor_sent[i] = value;
+    ToioSim::_queueNotify(this->_client, TOIO_SIM_CHAR_MOTION, value);
+  }
+}
+
+// モーターの速度が変わったら速度情報 (0xe0) を通知する (ロック中に呼ばれる)
+// (車輪を止めていれば 0。マットから持ち上げても車輪は回る)
+void ToioSimCube::_notifySpeed(unsigned long now_ms) {
+  if (!this->_speed_notify || (int32_t)(now_ms - this->_speed_next) < 0) {
+    return;
+  }
+  this->_speed_next = now_ms + TOIO_SIM_SPEED_NOTIFY_INTERVAL;
+  uint8_t speed[2] = {0, 0};
+  if (!this->_stalled) {
+    speed[0] = (uint8_t)std::min(abs(this->_motor_left), 255);
+    speed[1] = (uint8_t)std::min(abs(this->_motor_right), 255);
+  }
+  if (speed[0] == this->_speed_sent[0] && speed[1] == this->_speed_sent[1]) {
+    return;
+  }
+  memcpy(this->_speed_sent, speed, sizeof(speed));
+  ToioSim::_queueNotify(this->_client, TOIO_SIM_CHAR_MOTOR, {0xe0, speed[0], speed[1]});
+}
+
+void ToioSimCube::_notify(ToioSimChar ch) {
+  if (!this->_client) {
+    return;
+  }
+  ToioSim::_queueNotify(this->_client, ch, this->_values[ch]);
+}
+
+// ===============================================================
+// ToioSim クラス
+// ===============================================================
+
+ToioSimCube* ToioSim::addCube(const std::string& address, const std::string& name) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  std::string addr = address;
+  if (addr.empty()) {
+    char buf[18];
+    uint32_t n = g_sim_next_address++;
+    snprintf(buf, sizeof(buf), "d0:00:00:00:%02x:%02x", (n >> 8) & 0xff, n & 0xff);
+    addr = buf;
+  }
+  ToioSimCube* cube = new ToioSimCube(addr, name);
+  cube->_radio_slot = g_sim_cubes.size();
+  g_sim_cubes.push_back(cube);
+  ToioSim::_start();
+  return cube;
+}
+
+std::vector<ToioSimCube*> ToioSim::addCubes(size_t n) {
+  std::vector<ToioSimCube*> cubes;
+  for (size_t i = 0; i < n; i++) {
+    cubes.push_back(ToioSim::addCube());
+  }
+  return cubes;
+}
+
+std::vector<ToioSimCube*> ToioSim::getCubes() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return g_sim_cubes;
+}
+
+uint32_t ToioSim::getRejectedConnects() {
+  return g_sim_connect_rejected;
+}
+
+void ToioSim::setLinkConfig(const ToioSimLinkConfig& config) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  g_sim_link = config;
+}
+
+ToioSimLinkConfig ToioSim::getLinkConfig() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return g_sim_link;
+}
+
+void ToioSim::_lock() {
+  g_sim_mutex.lock();
+}
+
+void ToioSim::_unlock() {
+  g_sim_mutex.unlock();
+}
+
+ToioSimCube* ToioSim::_findCube(const std::string& address) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  for (ToioSimCube* cube : g_sim_cubes) {
+    if (cube->_address == address) {
+      return cube;
+    }
+  }
+  return nullptr;
+}
+
+bool ToioSim::_chance(float rate) {
+  if (rate <= 0.0f) {
+    return false;
+  }
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+  return dist(g_sim_random) < rate;
+}
+
+uint32_t ToioSim::_latency(uint32_t base) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  if (g_sim_link.jitter_ms == 0) {
+    return base;
+  }
+  std::uniform_int_distribution<uint32_t> dist(0, g_sim_link.jitter_ms);
+  return base + dist(g_sim_random);
+}
+
+void ToioSim::_sleep(uint32_t msec) {
+  if (msec > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(msec));
+  }
+}
+
+ToioSimChar ToioSim::_charFromUuid(const std::string& uuid) {
+  for (int i = 0; i < TOIO_SIM_CHAR_NUM; i++) {
+    if (uuid == ToioSim::CHAR_UUIDS[i]) {
+      return (ToioSimChar)i;
+    }
+  }
+  return TOIO_SIM_CHAR_NUM;
+}
+
+// 通知を配送キューに積む (ロック中に呼ばれる)
+void ToioSim::_queueNotify(BLEClient* client, ToioSimChar ch, const std::vector<uint8_t>& data) {
+  ToioSimCube* cube = client->_cube;
+  if (ToioSim::_chance(g_sim_link.notify_loss_rate)) {
+    cube->_stats.lost[ch]++;
+    return;
+  }
+  ToioSimDelivery d;
+  if (cube->_conn_requested) {
+    if (!cube->_scheduleNotify(micros(), d.at)) {
+      cube->_stats.lost[ch]++;
+      return;
+    }
+  } else {
+    d.at = micros() + ToioSim::_latency(g_sim_link.notify_latency_ms) * 1000;
+  }
+  cube->_stats.notified[ch]++;
+  d.client = client;
+  d.disconnect = false;
+  d.ch = ch;
+  d.data = data;
+  g_sim_deliveries.push_back(d);
+}
+
+// 切断イベントを配送キューに積む (ロック中に呼ばれる)
+void ToioSim::_queueDisconnect(BLEClient* client) {
+  ToioSimDelivery d;
+  d.at = micros();
+  d.client = client;
+  d.disconnect = true;
+  d.ch = TOIO_SIM_CHAR_NUM;
+  g_sim_deliveries.push_back(d);
+}
+
+// アドバタイズ中の仮想キューブ
+std::vector<BLEAdvertisedDevice> ToioSim::_advertisingDevices() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  std::vector<BLEAdvertisedDevice> devices;
+  for (ToioSimCube* cube : g_sim_cubes) {
+    if (!cube->_powered || cube->_client) {
+      continue;
+    }
+    BLEAdvertisedDevice device;
+    device._address = cube->_address;
+    device._name = cube->_name;
+    device._rssi = cube->_rssi;
+    device._service_uuid = ToioSim::SERVICE_UUID;
+    devices.push_back(device);
+  }
+  return devices;
+}
+
+void ToioSim::_startScan(BLEScan* scan, uint32_t duration, void (*cb)(BLEScanResults)) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  ToioSim::_stopScan(scan);
+  ToioSimScanSession session;
+  session.scan = scan;
+  session.end = (duration == 0) ? 0 : millis() + (unsigned long)(duration * 1000 * g_sim_link.scan_time_scale);
+  session.next = millis();
+  session.cb = cb;
+  g_sim_scans.push_back(session);
+  ToioSim::_start();
+}
+
+void ToioSim::_stopScan(BLEScan* scan) {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  for (auto itr = g_sim_scans.begin(); itr != g_sim_scans.end(); ++itr) {
+    if (itr->scan == scan) {
+      g_sim_scans.erase(itr);
+      return;
+    }
+  }
+}
+
+// BLE タスクに相当するスレッドの処理
+void ToioSim::_task() {
+  while (g_sim_running) {
+    std::this_thread::sleep_for(std::chrono::microseconds(500));
+
+    std::vector<ToioSimDelivery> due;
+    std::vector<std::pair<BLEScan*, BLEAdvertisedDevice>> adverts;
+    std::vector<std::pair<void (*)(BLEScanResults), BLEScanResults>> completed;
+    {
+      std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+      unsigned long now_ms = millis();
+
+      // 定期的な通知
+      for (ToioSimCube* cube : g_sim_cubes) {
+        if (!cube->_client) {
+          continue;
+        }
+        for (int i = 0; i < TOIO_SIM_CHAR_NUM; i++) {
+          uint32_t interval = cube->_notify_interval[i];
+          if (i == TOIO_SIM_CHAR_ID || interval == 0 || (int32_t)(now_ms - cube->_notify_next[i]) < 0) {
+            continue;
+          }
+          cube->_notify_next[i] = now_ms + interval;
+          cube->_notify((ToioSimChar)i);
+        }
+
+        cube->_notifySensors(now_ms);
+
+        // 位置が変化したら ID 情報を通知
+        cube->_step(micros());
+        cube->_notifySpeed(now_ms);
+        if ((int32_t)(now_ms - cube->_notify_next[TOIO_SIM_CHAR_ID]) >= 0) {
+          std::vector<uint8_t> prev = cube->_values[TOIO_SIM_CHAR_ID];
+          cube->_updateIdValue();
+          if (cube->_values[TOIO_SIM_CHAR_ID] != prev) {
+            cube->_notify_next[TOIO_SIM_CHAR_ID] = now_ms + cube->_notify_interval[TOIO_SIM_CHAR_ID];
+            cube->_notify(TOIO_SIM_CHAR_ID);
+          }
+        }
+      }
+
+      // 配送時刻に達した通知・切断イベント
+      unsigned long now_us = micros();
+      for (auto itr = g_sim_deliveries.begin(); itr != g_sim_deliveries.end();) {
+        if ((int32_t)(now_us - itr->at) >= 0) {
+          due.push_back(*itr);
+          itr = g_sim_deliveries.erase(itr);
+        } else {
+          ++itr;
+        }
+      }
+
+      // 非同期スキャン
+      std::vector<BLEAdvertisedDevice> devices;
+      bool devices_ready = false;
+      for (auto itr = g_sim_scans.begin(); itr != g_sim_scans.end();) {
+        ToioSimScanSession& session = *itr;
+        if ((int32_t)(now_ms - session.next) >= 0) {
+          session.next = now_ms + session.scan->_interval;
+          if (!devices_ready) {
+            devices = ToioSim::_advertisingDevices();
+            devices_ready = true;
+          }
+          for (BLEAdvertisedDevice& device : devices) {
+            std::string addr = device.getAddress().toString();
+            if (!session.scan->_want_duplicates && session.seen.count(addr) > 0) {
+              continue;
+            }
+            session.seen.insert(addr);
+            adverts.push_back(std::make_pair(session.scan, device));
+          }
+        }
+        if (session.end != 0 && (int32_t)(now_ms - session.end) >= 0) {
+          completed.push_back(std::make_pair(session.cb, session.scan->_results));
+          itr = g_sim_scans.erase(itr);
+        } else {
+          ++itr;
+        }
+      }
+    }
+
+    // コールバックはロックの外で呼び出す
+    for (auto& advert : adverts) {
+      advert.first->_onAdvertisement(advert.second);
+    }
+    for (ToioSimDelivery& d : due) {
+      if (d.disconnect) {
+        if (d.client->_callbacks) {
+          d.client->_callbacks->onDisconnect(d.client);
+        }
+        continue;
+      }
+      notify_callback cb = nullptr;
+      BLERemoteCharacteristic* rchar = nullptr;
+      {
+        std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+        if (!d.client->_connected) {
+          continue;
+        }
+        auto sitr = d.client->_services.find(ToioSim::SERVICE_UUID);
+        if (sitr == d.client->_services.end()) {
+          continue;
+        }
+        auto citr = sitr->second->_chars.find(ToioSim::CHAR_UUIDS[d.ch]);
+        if (citr == sitr->second->_chars.end()) {
+          continue;
+        }
+        rchar = citr->second;
+        cb = rchar->_notify;
+      }
+      if (cb) {
+        cb(rchar, d.data.data(), d.data.size(), true);
+      }
+    }
+    for (auto& c : completed) {
+      if (c.first) {
+        c.first(c.second);
+      }
+    }
+  }
+}
+
+static void toioSimStop() {
+  g_sim_running = false;
+  if (g_sim_thread.joinable()) {
+    g_sim_thread.join();
+  }
+}
+
+void ToioSim::_start() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  if (g_sim_running) {
+    return;
+  }
+  g_sim_running = true;
+  g_sim_thread = std::thread(ToioSim::_task);
+  atexit(toioSimStop);
+}
+
+// ===============================================================
+// BLEScan クラス
+// ===============================================================
+
+void BLEScan::setAdvertisedDeviceCallbacks(BLEAdvertisedDeviceCallbacks* callbacks, bool wantDuplicates) {
+  this->_callbacks = callbacks;
+  this->_want_duplicates = wantDuplicates;
+}
+
+void BLEScan::_onAdvertisement(BLEAdvertisedDevice& device) {
+  {
+    std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+    bool found = false;
+    for (BLEAdvertisedDevice& d : this->_results._devices) {
+      if (d._address == device._address) {
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      this->_results._devices.push_back(device);
+    }
+  }
+  if (this->_callbacks) {
+    this->_callbacks->onResult(device);
+  }
+}
+
+BLEScanResults BLEScan::start(uint32_t duration, bool is_continue) {
+  if (!is_continue) {
+    this->clearResults();
+  }
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  ToioSim::_sleep((uint32_t)(duration * 1000 * link.scan_time_scale));
+  std::vector<BLEAdvertisedDevice> devices = ToioSim::_advertisingDevices();
+  for (BLEAdvertisedDevice& device : devices) {
+    this->_onAdvertisement(device);
+  }
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return this->_results;
+}
+
+bool BLEScan::start(uint32_t duration, void (*scanCompleteCB)(BLEScanResults), bool is_continue) {
+  if (!is_continue) {
+    this->clearResults();
+  }
+  ToioSim::_startScan(this, duration, scanCompleteCB);
+  return true;
+}
+
+void BLEScan::stop() {
+  ToioSim::_stopScan(this);
+}
+
+void BLEScan::clearResults() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_results._devices.clear();
+}
+
+// ===============================================================
+// BLEClient クラス
+// ===============================================================
+
+BLEClient::BLEClient() {
+  this->_callbacks = nullptr;
+  this->_cube = nullptr;
+  this->_connected = false;
+  this->_mtu = 23;
+}
+
+BLEClient::~BLEClient() {
+  this->_clearServices();
+}
+
+void BLEClient::_clearServices() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  for (auto& s : this->_services) {
+    delete s.second;
+  }
+  this->_services.clear();
+}
+
+bool BLEClient::connect(BLEAdvertisedDevice* device) {
+  return this->connect(device->getAddress());
+}
+
+bool BLEClient::connect(BLEAddress address) {
+  ToioSimCube* cube = ToioSim::_findCube(address.toString());
+  if (!cube || !cube->isPowered() || cube->isConnected()) {
+    return false;
+  }
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  {
+    // セントラルの接続数と、同時に確立できる接続の数の上限
+    std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+    size_t connected = 0;
+    for (ToioSimCube* c : g_sim_cubes) {
+      connected += (c->_client != nullptr);
+    }
+    if ((link.max_connections != 0 && connected >= link.max_connections) ||
+        (link.max_connecting != 0 && g_sim_connecting >= link.max_connecting)) {
+      g_sim_connect_rejected++;
+      return false;
+    }
+    g_sim_connecting++;
+  }
+  ToioSim::_sleep(ToioSim::_latency(link.connect_latency_ms));
+  g_sim_connecting--;
+  if (ToioSim::_chance(link.connect_failure_rate)) {
+    return false;
+  }
+  this->_clearServices();
+  {
+    std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+    if (!cube->_powered || cube->_client) {
+      return false;
+    }
+    this->_cube = cube;
+    this->_connected = true;
+    cube->_client = this;
+    cube->_stats.connections++;
+    unsigned long now = millis();
+    for (int i = 0; i < TOIO_SIM_CHAR_NUM; i++) {
+      cube->_notify_next[i] = now + cube->_notify_interval[i];
+    }
+    // 姿勢角・磁気センサー・モーターの速度情報の通知と接続パラメーターは接続のたびに元に戻る
+    for (int i = 0; i < TOIO_SIM_SENSOR_NUM; i++) {
+      cube->_sensor_mode[i] = 0;
+    }
+    cube->_speed_notify = false;
+    cube->_conn_request[0] = 0xffff;
+    cube->_conn_request[1] = 0xffff;
+    cube->_conn_interval = TOIO_SIM_DEFAULT_CONN_INTERVAL;
+    cube->_conn_requested = false;
+    this->_mtu = 23;
+  }
+  if (this->_callbacks) {
+    this->_callbacks->onConnect(this);
+  }
+  return true;
+}
+
+void BLEClient::disconnect() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  if (!this->_connected) {
+    return;
+  }
+  this->_connected = false;
+  if (this->_cube && this->_cube->_client == this) {
+    // 切断されるとキューブはモーターを止める
+    this->_cube->_client = nullptr;
+    this->_cube->_stopMotor();
+  }
+  ToioSim::_queueDisconnect(this);
+}
+
+// MTU の交換 (レスポンスあり書き込みと同じ往復時間がかかる)
+int BLEClient::setMTU(uint16_t mtu) {
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  ToioSim::_sleep(ToioSim::_latency(link.write_latency_ms));
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  if (!this->_connected) {
+    return -1;
+  }
+  this->_mtu = std::max((uint16_t)23, std::min(mtu, (uint16_t)TOIO_SIM_MAX_MTU));
+  return 0;
+}
+
+bool BLEClient::isConnected() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return this->_connected;
+}
+
+BLEAddress BLEClient::getPeerAddress() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return BLEAddress(this->_cube ? this->_cube->_address : "00:00:00:00:00:00");
+}
+
+int BLEClient::getRssi() {
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  return this->_cube ? this->_cube->_rssi : 0;
+}
+
+BLERemoteService* BLEClient::getService(const char* uuid) {
+  return this->getService(BLEUUID(uuid));
+}
+
+BLERemoteService* BLEClient::getService(BLEUUID uuid) {
+  if (!this->isConnected()) {
+    return nullptr;
+  }
+  bool discovered;
+  {
+    std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+    discovered = !this->_services.empty();
+  }
+  if (!discovered) {
+    // 最初の呼び出しでプライマリサービスを探索する
+    ToioSimLinkConfig link = ToioSim::getLinkConfig();
+    ToioSim::_sleep(ToioSim::_latency(link.discovery_latency_ms));
+    std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+    if (this->_services.empty()) {
+      this->_services[ToioSim::SERVICE_UUID] = new BLERemoteService(this, ToioSim::SERVICE_UUID);
+    }
+  }
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  auto itr = this->_services.find(uuid.toString());
+  return (itr == this->_services.end()) ? nullptr : itr->second;
+}
+
+// ===============================================================
+// BLERemoteService クラス
+// ===============================================================
+
+BLERemoteService::BLERemoteService(BLEClient* client, std::string uuid) {
+  this->_client = client;
+  this->_uuid = uuid;
+  this->_chars_retrieved = false;
+}
+
+BLERemoteService::~BLERemoteService() {
+  for (auto& c : this->_chars) {
+    delete c.second;
+  }
+}
+
+BLERemoteCharacteristic* BLERemoteService::getCharacteristic(const char* uuid) {
+  return this->getCharacteristic(BLEUUID(uuid));
+}
+
+BLERemoteCharacteristic* BLERemoteService::getCharacteristic(BLEUUID uuid) {
+  std::string str = uuid.toString();
+  {
+    std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+    auto itr = this->_chars.find(str);
+    if (itr != this->_chars.end()) {
+      return itr->second;
+    }
+  }
+  ToioSimChar ch = ToioSim::_charFromUuid(str);
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  ToioSim::_sleep(ToioSim::_latency(link.char_lookup_latency_ms));
+  if (ch == TOIO_SIM_CHAR_NUM) {
+    return nullptr;
+  }
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  auto itr = this->_chars.find(str);
+  if (itr != this->_chars.end()) {
+    return itr->second;
+  }
+  BLERemoteCharacteristic* rchar = new BLERemoteCharacteristic(this, str, 0x000d + ch * 4);
+  this->_chars[str] = rchar;
+  this->_chars_by_handle[rchar->_handle] = rchar;
+  return rchar;
+}
+
+std::map<uint16_t, BLERemoteCharacteristic*>* BLERemoteService::getCharacteristicsByHandle() {
+  {
+    std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+    if (this->_chars_retrieved) {
+      return &this->_chars_by_handle;
+    }
+  }
+  // 全 Characteristic の探索は 1 往復で済む
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  ToioSim::_sleep(ToioSim::_latency(link.char_lookup_latency_ms));
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  for (int ch = 0; ch < TOIO_SIM_CHAR_NUM; ch++) {
+    std::string str = ToioSim::CHAR_UUIDS[ch];
+    if (this->_chars.find(str) == this->_chars.end()) {
+      BLERemoteCharacteristic* rchar = new BLERemoteCharacteristic(this, str, 0x000d + ch * 4);
+      this->_chars[str] = rchar;
+      this->_chars_by_handle[rchar->_handle] = rchar;
+    }
+  }
+  this->_chars_retrieved = true;
+  return &this->_chars_by_handle;
+}
+
+// ===============================================================
+// BLERemoteCharacteristic クラス
+// ===============================================================
+
+BLERemoteCharacteristic::BLERemoteCharacteristic(BLERemoteService* service, std::string uuid, uint16_t handle) {
+  this->_service = service;
+  this->_uuid = uuid;
+  this->_handle = handle;
+  this->_notify = nullptr;
+}
+
+void BLERemoteCharacteristic::writeValue(uint8_t* data, size_t length, bool response) {
+  BLEClient* client = this->_service->_client;
+  ToioSimChar ch = ToioSim::_charFromUuid(this->_uuid);
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  uint32_t wait_us = 0;
+  {
+    std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+    if (client->_connected && client->_cube) {
+      wait_us = client->_cube->_reserveWrite(response, micros());
+    }
+  }
+  if (wait_us > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+  } else if (response) {
+    ToioSim::_sleep(ToioSim::_latency(link.write_latency_ms));
+  }
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  if (!client->_connected || !client->_cube) {
+    return;
+  }
+  if (!response && ToioSim::_chance(link.write_loss_rate)) {
+    client->_cube->_stats.lost[ch]++;
+    return;
+  }
+  client->_cube->_onWrite(ch, data, length);
+}
+
+void BLERemoteCharacteristic::writeValue(std::string value, bool response) {
+  this->writeValue((uint8_t*)value.data(), value.size(), response);
+}
+
+void BLERemoteCharacteristic::writeValue(uint8_t value, bool response) {
+  this->writeValue(&value, 1, response);
+}
+
+std::string BLERemoteCharacteristic::readValue() {
+  BLEClient* client = this->_service->_client;
+  ToioSimChar ch = ToioSim::_charFromUuid(this->_uuid);
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  uint32_t wait_us = 0;
+  {
+    std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+    if (client->_connected && client->_cube) {
+      wait_us = client->_cube->_reserveWrite(true, micros());
+    }
+  }
+  if (wait_us > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+  } else {
+    ToioSim::_sleep(ToioSim::_latency(link.write_latency_ms));
+  }
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  if (!client->_connected || !client->_cube) {
+    return std::string();
+  }
+  client->_cube->_stats.read[ch]++;
+  std::vector<uint8_t>& value = client->_cube->_values[ch];
+  return std::string(value.begin(), value.end());
+}
+
+uint8_t BLERemoteCharacteristic::readUInt8() {
+  std::string value = this->readValue();
+  return value.empty() ? 0 : (uint8_t)value[0];
+}
+
+void BLERemoteCharacteristic::registerForNotify(notify_callback callback, bool notifications) {
+  // CCCD への書き込み (レスポンスあり) に相当
+  ToioSimLinkConfig link = ToioSim::getLinkConfig();
+  ToioSim::_sleep(ToioSim::_latency(link.write_latency_ms));
+  std::lock_guard<std::recursive_mutex> lock(g_sim_mutex);
+  this->_notify = callback;
+}
+
+// ===============================================================
+// BLEDevice クラス
+// ===============================================================
+
+static bool g_sim_ble_initialized = false;
+static BLEScan g_sim_scan;
+
+void BLEDevice::init(std::string deviceName) {
+  g_sim_ble_initialized = true;
+  ToioSim::_start();
+}
+
+void BLEDevice::deinit(bool release_memory) {
+  g_sim_ble_initialized = false;
+}
+
+bool BLEDevice::getInitialized() {
+  return g_sim_ble_initialized;
+}
+
+BLEScan* BLEDevice::getScan() {
+  return &g_sim_scan;
+}
+
+BLEClient* BLEDevice::createClient() {
+  return new BLEClient();
+}
@@ -0,0 +1,121 @@
+/* ----------------------------------------------------------------
+  ToioSimArduino.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <mutex>
+
+static const std::chrono::steady_clock::time_point g_start_time = std::chrono::steady_clock::now();
+
+unsigned long millis() {
+  auto elapsed = std::chrono::steady_clock::now() - g_start_time;
+  return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+}
+
+unsigned long micros() {
+  auto elapsed = std::chrono::steady_clock::now() - g_start_time;
+  return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+void delay(uint32_t msec) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(msec));
+}
+
+void delayMicroseconds(uint32_t usec) {
+  std::this_thread::sleep_for(std::chrono::microseconds(usec));
+}
+
+void yield() {
+  std::this_thread::yield();
+}
+
+static std::mutex g_random_mutex;
+static std::mt19937 g_random(0x5eed);
+
+long random(long max) {
+  return random(0, max);
+}
+
+long random(long min, long max) {
+  if (max <= min) {
+    return min;
+  }
+  std::lock_guard<std::mutex> lock(g_random_mutex);
+  std::uniform_int_distribution<long> dist(min, max - 1);
+  return dist(g_random);
+}
+
+// ---------------------------------------------------------------
+// String クラス
+// ---------------------------------------------------------------
+String::String(float value, unsigned int decimals) : String((double)value, decimals) {
+}
+
+String::String(double value, unsigned int decimals) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.*f", (int)decimals, value);
+  this->_str = buf;
+}
+
+// ---------------------------------------------------------------
+// Print クラス
+// ---------------------------------------------------------------
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  size_t n = 0;
+  for (size_t i = 0; i < size; i++) {
+    n += this->write(buffer[i]);
+  }
+  return n;
+}
+
+size_t Print::printf(const char* format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (len < 0) {
+    return 0;
+  }
+  if ((size_t)len >= sizeof(buf)) {
+    len = sizeof(buf) - 1;
+  }
+  return this->write((const uint8_t*)buf, len);
+}
+
+// ---------------------------------------------------------------
+// Stream クラス
+// ---------------------------------------------------------------
+size_t Stream::readBytes(uint8_t* buffer, size_t length) {
+  size_t n = 0;
+  while (n < length) {
+    int c = this->read();
+    if (c < 0) {
+      break;
+    }
+    buffer[n++] = (uint8_t)c;
+  }
+  return n;
+}
+
+// ---------------------------------------------------------------
+// シリアル
+// ---------------------------------------------------------------
+size_t HardwareSerial::write(uint8_t c) {
+  return fwrite(&c, 1, 1, stdout);
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+  return fwrite(buffer, 1, size, stdout);
+}
+
+HardwareSerial Serial;
@@ -0,0 +1,172 @@
+/* ----------------------------------------------------------------
+  ToioSimFreeRTOS.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include <Arduino.h>
+#include <freertos/semphr.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <vector>
+
+// ---------------------------------------------------------------
+// タスク
+// ---------------------------------------------------------------
+struct ToioSimTask {
+  TaskFunction_t fn;
+  void* arg;
+};
+
+// vTaskDelete(NULL) でスレッドを終了させるための例外
+struct ToioSimTaskExit {
+};
+
+static thread_local ToioSimTask* g_current_task = nullptr;
+
+static void toioSimTaskMain(ToioSimTask* task) {
+  g_current_task = task;
+  try {
+    task->fn(task->arg);
+  } catch (ToioSimTaskExit&) {
+  }
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack_depth, void* arg,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core_id) {
+  ToioSimTask* task = new ToioSimTask();
+  task->fn = fn;
+  task->arg = arg;
+  std::thread(toioSimTaskMain, task).detach();
+  if (handle) {
+    *handle = task;
+  }
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char* name, uint32_t stack_depth, void* arg,
+                       UBaseType_t priority, TaskHandle_t* handle) {
+  return xTaskCreatePinnedToCore(fn, name, stack_depth, arg, priority, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t handle) {
+  // 自タスクの削除のみ対応
+  if (handle == nullptr || handle == g_current_task) {
+    throw ToioSimTaskExit();
+  }
+}
+
+void vTaskDelay(TickType_t ticks) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+void vTaskDelayUntil(TickType_t* previous_wake_time, TickType_t increment) {
+  TickType_t wake = *previous_wake_time + increment;
+  int32_t wait = (int32_t)(wake - xTaskGetTickCount());
+  if (wait > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+  }
+  *previous_wake_time = wake;
+}
+
+TickType_t xTaskGetTickCount() {
+  return (TickType_t)millis();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  return g_current_task;
+}
+
+// ---------------------------------------------------------------
+// キュー
+// ---------------------------------------------------------------
+struct ToioSimQueue {
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::deque<std::vector<uint8_t>> items;
+  UBaseType_t length;
+  UBaseType_t item_size;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  ToioSimQueue* queue = new ToioSimQueue();
+  queue->length = length;
+  queue->item_size = item_size;
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+  delete queue;
+}
+
+static bool toioSimQueueWait(ToioSimQueue* queue, std::unique_lock<std::mutex>& lock, TickType_t ticks, bool for_send) {
+  auto ready = [queue, for_send]() {
+    return for_send ? (queue->items.size() < queue->length) : !queue->items.empty();
+  };
+  if (ticks == portMAX_DELAY) {
+    queue->cond.wait(lock, ready);
+    return true;
+  }
+  return queue->cond.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks_to_wait) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!toioSimQueueWait(queue, lock, ticks_to_wait, true)) {
+    return pdFAIL;
+  }
+  const uint8_t* p = (const uint8_t*)item;
+  queue->items.push_back(std::vector<uint8_t>(p, p + queue->item_size));
+  queue->cond.notify_all();
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* buffer, TickType_t ticks_to_wait) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!toioSimQueueWait(queue, lock, ticks_to_wait, false)) {
+    return pdFAIL;
+  }
+  memcpy(buffer, queue->items.front().data(), queue->item_size);
+  queue->items.pop_front();
+  queue->cond.notify_all();
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return queue->items.size();
+}
+
+// ---------------------------------------------------------------
+// ミューテックス
+// ---------------------------------------------------------------
+struct ToioSimSemaphore {
+  std::timed_mutex mutex;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return new ToioSimSemaphore();
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+  delete semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait) {
+  if (ticks_to_wait == portMAX_DELAY) {
+    semaphore->mutex.lock();
+    return pdTRUE;
+  }
+  return semaphore->mutex.try_lock_for(std::chrono::milliseconds(ticks_to_wait)) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  semaphore->mutex.unlock();
+  return pdTRUE;
+}
@@ -0,0 +1,84 @@
+/* ----------------------------------------------------------------
+  ToioSimPreferences.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include <Preferences.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+#include <vector>
+
+typedef std::map<std::string, std::vector<uint8_t>> ToioSimPrefsNamespace;
+
+static std::mutex g_prefs_mutex;
+static std::map<std::string, ToioSimPrefsNamespace> g_prefs;
+
+bool Preferences::begin(const char* name, bool readOnly) {
+  if (this->_started || name == nullptr || strlen(name) > 15) {
+    return false;
+  }
+  this->_namespace = name;
+  this->_read_only = readOnly;
+  this->_started = true;
+  return true;
+}
+
+void Preferences::end() {
+  this->_started = false;
+}
+
+bool Preferences::clear() {
+  if (!this->_started || this->_read_only) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(g_prefs_mutex);
+  g_prefs[this->_namespace].clear();
+  return true;
+}
+
+bool Preferences::remove(const char* key) {
+  if (!this->_started || this->_read_only) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(g_prefs_mutex);
+  return g_prefs[this->_namespace].erase(key) > 0;
+}
+
+size_t Preferences::putBytes(const char* key, const void* value, size_t len) {
+  if (!this->_started || this->_read_only || strlen(key) > 15) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(g_prefs_mutex);
+  const uint8_t* bytes = (const uint8_t*)value;
+  g_prefs[this->_namespace][key].assign(bytes, bytes + len);
+  return len;
+}
+
+size_t Preferences::getBytes(const char* key, void* buf, size_t maxLen) {
+  if (!this->_started) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(g_prefs_mutex);
+  ToioSimPrefsNamespace& ns = g_prefs[this->_namespace];
+  auto itr = ns.find(key);
+  if (itr == ns.end() || itr->second.size() > maxLen) {
+    return 0;
+  }
+  memcpy(buf, itr->second.data(), itr->second.size());
+  return itr->second.size();
+}
+
+size_t Preferences::getBytesLength(const char* key) {
+  if (!this->_started) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(g_prefs_mutex);
+  ToioSimPrefsNamespace& ns = g_prefs[this->_namespace];
+  auto itr = ns.find(key);
+  return (itr == ns.end()) ? 0 : itr->second.size();
+}
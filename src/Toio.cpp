@@ -8,26 +8,78 @@
   See LICENSE file in the project root for full license information.
   -------------------------------------------------------------- */
 #include "Toio.h"
+#include <algorithm>
 // ===============================================================
 // Toio クラス
 // ===============================================================
 
+// バックグラウンドスキャンの 1 ラウンドが完了したか
+// (BLEScan の完了コールバックには関数ポインタしか渡せないため static で持つ)
+static std::atomic<bool> g_scan_round_completed(false);
+
+// アドバタイズ受信のコールバック (BLE タスクから呼ばれる)
+class ToioAdvertisedDeviceCallback : public BLEAdvertisedDeviceCallbacks {
+  private:
+    Toio* _toio;
+
+  public:
+    ToioAdvertisedDeviceCallback(Toio* toio) {
+      this->_toio = toio;
+    }
+    void onResult(BLEAdvertisedDevice device) {
+      // サービス UUID が toio に一致しなければ無視
+      if (!device.haveServiceUUID()) {
+        return;
+      }
+      if (!device.isAdvertisingService(BLEUUID(this->_toio->_TOIO_SERVICE_UUID))) {
+        return;
+      }
+      this->_toio->_advertised_devices.push(device);
+    }
+};
+
 // ---------------------------------------------------------------
 // コンストラクタ
 // ---------------------------------------------------------------
 Toio::Toio() {
+  this->_scanning = false;
+  this->_scan_continuous = false;
+  this->_scan_deadline = 0;
+  this->_ondiscovery = nullptr;
+  this->_advertised_callback = new ToioAdvertisedDeviceCallback(this);
+  this->_reconnect_enabled = false;
+  this->_reconnect_min_ms = 50;
+  this->_reconnect_max_ms = 5000;
+  this->_recorder = nullptr;
+  this->_stats_out = nullptr;
+  this->_stats_interval_ms = 1000;
+  this->_stats_dumped_at = 0;
+  this->_dispatch_cursor = 0;
+  memset(&this->_loop_stats, 0, sizeof(this->_loop_stats));
+  memset(this->_event_priority, 0xff, sizeof(this->_event_priority));
+  this->_connecting = 0;
+  this->_connect_concurrency = TOIO_CONNECT_CONCURRENCY;
+  this->_max_connections = TOIO_MAX_CONNECTIONS;
+  this->_linked_count = 0;
+  this->_connected_count = 0;
+  this->_link_plan = false;
+  this->_link_event_units = TOIO_LINK_EVENT_UNITS;
+  this->_link_interval = 0;
+  this->_link_planned_for = 0;
+  memset(&this->_scheduler_stats, 0, sizeof(this->_scheduler_stats));
 }
 
 // ---------------------------------------------------------------
 // toio をスキャン
 // ---------------------------------------------------------------
 std::vector<ToioCore*> Toio::scan(uint8_t duration = 3) {
+  // バックグラウンドスキャン中なら停止
+  this->stopScan();
+
   // スキャンの準備
-  BLEDevice::init("");
+  this->_initBle();
   BLEScan* scan = BLEDevice::getScan();
-  scan->setActiveScan(true);
-  scan->setInterval(this->_BLE_SCAN_INTERVAL);
-  scan->setWindow(this->_BLE_SCAN_WINDOW);
+  scan->setAdvertisedDeviceCallbacks(nullptr);
 
   // スキャン開始
   BLEScanResults scan_res = scan->start(duration, false);
@@ -45,27 +97,495 @@ std::vector<ToioCore*> Toio::scan(uint8_t duration = 3) {
       continue;
     }
 
-    // ToioCore オブジェクトを生成
-    ToioCore* toiocore = new ToioCore(device);
+    // ToioCore オブジェクトを取得 (発見済みの toio ならそれを再利用)
+    ToioCore* toiocore = this->_addDevice(device);
     found_toiocore_list.push_back(toiocore);
-
-    // すでに発見済みの toio かどうかをチェック
-    std::string addr = toiocore->getAddress();
-    auto itr = this->_devices.find(addr);
-    if ( itr == this->_devices.end() ) {
-      this->_devices[addr] = toiocore;
-    }
   }
   scan->clearResults();
   return found_toiocore_list;
 }
 
+// ---------------------------------------------------------------
+// バックグラウンドで toio のスキャンを開始
+// ---------------------------------------------------------------
+void Toio::startScan(OnDiscoveryCallback cb, uint32_t duration) {
+  this->stopScan();
+  this->_initBle();
+  this->_ondiscovery = cb;
+  this->_scanning = true;
+  this->_scan_continuous = (duration == 0);
+  this->_scan_deadline = millis() + duration * 1000;
+  this->_advertised_devices.clear();
+  this->_startScanRound();
+}
+
+// ---------------------------------------------------------------
+// バックグラウンドスキャンを停止
+// ---------------------------------------------------------------
+void Toio::stopScan() {
+  if (!this->_scanning) {
+    return;
+  }
+  this->_scanning = false;
+  BLEScan* scan = BLEDevice::getScan();
+  scan->stop();
+  scan->setAdvertisedDeviceCallbacks(nullptr);
+  scan->clearResults();
+}
+
+// ---------------------------------------------------------------
+// バックグラウンドスキャン中かどうか
+// ---------------------------------------------------------------
+bool Toio::isScanning() {
+  return this->_scanning;
+}
+
 // ---------------------------------------------------------------
 // .ino の loop() 内で呼び出す
 // ---------------------------------------------------------------
-void Toio::loop() {
-  for (auto itr = this->_devices.begin(); itr != this->_devices.end(); ++itr) {
-    ToioCore* toiocore = itr->second;
-    toiocore->_loop();
+void Toio::loop(uint32_t budget_us) {
+  uint32_t started = micros();
+  this->_loopScan();
+  this->_scheduleConnections();
+  this->_dispatch(started, budget_us);
+  this->_planLinks();
+
+#if TOIO_STATS_ENABLED
+  // 通信の計測結果を定期的に表示
+  if (this->_stats_out && millis() - this->_stats_dumped_at >= this->_stats_interval_ms) {
+    this->_stats_dumped_at = millis();
+    for (auto& device : this->_devices) {
+      if (device.second->isConnected()) {
+        device.second->printLinkStats(*this->_stats_out);
+      }
+    }
+  }
+#endif
+
+  uint32_t elapsed = micros() - started;
+  this->_loop_stats.loops++;
+  this->_loop_stats.last_us = elapsed;
+  if (elapsed > this->_loop_stats.max_us) {
+    this->_loop_stats.max_us = elapsed;
+  }
+}
+
+// ---------------------------------------------------------------
+// 処理待ちのキューブだけを処理する
+// 1. 接続状態の処理と送信待ちの書き込み (すべて)
+// 2. 優先度の高いイベント (すべて)
+// 3. 通常のイベント (1 台ずつ TOIO_DISPATCH_BATCH 個ずつ順番に、時間の予算の範囲で)
+// ---------------------------------------------------------------
+void Toio::_dispatch(uint32_t started, uint32_t budget_us) {
+  // 登録された順に並べる
+  std::vector<ToioCore*>& cubes = this->_ready_cubes;
+  cubes.clear();
+  for (ToioReadyNode<ToioCore>* node = this->_ready.takeAll(); node; node = node->next) {
+    cubes.push_back(node->owner);
+  }
+  std::reverse(cubes.begin(), cubes.end());
+  size_t n = cubes.size();
+  this->_loop_stats.cubes = n;
+  if (n == 0) {
+    return;
+  }
+
+  // 書き込みやイベントの処理で同じキューブばかりが後回しにならないよう、始める位置をずらす
+  size_t start = this->_dispatch_cursor++ % n;
+  for (size_t k = 0; k < n; k++) {
+    cubes[(start + k) % n]->_service();
+  }
+  if (this->_spatial.isEnabled()) {
+    for (size_t k = 0; k < n; k++) {
+      this->_spatial.update(cubes[(start + k) % n]);
+    }
+  }
+  uint32_t events = 0;
+  for (size_t k = 0; k < n; k++) {
+    events += cubes[(start + k) % n]->_dispatchEvents(true, TOIO_CORE_URGENT_QUEUE_SIZE);
+  }
+
+  size_t rounds = TOIO_CORE_EVENT_QUEUE_SIZE / TOIO_DISPATCH_BATCH + 1;
+  bool deferred = false;
+  for (size_t r = 0; r < rounds && !deferred; r++) {
+    uint32_t dispatched = 0;
+    for (size_t k = 0; k < n && !deferred; k++) {
+      ToioCore* toiocore = cubes[(start + k) % n];
+      for (size_t j = 0; j < TOIO_DISPATCH_BATCH; j++) {
+        // 予算はイベント 1 個ごとに確かめる (超えるのは最後の 1 個の処理時間まで)
+        if (budget_us > 0 && (uint32_t)(micros() - started) >= budget_us) {
+          deferred = true;
+          break;
+        }
+        if (toiocore->_dispatchEvents(false, 1) == 0) {
+          break;
+        }
+        dispatched++;
+      }
+    }
+    events += dispatched;
+    if (dispatched == 0) {
+      break;
+    }
+  }
+  this->_loop_stats.events += events;
+  if (deferred) {
+    this->_loop_stats.deferred++;
+  }
+
+  // 処理すべきことが残っているキューブは登録し直す
+  for (ToioCore* toiocore : cubes) {
+    this->_ready.release(&toiocore->_ready_node);
+    if (!toiocore->_isIdle()) {
+      this->_ready.push(&toiocore->_ready_node);
+    }
+  }
+}
+
+// ---------------------------------------------------------------
+// 発見済みと今後発見するすべてのキューブのイベントの優先度をセット
+// ---------------------------------------------------------------
+void Toio::setEventPriority(ToioCoreEventType type, ToioCoreEventPriority priority) {
+  if (type >= sizeof(this->_event_priority)) {
+    return;
+  }
+  this->_event_priority[type] = priority;
+  for (auto& device : this->_devices) {
+    device.second->setEventPriority(type, priority);
+  }
+}
+
+// ---------------------------------------------------------------
+// loop() の統計情報を取得
+// ---------------------------------------------------------------
+ToioLoopStats Toio::getLoopStats() {
+  return this->_loop_stats;
+}
+
+// ---------------------------------------------------------------
+// 同時に BLE 接続を始めるキューブの数をセット
+// ---------------------------------------------------------------
+void Toio::setConnectConcurrency(uint8_t n) {
+  this->_connect_concurrency = n;
+}
+
+// ---------------------------------------------------------------
+// 同時に接続できるキューブの数をセット
+// ---------------------------------------------------------------
+void Toio::setMaxConnections(uint8_t n) {
+  this->_max_connections = n;
+}
+
+// ---------------------------------------------------------------
+// 接続中のキューブの数に合わせた接続間隔の計画を有効・無効にする
+// (無効にすると、計画した接続間隔の要求を取り消し、各キューブが要求していた接続間隔に戻す)
+// ---------------------------------------------------------------
+void Toio::setLinkPlan(bool enable, uint8_t event_units) {
+  this->_link_plan = enable;
+  this->_link_event_units = event_units ? event_units : 1;
+  this->_link_planned_for = 0;
+  if (!enable && this->_link_interval) {
+    this->_link_interval = 0;
+    this->_scheduler_stats.interval = 0;
+    for (auto& device : this->_devices) {
+      device.second->_applyLinkPlan(0);
+    }
+  }
+}
+
+// ---------------------------------------------------------------
+// 接続の順番と接続間隔の統計情報を取得
+// ---------------------------------------------------------------
+ToioSchedulerStats Toio::getSchedulerStats() {
+  ToioSchedulerStats stats = this->_scheduler_stats;
+  stats.connecting = this->_connecting;
+  stats.waiting = 0;
+  for (auto& entry : this->_connect_queue) {
+    if (entry.first->_conn_waiting) {
+      stats.waiting++;
+    }
+  }
+  stats.connected = this->_connected_count;
+  return stats;
+}
+
+// ---------------------------------------------------------------
+// 空間インデックスを有効・無効にする
+// (有効にしたら、発見済みのすべてのキューブの最新の位置を反映する)
+// ---------------------------------------------------------------
+void Toio::setSpatialIndex(bool enable, uint16_t cell_size) {
+  this->_spatial.setEnabled(enable, cell_size);
+  if (!enable) {
+    return;
+  }
+  for (auto& device : this->_devices) {
+    this->_spatial.update(device.second);
+  }
+}
+
+// ---------------------------------------------------------------
+// toiocore の近くにいる他のキューブを探す
+// ---------------------------------------------------------------
+size_t Toio::findNeighbors(ToioCore* toiocore, uint16_t radius, ToioCore** cubes, size_t max) {
+  return this->_spatial.findNeighbors(toiocore, radius, cubes, max);
+}
+
+// ---------------------------------------------------------------
+// マットの座標の近くにいるキューブを探す
+// ---------------------------------------------------------------
+size_t Toio::findCubesNear(int32_t x, int32_t y, uint16_t radius, ToioCore** cubes, size_t max) {
+  if (!this->_spatial.isEnabled()) {
+    return 0;
+  }
+  return this->_spatial.findNear(x, y, radius, cubes, max);
+}
+
+// ---------------------------------------------------------------
+// 衝突回避を有効・無効にする
+// ---------------------------------------------------------------
+void Toio::setCollisionAvoidance(bool enable, uint16_t stop_distance, uint16_t slow_distance) {
+  if (enable && !this->_spatial.isEnabled()) {
+    this->setSpatialIndex(true);
+  }
+  this->_spatial.setAvoidance(enable, stop_distance, slow_distance);
+}
+
+// ---------------------------------------------------------------
+// 空間インデックスの統計情報を取得
+// ---------------------------------------------------------------
+ToioSpatialStats Toio::getSpatialStats() {
+  return this->_spatial.getStats();
+}
+
+// ---------------------------------------------------------------
+// 最大接続数を超えないか確かめる (接続を始める前に ToioCore から呼ばれる)
+// ---------------------------------------------------------------
+bool Toio::_admitConnect(ToioCore* toiocore) {
+  if (this->_max_connections == 0) {
+    return true;
+  }
+  size_t links = this->_linked_count;
+  if (toiocore->getConnectionState() != TOIO_CORE_CONNECTION_DISCONNECTED && links > 0) {
+    links--;
+  }
+  if (links >= this->_max_connections) {
+    this->_scheduler_stats.rejected++;
+    return false;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------
+// BLE 接続の枠を取得 / 返却 (どのタスクから呼んでもよい)
+// ---------------------------------------------------------------
+bool Toio::_acquireConnectSlot() {
+  uint8_t n = this->_connecting.load();
+  do {
+    if (this->_connect_concurrency != 0 && n >= this->_connect_concurrency) {
+      return false;
+    }
+  } while (!this->_connecting.compare_exchange_weak(n, n + 1));
+  return true;
+}
+
+void Toio::_releaseConnectSlot() {
+  this->_connecting--;
+}
+
+// ---------------------------------------------------------------
+// キューブの接続状態の変化を数に反映する (ToioCore から呼ばれる。どのタスクから呼んでもよい)
+// ---------------------------------------------------------------
+void Toio::_onConnectionState(uint8_t from, uint8_t to) {
+  bool was_linked = (from != TOIO_CORE_CONNECTION_DISCONNECTED);
+  bool linked = (to != TOIO_CORE_CONNECTION_DISCONNECTED);
+  if (was_linked != linked) {
+    linked ? this->_linked_count++ : this->_linked_count--;
+  }
+  bool was_connected = (from == TOIO_CORE_CONNECTION_CONNECTED);
+  bool connected = (to == TOIO_CORE_CONNECTION_CONNECTED);
+  if (was_connected != connected) {
+    connected ? this->_connected_count++ : this->_connected_count--;
+  }
+}
+
+// ---------------------------------------------------------------
+// BLE 接続の順番待ちに加える (connectAsync() から呼ばれる)
+// ---------------------------------------------------------------
+void Toio::_queueConnect(ToioCore* toiocore) {
+  this->_connect_queue.push_back(std::make_pair(toiocore, millis()));
+  toiocore->_markReady();
+}
+
+// ---------------------------------------------------------------
+// 枠が空いていれば、順番待ちのキューブの BLE 接続を始める
+// ---------------------------------------------------------------
+void Toio::_scheduleConnections() {
+  while (!this->_connect_queue.empty()) {
+    ToioCore* toiocore = this->_connect_queue.front().first;
+    unsigned long queued_at = this->_connect_queue.front().second;
+    // 順番待ちの間に disconnect() されたキューブは除く
+    if (!toiocore->_conn_waiting) {
+      this->_connect_queue.pop_front();
+      continue;
+    }
+    if (!this->_acquireConnectSlot()) {
+      return;
+    }
+    this->_connect_queue.pop_front();
+    uint32_t waited = millis() - queued_at;
+    if (waited > this->_scheduler_stats.max_wait_ms) {
+      this->_scheduler_stats.max_wait_ms = waited;
+    }
+    this->_scheduler_stats.granted++;
+    toiocore->_conn_slot = true;
+    toiocore->_grantConnect();
+  }
+}
+
+// ---------------------------------------------------------------
+// 接続中のキューブの数が変わったら、共通の接続間隔を計画し直す
+// (全キューブの接続イベントが 1 回の接続間隔に収まるようにする)
+// ---------------------------------------------------------------
+void Toio::_planLinks() {
+  if (!this->_link_plan) {
+    return;
+  }
+  size_t n = this->_connected_count;
+  if (n == 0 || n == this->_link_planned_for) {
+    return;
+  }
+  uint32_t interval = n * this->_link_event_units;
+  if (interval < 0x0006) {
+    interval = 0x0006;
+  } else if (interval > 0x0c80) {
+    interval = 0x0c80;
+  }
+  this->_link_planned_for = n;
+  this->_link_interval = interval;
+  this->_scheduler_stats.interval = interval;
+  this->_scheduler_stats.replans++;
+  for (auto& device : this->_devices) {
+    device.second->_applyLinkPlan(interval);
+  }
+}
+
+// ---------------------------------------------------------------
+// 発見済みと今後発見するすべてのキューブの自動再接続を設定
+// ---------------------------------------------------------------
+void Toio::setAutoReconnect(bool enable, uint32_t min_backoff_ms, uint32_t max_backoff_ms) {
+  this->_reconnect_enabled = enable;
+  this->_reconnect_min_ms = min_backoff_ms;
+  this->_reconnect_max_ms = max_backoff_ms;
+  for (auto& device : this->_devices) {
+    device.second->setAutoReconnect(enable, min_backoff_ms, max_backoff_ms);
+  }
+}
+
+// ---------------------------------------------------------------
+// 発見済みと今後発見するすべてのキューブの記録先をセット
+// ---------------------------------------------------------------
+void Toio::setRecorder(ToioRecorder* recorder) {
+  this->_recorder = recorder;
+  for (auto& device : this->_devices) {
+    device.second->setRecorder(recorder);
+  }
+}
+
+// ---------------------------------------------------------------
+// 接続中のすべてのキューブの通信の計測結果を定期的に表示
+// ---------------------------------------------------------------
+void Toio::setLinkStatsDump(Print* out, uint32_t interval_ms) {
+  this->_stats_out = out;
+  this->_stats_interval_ms = interval_ms;
+  this->_stats_dumped_at = millis();
+}
+
+// ---------------------------------------------------------------
+// BLE の初期化 (初回のみ)
+// ---------------------------------------------------------------
+void Toio::_initBle() {
+  if (BLEDevice::getInitialized()) {
+    return;
+  }
+  BLEDevice::init("");
+  BLEScan* scan = BLEDevice::getScan();
+  scan->setActiveScan(true);
+  scan->setInterval(this->_BLE_SCAN_INTERVAL);
+  scan->setWindow(this->_BLE_SCAN_WINDOW);
+}
+
+// ---------------------------------------------------------------
+// 発見した toio を登録し、その ToioCore オブジェクトを返す
+// (発見済みの toio なら既存の ToioCore オブジェクトを返す)
+// ---------------------------------------------------------------
+ToioCore* Toio::_addDevice(BLEAdvertisedDevice& device) {
+  std::string addr = device.getAddress().toString();
+  ToioCore* toiocore = nullptr;
+  auto itr = this->_devices.find(addr);
+  if (itr == this->_devices.end()) {
+    toiocore = new ToioCore(device);
+    toiocore->setAutoReconnect(this->_reconnect_enabled, this->_reconnect_min_ms, this->_reconnect_max_ms);
+    if (this->_recorder) {
+      toiocore->setRecorder(this->_recorder);
+    }
+    for (uint8_t type = 0; type < sizeof(this->_event_priority); type++) {
+      if (this->_event_priority[type] != 0xff) {
+        toiocore->setEventPriority((ToioCoreEventType)type, (ToioCoreEventPriority)this->_event_priority[type]);
+      }
+    }
+    toiocore->_ready_list = &this->_ready;
+    toiocore->_toio = this;
+    if (this->_link_interval) {
+      toiocore->_applyLinkPlan(this->_link_interval);
+    }
+    toiocore->_markReady();
+    this->_devices[addr] = toiocore;
+  } else {
+    toiocore = itr->second;
+  }
+  toiocore->_setRssi(device.getRSSI());
+  return toiocore;
+}
+
+// ---------------------------------------------------------------
+// バックグラウンドスキャンの 1 ラウンドを開始
+// ---------------------------------------------------------------
+void Toio::_startScanRound() {
+  uint32_t duration = this->_BLE_SCAN_ROUND_DURATION;
+  if (!this->_scan_continuous) {
+    int32_t remaining = (int32_t)(this->_scan_deadline - millis());
+    if (remaining <= 0) {
+      this->stopScan();
+      return;
+    }
+    uint32_t remaining_sec = (remaining + 999) / 1000;
+    if (remaining_sec < duration) {
+      duration = remaining_sec;
+    }
+  }
+  g_scan_round_completed = false;
+  BLEScan* scan = BLEDevice::getScan();
+  scan->clearResults();
+  scan->setAdvertisedDeviceCallbacks(this->_advertised_callback, false);
+  scan->start(duration, [](BLEScanResults results) {
+    g_scan_round_completed = true;
+  }, false);
+}
+
+// ---------------------------------------------------------------
+// バックグラウンドスキャンで受信したアドバタイズを処理
+// ---------------------------------------------------------------
+void Toio::_loopScan() {
+  BLEAdvertisedDevice device;
+  while (this->_advertised_devices.pop(device)) {
+    ToioCore* toiocore = this->_addDevice(device);
+    if (this->_ondiscovery) {
+      this->_ondiscovery(toiocore, device.getRSSI());
+    }
+  }
+
+  // ラウンドが完了したら次のラウンドを開始
+  if (this->_scanning && g_scan_round_completed.exchange(false)) {
+    this->_startScanRound();
   }
 }
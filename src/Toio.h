@@ -14,11 +14,69 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <deque>
+#include <functional>
+#include <atomic>
 #include <BLEDevice.h>
 #include <BLEUtils.h>
 #include <BLEScan.h>
 #include <BLEAdvertisedDevice.h>
 #include "ToioCore.h"
+#include "ToioGroup.h"
+#include "ToioController.h"
+#include "ToioRecorder.h"
+#include "ToioReplay.h"
+#include "ToioSequencer.h"
+#include "ToioRingBuffer.h"
+#include "ToioReadyList.h"
+#include "ToioSpatial.h"
+
+// loop() で通常のイベントを 1 台ずつ続けて処理する数
+// (時間の予算を使い切る前に、すべてのキューブに順番が回るようにする)
+#ifndef TOIO_DISPATCH_BATCH
+#define TOIO_DISPATCH_BATCH 8
+#endif
+
+// loop() の統計情報
+struct ToioLoopStats {
+  uint32_t loops;     // loop() の呼び出し回数
+  uint32_t cubes;     // 直近の loop() で処理したキューブの数
+  uint32_t events;    // 処理したイベントの累計
+  uint32_t deferred;  // 時間の予算を使い切り、通常のイベントを次の loop() に持ち越した回数
+  uint32_t last_us;   // 直近の loop() の所要時間 (マイクロ秒)
+  uint32_t max_us;    // loop() の所要時間の最大値 (マイクロ秒)
+};
+
+// 同時に BLE 接続を始めるキューブの数の既定値 (0 なら制限なし)
+// (多くのコントローラーは一度に 1 つの接続しか確立できない)
+#ifndef TOIO_CONNECT_CONCURRENCY
+#define TOIO_CONNECT_CONCURRENCY 1
+#endif
+
+// 同時に接続できるキューブの数の既定値 (0 なら制限なし)
+// (ESP32 では BLE スタックの設定で決まる最大接続数に合わせる)
+#ifndef TOIO_MAX_CONNECTIONS
+#define TOIO_MAX_CONNECTIONS 0
+#endif
+
+// 接続間隔を計画するとき 1 台の接続イベントに見込む時間の既定値 (1.25 ミリ秒単位)
+#ifndef TOIO_LINK_EVENT_UNITS
+#define TOIO_LINK_EVENT_UNITS 2
+#endif
+
+// 接続の順番と接続間隔の統計情報
+struct ToioSchedulerStats {
+  uint8_t connecting;   // BLE 接続を始めているキューブの数
+  uint8_t waiting;      // BLE 接続の順番を待っているキューブの数
+  uint8_t connected;    // 接続中のキューブの数
+  uint16_t interval;    // 計画した接続間隔 (1.25 ミリ秒単位。計画していなければ 0)
+  uint32_t granted;     // BLE 接続を始めた回数
+  uint32_t rejected;    // 最大接続数に達していたため接続しなかった回数
+  uint32_t replans;     // 接続間隔を計画し直した回数
+  uint32_t max_wait_ms; // BLE 接続の順番を待った時間の最大値 (ミリ秒)
+};
+
+typedef std::function<void(ToioCore* toiocore, int rssi)> OnDiscoveryCallback;
 
 // ---------------------------------------------------------------
 // Toio クラス
@@ -34,9 +92,86 @@ class Toio {
     // toio のプライマリサービス UUID (スキャンのフィルタリングに使う)
     const char* _TOIO_SERVICE_UUID = "10b20100-5b3b-4571-9508-cf3efcd7bbae";
 
+    // バックグラウンドスキャンの 1 ラウンドの秒数
+    // (ラウンドごとにスキャン結果を破棄して、メモリ使用量を一定に保つ)
+    const uint32_t _BLE_SCAN_ROUND_DURATION = 5;
+
     // 発見済みの toio (ToioCore オブジェクト) の map (キーはアドレス)
     std::map<std::string, ToioCore*> _devices;
 
+    // バックグラウンドスキャンの状態
+    bool _scanning;
+    bool _scan_continuous;
+    unsigned long _scan_deadline;
+    OnDiscoveryCallback _ondiscovery;
+    BLEAdvertisedDeviceCallbacks* _advertised_callback;
+
+    // 自動再接続の設定 (後から発見したキューブにも適用する)
+    bool _reconnect_enabled;
+    uint32_t _reconnect_min_ms;
+    uint32_t _reconnect_max_ms;
+
+    // 通知と書き込みの記録先 (後から発見したキューブにも適用する)
+    ToioRecorder* _recorder;
+
+    // 通信の計測結果の定期的な表示先 (nullptr なら表示しない)
+    Print* _stats_out;
+    uint32_t _stats_interval_ms;
+    unsigned long _stats_dumped_at;
+
+    // BLE タスクで受信したアドバタイズ (loop() で処理する)
+    ToioRingBuffer<BLEAdvertisedDevice, 16> _advertised_devices;
+
+    // 処理すべきことがあるキューブ (イベントの受信などで登録され、loop() で処理する)
+    ToioReadyList<ToioCore> _ready;
+    std::vector<ToioCore*> _ready_cubes;
+    size_t _dispatch_cursor;
+    ToioLoopStats _loop_stats;
+
+    // イベントの種類ごとの優先度 (後から発見したキューブにも適用する。0xff なら既定のまま)
+    uint8_t _event_priority[16];
+
+    // BLE 接続の順番待ち (loop タスクのみが更新する。値は順番待ちを始めた時刻)
+    // (_connecting は BLE 接続を始めているキューブの数で、ワーカータスクからも減らす)
+    std::deque<std::pair<ToioCore*, unsigned long>> _connect_queue;
+    std::atomic<uint8_t> _connecting;
+    uint8_t _connect_concurrency;
+    uint8_t _max_connections;
+
+    // 接続処理中または接続中のキューブの数と、そのうち接続中のキューブの数
+    // (キューブの接続状態が変わるたびに ToioCore から更新する)
+    std::atomic<uint16_t> _linked_count;
+    std::atomic<uint16_t> _connected_count;
+
+    // 接続中のキューブの数に合わせた共通の接続間隔
+    bool _link_plan;
+    uint8_t _link_event_units;
+    uint16_t _link_interval;
+    size_t _link_planned_for;
+    ToioSchedulerStats _scheduler_stats;
+
+    // マット上のキューブの空間インデックスと衝突回避 (loop() で位置を反映する)
+    ToioSpatial _spatial;
+
+    friend class ToioAdvertisedDeviceCallback;
+    friend class ToioCore;
+    friend class ToioGroup;
+    friend class ToioReplay;
+
+  private:
+    void _initBle();
+    ToioCore* _addDevice(BLEAdvertisedDevice& device);
+    void _startScanRound();
+    void _loopScan();
+    void _dispatch(uint32_t started, uint32_t budget_us);
+    bool _admitConnect(ToioCore* toiocore);
+    bool _acquireConnectSlot();
+    void _releaseConnectSlot();
+    void _onConnectionState(uint8_t from, uint8_t to);
+    void _queueConnect(ToioCore* toiocore);
+    void _scheduleConnections();
+    void _planLinks();
+
   public:
     // コンストラクタ
     Toio();
@@ -44,8 +179,68 @@ class Toio {
     // toio をスキャン
     std::vector<ToioCore*> scan(uint8_t duration);
 
+    // バックグラウンドで toio のスキャンを開始 (duration が 0 なら停止するまで継続)
+    void startScan(OnDiscoveryCallback cb, uint32_t duration = 0);
+
+    // バックグラウンドスキャンを停止
+    void stopScan();
+
+    // バックグラウンドスキャン中かどうか
+    bool isScanning();
+
+    // 発見済みと今後発見するすべてのキューブの自動再接続を設定
+    void setAutoReconnect(bool enable, uint32_t min_backoff_ms = 50, uint32_t max_backoff_ms = 5000);
+
+    // 発見済みと今後発見するすべてのキューブの記録先をセット (nullptr で記録をやめる)
+    void setRecorder(ToioRecorder* recorder);
+
+    // 接続中のすべてのキューブの通信の計測結果を interval_ms ごとに表示 (nullptr で停止)
+    void setLinkStatsDump(Print* out, uint32_t interval_ms = 1000);
+
+    // 発見済みと今後発見するすべてのキューブのイベントの優先度をセット
+    void setEventPriority(ToioCoreEventType type, ToioCoreEventPriority priority);
+
+    // loop() の統計情報を取得
+    ToioLoopStats getLoopStats();
+
+    // 同時に BLE 接続を始めるキューブの数をセット (0 なら制限なし)
+    // (connectAsync() したキューブは順番を待ち、loop() で 1 台ずつ BLE 接続を始める)
+    void setConnectConcurrency(uint8_t n);
+
+    // 同時に接続できるキューブの数をセット (0 なら制限なし)
+    void setMaxConnections(uint8_t n);
+
+    // 接続中のキューブの数に合わせて、全キューブに共通の接続間隔を要求するかどうか
+    // (接続間隔は 台数 x event_units。各キューブのモーター制御の書き込み間隔は
+    //  接続間隔より短くしない)
+    void setLinkPlan(bool enable, uint8_t event_units = TOIO_LINK_EVENT_UNITS);
+
+    // 接続の順番と接続間隔の統計情報を取得
+    ToioSchedulerStats getSchedulerStats();
+
+    // マット上のキューブの空間インデックスを有効・無効にする
+    // (有効にすると loop() で位置が更新されたキューブだけをインデックスに反映する)
+    void setSpatialIndex(bool enable, uint16_t cell_size = TOIO_SPATIAL_CELL_SIZE);
+
+    // toiocore から radius 以内にいる他のキューブを探す (見つけた数を返す)
+    size_t findNeighbors(ToioCore* toiocore, uint16_t radius, ToioCore** cubes, size_t max);
+
+    // マットの座標 (x, y) から radius 以内にいるキューブを探す (見つけた数を返す)
+    size_t findCubesNear(int32_t x, int32_t y, uint16_t radius, ToioCore** cubes, size_t max);
+
+    // 衝突回避を有効・無効にする (有効にすると空間インデックスも有効にする)
+    // (前方・後方のキューブまでの距離が slow_distance 未満なら、その向きの速度を距離に
+    //  比例して下げ、stop_distance 以下なら止める)
+    void setCollisionAvoidance(bool enable, uint16_t stop_distance = TOIO_SPATIAL_STOP_DISTANCE,
+                               uint16_t slow_distance = TOIO_SPATIAL_SLOW_DISTANCE);
+
+    // 空間インデックスの統計情報を取得
+    ToioSpatialStats getSpatialStats();
+
     // .ino の loop() 内で呼び出す
-    void loop();
+    // (budget_us は通常のイベントの処理に使ってよい時間 (マイクロ秒)。0 なら溜まっている
+    //  イベントをすべて処理する。使い切ったら残りは次の loop() で処理する)
+    void loop(uint32_t budget_us = 0);
 };
 
 #endif
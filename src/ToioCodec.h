@@ -0,0 +1,610 @@
+/* ----------------------------------------------------------------
+  ToioCodec.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioCodec_h
+#define ToioCodec_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// ---------------------------------------------------------------
+// toio コア キューブの通信のデータの組み立てと解釈
+//
+// BLE にも Arduino にも依存しないヘッダーだけのコード。
+// - toioEncodeXxx() は書き込むデータを ToioPacket に組み立てて返す
+//   (長さが決まっているものは constexpr。メモリの確保はない)
+// - toioDecodeXxx() は通知・読み出し・設定の応答のデータを解釈し、
+//   形式が正しければ true を返す
+// ---------------------------------------------------------------
+
+// 書き込むデータ (N は最大長。スタックに置いて使う)
+template <size_t N>
+struct ToioPacket {
+  uint8_t data[N];
+  size_t length;
+};
+
+// モーションセンサーの値
+struct ToioCoreMotionData {
+  bool flat;
+  bool clash;
+  bool dtap;
+  uint8_t attitude;
+  uint8_t shake;    // シェイクの強さ (0 ならシェイクなし。BLE プロトコル 2.1.0 以降)
+};
+
+// 姿勢角の通知の形式
+enum ToioCorePostureType : uint8_t {
+  TOIO_CORE_POSTURE_EULER = 1,     // オイラー角 (1 度単位)
+  TOIO_CORE_POSTURE_QUATERNION,    // クォータニオン
+  TOIO_CORE_POSTURE_EULER_PRECISE  // 高精度オイラー角
+};
+
+// 姿勢角 (固定小数点)
+struct ToioCorePostureData {
+  ToioCorePostureType type; // 通知の形式
+  int32_t roll;             // ロール (1/100 度。クォータニオンの通知なら 0)
+  int32_t pitch;            // ピッチ (1/100 度。同上)
+  int32_t yaw;              // ヨー (1/100 度。同上)
+  int16_t qw;               // クォータニオン (Q14: 16384 が 1.0。クォータニオンの通知のときだけ)
+  int16_t qx;
+  int16_t qy;
+  int16_t qz;
+};
+
+// 磁気センサーの機能
+enum ToioCoreMagneticMode : uint8_t {
+  TOIO_CORE_MAGNETIC_DISABLED = 0, // 無効
+  TOIO_CORE_MAGNETIC_STATE,        // 磁石の状態を検出
+  TOIO_CORE_MAGNETIC_FORCE         // 磁力を検出
+};
+
+// 磁気センサーの値
+struct ToioCoreMagneticData {
+  uint8_t state;    // 磁石の状態 (0 なら磁石なし。TOIO_CORE_MAGNETIC_STATE のとき)
+  uint8_t strength; // 磁力の強さ (TOIO_CORE_MAGNETIC_FORCE のとき)
+  int8_t x;         // 磁力の向き (TOIO_CORE_MAGNETIC_FORCE のとき)
+  int8_t y;
+  int8_t z;
+};
+
+// 姿勢角・磁気センサーの通知の条件
+enum ToioCoreNotifyCondition : uint8_t {
+  TOIO_CORE_NOTIFY_ALWAYS = 0,  // 間隔ごとに常に通知
+  TOIO_CORE_NOTIFY_ON_CHANGE    // 値が変化したときだけ通知
+};
+
+// LED のシナリオに入れられるステップの最大数 (toio の仕様)
+#define TOIO_CORE_LED_SCENARIO_MAX_STEPS 29
+
+
+// LED のシナリオの 1 ステップ
+struct ToioCoreLedStep {
+  uint16_t duration_ms; // 点灯する時間 (ミリ秒。10 ミリ秒単位で 10 ～ 2550 に丸める)
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+};
+
+// ID 情報の種類
+enum ToioCoreIdType : uint8_t {
+  TOIO_CORE_ID_POSITION = 1, // Position ID (マットの座標)
+  TOIO_CORE_ID_STANDARD      // Standard ID (カードやシールの ID)
+};
+
+// Position ID
+struct ToioCorePositionData {
+  uint16_t x;            // キューブの中心の X 座標
+  uint16_t y;            // キューブの中心の Y 座標
+  uint16_t angle;        // キューブの角度 (度)
+  uint16_t sensor_x;     // 読み取りセンサーの X 座標
+  uint16_t sensor_y;     // 読み取りセンサーの Y 座標
+  uint16_t sensor_angle; // 読み取りセンサーの角度 (度)
+};
+
+// Standard ID
+struct ToioCoreStandardIdData {
+  uint32_t id;    // Standard ID の値
+  uint16_t angle; // キューブの角度 (度)
+};
+
+// 目標指定付きモーター制御の移動タイプ
+enum ToioCoreMoveType : uint8_t {
+  TOIO_CORE_MOVE_ROTATE_WHILE_MOVING = 0, // 回転しながら移動
+  TOIO_CORE_MOVE_NO_BACKWARD,             // 回転しながら移動 (後退なし)
+  TOIO_CORE_MOVE_ROTATE_THEN_MOVE         // 回転してから移動
+};
+
+// 目標指定付きモーター制御の速度変化タイプ
+enum ToioCoreSpeedType : uint8_t {
+  TOIO_CORE_SPEED_CONSTANT = 0,   // 速度一定
+  TOIO_CORE_SPEED_ACCELERATE,     // 目標地点まで徐々に加速
+  TOIO_CORE_SPEED_DECELERATE,     // 目標地点まで徐々に減速
+  TOIO_CORE_SPEED_ACCEL_DECEL     // 中間地点まで徐々に加速し、そこから目標地点まで減速
+};
+
+// 目標地点でのキューブの角度の意味
+enum ToioCoreAngleType : uint8_t {
+  TOIO_CORE_ANGLE_ABSOLUTE = 0,          // 絶対角度 (回転量が少ない方向)
+  TOIO_CORE_ANGLE_ABSOLUTE_POSITIVE,     // 絶対角度 (正方向)
+  TOIO_CORE_ANGLE_ABSOLUTE_NEGATIVE,     // 絶対角度 (負方向)
+  TOIO_CORE_ANGLE_RELATIVE_POSITIVE,     // 相対角度 (正方向)
+  TOIO_CORE_ANGLE_RELATIVE_NEGATIVE,     // 相対角度 (負方向)
+  TOIO_CORE_ANGLE_NONE,                  // 角度を指定しない (回転しない)
+  TOIO_CORE_ANGLE_SAME_AS_WRITE          // 書き込み時と同じ角度 (回転量が少ない方向)
+};
+
+// 目標地点
+struct ToioCoreTarget {
+  uint16_t x;                  // X 座標 (0xffff なら現在の X 座標のまま)
+  uint16_t y;                  // Y 座標 (0xffff なら現在の Y 座標のまま)
+  uint16_t angle;              // 角度 (度, 0 ～ 8191)
+  ToioCoreAngleType angle_type;
+};
+
+// 目標指定付きモーター制御のパラメーター
+struct ToioCoreTargetParams {
+  uint8_t timeout;             // タイムアウト (秒, 0 なら 10 秒)
+  ToioCoreMoveType move_type;
+  uint8_t max_speed;           // 最大速度の指示値 (10 ～ 255)
+  ToioCoreSpeedType speed_type;
+};
+
+// 目標指定付きモーター制御の応答
+enum ToioCoreMotorResult : uint8_t {
+  TOIO_CORE_MOTOR_RESULT_SUCCESS = 0,   // 目標地点に到着
+  TOIO_CORE_MOTOR_RESULT_TIMEOUT,       // タイムアウト
+  TOIO_CORE_MOTOR_RESULT_ID_MISSED,     // toio ID を読み取れなくなった
+  TOIO_CORE_MOTOR_RESULT_INVALID_PARAMS,// パラメーターの組み合わせが不正
+  TOIO_CORE_MOTOR_RESULT_INVALID_STATE, // 電源が切られたなど、動作できない状態
+  TOIO_CORE_MOTOR_RESULT_OVERWRITTEN,   // 他のモーター制御で上書きされた
+  TOIO_CORE_MOTOR_RESULT_NOT_SUPPORTED, // 非対応のモーター制御
+  TOIO_CORE_MOTOR_RESULT_APPEND_FAILED  // 複数目標の追加に失敗 (追加できる数を超えた)
+};
+
+struct ToioCoreMotorResponse {
+  uint8_t request_id;
+  ToioCoreMotorResult result;
+};
+
+// モーターの速度情報 (キューブが測った速度。速度指示値と同じ単位で、向きは含まない)
+struct ToioCoreMotorSpeed {
+  uint8_t left;
+  uint8_t right;
+};
+
+// 複数目標指定付きモーター制御の 1 回の書き込みに入れられる目標地点の最大数 (toio の仕様)
+#define TOIO_TARGETS_MAX 29
+
+// 1 回の MIDI 再生の書き込みで送れる音の最大数 (toio の仕様)
+#define TOIO_MIDI_MAX_NOTES 59
+
+// 休符の音階番号
+#define TOIO_NOTE_REST 128
+
+// MIDI の 1 音 (書き込みのデータと同じ並び)
+struct ToioNote {
+  uint8_t duration; // 長さ (10 ミリ秒単位, 1 ～ 255)
+  uint8_t note;     // 音階番号 (0 ～ 127。TOIO_NOTE_REST なら休符)
+  uint8_t volume;   // 音量 (0 ～ 255)
+};
+
+static_assert(sizeof(ToioNote) == 3, "ToioNote must match the MIDI packet layout");
+
+// 音名とオクターブから音階番号を求める (例 toioPitch('A', 5) は 69)
+// (accidental は半音の上げ下げ。1 ならシャープ、-1 ならフラット)
+constexpr uint8_t toioPitch(char name, int octave, int accidental = 0) {
+  return (uint8_t)(12 * octave + accidental +
+                   (name == 'C' ? 0 : name == 'D' ? 2 : name == 'E' ? 4 : name == 'F' ? 5 :
+                    name == 'G' ? 7 : name == 'A' ? 9 : 11));
+}
+
+// 1 音を作る (ms は 10 ～ 2550 ミリ秒に丸める)
+constexpr ToioNote toioNote(uint8_t note, uint16_t ms, uint8_t volume = 255) {
+  return ToioNote{(uint8_t)(ms < 10 ? 1 : ms > 2550 ? 255 : ms / 10), note, volume};
+}
+
+// 休符を作る
+constexpr ToioNote toioRest(uint16_t ms) {
+  return toioNote(TOIO_NOTE_REST, ms, 0);
+}
+
+// 書き込むデータの最大長
+#define TOIO_LED_PACKET_SIZE (3 + TOIO_CORE_LED_SCENARIO_MAX_STEPS * 6)
+#define TOIO_TARGETS_PACKET_SIZE (8 + TOIO_TARGETS_MAX * 6)
+#define TOIO_MIDI_PACKET_SIZE (3 + TOIO_MIDI_MAX_NOTES * 3)
+
+// 設定の応答の種類
+enum ToioConfigResponseType : uint8_t {
+  TOIO_CONFIG_RESPONSE_PROTOCOL_VERSION = 0x81,
+  TOIO_CONFIG_RESPONSE_MAGNETIC = 0x9b,
+  TOIO_CONFIG_RESPONSE_MOTOR_SPEED = 0x9c,
+  TOIO_CONFIG_RESPONSE_POSTURE = 0x9d,
+  TOIO_CONFIG_RESPONSE_REQUESTED_CONN_INTERVAL = 0xb1,
+  TOIO_CONFIG_RESPONSE_CONN_INTERVAL = 0xb2
+};
+
+// ---- ライト ----
+
+// 点灯・消灯 (0x03)
+constexpr ToioPacket<7> toioEncodeLed(uint8_t r, uint8_t g, uint8_t b) {
+  return ToioPacket<7>{{
+    0x03, // 制御の種類 (点灯・消灯)
+    0x00, // ランプを制御する時間 (0 なら時間の指定なし)
+    0x01, // 制御するランプの数 (0x01 固定)
+    0x01, // 制御するランプの ID (0x01 固定)
+    r, g, b
+  }, 7};
+}
+
+// シナリオのステップの時間 (10 ミリ秒単位, 1 ～ 255 に丸める)
+constexpr uint8_t toioLedDuration(uint16_t ms) {
+  return (uint8_t)((ms < 10) ? 1 : (ms > 2550) ? 255 : ms / 10);
+}
+
+// 点灯・消灯のシナリオ (0x04。ステップの数は TOIO_CORE_LED_SCENARIO_MAX_STEPS までに切り詰める)
+inline void toioEncodeLedScenario(const ToioCoreLedStep* steps, size_t count, uint8_t repeat,
+                                  ToioPacket<TOIO_LED_PACKET_SIZE>& packet) {
+  if (count > TOIO_CORE_LED_SCENARIO_MAX_STEPS) {
+    count = TOIO_CORE_LED_SCENARIO_MAX_STEPS;
+  }
+  packet.data[0] = 0x04;
+  packet.data[1] = repeat;
+  packet.data[2] = (uint8_t)count;
+  uint8_t* op = packet.data + 3;
+  for (size_t i = 0; i < count; i++, op += 6) {
+    op[0] = toioLedDuration(steps[i].duration_ms);
+    op[1] = 0x01; // 制御するランプの数
+    op[2] = 0x01; // 制御するランプの ID
+    op[3] = steps[i].r;
+    op[4] = steps[i].g;
+    op[5] = steps[i].b;
+  }
+  packet.length = 3 + count * 6;
+}
+
+// ---- サウンド ----
+
+// 効果音の再生 (0x02)
+constexpr ToioPacket<3> toioEncodeSoundEffect(uint8_t sound_id, uint8_t volume) {
+  return ToioPacket<3>{{0x02, sound_id, volume}, 3};
+}
+
+// 再生の停止 (0x01)
+constexpr ToioPacket<1> toioEncodeSoundStop() {
+  return ToioPacket<1>{{0x01}, 1};
+}
+
+// MIDI の再生 (0x03。音の数は TOIO_MIDI_MAX_NOTES までに切り詰める)
+inline void toioEncodeMidi(const ToioNote* notes, size_t count, uint8_t repeat, ToioPacket<TOIO_MIDI_PACKET_SIZE>& packet) {
+  if (count > TOIO_MIDI_MAX_NOTES) {
+    count = TOIO_MIDI_MAX_NOTES;
+  }
+  packet.data[0] = 0x03;
+  packet.data[1] = repeat;
+  packet.data[2] = (uint8_t)count;
+  memcpy(packet.data + 3, notes, count * sizeof(ToioNote));
+  packet.length = 3 + count * sizeof(ToioNote);
+}
+
+// ---- モーター ----
+
+// モーターの制御 (timed なら時間指定付きの 0x02、そうでなければ 0x01)
+// (duration は 10 ミリ秒単位。0 なら時間の指定なし)
+constexpr ToioPacket<8> toioEncodeMotor(bool lback, uint8_t lspeed, bool rback, uint8_t rspeed, bool timed = false,
+                                        uint8_t duration = 0) {
+  return ToioPacket<8>{{
+    (uint8_t)(timed ? 0x02 : 0x01),
+    0x01, (uint8_t)(lback ? 0x02 : 0x01), lspeed,
+    0x02, (uint8_t)(rback ? 0x02 : 0x01), rspeed,
+    duration
+  }, (size_t)(timed ? 8 : 7)};
+}
+
+// 目標地点の角度と角度の意味を 1 つの値にまとめる
+constexpr uint16_t toioTargetAngle(const ToioCoreTarget& target) {
+  return (uint16_t)((target.angle & 0x1fff) | ((uint16_t)target.angle_type << 13));
+}
+
+// 目標指定付きモーター制御 (0x03)
+constexpr ToioPacket<13> toioEncodeMoveToTarget(uint8_t request_id, const ToioCoreTarget& target,
+                                                const ToioCoreTargetParams& params) {
+  return ToioPacket<13>{{
+    0x03,
+    request_id,
+    params.timeout,
+    params.move_type,
+    params.max_speed,
+    params.speed_type,
+    0x00,
+    (uint8_t)(target.x & 0xff), (uint8_t)(target.x >> 8),
+    (uint8_t)(target.y & 0xff), (uint8_t)(target.y >> 8),
+    (uint8_t)(toioTargetAngle(target) & 0xff), (uint8_t)(toioTargetAngle(target) >> 8)
+  }, 13};
+}
+
+// 複数目標指定付きモーター制御 (0x04。目標地点の数は TOIO_TARGETS_MAX までに切り詰める)
+// (append なら、実行中の目標地点の後に追加する)
+inline void toioEncodeMoveToTargets(uint8_t request_id, const ToioCoreTarget* targets, size_t count,
+                                    const ToioCoreTargetParams& params, bool append,
+                                    ToioPacket<TOIO_TARGETS_PACKET_SIZE>& packet) {
+  if (count > TOIO_TARGETS_MAX) {
+    count = TOIO_TARGETS_MAX;
+  }
+  uint8_t* p = packet.data;
+  *p++ = 0x04;
+  *p++ = request_id;
+  *p++ = params.timeout;
+  *p++ = params.move_type;
+  *p++ = params.max_speed;
+  *p++ = params.speed_type;
+  *p++ = 0x00;
+  *p++ = append ? 0x01 : 0x00;
+  for (size_t i = 0; i < count; i++) {
+    uint16_t angle = toioTargetAngle(targets[i]);
+    *p++ = targets[i].x & 0xff;
+    *p++ = targets[i].x >> 8;
+    *p++ = targets[i].y & 0xff;
+    *p++ = targets[i].y >> 8;
+    *p++ = angle & 0xff;
+    *p++ = angle >> 8;
+  }
+  packet.length = p - packet.data;
+}
+
+// 加速度指定モーター制御 (0x05。duration はミリ秒)
+constexpr ToioPacket<9> toioEncodeAcceleration(uint8_t speed, uint8_t acceleration, uint16_t rotation,
+                                               bool rotate_negative, bool backward, bool rotation_priority,
+                                               uint16_t duration) {
+  return ToioPacket<9>{{
+    0x05,
+    speed,
+    acceleration,
+    (uint8_t)(rotation & 0xff), (uint8_t)(rotation >> 8),
+    (uint8_t)(rotate_negative ? 0x01 : 0x00),
+    (uint8_t)(backward ? 0x01 : 0x00),
+    (uint8_t)(rotation_priority ? 0x01 : 0x00),
+    (uint8_t)(duration / 10)
+  }, 9};
+}
+
+// ---- 設定 ----
+
+// BLE プロトコルバージョンの要求 (応答は TOIO_CONFIG_RESPONSE_PROTOCOL_VERSION)
+constexpr ToioPacket<2> toioEncodeGetProtocolVersion() {
+  return ToioPacket<2>{{0x01, 0x00}, 2};
+}
+
+// しきい値の設定 (水平検出 0x05、衝突検出 0x06、ダブルタップ検出 0x17。応答はない)
+constexpr ToioPacket<3> toioEncodeFlatThreshold(uint8_t deg) {
+  return ToioPacket<3>{{0x05, 0x00, deg}, 3};
+}
+
+constexpr ToioPacket<3> toioEncodeClashThreshold(uint8_t level) {
+  return ToioPacket<3>{{0x06, 0x00, level}, 3};
+}
+
+constexpr ToioPacket<3> toioEncodeDtapThreshold(uint8_t level) {
+  return ToioPacket<3>{{0x17, 0x00, level}, 3};
+}
+
+// 姿勢角の通知の設定 (0x1d。interval は 10 ミリ秒単位。応答は TOIO_CONFIG_RESPONSE_POSTURE)
+constexpr ToioPacket<5> toioEncodePostureNotify(uint8_t type, uint8_t interval, uint8_t condition) {
+  return ToioPacket<5>{{0x1d, 0x00, type, interval, condition}, 5};
+}
+
+// 磁気センサーの通知の設定 (0x1b。interval は 20 ミリ秒単位。応答は TOIO_CONFIG_RESPONSE_MAGNETIC)
+constexpr ToioPacket<5> toioEncodeMagneticNotify(uint8_t mode, uint8_t interval, uint8_t condition) {
+  return ToioPacket<5>{{0x1b, 0x00, mode, interval, condition}, 5};
+}
+
+// モーターの速度情報の取得の設定 (0x1c。応答は TOIO_CONFIG_RESPONSE_MOTOR_SPEED)
+constexpr ToioPacket<3> toioEncodeMotorSpeedNotify(bool enable) {
+  return ToioPacket<3>{{0x1c, 0x00, (uint8_t)(enable ? 0x01 : 0x00)}, 3};
+}
+
+// 接続間隔の変更の要求 (0x30。1.25 ミリ秒単位。応答はない)
+constexpr ToioPacket<6> toioEncodeConnInterval(uint16_t min_interval, uint16_t max_interval) {
+  return ToioPacket<6>{{
+    0x30, 0x00,
+    (uint8_t)(min_interval & 0xff), (uint8_t)(min_interval >> 8),
+    (uint8_t)(max_interval & 0xff), (uint8_t)(max_interval >> 8)
+  }, 6};
+}
+
+// 要求した接続間隔の取得 (0x31。応答は TOIO_CONFIG_RESPONSE_REQUESTED_CONN_INTERVAL)
+constexpr ToioPacket<2> toioEncodeGetRequestedConnInterval() {
+  return ToioPacket<2>{{0x31, 0x00}, 2};
+}
+
+// 現在の接続間隔の取得 (0x32。応答は TOIO_CONFIG_RESPONSE_CONN_INTERVAL)
+constexpr ToioPacket<2> toioEncodeGetConnInterval() {
+  return ToioPacket<2>{{0x32, 0x00}, 2};
+}
+
+// ---- 解釈 ----
+
+inline uint16_t toioReadUint16(const uint8_t* p) {
+  return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+inline uint32_t toioReadUint32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// IEEE 754 単精度のビット列を scale 倍して整数に丸める (浮動小数点演算を使わない)
+inline int32_t toioReadFloatScaled(const uint8_t* p, int32_t scale) {
+  uint32_t bits = toioReadUint32(p);
+  int exponent = (int)((bits >> 23) & 0xff);
+  if (exponent == 0 || exponent == 0xff) {
+    return 0; // 0、非正規化数、無限大、NaN
+  }
+  int64_t value = (int64_t)((bits & 0x7fffff) | 0x800000) * scale;
+  int shift = exponent - 150;
+  if (shift >= 0) {
+    value = (shift > 24) ? INT32_MAX : (value << shift);
+  } else if (shift < -62) {
+    value = 0;
+  } else {
+    value = (value + ((int64_t)1 << (-shift - 1))) >> -shift;
+  }
+  if (value > INT32_MAX) {
+    value = INT32_MAX;
+  }
+  return (bits & 0x80000000) ? -(int32_t)value : (int32_t)value;
+}
+
+inline int16_t toioClampInt16(int32_t v) {
+  return (v > INT16_MAX) ? INT16_MAX : (v < INT16_MIN) ? INT16_MIN : (int16_t)v;
+}
+
+// バッテリー残量の通知・読み出し
+inline bool toioDecodeBattery(const uint8_t* data, size_t len, uint8_t& level) {
+  if (len != 1) {
+    return false;
+  }
+  level = data[0];
+  return true;
+}
+
+// ボタンの通知・読み出し
+inline bool toioDecodeButton(const uint8_t* data, size_t len, bool& state) {
+  if (len != 2 || data[0] != 0x01) {
+    return false;
+  }
+  state = (data[1] == 0x80);
+  return true;
+}
+
+// モーションセンサーの通知・読み出し (0x01)
+inline bool toioDecodeMotion(const uint8_t* data, size_t len, ToioCoreMotionData& motion) {
+  if (len < 5 || data[0] != 0x01) {
+    return false;
+  }
+  motion.flat = data[1];
+  motion.clash = data[2];
+  motion.dtap = data[3];
+  motion.attitude = data[4];
+  motion.shake = (len >= 6) ? data[5] : 0;
+  return true;
+}
+
+// 姿勢角の通知 (モーションセンサーの 0x03)
+inline bool toioDecodePosture(const uint8_t* data, size_t len, ToioCorePostureData& posture) {
+  if (len < 8 || data[0] != 0x03) {
+    return false;
+  }
+  memset(&posture, 0, sizeof(posture));
+  posture.type = (ToioCorePostureType)data[1];
+  if (data[1] == TOIO_CORE_POSTURE_EULER) {
+    posture.roll = (int16_t)toioReadUint16(data + 2) * 100;
+    posture.pitch = (int16_t)toioReadUint16(data + 4) * 100;
+    posture.yaw = (int16_t)toioReadUint16(data + 6) * 100;
+  } else if (data[1] == TOIO_CORE_POSTURE_EULER_PRECISE && len >= 14) {
+    posture.roll = toioReadFloatScaled(data + 2, 100);
+    posture.pitch = toioReadFloatScaled(data + 6, 100);
+    posture.yaw = toioReadFloatScaled(data + 10, 100);
+  } else if (data[1] == TOIO_CORE_POSTURE_QUATERNION && len >= 18) {
+    posture.qw = toioClampInt16(toioReadFloatScaled(data + 2, 16384));
+    posture.qx = toioClampInt16(toioReadFloatScaled(data + 6, 16384));
+    posture.qy = toioClampInt16(toioReadFloatScaled(data + 10, 16384));
+    posture.qz = toioClampInt16(toioReadFloatScaled(data + 14, 16384));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// 磁気センサーの通知 (モーションセンサーの 0x02)
+inline bool toioDecodeMagnetic(const uint8_t* data, size_t len, ToioCoreMagneticData& magnetic) {
+  if (len < 6 || data[0] != 0x02) {
+    return false;
+  }
+  magnetic.state = data[1];
+  magnetic.strength = data[2];
+  magnetic.x = (int8_t)data[3];
+  magnetic.y = (int8_t)data[4];
+  magnetic.z = (int8_t)data[5];
+  return true;
+}
+
+// Position ID の通知 (ID 情報の 0x01)
+inline bool toioDecodePosition(const uint8_t* data, size_t len, ToioCorePositionData& position) {
+  if (len < 13 || data[0] != 0x01) {
+    return false;
+  }
+  position.x = toioReadUint16(data + 1);
+  position.y = toioReadUint16(data + 3);
+  position.angle = toioReadUint16(data + 5);
+  position.sensor_x = toioReadUint16(data + 7);
+  position.sensor_y = toioReadUint16(data + 9);
+  position.sensor_angle = toioReadUint16(data + 11);
+  return true;
+}
+
+// Standard ID の通知 (ID 情報の 0x02)
+inline bool toioDecodeStandardId(const uint8_t* data, size_t len, ToioCoreStandardIdData& standard_id) {
+  if (len < 7 || data[0] != 0x02) {
+    return false;
+  }
+  standard_id.id = toioReadUint32(data + 1);
+  standard_id.angle = toioReadUint16(data + 5);
+  return true;
+}
+
+// ID を読み取れなくなった通知 (ID 情報の 0x03: Position ID、0x04: Standard ID)
+inline bool toioDecodeIdMissed(const uint8_t* data, size_t len, ToioCoreIdType& type) {
+  if (len < 1 || (data[0] != 0x03 && data[0] != 0x04)) {
+    return false;
+  }
+  type = (data[0] == 0x03) ? TOIO_CORE_ID_POSITION : TOIO_CORE_ID_STANDARD;
+  return true;
+}
+
+// 目標指定付きモーター制御の応答 (0x83、0x84)
+inline bool toioDecodeMotorResponse(const uint8_t* data, size_t len, ToioCoreMotorResponse& response) {
+  if (len < 3 || (data[0] != 0x83 && data[0] != 0x84)) {
+    return false;
+  }
+  response.request_id = data[1];
+  response.result = (ToioCoreMotorResult)data[2];
+  return true;
+}
+
+// モーターの速度情報 (0xe0)
+inline bool toioDecodeMotorSpeed(const uint8_t* data, size_t len, ToioCoreMotorSpeed& speed) {
+  if (len < 3 || data[0] != 0xe0) {
+    return false;
+  }
+  speed.left = data[1];
+  speed.right = data[2];
+  return true;
+}
+
+// 通知の設定の応答 (応答の種類、0x00、結果) が成功か
+inline bool toioDecodeConfigResult(const uint8_t* data, size_t len) {
+  return len == 3 && data[2] == 0x00;
+}
+
+// 接続間隔の応答 (要求した接続間隔なら最小値と最大値、現在の接続間隔なら min と max の両方に入れる)
+inline bool toioDecodeConnInterval(const uint8_t* data, size_t len, uint16_t& min_interval, uint16_t& max_interval) {
+  if (len >= 6 && data[0] == TOIO_CONFIG_RESPONSE_REQUESTED_CONN_INTERVAL) {
+    min_interval = toioReadUint16(data + 2);
+    max_interval = toioReadUint16(data + 4);
+    return true;
+  }
+  if (len >= 4 && data[0] == TOIO_CONFIG_RESPONSE_CONN_INTERVAL) {
+    min_interval = max_interval = toioReadUint16(data + 2);
+    return true;
+  }
+  return false;
+}
+
+#endif
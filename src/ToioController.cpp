@@ -0,0 +1,398 @@
+/* ----------------------------------------------------------------
+  ToioController.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include "ToioController.h"
+#include <math.h>
+
+// 角度を -180 ～ 180 度に正規化
+static float toioWrapAngle(float deg) {
+  deg = fmodf(deg + 180.0f, 360.0f);
+  if (deg < 0) {
+    deg += 360.0f;
+  }
+  return deg - 180.0f;
+}
+
+static float toioClamp(float v, float lo, float hi) {
+  return (v < lo) ? lo : ((v > hi) ? hi : v);
+}
+
+// ===============================================================
+// ToioController クラス
+// ===============================================================
+
+// ---------------------------------------------------------------
+// コンストラクタ
+// ---------------------------------------------------------------
+ToioController::ToioController(ToioCore* toiocore) {
+  this->_toiocore = toiocore;
+  this->_task = nullptr;
+  this->_running = false;
+  this->_task_alive = false;
+  this->_reset_stats = false;
+  this->_arrived_generation = 0;
+  this->_period_us = 0;
+
+  memset(&this->_command, 0, sizeof(this->_command));
+  this->_command.mode = TOIO_CONTROLLER_IDLE;
+  this->_command.gains.kp_distance = 1.0f;
+  this->_command.gains.kp_angle = 1.0f;
+  this->_command.gains.ki_angle = 0.0f;
+  this->_command.gains.kd_angle = 0.05f;
+  this->_command.max_speed = 60;
+  this->_command.tolerance = 10;
+  this->_command.lookahead = 30;
+  this->_publish(this->_command);
+  this->_active_command = this->_command;
+
+  memset(&this->_stats, 0, sizeof(this->_stats));
+  this->_jitter_total = 0;
+  this->_generation = 0;
+  this->_integral = 0;
+  this->_prev_error = 0;
+  this->_segment = 0;
+  this->_stopped = false;
+}
+
+ToioController::~ToioController() {
+  this->stop();
+}
+
+// ---------------------------------------------------------------
+// 制御タスクを開始
+// ---------------------------------------------------------------
+bool ToioController::start(uint16_t rate_hz, BaseType_t core, UBaseType_t priority) {
+  if (this->_task_alive) {
+    return true;
+  }
+  if (rate_hz == 0) {
+    return false;
+  }
+  uint32_t period_ms = 1000 / rate_hz;
+  if (period_ms == 0) {
+    period_ms = 1;
+  }
+  this->_period_us = period_ms * 1000;
+  this->_reset_stats = true;
+  this->_running = true;
+  this->_task_alive = true;
+  if (xTaskCreatePinnedToCore(ToioController::_controlTask, "ToioController", _TASK_STACK_SIZE,
+                              this, priority, &this->_task, core) != pdPASS) {
+    this->_running = false;
+    this->_task_alive = false;
+    this->_task = nullptr;
+    return false;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------
+// 制御タスクを停止 (タスクが終わるまで待つ)
+// ---------------------------------------------------------------
+void ToioController::stop() {
+  if (!this->_task_alive) {
+    return;
+  }
+  this->_running = false;
+  while (this->_task_alive) {
+    delay(1);
+  }
+  this->_task = nullptr;
+}
+
+bool ToioController::isRunning() {
+  return this->_task_alive;
+}
+
+// ---------------------------------------------------------------
+// 制御の指示
+// ---------------------------------------------------------------
+void ToioController::moveTo(uint16_t x, uint16_t y) {
+  this->_command.generation++;
+  this->_command.mode = TOIO_CONTROLLER_MOVE_TO;
+  this->_command.count = 1;
+  this->_command.points[0].x = x;
+  this->_command.points[0].y = y;
+  this->_publish(this->_command);
+}
+
+void ToioController::follow(const ToioControllerPoint* points, size_t count, uint16_t lookahead) {
+  if (count == 0) {
+    this->idle();
+    return;
+  }
+  if (count > TOIO_CONTROLLER_PATH_SIZE) {
+    count = TOIO_CONTROLLER_PATH_SIZE;
+  }
+  this->_command.generation++;
+  this->_command.mode = TOIO_CONTROLLER_FOLLOW;
+  this->_command.count = count;
+  this->_command.lookahead = (lookahead == 0) ? 1 : lookahead;
+  memcpy(this->_command.points, points, sizeof(ToioControllerPoint) * count);
+  this->_publish(this->_command);
+}
+
+void ToioController::idle() {
+  this->_command.generation++;
+  this->_command.mode = TOIO_CONTROLLER_IDLE;
+  this->_command.count = 0;
+  this->_publish(this->_command);
+}
+
+bool ToioController::isArrived() {
+  return this->_command.mode != TOIO_CONTROLLER_IDLE && this->_arrived_generation == this->_command.generation;
+}
+
+// ---------------------------------------------------------------
+// 制御のパラメータ
+// ---------------------------------------------------------------
+void ToioController::setGains(const ToioControllerGains& gains) {
+  this->_command.gains = gains;
+  this->_publish(this->_command);
+}
+
+void ToioController::setMaxSpeed(uint8_t speed) {
+  this->_command.max_speed = (speed > 115) ? 115 : speed;
+  this->_publish(this->_command);
+}
+
+void ToioController::setTolerance(uint16_t distance) {
+  this->_command.tolerance = distance;
+  this->_publish(this->_command);
+}
+
+void ToioController::_publish(const _Command& command) {
+  this->_shared_command.write(command);
+}
+
+// ---------------------------------------------------------------
+// 統計情報
+// ---------------------------------------------------------------
+ToioControllerStats ToioController::getStats() {
+  ToioControllerStats stats;
+  if (!this->_shared_stats.read(stats)) {
+    memset(&stats, 0, sizeof(stats));
+  }
+  return stats;
+}
+
+// 統計情報は制御タスクが書き込むので、リセットは次の周期に制御タスクで行う
+void ToioController::resetStats() {
+  this->_reset_stats = true;
+}
+
+// ---------------------------------------------------------------
+// 制御タスク
+// ---------------------------------------------------------------
+void ToioController::_controlTask(void* arg) {
+  ToioController* controller = (ToioController*)arg;
+  controller->_run();
+  controller->_drive(0, 0);
+  controller->_task_alive = false;
+  vTaskDelete(NULL);
+}
+
+void ToioController::_run() {
+  const TickType_t period_ticks = pdMS_TO_TICKS(this->_period_us / 1000);
+  TickType_t wake = xTaskGetTickCount();
+  uint32_t prev = micros();
+  uint32_t expected = prev;
+  this->_stopped = false;
+
+  while (this->_running) {
+    vTaskDelayUntil(&wake, period_ticks);
+    uint32_t now = micros();
+
+    if (this->_reset_stats.exchange(false)) {
+      memset(&this->_stats, 0, sizeof(this->_stats));
+      this->_stats.period_us = this->_period_us;
+      this->_jitter_total = 0;
+    }
+
+    // 実際の周期と設定した周期の差 (初回は起動直後なので数えない)
+    uint32_t period = now - prev;
+    prev = now;
+    if (this->_stats.iterations > 0) {
+      uint32_t jitter = (period > this->_period_us) ? period - this->_period_us : this->_period_us - period;
+      if (jitter > this->_stats.max_jitter_us) {
+        this->_stats.max_jitter_us = jitter;
+      }
+      this->_jitter_total += jitter;
+      this->_stats.avg_jitter_us = this->_jitter_total / this->_stats.iterations;
+    }
+    this->_stats.last_period_us = period;
+
+    // 1 周期以上遅れたら、遅れを取り戻そうとせずに予定を今の時刻に合わせ直す
+    expected += this->_period_us;
+    if ((int32_t)(now - expected) >= (int32_t)this->_period_us) {
+      this->_stats.overruns++;
+      expected = now;
+      wake = xTaskGetTickCount();
+    }
+
+    this->_readCommand();
+    this->_step(this->_active_command, period / 1000000.0f);
+
+    uint32_t exec = micros() - now;
+    this->_stats.last_exec_us = exec;
+    if (exec > this->_stats.max_exec_us) {
+      this->_stats.max_exec_us = exec;
+    }
+    this->_stats.iterations++;
+    this->_shared_stats.write(this->_stats);
+  }
+}
+
+// ---------------------------------------------------------------
+// スケッチのタスクが書き込んだ制御の指示を読み出す
+// (制御タスクはスケッチのタスクより優先度が高いので、書き込み中に割り込んだ
+// ときに読み直し続けると書き込みが終わらない。1 tick ずつ譲って数回だけ読み直し、
+// それでも読めなければ前回の指示のまま制御する)
+// ---------------------------------------------------------------
+void ToioController::_readCommand() {
+  _Command command;
+  for (uint32_t i = 0; i <= TOIO_CONTROLLER_COMMAND_RETRIES; i++) {
+    if (this->_shared_command.tryRead(command)) {
+      this->_active_command = command;
+      return;
+    }
+    if (i < TOIO_CONTROLLER_COMMAND_RETRIES) {
+      vTaskDelay(1);
+    }
+  }
+  this->_stats.stale_commands++;
+}
+
+// ---------------------------------------------------------------
+// 制御計算 (1 周期分)
+// ---------------------------------------------------------------
+void ToioController::_step(const _Command& command, float dt) {
+  if (command.generation != this->_generation) {
+    this->_generation = command.generation;
+    this->_integral = 0;
+    this->_prev_error = 0;
+    this->_segment = 0;
+  }
+  if (command.mode == TOIO_CONTROLLER_IDLE || command.count == 0 || this->_arrived_generation == command.generation) {
+    this->_drive(0, 0);
+    return;
+  }
+
+  ToioCorePose pose;
+  if (!this->_toiocore->getLatestPose(pose) || !pose.on_mat ||
+      (uint32_t)(micros() - pose.timestamp) > TOIO_CONTROLLER_POSE_TIMEOUT * 1000UL) {
+    if (!this->_stopped) {
+      this->_stats.stale_poses++;
+    }
+    this->_drive(0, 0);
+    return;
+  }
+  float x = pose.position.x;
+  float y = pose.position.y;
+  float angle = pose.position.angle;
+
+  // 目標地点 (経路の場合は先読み距離だけ先の経路上の点)
+  const ToioControllerPoint& end = command.points[command.count - 1];
+  float gx = end.x;
+  float gy = end.y;
+  if (command.mode == TOIO_CONTROLLER_FOLLOW) {
+    float lookahead = command.lookahead;
+    while (this->_segment + 1 < command.count &&
+           hypotf(command.points[this->_segment].x - x, command.points[this->_segment].y - y) < lookahead) {
+      this->_segment++;
+    }
+    gx = command.points[this->_segment].x;
+    gy = command.points[this->_segment].y;
+    if (this->_segment > 0) {
+      // 直前の地点からの線分と、先読み距離の円との交点のうち先の方
+      float ax = command.points[this->_segment - 1].x - x;
+      float ay = command.points[this->_segment - 1].y - y;
+      float bx = gx - x;
+      float by = gy - y;
+      float dx = bx - ax;
+      float dy = by - ay;
+      float a = dx * dx + dy * dy;
+      float b = 2 * (ax * dx + ay * dy);
+      float c = ax * ax + ay * ay - lookahead * lookahead;
+      float d = b * b - 4 * a * c;
+      if (a > 0 && d >= 0) {
+        float t = (-b + sqrtf(d)) / (2 * a);
+        if (t >= 0 && t <= 1) {
+          gx = x + ax + dx * t;
+          gy = y + ay + dy * t;
+        }
+      }
+    }
+  }
+
+  float dist_end = hypotf(end.x - x, end.y - y);
+  if (dist_end <= command.tolerance && this->_segment + 1 >= command.count) {
+    this->_arrived_generation = command.generation;
+    this->_drive(0, 0);
+    return;
+  }
+
+  float dx = gx - x;
+  float dy = gy - y;
+  float dist = hypotf(dx, dy);
+  float error = toioWrapAngle(atan2f(dy, dx) * 180.0f / (float)M_PI - angle);
+  float max_speed = command.max_speed;
+
+  // 向きの PID (大きく向きがずれているときはその場で回転する)
+  const ToioControllerGains& gains = command.gains;
+  if (dt > 0) {
+    this->_integral = toioClamp(this->_integral + error * dt, -1000.0f, 1000.0f);
+  }
+  float derivative = (dt > 0) ? (error - this->_prev_error) / dt : 0;
+  this->_prev_error = error;
+  float turn = gains.kp_angle * error + gains.ki_angle * this->_integral + gains.kd_angle * derivative;
+  turn = toioClamp(turn, -max_speed, max_speed);
+
+  float speed = toioClamp(gains.kp_distance * dist_end, 0, max_speed);
+  if (fabsf(error) > 60.0f) {
+    this->_drive(turn, -turn);
+    return;
+  }
+  speed *= cosf(error * (float)M_PI / 180.0f);
+
+  if (command.mode == TOIO_CONTROLLER_FOLLOW && dist > 0) {
+    // Pure Pursuit: 目標点を通る円弧の曲率から左右の速度差を決める
+    float curvature = 2.0f * sinf(error * (float)M_PI / 180.0f) / dist;
+    float diff = speed * curvature * TOIO_CONTROLLER_WHEEL_TRACK / 2.0f;
+    this->_drive(speed + diff, speed - diff);
+  } else {
+    this->_drive(speed + turn, speed - turn);
+  }
+}
+
+// ---------------------------------------------------------------
+// 左右のモーターの速度指示値を送る (負なら後退)
+// - 速度指示値 10 未満ではモーターが回らないので 10 に切り上げる
+// - 制御タスクが止まってもキューブが走り続けないように時間指定にする
+// ---------------------------------------------------------------
+void ToioController::_drive(float left, float right) {
+  int l = (int)lroundf(toioClamp(left, -115.0f, 115.0f));
+  int r = (int)lroundf(toioClamp(right, -115.0f, 115.0f));
+  if (l != 0 && abs(l) < 10) {
+    l = (l > 0) ? 10 : -10;
+  }
+  if (r != 0 && abs(r) < 10) {
+    r = (r > 0) ? 10 : -10;
+  }
+  bool stop = (l == 0 && r == 0);
+  if (stop && this->_stopped) {
+    return;
+  }
+  this->_stopped = stop;
+  uint32_t duration = this->_period_us / 1000 * 5;
+  if (duration < 100) {
+    duration = 100;
+  }
+  this->_toiocore->controlMotor(l >= 0, abs(l), r >= 0, abs(r), stop ? 0 : duration);
+}
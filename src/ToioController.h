@@ -0,0 +1,159 @@
+/* ----------------------------------------------------------------
+  ToioController.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioController_h
+#define ToioController_h
+
+#include <Arduino.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "ToioCore.h"
+#include "ToioSeqLock.h"
+
+// 経路に指定できる地点の最大数
+#ifndef TOIO_CONTROLLER_PATH_SIZE
+#define TOIO_CONTROLLER_PATH_SIZE 32
+#endif
+
+// 位置の通知がこの時間 (ミリ秒) 途絶えたらモーターを止める
+#ifndef TOIO_CONTROLLER_POSE_TIMEOUT
+#define TOIO_CONTROLLER_POSE_TIMEOUT 200
+#endif
+
+// 制御の指示が書き込み中だったときに読み直す回数 (1 回ごとに 1 tick 譲る)
+#ifndef TOIO_CONTROLLER_COMMAND_RETRIES
+#define TOIO_CONTROLLER_COMMAND_RETRIES 2
+#endif
+
+// 左右の車輪の間隔 (マットの座標単位)
+#define TOIO_CONTROLLER_WHEEL_TRACK 19.5f
+
+// 制御のモード
+enum ToioControllerMode : uint8_t {
+  TOIO_CONTROLLER_IDLE = 0,  // 何もしない (モーターを止める)
+  TOIO_CONTROLLER_MOVE_TO,   // 目標地点に向かう (PID)
+  TOIO_CONTROLLER_FOLLOW     // 経路をたどる (Pure Pursuit)
+};
+
+// マット上の地点
+struct ToioControllerPoint {
+  uint16_t x;
+  uint16_t y;
+};
+
+// 制御のゲイン
+struct ToioControllerGains {
+  float kp_distance; // 目標までの距離 1 あたりの速度指示値
+  float kp_angle;    // 向きの誤差 1 度あたりの旋回量 (速度指示値)
+  float ki_angle;    // 向きの誤差の積分 (度・秒) あたりの旋回量
+  float kd_angle;    // 向きの誤差の変化 (度/秒) あたりの旋回量
+};
+
+// 制御ループの統計情報
+struct ToioControllerStats {
+  uint32_t iterations;     // 制御ループの実行回数
+  uint32_t overruns;       // 予定の起床時刻から 1 周期以上遅れた回数
+  uint32_t stale_poses;    // 位置が古いかマット外だったためモーターを止めた回数
+  uint32_t period_us;      // 設定した周期 (マイクロ秒)
+  uint32_t last_period_us; // 直近の実際の周期 (マイクロ秒)
+  uint32_t max_jitter_us;  // 実際の周期と設定した周期の差の最大値 (マイクロ秒)
+  uint32_t avg_jitter_us;  // 上記の平均値 (マイクロ秒)
+  uint32_t last_exec_us;   // 直近の制御計算にかかった時間 (マイクロ秒)
+  uint32_t max_exec_us;    // 上記の最大値 (マイクロ秒)
+  uint32_t stale_commands; // 指示が書き込み中で読めず、前回の指示で制御した回数
+};
+
+// ---------------------------------------------------------------
+// ToioController クラス
+//
+// 専用の FreeRTOS タスクで、一定周期の位置制御ループを実行する。
+// キューブの最新の位置 (getLatestPose()) を読み、モーター制御を
+// controlMotor() で送る (送信は ToioCore 側で間隔をあけてまとめられる)。
+// スケッチの loop() の処理時間に左右されずに周期を保てる。
+// ---------------------------------------------------------------
+class ToioController {
+  private:
+    // 制御の指示 (スケッチのタスクが書き込み、制御タスクが読み出す)
+    struct _Command {
+      uint32_t generation;  // 指示を変えるたびに増える (積分値などをリセットする)
+      ToioControllerMode mode;
+      ToioControllerGains gains;
+      uint8_t max_speed;
+      uint16_t tolerance;
+      uint16_t lookahead;
+      uint8_t count;
+      ToioControllerPoint points[TOIO_CONTROLLER_PATH_SIZE];
+    };
+
+    static const uint32_t _TASK_STACK_SIZE = 4096;
+
+    ToioCore* _toiocore;
+    TaskHandle_t _task;
+    std::atomic<bool> _running;
+    std::atomic<bool> _task_alive;
+    std::atomic<bool> _reset_stats;
+    std::atomic<uint32_t> _arrived_generation;
+    uint32_t _period_us;
+
+    _Command _command;  // スケッチのタスク側の作業用
+    ToioSeqLock<_Command> _shared_command;
+    _Command _active_command;  // 制御タスクが最後に読めた指示
+    ToioSeqLock<ToioControllerStats> _shared_stats;
+
+    // 以下は制御タスクだけが触る
+    ToioControllerStats _stats;
+    uint64_t _jitter_total;
+    uint32_t _generation;
+    float _integral;
+    float _prev_error;
+    uint8_t _segment;
+    bool _stopped;
+
+  private:
+    static void _controlTask(void* arg);
+    void _run();
+    void _readCommand();
+    void _step(const _Command& command, float dt);
+    void _drive(float left, float right);
+    void _publish(const _Command& command);
+
+  public:
+    // コンストラクタ
+    ToioController(ToioCore* toiocore);
+    ~ToioController();
+
+    // 制御タスクを開始 / 停止
+    bool start(uint16_t rate_hz = 50, BaseType_t core = 1, UBaseType_t priority = 2);
+    void stop();
+    bool isRunning();
+
+    // 目標地点に向かう
+    void moveTo(uint16_t x, uint16_t y);
+
+    // 経路をたどる (lookahead は先読み距離)
+    void follow(const ToioControllerPoint* points, size_t count, uint16_t lookahead = 30);
+
+    // 制御をやめてモーターを止める
+    void idle();
+
+    // 目標地点 (経路の終点) に着いたか
+    bool isArrived();
+
+    // 制御のパラメータ
+    void setGains(const ToioControllerGains& gains);
+    void setMaxSpeed(uint8_t speed);
+    void setTolerance(uint16_t distance);
+
+    // 統計情報
+    ToioControllerStats getStats();
+    void resetStats();
+};
+
+#endif
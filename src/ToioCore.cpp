@@ -8,34 +8,31 @@
   See LICENSE file in the project root for full license information.
   -------------------------------------------------------------- */
 #include "ToioCore.h"
+#include "Toio.h"
+#include "ToioRecorder.h"
 
 // ===============================================================
 // ToioCore クラス
 // ===============================================================
 
-static bool g_event_connection_updated = false;
-static BLEClient* g_current_client = nullptr;
-static BLEClient* g_last_client = nullptr;
-
-static bool g_event_battery_updated = false;
-static uint8_t g_event_battery_level = 0;
-
-static bool g_event_button_updated = false;
-static bool g_event_button_state = false;
-
-static bool g_event_motion_updated = false;
-static ToioCoreMotionData g_event_motion_data = {0x00, 0x00, 0x00, 0x00};
-
 // BLE 接続状態変化のコールバック
 class ToioClientCallback : public BLEClientCallbacks {
+  private:
+    ToioCore* _toiocore;
+
+  public:
+    ToioClientCallback(ToioCore* toiocore) {
+      this->_toiocore = toiocore;
+    }
     void onConnect(BLEClient* client) {
-      g_current_client = client;
-      g_last_client = client;
-      g_event_connection_updated = true;
+      this->_toiocore->_connected = true;
+      this->_toiocore->_connection_updated = true;
+      this->_toiocore->_markReady();
     }
     void onDisconnect(BLEClient* client) {
-      g_current_client = nullptr;
-      g_event_connection_updated = true;
+      this->_toiocore->_connected = false;
+      this->_toiocore->_connection_updated = true;
+      this->_toiocore->_markReady();
     }
 };
 
@@ -46,19 +43,143 @@ ToioCore::ToioCore(BLEAdvertisedDevice& device) {
   this->_device = new BLEAdvertisedDevice(device);
   BLEClient* client = BLEDevice::createClient();
   this->_client = client;
+  this->_rssi = device.getRSSI();
 
   this->_onconnection = nullptr;
   this->_onbutton = nullptr;
   this->_onbattery = nullptr;
   this->_onmotion = nullptr;
+  this->_onposture = nullptr;
+  this->_onmagnetic = nullptr;
+  this->_onposition = nullptr;
+  this->_onstandardid = nullptr;
+  this->_onidmissed = nullptr;
+  this->_pose_seq = 0;
+  this->_urgent_types = (1 << TOIO_CORE_EVENT_BUTTON) | (1 << TOIO_CORE_EVENT_STANDARD_ID) |
+                        (1 << TOIO_CORE_EVENT_ID_MISSED) | (1 << TOIO_CORE_EVENT_MOTOR_RESPONSE);
+  this->_ready_node.owner = this;
+  this->_ready_list = nullptr;
+  this->_toio = nullptr;
+  this->_conn_waiting = false;
+  this->_conn_slot = false;
+  this->_link_interval = 0;
+  this->_link_pending = false;
+  this->_link_floor_us = 0;
+
+  this->_motor_pending = 0;
+  this->_motor_submitted_at = 0;
+  this->_motor_sent_at = 0;
+  this->_motor_sending = false;
+  this->_motor_interval_us = TOIO_CORE_MOTOR_WRITE_INTERVAL * 1000;
+  this->_motor_stats_submitted = 0;
+  this->_motor_stats_sent = 0;
+  this->_motor_stats_coalesced = 0;
+  this->_motor_stats_dropped = 0;
+  this->_motor_stats_last_latency = 0;
+  this->_motor_stats_max_latency = 0;
+  this->_motor_stats_responses = 0;
+  this->_motor_stats_failures = 0;
+  this->_motor_written = 0;
+  this->_motor_written_at = 0;
+  this->_motor_limits = _MOTOR_NO_LIMIT | (_MOTOR_NO_LIMIT << 8);
+  this->_motor_requested = 0;
+  this->_motor_stats_limited = 0;
+  this->_spatial_slot = -1;
+  this->_motor_feedback_seq = 0;
+  this->_onmotorresponse = nullptr;
+  this->_motor_request_id = 0;
+  for (size_t i = 0; i < _MOTOR_PATH_NUM; i++) {
+    this->_motor_paths[i].state = _MOTOR_PATH_FREE;
+  }
 
-  client->setClientCallbacks(new ToioClientCallback());
+  this->_connected = false;
+  this->_connection_updated = false;
+  this->_onconnectionstate = nullptr;
+  this->_conn_state = TOIO_CORE_CONNECTION_DISCONNECTED;
+  this->_conn_started = 0;
+
+  this->_worker = nullptr;
+  this->_jobs = nullptr;
+  this->_worker_stopping = false;
+  this->_worker_alive = false;
+  this->_job_busy = false;
+  this->_job_done = false;
+  this->_job_error = TOIO_CORE_CONNECTION_ERROR_NONE;
+  this->_job_generation = 0;
+  this->_gatt_cache_enabled = false;
+  memset(&this->_gatt_cache_stats, 0, sizeof(this->_gatt_cache_stats));
+
+  this->_reconnect_enabled = false;
+  this->_reconnecting = false;
+  this->_reconnect_suppressed = false;
+  this->_reconnect_min_ms = 50;
+  this->_reconnect_max_ms = 5000;
+  this->_reconnect_backoff = 0;
+  this->_reconnect_at = 0;
+  this->_reconnect_lost_at = 0;
+  this->_reconnect_total_ms = 0;
+  memset(&this->_reconnect_stats, 0, sizeof(this->_reconnect_stats));
+  memset(&this->_session, 0, sizeof(this->_session));
+  this->_led_last_len = 0;
+  this->_led_pending = 0;
+  this->_led_sent_at = 0;
+  this->_led_interval_us = TOIO_CORE_LED_WRITE_INTERVAL * 1000;
+  this->_led_stats_frames = 0;
+  this->_led_stats_coalesced = 0;
+  this->_led_stats_skipped = 0;
+  this->_led_stats_writes = 0;
+  this->_recorder = nullptr;
+  this->resetLinkStats();
+  this->_read_mode = TOIO_CORE_READ_BLOCKING;
+  this->_read_max_age_ms = 0;
+  this->_read_pending = 0;
+  this->_notify_count = 0;
+  this->_posture_queued = false;
+  this->_magnetic_queued = false;
+  for (size_t i = 0; i < TOIO_CORE_CONFIG_PENDING_NUM; i++) {
+    this->_config_requests[i].state = _CONFIG_FREE;
+    this->_config_requests[i].async = false;
+    this->_config_requests[i].cb = nullptr;
+  }
+  this->_config_seq = 0;
+
+  this->_client_callback = new ToioClientCallback(this);
+  client->setClientCallbacks(this->_client_callback);
 }
 
 // ---------------------------------------------------------------
 // デストラクタ
+// - ワーカータスクを止めてから切断し、キューと接続状態のコールバックを解放する
+//   (ワーカータスクの処理中の接続処理が終わるまで待つ)
+// - BLEClient は BLE スタックに登録されたままなので解放しない
 // ---------------------------------------------------------------
 ToioCore::~ToioCore() {
+  if (this->_worker) {
+    this->_worker_stopping = true;
+    ToioCoreJob job;
+    job.state = TOIO_CORE_CONNECTION_DISCONNECTED;
+    job.generation = this->_job_generation;
+    job.read = TOIO_CORE_CHAR_NUM;
+    job.link = false;
+    xQueueSend(this->_jobs, &job, portMAX_DELAY);
+    while (this->_worker_alive) {
+      delay(1);
+    }
+    vQueueDelete(this->_jobs);
+  }
+
+  // 通知のコールバックは this を捕捉しているので、切断する前に外す
+  if (this->_connected) {
+    this->_unsubscribe();
+  }
+  this->disconnect();
+  unsigned long started = millis();
+  while (this->_connected && millis() - started < this->_DISCONNECT_TIMEOUT) {
+    delay(1);
+  }
+  // 切断が間に合わなくても、クライアントのコールバックを外してから解放する
+  this->_client->setClientCallbacks(nullptr);
+  delete this->_client_callback;
   delete this->_device;
 }
 
@@ -79,143 +200,113 @@ std::string ToioCore::getName() {
 }
 
 // ---------------------------------------------------------------
-// 接続
+// 最後に受信したアドバタイズの RSSI を取得
+// ---------------------------------------------------------------
+int ToioCore::getRssi() {
+  return this->_rssi;
+}
+
+// ---------------------------------------------------------------
+// 接続 (接続が完了するまで処理を戻さない)
 // ---------------------------------------------------------------
 bool ToioCore::connect() {
+  this->_reconnect_suppressed = false;
   if (this->isConnected()) {
     return true;
   }
-
-  // 接続
-  bool connected = this->_client->connect(this->_device);
-  if (!connected) {
+  // 非同期接続の処理中
+  if (this->_conn_state != TOIO_CORE_CONNECTION_DISCONNECTED || this->_job_busy) {
     return false;
   }
 
-  g_event_battery_updated = false;
-  g_event_battery_level = 0;
-
-  g_event_button_updated = false;
-  g_event_button_state = false;
-
-  // Service を取得
-  BLERemoteService* service = this->_client->getService(this->_TOIO_SERVICE_UUID);
-  if (service == nullptr) {
-    Serial.print("Failed to find the service: UUID=" + String(this->_TOIO_SERVICE_UUID));
-    this->disconnect();
-    return false;
-  }
+  // 前回の接続時に受信したまま処理されていないイベントを破棄
+  this->_clearEvents();
 
-  // バッテリーの Characteristic を取得
-  this->_char_battery = service->getCharacteristic(this->_TOIO_CHAR_UUID_BATT);
-  if (this->_char_battery == nullptr) {
-    Serial.print("Failed to find the characteristic for the battery: UUID=" + String(this->_TOIO_CHAR_UUID_BATT));
-    this->disconnect();
-    return false;
+  // BLE 接続の枠が空くまで待つ (Toio に登録されている場合)
+  if (this->_toio) {
+    if (!this->_toio->_admitConnect(this)) {
+      this->_setConnectionState(TOIO_CORE_CONNECTION_DISCONNECTED, TOIO_CORE_CONNECTION_ERROR_LIMIT);
+      return false;
+    }
+    unsigned long started = millis();
+    while (!this->_toio->_acquireConnectSlot()) {
+      if (millis() - started >= this->_CONNECT_TIMEOUT) {
+        this->_setConnectionState(TOIO_CORE_CONNECTION_DISCONNECTED, TOIO_CORE_CONNECTION_ERROR_TIMEOUT);
+        return false;
+      }
+      delay(1);
+    }
+    this->_conn_slot = true;
   }
 
-  // ライト (LED) の Characteristic を取得
-  this->_char_light = service->getCharacteristic(this->_TOIO_CHAR_UUID_LIGHT);
-  if (this->_char_light == nullptr) {
-    Serial.print("Failed to find the characteristic for the light: UUID=" + String(this->_TOIO_CHAR_UUID_LIGHT));
-    this->disconnect();
-    return false;
+  // 接続処理の各段階を順に実行
+  for (uint8_t s = TOIO_CORE_CONNECTION_CONNECTING; s < TOIO_CORE_CONNECTION_CONNECTED; s++) {
+    ToioCoreConnectionState state = (ToioCoreConnectionState)s;
+    this->_setConnectionState(state, TOIO_CORE_CONNECTION_ERROR_NONE);
+    ToioCoreConnectionError error = this->_runConnectStep(state);
+    if (state == TOIO_CORE_CONNECTION_CONNECTING) {
+      this->_releaseConnectSlot();
+    }
+    if (error != TOIO_CORE_CONNECTION_ERROR_NONE) {
+      this->_client->disconnect();
+      this->_setConnectionState(TOIO_CORE_CONNECTION_DISCONNECTED, error);
+      return false;
+    }
   }
+  this->_setConnectionState(TOIO_CORE_CONNECTION_CONNECTED, TOIO_CORE_CONNECTION_ERROR_NONE);
+  return true;
+}
 
-  // サウンドの Characteristic を取得
-  this->_char_sound = service->getCharacteristic(this->_TOIO_CHAR_UUID_SOUND);
-  if (this->_char_sound == nullptr) {
-    Serial.print("Failed to find the characteristic for the sound: UUID=" + String(this->_TOIO_CHAR_UUID_SOUND));
-    this->disconnect();
-    return false;
+// ---------------------------------------------------------------
+// 非同期接続 (接続処理は Toio::loop() から進められる)
+// ---------------------------------------------------------------
+bool ToioCore::connectAsync() {
+  this->_reconnect_suppressed = false;
+  if (this->_conn_state != TOIO_CORE_CONNECTION_DISCONNECTED) {
+    return true;
   }
-
-  // ボタンの Characteristic を取得
-  this->_char_button = service->getCharacteristic(this->_TOIO_CHAR_UUID_BUTTON);
-  if (this->_char_button == nullptr) {
-    Serial.print("Failed to find the characteristic for the button: UUID=" + String(this->_TOIO_CHAR_UUID_BUTTON));
-    this->disconnect();
+  // タイムアウトした前回の接続処理がまだ終わっていない
+  if (this->_job_busy) {
     return false;
   }
-
-  // モーションセンサーの Characteristic を取得
-  this->_char_motion = service->getCharacteristic(this->_TOIO_CHAR_UUID_MOTION);
-  if (this->_char_motion == nullptr) {
-    Serial.print("Failed to find the characteristic for the motion sensor: UUID=" + String(this->_TOIO_CHAR_UUID_MOTION));
-    this->disconnect();
+  if (!this->_startWorker()) {
     return false;
   }
-
-  // 設定の Characteristic を取得
-  this->_char_conf = service->getCharacteristic(this->_TOIO_CHAR_UUID_CONF);
-  if (this->_char_conf == nullptr) {
-    Serial.print("Failed to find the characteristic for the configuration: UUID=" + String(this->_TOIO_CHAR_UUID_CONF));
-    this->disconnect();
+  if (this->_toio && !this->_toio->_admitConnect(this)) {
+    this->_setConnectionState(TOIO_CORE_CONNECTION_DISCONNECTED, TOIO_CORE_CONNECTION_ERROR_LIMIT);
     return false;
   }
-
-  // モーターの Characteristic を取得
-  this->_char_motor = service->getCharacteristic(this->_TOIO_CHAR_UUID_MOTOR);
-  if (this->_char_motor == nullptr) {
-    Serial.print("Failed to find the characteristic for the motors: UUID=" + String(this->_TOIO_CHAR_UUID_MOTOR));
-    this->disconnect();
-    return false;
+  this->_clearEvents();
+  this->_setConnectionState(TOIO_CORE_CONNECTION_CONNECTING, TOIO_CORE_CONNECTION_ERROR_NONE);
+  if (this->_toio) {
+    // BLE 接続は Toio::loop() が順番に始める
+    this->_conn_waiting = true;
+    this->_toio->_queueConnect(this);
+    return true;
   }
-
-  // バッテリーイベントのコールバックをセット
-  this->_char_battery->registerForNotify([](BLERemoteCharacteristic * rchar, uint8_t* data, size_t len, bool is_notify) {
-    if (!g_current_client) {
-      return;
-    }
-    if (len != 1) {
-      return;
-    }
-    uint8_t level = data[0];
-    g_event_battery_level = level;
-    g_event_battery_updated = true;
-  });
-
-  // ボタンイベントのコールバックをセット
-  this->_char_button->registerForNotify([](BLERemoteCharacteristic * rchar, uint8_t* data, size_t len, bool is_notify) {
-    if (!g_current_client) {
-      return;
-    }
-    if (len != 2) {
-      return;
-    }
-    if (data[0] != 0x01) {
-      return;
-    }
-    bool state = (data[1] == 0x80) ? true : false;
-    g_event_button_state = state;
-    g_event_button_updated = true;
-  });
-
-
-  // モーションセンサーイベントのコールバックをセット
-  this->_char_motion->registerForNotify([](BLERemoteCharacteristic * rchar, uint8_t* data, size_t len, bool is_notify) {
-    if (!g_current_client) {
-      return;
-    }
-    if (len != 5) {
-      return;
-    }
-    g_event_motion_data.flat = data[1];
-    g_event_motion_data.clash = data[2];
-    g_event_motion_data.dtap = data[3];
-    g_event_motion_data.attitude = data[4];
-    g_event_motion_updated = true;
-  });
-
-  // 1000 ミリ秒待つ
-  this->_wait(1000);
+  this->_grantConnect();
   return true;
 }
 
+// ---------------------------------------------------------------
+// 接続処理の状態を返す
+// ---------------------------------------------------------------
+ToioCoreConnectionState ToioCore::getConnectionState() {
+  return (ToioCoreConnectionState)this->_conn_state.load();
+}
+
 // ---------------------------------------------------------------
 // 切断
 // ---------------------------------------------------------------
 void ToioCore::disconnect() {
+  this->_reconnect_suppressed = true;
+  this->_reconnecting = false;
+  if (this->_conn_waiting) {
+    // BLE 接続の順番待ちをやめる
+    this->_conn_waiting = false;
+    this->_setConnectionState(TOIO_CORE_CONNECTION_DISCONNECTED, TOIO_CORE_CONNECTION_ERROR_NONE);
+    return;
+  }
   this->_client->disconnect();
 }
 
@@ -223,7 +314,7 @@ void ToioCore::disconnect() {
 // 接続状態を返す
 // ---------------------------------------------------------------
 bool ToioCore::isConnected() {
-  return (g_current_client && g_current_client == this->_client) ? true : false;
+  return (this->_connected && this->_conn_state == TOIO_CORE_CONNECTION_CONNECTED) ? true : false;
 }
 
 // ---------------------------------------------------------------
@@ -233,6 +324,13 @@ void ToioCore::onConnection(OnConnectionCallback cb) {
   this->_onconnection = cb;
 }
 
+// ---------------------------------------------------------------
+// 接続処理の状態変化のコールバックをセット
+// ---------------------------------------------------------------
+void ToioCore::onConnection(OnConnectionStateCallback cb) {
+  this->_onconnectionstate = cb;
+}
+
 // ---------------------------------------------------------------
 // サウンド再生開始 (生データ指定)
 // ---------------------------------------------------------------
@@ -240,7 +338,7 @@ void ToioCore::playSoundRaw(uint8_t* data, size_t length) {
   if (!this->isConnected()) {
     return;
   }
-  this->_char_sound->writeValue(data, length, true);
+  this->_write(TOIO_CORE_CHAR_SOUND, data, length, true);
 }
 
 // ---------------------------------------------------------------
@@ -250,8 +348,8 @@ void ToioCore::playSoundEffect(uint8_t sound_id, uint8_t volume) {
   if (!this->isConnected()) {
     return;
   }
-  uint8_t data[3] = {0x02, sound_id, volume};
-  this->_char_sound->writeValue(data, 3, true);
+  ToioPacket<3> packet = toioEncodeSoundEffect(sound_id, volume);
+  this->_write(TOIO_CORE_CHAR_SOUND, packet.data, packet.length, true);
 }
 
 // ---------------------------------------------------------------
@@ -261,27 +359,21 @@ void ToioCore::stopSound() {
   if (!this->isConnected()) {
     return;
   }
-  uint8_t data[1] = {0x01};
-  this->_char_sound->writeValue(data, 1, true);
+  ToioPacket<1> packet = toioEncodeSoundStop();
+  this->_write(TOIO_CORE_CHAR_SOUND, packet.data, packet.length, true);
 }
 
 // ---------------------------------------------------------------
 // LED 点灯
 // ---------------------------------------------------------------
 void ToioCore::turnOnLed(uint8_t r, uint8_t g, uint8_t b) {
+  this->_setSessionLed(r, g, b);
+  this->_led_pending = 0;
   if (!this->isConnected()) {
     return;
   }
-  uint8_t data[7] = {
-    0x03, // 制御の種類 (点灯・消灯)
-    0x00, // ランプを制御する時間 (ミリ秒)
-    0x01, // 制御するランプの数 (0x01 固定)
-    0x01, // 制御するランプの ID (0x01 固定)
-    r,    // ランプの Red の値
-    g,    // ランプの Green の値
-    b     // ランプの Blue の値
-  };
-  this->_char_light->writeValue(data, 7);
+  ToioPacket<7> packet = toioEncodeLed(r, g, b);
+  this->_writeLight(packet.data, packet.length, false);
 }
 
 // ---------------------------------------------------------------
@@ -291,6 +383,161 @@ void ToioCore::turnOffLed() {
   this->turnOnLed(0x00, 0x00, 0x00);
 }
 
+// ---------------------------------------------------------------
+// LED のシナリオを再生
+// ---------------------------------------------------------------
+bool ToioCore::playLedScenario(const ToioCoreLedStep* steps, size_t count, uint8_t repeat) {
+  if (count == 0) {
+    return false;
+  }
+  ToioPacket<TOIO_LED_PACKET_SIZE> packet;
+  toioEncodeLedScenario(steps, count, repeat, packet);
+
+  // 繰り返し続けるシナリオは、接続し直したときに再送する
+  portENTER_CRITICAL(&this->_session_mux);
+  this->_session.led = false;
+  this->_session.led_scenario_len = 0;
+  if (repeat == 0) {
+    memcpy(this->_session.led_scenario, packet.data, packet.length);
+    this->_session.led_scenario_len = packet.length;
+  }
+  portEXIT_CRITICAL(&this->_session_mux);
+  this->_led_pending = 0;
+  if (!this->isConnected()) {
+    return false;
+  }
+  this->_writeLight(packet.data, packet.length, repeat == 0);
+  return true;
+}
+
+// ---------------------------------------------------------------
+// LED を点滅
+// ---------------------------------------------------------------
+bool ToioCore::blinkLed(uint8_t r, uint8_t g, uint8_t b, uint16_t on_ms, uint16_t off_ms, uint8_t repeat) {
+  ToioCoreLedStep steps[2] = {
+    {on_ms, r, g, b},
+    {off_ms, 0x00, 0x00, 0x00}
+  };
+  return this->playLedScenario(steps, 2, repeat);
+}
+
+// ---------------------------------------------------------------
+// LED をゆっくり明滅
+// (明るさは 2 乗で変化させ、暗いところの変化を細かくする)
+// ---------------------------------------------------------------
+bool ToioCore::breatheLed(uint8_t r, uint8_t g, uint8_t b, uint16_t period_ms, uint8_t repeat) {
+  const uint32_t half = TOIO_CORE_LED_SCENARIO_MAX_STEPS / 2;
+  ToioCoreLedStep steps[half * 2];
+  uint16_t duration = period_ms / (half * 2);
+  for (uint32_t i = 0; i < half * 2; i++) {
+    uint32_t level = (i <= half) ? i : half * 2 - i;
+    uint32_t scale = level * level;
+    steps[i].duration_ms = duration;
+    steps[i].r = r * scale / (half * half);
+    steps[i].g = g * scale / (half * half);
+    steps[i].b = b * scale / (half * half);
+  }
+  return this->playLedScenario(steps, half * 2, repeat);
+}
+
+// ---------------------------------------------------------------
+// フレームごとの LED の色をセット
+// ---------------------------------------------------------------
+void ToioCore::setLedFrame(uint8_t r, uint8_t g, uint8_t b) {
+  this->_led_stats_frames++;
+  if (!this->isConnected()) {
+    return;
+  }
+  uint32_t frame = ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+  if (this->_led_pending.exchange(frame | _LED_FRAME_PENDING) & _LED_FRAME_PENDING) {
+    this->_led_stats_coalesced++;
+  }
+  this->_flushLedFrame();
+  if (this->_led_pending.load() != 0) {
+    this->_markReady();
+  }
+}
+
+// ---------------------------------------------------------------
+// setLedFrame() の書き込み間隔 (ミリ秒) をセット
+// ---------------------------------------------------------------
+void ToioCore::setLedWriteInterval(uint16_t msec) {
+  this->_led_interval_us = (uint32_t)msec * 1000;
+}
+
+// ---------------------------------------------------------------
+// LED の書き込みの統計情報を取得
+// ---------------------------------------------------------------
+ToioCoreLedStats ToioCore::getLedStats() {
+  ToioCoreLedStats stats;
+  stats.frames = this->_led_stats_frames;
+  stats.coalesced = this->_led_stats_coalesced;
+  stats.skipped = this->_led_stats_skipped;
+  stats.writes = this->_led_stats_writes;
+  return stats;
+}
+
+// ---------------------------------------------------------------
+// 送信待ちのフレームを書き込む
+// (書き込み間隔が経過していなければ何もしない。Toio::loop() からも呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_flushLedFrame() {
+  if (!(this->_led_pending.load() & _LED_FRAME_PENDING)) {
+    return;
+  }
+  uint32_t now = micros();
+  if (this->_led_sent_at != 0 && (int32_t)(now - this->_led_sent_at - this->_led_interval_us) < 0) {
+    return;
+  }
+  uint32_t frame = this->_led_pending.exchange(0);
+  if (!(frame & _LED_FRAME_PENDING)) {
+    return;
+  }
+  uint8_t r = frame >> 16;
+  uint8_t g = frame >> 8;
+  uint8_t b = frame;
+  this->_setSessionLed(r, g, b);
+  ToioPacket<7> packet = toioEncodeLed(r, g, b);
+  if (this->_writeLight(packet.data, packet.length, true)) {
+    this->_led_sent_at = now | 1;
+  }
+}
+
+// ---------------------------------------------------------------
+// ライトに書き込む (skip_same なら、最後に書き込んだデータと同じときは書き込まない)
+// ---------------------------------------------------------------
+bool ToioCore::_writeLight(const uint8_t* data, size_t length, bool skip_same) {
+  portENTER_CRITICAL(&this->_led_mux);
+  if (skip_same && length == this->_led_last_len && memcmp(data, this->_led_last, length) == 0) {
+    portEXIT_CRITICAL(&this->_led_mux);
+    this->_led_stats_skipped++;
+    return false;
+  }
+  memcpy(this->_led_last, data, length);
+  this->_led_last_len = length;
+  portEXIT_CRITICAL(&this->_led_mux);
+  this->_write(TOIO_CORE_CHAR_LIGHT, data, length, false);
+  this->_led_stats_writes++;
+  return true;
+}
+
+// ---------------------------------------------------------------
+// 最後にライトに書き込んだデータを忘れる (接続し直したときは次の書き込みを必ず送る)
+// ---------------------------------------------------------------
+void ToioCore::_forgetLight() {
+  portENTER_CRITICAL(&this->_led_mux);
+  this->_led_last_len = 0;
+  portEXIT_CRITICAL(&this->_led_mux);
+}
+
+// ---------------------------------------------------------------
+// バッテリー・ボタン・モーションセンサーの状態の取得方法をセット
+// ---------------------------------------------------------------
+void ToioCore::setReadMode(ToioCoreReadMode mode, uint32_t max_age_ms) {
+  this->_read_mode = mode;
+  this->_read_max_age_ms = max_age_ms;
+}
+
 // ---------------------------------------------------------------
 // バッテリーレベルを取得
 // ---------------------------------------------------------------
@@ -298,14 +545,24 @@ uint8_t ToioCore::getBatteryLevel() {
   if (!this->isConnected()) {
     return 0;
   }
-  std::string data = this->_char_battery->readValue();
-  if (data.size() != 1) {
+  if (this->_read_mode == TOIO_CORE_READ_BLOCKING && !this->_readState(TOIO_CORE_CHAR_BATTERY)) {
     return 0;
   }
-  uint8_t level = data[0];
+  uint8_t level = 0;
+  uint32_t age_ms;
+  this->getBatteryLevel(level, age_ms);
   return level;
 }
 
+bool ToioCore::getBatteryLevel(uint8_t& level, uint32_t& age_ms) {
+  _State state;
+  if (!this->_getState(TOIO_CORE_CHAR_BATTERY, state, age_ms)) {
+    return false;
+  }
+  level = state.battery_level;
+  return true;
+}
+
 // ---------------------------------------------------------------
 // バッテリーイベントのコールバックをセット
 // ---------------------------------------------------------------
@@ -320,12 +577,22 @@ bool ToioCore::getButtonState() {
   if (!this->isConnected()) {
     return false;
   }
-  std::string data = this->_char_button->readValue();
-  if (data.size() != 2) {
+  if (this->_read_mode == TOIO_CORE_READ_BLOCKING && !this->_readState(TOIO_CORE_CHAR_BUTTON)) {
+    return false;
+  }
+  bool pressed = false;
+  uint32_t age_ms;
+  this->getButtonState(pressed, age_ms);
+  return pressed;
+}
+
+bool ToioCore::getButtonState(bool& state, uint32_t& age_ms) {
+  _State cached;
+  if (!this->_getState(TOIO_CORE_CHAR_BUTTON, cached, age_ms)) {
     return false;
   }
-  bool state = (data[1] == 0x80) ? true : false;
-  return state;
+  state = cached.button_state;
+  return true;
 }
 
 // ---------------------------------------------------------------
@@ -343,206 +610,2231 @@ ToioCoreMotionData ToioCore::getMotion() {
   if (!this->isConnected()) {
     return res;
   }
-  std::string data = this->_char_motion->readValue();
-  if (data.size() != 5) {
+  if (this->_read_mode == TOIO_CORE_READ_BLOCKING && !this->_readState(TOIO_CORE_CHAR_MOTION)) {
     return res;
   }
-  res.flat = data[1];
-  res.clash = data[2];
-  res.dtap = data[3];
-  res.attitude = data[4];
+  uint32_t age_ms;
+  this->getMotion(res, age_ms);
   return res;
 }
 
-// ---------------------------------------------------------------
-// モーションセンサーのコールバックをセット
-// ---------------------------------------------------------------
-void ToioCore::onMotion(OnMotionCallback cb) {
-  this->_onmotion = cb;
+bool ToioCore::getMotion(ToioCoreMotionData& motion, uint32_t& age_ms) {
+  _State state;
+  if (!this->_getState(TOIO_CORE_CHAR_MOTION, state, age_ms)) {
+    return false;
+  }
+  motion = state.motion;
+  return true;
 }
 
 // ---------------------------------------------------------------
-// BLE プロトコルバージョン取得
+// 通知・読み出しで得た値で状態を更新する
+// (BLE タスク、ワーカータスク、loop タスクから呼ばれる)
 // ---------------------------------------------------------------
-std::string ToioCore::getBleProtocolVersion() {
-  std::string empty_data = "";
-  if (!this->isConnected()) {
-    return empty_data;
+bool ToioCore::_updateState(ToioCoreCharacteristic ch, const uint8_t* data, size_t len, uint32_t timestamp) {
+  uint32_t at = timestamp ? timestamp : 1;
+  portENTER_CRITICAL(&this->_state_mux);
+  _State state;
+  this->_state.read(state);
+  bool updated = false;
+  switch (ch) {
+    case TOIO_CORE_CHAR_BATTERY:
+      if (toioDecodeBattery(data, len, state.battery_level)) {
+        state.battery_at = at;
+        updated = true;
+      }
+      break;
+    case TOIO_CORE_CHAR_BUTTON:
+      if (toioDecodeButton(data, len, state.button_state)) {
+        state.button_at = at;
+        updated = true;
+      }
+      break;
+    case TOIO_CORE_CHAR_MOTION:
+      if (toioDecodeMotion(data, len, state.motion)) {
+        state.motion_at = at;
+        updated = true;
+      }
+      break;
+    default:
+      break;
   }
-  uint8_t sdata[2] = {0x01, 0x00};
-  this->_char_conf->writeValue(sdata, 2, true);
-  this->_wait(2000);
-  std::string rdata = this->_char_conf->readValue();
-  if (rdata.size() >= 3 || rdata[0] == 0x81) {
-    std::string ver = rdata.substr(2, rdata.size() - 2);
-    return ver;
-  } else {
-    return empty_data;
+  if (updated) {
+    this->_state.write(state);
   }
+  portEXIT_CRITICAL(&this->_state_mux);
+  return updated;
 }
 
 // ---------------------------------------------------------------
-// 水平検出のしきい値設定
+// 状態を破棄する (接続のたびに呼ばれる)
 // ---------------------------------------------------------------
-void ToioCore::setFlatThreshold(uint8_t deg) {
-  if (!this->isConnected()) {
-    return;
-  }
-  if (deg < 1) {
-    deg = 1;
-  }
-  if (deg > 45) {
-    deg = 45;
-  }
-  uint8_t data[3] = {0x05, 0x00, deg};
-  this->_char_sound->writeValue(data, 3, true);
+void ToioCore::_clearState() {
+  portENTER_CRITICAL(&this->_state_mux);
+  _State state;
+  memset(&state, 0, sizeof(state));
+  this->_state.write(state);
+  portEXIT_CRITICAL(&this->_state_mux);
 }
 
 // ---------------------------------------------------------------
-// 衝突検出のしきい値設定
+// 最新の状態と経過時間を返す (値がなければ false)
+// (値がないか max_age_ms より古ければ、非同期の読み出しを要求する)
 // ---------------------------------------------------------------
-void ToioCore::setClashThreshold(uint8_t level) {
-  if (!this->isConnected()) {
-    return;
+bool ToioCore::_getState(ToioCoreCharacteristic ch, _State& state, uint32_t& age_ms) {
+  this->_state.read(state);
+  uint32_t at = 0;
+  switch (ch) {
+    case TOIO_CORE_CHAR_BATTERY: at = state.battery_at; break;
+    case TOIO_CORE_CHAR_BUTTON: at = state.button_at; break;
+    case TOIO_CORE_CHAR_MOTION: at = state.motion_at; break;
+    default: break;
   }
-  if (level < 1) {
-    level = 1;
+  if (at == 0) {
+    this->_requestRead(ch);
+    return false;
   }
-  if (level > 10) {
-    level = 10;
+  age_ms = (micros() - at) / 1000;
+  if (this->_read_max_age_ms > 0 && age_ms >= this->_read_max_age_ms) {
+    this->_requestRead(ch);
   }
-  uint8_t data[3] = {0x06, 0x00, level};
-  this->_char_sound->writeValue(data, 3, true);
+  return true;
 }
 
 // ---------------------------------------------------------------
-// ダブルタップ検出の時間間隔の設定
+// GATT の読み出しで状態を更新する (応答を待つ)
 // ---------------------------------------------------------------
-void ToioCore::setDtapThreshold(uint8_t level) {
-  if (!this->isConnected()) {
+bool ToioCore::_readState(ToioCoreCharacteristic ch) {
+  std::string data = this->_getChar(ch)->readValue();
+  return this->_updateState(ch, (const uint8_t*)data.data(), data.size(), micros());
+}
+
+// ---------------------------------------------------------------
+// ワーカータスクに非同期の読み出しを要求する
+// (キャラクタリスティックごとに 1 つまで。キューが一杯なら諦める。
+// 同期の connect() で接続した場合はここでワーカータスクを起動する)
+// ---------------------------------------------------------------
+void ToioCore::_requestRead(ToioCoreCharacteristic ch) {
+  if (!this->isConnected() || !this->_startWorker()) {
     return;
   }
-  if (level < 1) {
-    level = 1;
+  uint8_t bit = 1 << ch;
+  if (this->_read_pending.fetch_or(bit) & bit) {
+    return;
   }
-  if (level > 7) {
-    level = 7;
+  ToioCoreJob job;
+  job.state = TOIO_CORE_CONNECTION_CONNECTED;
+  job.generation = this->_job_generation;
+  job.read = ch;
+  job.link = false;
+  if (xQueueSend(this->_jobs, &job, 0) != pdTRUE) {
+    this->_read_pending.fetch_and(~bit);
   }
-  uint8_t data[3] = {0x17, 0x00, level};
-  this->_char_sound->writeValue(data, 3, true);
 }
 
 // ---------------------------------------------------------------
-// モーター制御 (引数の値をそのまま送信するローレベルのメソッド)
+// モーションセンサーのコールバックをセット
 // ---------------------------------------------------------------
-void ToioCore::controlMotor(bool ldir, uint8_t lspeed, bool rdir, uint8_t rspeed, uint16_t duration) {
-  if (!this->isConnected()) {
-    return;
-  }
-  uint8_t ldir_data = ldir ? 0x01 : 0x02;
-  uint8_t rdir_data = rdir ? 0x01 : 0x02;
-  uint8_t dur_data = (float)duration / 10;
-  uint8_t data[8] = {0x02, 0x01, ldir_data, lspeed, 0x02, rdir_data, rspeed, dur_data};
-  this->_char_motor->writeValue(data, 8, true);
+void ToioCore::onMotion(OnMotionCallback cb) {
+  this->_onmotion = cb;
 }
 
 // ---------------------------------------------------------------
-// 運転 (モーター制御をスロットルとステアリング操作に置き換える)
-// - throttle : -100 ～ +100
-// - handle   : -100 ～ +100
+// 姿勢角の通知を設定
 // ---------------------------------------------------------------
-void ToioCore::drive(int8_t throttle, int8_t steering) {
-  if (!this->isConnected()) {
-    return;
-  }
-  uint8_t dir = 0x01;
-  if (throttle < 0) {
-    dir = 0x02;
+bool ToioCore::setPostureNotify(ToioCorePostureType type, uint16_t interval_ms, ToioCoreNotifyCondition condition) {
+  uint16_t interval = interval_ms / 10;
+  if (interval > 0xff) {
+    interval = 0xff;
   }
-  throttle = abs(throttle);
-  if(throttle > 100) {
-  	  throttle = 100;
-  }
-
-  if (steering < -100) {
-    steering = -100;
-  } else if (steering > 100) {
-    steering = 100;
-  }
-
-  double speed = 115.0 * (double)throttle / 100.0;
-
-  // steering から左右のモーターのスピードを確定する
-  double lspeed = speed;
-  double rspeed = speed;
-  if (steering < 0) {
-    // 左に旋回を意味するので左のモーターを減速する
-    lspeed = speed * (100 - abs(steering)) / 100.0;
-  } else if (steering > 0) {
-    // 右に旋回を意味するので右のモーターを減速する
-    rspeed = speed * (100 - abs(steering)) / 100.0;
+  portENTER_CRITICAL(&this->_session_mux);
+  this->_session.posture[0] = type;
+  this->_session.posture[1] = interval;
+  this->_session.posture[2] = condition;
+  portEXIT_CRITICAL(&this->_session_mux);
+  if (!this->isConnected()) {
+    return false;
   }
-
-  uint8_t data[7] = {0x01, 0x01, dir, (uint8_t)lspeed, 0x02, dir, (uint8_t)rspeed};
-  this->_char_motor->writeValue(data, 7, true);
+  ToioPacket<5> packet = toioEncodePostureNotify(type, interval, condition);
+  uint8_t res[3];
+  size_t len = this->requestConfig(packet.data, packet.length, TOIO_CONFIG_RESPONSE_POSTURE, res, sizeof(res));
+  return toioDecodeConfigResult(res, len);
 }
 
 // ---------------------------------------------------------------
-// Toio.cpp から呼ばれる (.ino からは直接呼ばない)
+// 最新の姿勢角を取得
 // ---------------------------------------------------------------
-void ToioCore::_loop() {
-  // 接続状態イベント
-  if (g_event_connection_updated) {
-    if (g_last_client == this->_client) {
-      bool event_connection_state = false;
-      if (g_current_client) {
-        event_connection_state = true;
-      } else {
-        g_last_client = nullptr;
-      }
-      if (this->_onconnection) {
-        this->_onconnection(event_connection_state);
-      }
-      g_event_connection_updated = false;
-    }
-  }
-
-  // 未接続または接続中の ToioCore が自分自身でないなら、以降の処理は不要なので終了
-  if (!this->isConnected() || g_current_client != this->_client) {
-    return;
+bool ToioCore::getPosture(ToioCorePostureData& posture, uint32_t& age_ms) {
+  _State state;
+  this->_state.read(state);
+  if (state.posture_at == 0) {
+    return false;
   }
+  posture = state.posture;
+  age_ms = (micros() - state.posture_at) / 1000;
+  return true;
+}
 
-  // バッテリーイベント
-  if (g_event_battery_updated) {
-    if (this->_onbattery) {
-      this->_onbattery(g_event_battery_level);
-      g_event_battery_updated = false;
-    }
-  }
+// ---------------------------------------------------------------
+// 姿勢角のコールバックをセット
+// ---------------------------------------------------------------
+void ToioCore::onPosture(OnPostureCallback cb) {
+  this->_onposture = cb;
+}
 
-  // ボタンイベント
-  if (g_event_button_updated) {
-    if (this->_onbutton) {
-      this->_onbutton(g_event_button_state);
-      g_event_button_updated = false;
-    }
+// ---------------------------------------------------------------
+// 磁気センサーの通知を設定
+// ---------------------------------------------------------------
+bool ToioCore::setMagneticNotify(ToioCoreMagneticMode mode, uint16_t interval_ms, ToioCoreNotifyCondition condition) {
+  uint16_t interval = interval_ms / 20;
+  if (interval > 0xff) {
+    interval = 0xff;
   }
-
-  // モーションセンサーイベント
-  if (g_event_motion_updated) {
-    if (this->_onmotion) {
-      this->_onmotion(g_event_motion_data);
-      g_event_motion_updated = false;
-    }
+  portENTER_CRITICAL(&this->_session_mux);
+  this->_session.magnetic[0] = mode;
+  this->_session.magnetic[1] = interval;
+  this->_session.magnetic[2] = condition;
+  portEXIT_CRITICAL(&this->_session_mux);
+  if (!this->isConnected()) {
+    return false;
   }
+  ToioPacket<5> packet = toioEncodeMagneticNotify(mode, interval, condition);
+  uint8_t res[3];
+  size_t len = this->requestConfig(packet.data, packet.length, TOIO_CONFIG_RESPONSE_MAGNETIC, res, sizeof(res));
+  return toioDecodeConfigResult(res, len);
 }
 
 // ---------------------------------------------------------------
-// 指定のミリ秒数だけ待つ
+// 最新の磁気センサーの値を取得
 // ---------------------------------------------------------------
-void ToioCore::_wait(const unsigned long msec) {
-  unsigned long now = millis();
-  while (millis() < now + msec) {
-    yield();
+bool ToioCore::getMagnetic(ToioCoreMagneticData& magnetic, uint32_t& age_ms) {
+  _State state;
+  this->_state.read(state);
+  if (state.magnetic_at == 0) {
+    return false;
+  }
+  magnetic = state.magnetic;
+  age_ms = (micros() - state.magnetic_at) / 1000;
+  return true;
+}
+
+// ---------------------------------------------------------------
+// 磁気センサーのコールバックをセット
+// ---------------------------------------------------------------
+void ToioCore::onMagnetic(OnMagneticCallback cb) {
+  this->_onmagnetic = cb;
+}
+
+// ---------------------------------------------------------------
+// Position ID のコールバックをセット
+// ---------------------------------------------------------------
+void ToioCore::onPosition(OnPositionCallback cb) {
+  this->_onposition = cb;
+}
+
+// ---------------------------------------------------------------
+// Standard ID のコールバックをセット
+// ---------------------------------------------------------------
+void ToioCore::onStandardId(OnStandardIdCallback cb) {
+  this->_onstandardid = cb;
+}
+
+// ---------------------------------------------------------------
+// ID を読み取れなくなったときのコールバックをセット
+// ---------------------------------------------------------------
+void ToioCore::onIdMissed(OnIdMissedCallback cb) {
+  this->_onidmissed = cb;
+}
+
+// ---------------------------------------------------------------
+// 最新の位置を取得
+// (BLE タスクが通知を受信するたびに更新されるので、loop() を待たずに
+// 通知のレートで読み出せる)
+// ---------------------------------------------------------------
+bool ToioCore::getLatestPose(ToioCorePose& pose) {
+  return this->_pose.read(pose);
+}
+
+// ---------------------------------------------------------------
+// 位置の履歴を新しい順に取得
+// ---------------------------------------------------------------
+size_t ToioCore::getPoseHistory(ToioCorePose* poses, size_t max) {
+  uint32_t seq = this->_pose_seq.load(std::memory_order_acquire);
+  size_t n = 0;
+  while (n < max && n < TOIO_CORE_POSE_HISTORY_SIZE && seq > n) {
+    uint32_t expected = seq - n;
+    ToioCorePose pose;
+    this->_pose_history[(expected - 1) & (TOIO_CORE_POSE_HISTORY_SIZE - 1)].read(pose);
+    // 読み出し中に上書きされた要素より古い履歴は返さない
+    if (pose.seq != expected) {
+      break;
+    }
+    poses[n++] = pose;
+  }
+  return n;
+}
+
+// ---------------------------------------------------------------
+// BLE プロトコルバージョン取得
+// ---------------------------------------------------------------
+std::string ToioCore::getBleProtocolVersion() {
+  std::string empty_data = "";
+  if (!this->isConnected()) {
+    return empty_data;
+  }
+  ToioPacket<2> packet = toioEncodeGetProtocolVersion();
+  uint8_t rdata[TOIO_CORE_CONFIG_RESPONSE_SIZE];
+  size_t len = this->requestConfig(packet.data, packet.length, TOIO_CONFIG_RESPONSE_PROTOCOL_VERSION, rdata, sizeof(rdata));
+  if (len < 3) {
+    return empty_data;
+  }
+  std::string ver((const char*)rdata + 2, len - 2);
+  this->_updateGattCacheVersion(ver);
+  return ver;
+}
+
+// ---------------------------------------------------------------
+// 設定を要求し、応答を待つ
+// ---------------------------------------------------------------
+size_t ToioCore::requestConfig(const uint8_t* data, size_t length, uint8_t response_type, uint8_t* response, size_t response_size, uint32_t timeout_ms) {
+  _ConfigRequest* req = this->_sendConfigRequest(data, length, response_type, timeout_ms, nullptr);
+  if (!req) {
+    return 0;
+  }
+  while (req->state == _CONFIG_WAITING && this->isConnected() && (int32_t)(millis() - req->deadline) < 0) {
+    delay(1);
+  }
+  // タイムアウトしたら応答待ちを取り消す (BLE タスクが書き込み中なら終わるのを待つ。
+  // 優先度の低いタスクにも譲れるよう、yield() ではなく delay() で待つ)
+  uint8_t state = _CONFIG_WAITING;
+  if (req->state.compare_exchange_strong(state, _CONFIG_RESERVED)) {
+    req->state = _CONFIG_FREE;
+    return 0;
+  }
+  while (req->state != _CONFIG_DONE) {
+    delay(1);
+  }
+  size_t len = (req->length < response_size) ? req->length : response_size;
+  memcpy(response, req->data, len);
+  req->state = _CONFIG_FREE;
+  return len;
+}
+
+// ---------------------------------------------------------------
+// 設定を要求し、応答を待たずに処理を戻す
+// ---------------------------------------------------------------
+bool ToioCore::requestConfigAsync(const uint8_t* data, size_t length, uint8_t response_type, OnConfigResponseCallback cb, uint32_t timeout_ms) {
+  return this->_sendConfigRequest(data, length, response_type, timeout_ms, cb ? cb : [](bool, const uint8_t*, size_t) {}) != nullptr;
+}
+
+// ---------------------------------------------------------------
+// 応答待ちを登録してから設定を書き込む
+// (応答は書き込みの完了より先に届くことがあるため)
+// ---------------------------------------------------------------
+ToioCore::_ConfigRequest* ToioCore::_sendConfigRequest(const uint8_t* data, size_t length, uint8_t response_type, uint32_t timeout_ms, OnConfigResponseCallback cb) {
+  if (!this->isConnected()) {
+    return nullptr;
+  }
+  _ConfigRequest* req = nullptr;
+  for (size_t i = 0; i < TOIO_CORE_CONFIG_PENDING_NUM; i++) {
+    uint8_t state = _CONFIG_FREE;
+    if (this->_config_requests[i].state.compare_exchange_strong(state, _CONFIG_RESERVED)) {
+      req = &this->_config_requests[i];
+      break;
+    }
+  }
+  if (!req) {
+    return nullptr;
+  }
+  req->response_type = response_type;
+  req->async = (cb != nullptr);
+  req->cb = cb;
+  req->seq = this->_config_seq++;
+  req->deadline = millis() + timeout_ms;
+  req->length = 0;
+  req->state = _CONFIG_WAITING;
+  if (req->async) {
+    this->_markReady();
+  }
+  this->_write(TOIO_CORE_CHAR_CONF, data, length, true);
+  return req;
+}
+
+// ---------------------------------------------------------------
+// 設定の応答を、同じ種類の応答を待っている最も古い要求に渡す (BLE タスクで呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_onConfigResponse(const uint8_t* data, size_t len) {
+  if (len < 1) {
+    return;
+  }
+  _ConfigRequest* oldest = nullptr;
+  for (size_t i = 0; i < TOIO_CORE_CONFIG_PENDING_NUM; i++) {
+    _ConfigRequest& req = this->_config_requests[i];
+    if (req.state != _CONFIG_WAITING || req.response_type != data[0]) {
+      continue;
+    }
+    if (!oldest || (int32_t)(req.seq - oldest->seq) < 0) {
+      oldest = &req;
+    }
+  }
+  uint8_t state = _CONFIG_WAITING;
+  if (!oldest || !oldest->state.compare_exchange_strong(state, _CONFIG_FILLING)) {
+    return;
+  }
+  oldest->length = (len < TOIO_CORE_CONFIG_RESPONSE_SIZE) ? len : TOIO_CORE_CONFIG_RESPONSE_SIZE;
+  memcpy(oldest->data, data, oldest->length);
+  oldest->state = _CONFIG_DONE;
+  if (oldest->async) {
+    this->_markReady();
+  }
+}
+
+// ---------------------------------------------------------------
+// 非同期の設定の要求の完了・タイムアウトを処理する (loop タスクで呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_loopConfigRequests() {
+  for (size_t i = 0; i < TOIO_CORE_CONFIG_PENDING_NUM; i++) {
+    _ConfigRequest& req = this->_config_requests[i];
+    if (!req.async) {
+      continue;
+    }
+    uint8_t state = req.state;
+    if (state == _CONFIG_DONE) {
+      uint8_t data[TOIO_CORE_CONFIG_RESPONSE_SIZE];
+      size_t len = req.length;
+      memcpy(data, req.data, len);
+      OnConfigResponseCallback cb = req.cb;
+      req.cb = nullptr;
+      req.async = false;
+      req.state = _CONFIG_FREE;
+      cb(true, data, len);
+    } else if (state == _CONFIG_WAITING && (!this->isConnected() || (int32_t)(millis() - req.deadline) >= 0)) {
+      if (!req.state.compare_exchange_strong(state, _CONFIG_RESERVED)) {
+        continue;
+      }
+      OnConfigResponseCallback cb = req.cb;
+      req.cb = nullptr;
+      req.async = false;
+      req.state = _CONFIG_FREE;
+      cb(false, nullptr, 0);
+    }
+  }
+}
+
+// ---------------------------------------------------------------
+// 水平検出のしきい値設定
+// ---------------------------------------------------------------
+void ToioCore::setFlatThreshold(uint8_t deg) {
+  if (deg < 1) {
+    deg = 1;
+  }
+  if (deg > 45) {
+    deg = 45;
+  }
+  portENTER_CRITICAL(&this->_session_mux);
+  this->_session.flat = deg;
+  portEXIT_CRITICAL(&this->_session_mux);
+  if (!this->isConnected()) {
+    return;
+  }
+  ToioPacket<3> packet = toioEncodeFlatThreshold(deg);
+  this->_write(TOIO_CORE_CHAR_CONF, packet.data, packet.length, true);
+}
+
+// ---------------------------------------------------------------
+// 衝突検出のしきい値設定
+// ---------------------------------------------------------------
+void ToioCore::setClashThreshold(uint8_t level) {
+  if (level < 1) {
+    level = 1;
+  }
+  if (level > 10) {
+    level = 10;
+  }
+  portENTER_CRITICAL(&this->_session_mux);
+  this->_session.clash = level;
+  portEXIT_CRITICAL(&this->_session_mux);
+  if (!this->isConnected()) {
+    return;
+  }
+  ToioPacket<3> packet = toioEncodeClashThreshold(level);
+  this->_write(TOIO_CORE_CHAR_CONF, packet.data, packet.length, true);
+}
+
+// ---------------------------------------------------------------
+// ダブルタップ検出の時間間隔の設定
+// ---------------------------------------------------------------
+void ToioCore::setDtapThreshold(uint8_t level) {
+  if (level < 1) {
+    level = 1;
+  }
+  if (level > 7) {
+    level = 7;
+  }
+  portENTER_CRITICAL(&this->_session_mux);
+  this->_session.dtap = level;
+  portEXIT_CRITICAL(&this->_session_mux);
+  if (!this->isConnected()) {
+    return;
+  }
+  ToioPacket<3> packet = toioEncodeDtapThreshold(level);
+  this->_write(TOIO_CORE_CHAR_CONF, packet.data, packet.length, true);
+}
+
+// ---------------------------------------------------------------
+// 接続間隔の変更を要求
+// ---------------------------------------------------------------
+bool ToioCore::requestConnectionInterval(uint16_t min_interval, uint16_t max_interval) {
+  bool none = (min_interval == TOIO_CORE_CONN_INTERVAL_NONE && max_interval == TOIO_CORE_CONN_INTERVAL_NONE);
+  if (!none && (min_interval < 0x0006 || max_interval > 0x0c80 || min_interval > max_interval)) {
+    return false;
+  }
+  portENTER_CRITICAL(&this->_session_mux);
+  this->_session.conn_interval[0] = none ? 0 : min_interval;
+  this->_session.conn_interval[1] = none ? 0 : max_interval;
+  portEXIT_CRITICAL(&this->_session_mux);
+  if (!this->isConnected()) {
+    return false;
+  }
+  this->_writeConnInterval(min_interval, max_interval);
+  return true;
+}
+
+// ---------------------------------------------------------------
+// 接続間隔の変更要求を書き込む (応答はない)
+// ---------------------------------------------------------------
+void ToioCore::_writeConnInterval(uint16_t min_interval, uint16_t max_interval) {
+  ToioPacket<6> packet = toioEncodeConnInterval(min_interval, max_interval);
+  this->_write(TOIO_CORE_CHAR_CONF, packet.data, packet.length, true);
+}
+
+// ---------------------------------------------------------------
+// 接続間隔の要求を書き込む
+// - Toio が決めた接続間隔があればそれを、なければ requestConnectionInterval() で
+//   要求した接続間隔を書き込む
+// - どちらもなければ、cancel が true のときだけ要求の取り消しを書き込む
+// ---------------------------------------------------------------
+void ToioCore::_writeLinkInterval(const _Session& session, bool cancel) {
+  uint16_t interval = this->_link_interval;
+  if (interval != 0) {
+    this->_writeConnInterval(interval, interval);
+  } else if (session.conn_interval[0] != 0) {
+    this->_writeConnInterval(session.conn_interval[0], session.conn_interval[1]);
+  } else if (cancel) {
+    this->_writeConnInterval(TOIO_CORE_CONN_INTERVAL_NONE, TOIO_CORE_CONN_INTERVAL_NONE);
+  }
+}
+
+// ---------------------------------------------------------------
+// MTU の変更を要求
+// ---------------------------------------------------------------
+bool ToioCore::requestMtu(uint16_t mtu) {
+  portENTER_CRITICAL(&this->_session_mux);
+  this->_session.mtu = mtu;
+  portEXIT_CRITICAL(&this->_session_mux);
+  if (!this->isConnected()) {
+    return false;
+  }
+  return this->_client->setMTU(mtu) == 0;
+}
+
+// ---------------------------------------------------------------
+// 接続パラメーターのプリセットを適用
+// ---------------------------------------------------------------
+bool ToioCore::applyLinkPreset(ToioCoreLinkPreset preset) {
+  // 接続間隔の最小値・最大値、MTU (0 なら要求しない)、モーター制御の書き込み間隔 (ミリ秒)
+  static const uint16_t presets[3][4] = {
+    {TOIO_CORE_CONN_INTERVAL_NONE, TOIO_CORE_CONN_INTERVAL_NONE, 0, TOIO_CORE_MOTOR_WRITE_INTERVAL},
+    {6, 12, 247, 15},
+    {24, 40, 0, 50}
+  };
+  if (preset > TOIO_CORE_LINK_MANY_CUBES) {
+    return false;
+  }
+  const uint16_t* p = presets[preset];
+  this->setMotorWriteInterval(p[3]);
+  bool ok = this->requestConnectionInterval(p[0], p[1]);
+  if (p[2] != 0) {
+    ok = this->requestMtu(p[2]) && ok;
+  }
+  return ok;
+}
+
+// ---------------------------------------------------------------
+// 接続パラメーターを読み出す
+// ---------------------------------------------------------------
+bool ToioCore::getConnectionParams(ToioCoreConnParams& params) {
+  if (!this->isConnected()) {
+    return false;
+  }
+  uint8_t res[TOIO_CORE_CONFIG_RESPONSE_SIZE];
+  ToioPacket<2> requested = toioEncodeGetRequestedConnInterval();
+  size_t len = this->requestConfig(requested.data, requested.length, TOIO_CONFIG_RESPONSE_REQUESTED_CONN_INTERVAL, res, sizeof(res));
+  if (!toioDecodeConnInterval(res, len, params.min_interval, params.max_interval)) {
+    return false;
+  }
+  ToioPacket<2> current = toioEncodeGetConnInterval();
+  len = this->requestConfig(current.data, current.length, TOIO_CONFIG_RESPONSE_CONN_INTERVAL, res, sizeof(res));
+  if (!toioDecodeConnInterval(res, len, params.interval, params.interval)) {
+    return false;
+  }
+  params.mtu = this->_client->getMTU();
+  return true;
+}
+
+// ---------------------------------------------------------------
+// 通信の実測
+// ---------------------------------------------------------------
+ToioCoreLinkBenchmark ToioCore::benchmarkLink(uint32_t duration_ms) {
+  ToioCoreLinkBenchmark result;
+  memset(&result, 0, sizeof(result));
+  if (!this->isConnected() || duration_ms == 0) {
+    return result;
+  }
+  this->getConnectionParams(result.params);
+
+  // 往復時間 (現在の接続間隔の読み出しを繰り返す)
+  const uint32_t rounds = 5;
+  uint8_t res[TOIO_CORE_CONFIG_RESPONSE_SIZE];
+  ToioPacket<2> current = toioEncodeGetConnInterval();
+  uint32_t total_us = 0;
+  uint32_t answered = 0;
+  for (uint32_t i = 0; i < rounds; i++) {
+    uint32_t started = micros();
+    if (this->requestConfig(current.data, current.length, TOIO_CONFIG_RESPONSE_CONN_INTERVAL, res, sizeof(res)) >= 4) {
+      total_us += micros() - started;
+      answered++;
+    }
+  }
+  result.round_trip_us = (answered > 0) ? total_us / answered : 0;
+
+  // 最短間隔の姿勢角の通知を受けながら、停止のモーター制御を書き込み続ける
+  ToioPacket<5> posture = toioEncodePostureNotify(TOIO_CORE_POSTURE_EULER, 1, TOIO_CORE_NOTIFY_ALWAYS);
+  this->requestConfig(posture.data, posture.length, TOIO_CONFIG_RESPONSE_POSTURE, res, sizeof(res));
+  // (計測中はモーター制御の書き込みを独占する。その間の drive() / controlMotor() の
+  //  指示は送信待ちになり、計測のあとで書き込まれる)
+  const ToioPacket<8> stop = toioEncodeMotor(false, 0, false, 0);
+  while (this->_motor_sending.exchange(true)) {
+    yield();
+  }
+  uint32_t commands = 0;
+  uint32_t notified = this->_notify_count;
+  uint32_t started = micros();
+  while ((uint32_t)(micros() - started) < duration_ms * 1000 && this->isConnected()) {
+    this->_write(TOIO_CORE_CHAR_MOTOR, stop.data, stop.length, false);
+    commands++;
+  }
+  uint32_t elapsed_us = micros() - started;
+  notified = this->_notify_count - notified;
+  if (commands > 0) {
+    this->_motor_written_at = micros();
+    this->_motor_written = 0;
+    this->_motor_requested = 0;
+  }
+  this->_motor_sending = false;
+  if (this->_motor_pending.load() & _MOTOR_CMD_PENDING) {
+    this->_markReady();
+  }
+
+  // 姿勢角の通知を setPostureNotify() でセットされた設定に戻す
+  _Session session = this->_getSession();
+  if (session.posture[0] != 0) {
+    posture = toioEncodePostureNotify(session.posture[0], session.posture[1], session.posture[2]);
+  } else {
+    posture = toioEncodePostureNotify(TOIO_CORE_POSTURE_EULER, 0, TOIO_CORE_NOTIFY_ALWAYS);
+  }
+  this->requestConfig(posture.data, posture.length, TOIO_CONFIG_RESPONSE_POSTURE, res, sizeof(res));
+
+  // 計測の途中で切断されたときは、書き込めた分だけで求める (1 回も書き込めなければ 0)
+  if (elapsed_us > 0) {
+    result.commands_per_sec = (uint64_t)commands * 1000000 / elapsed_us;
+    result.notifications_per_sec = (uint64_t)notified * 1000000 / elapsed_us;
+  }
+  return result;
+}
+
+// ---------------------------------------------------------------
+// モーター制御 (引数の値をそのまま送信するローレベルのメソッド)
+// ---------------------------------------------------------------
+void ToioCore::controlMotor(bool ldir, uint8_t lspeed, bool rdir, uint8_t rspeed, uint16_t duration) {
+  this->_submitMotor(_encodeMotor(ldir, lspeed, rdir, rspeed, duration));
+}
+
+// ---------------------------------------------------------------
+// 運転 (モーター制御をスロットルとステアリング操作に置き換える)
+// - throttle : -100 ～ +100
+// - handle   : -100 ～ +100
+// ---------------------------------------------------------------
+void ToioCore::drive(int8_t throttle, int8_t steering) {
+  this->_submitMotor(this->_mixDrive(throttle, steering));
+}
+
+// ---------------------------------------------------------------
+// drive() の設定をセット
+// ---------------------------------------------------------------
+void ToioCore::setDriveConfig(const ToioDriveConfig& config) {
+  this->_drive_mixer.setConfig(config);
+}
+
+// ---------------------------------------------------------------
+// drive() の設定を取得
+// ---------------------------------------------------------------
+ToioDriveConfig ToioCore::getDriveConfig() {
+  return this->_drive_mixer.getConfig();
+}
+
+// ---------------------------------------------------------------
+// 目標指定付きモーター制御 (0x03)
+// ---------------------------------------------------------------
+int ToioCore::moveToTarget(const ToioCoreTarget& target, const ToioCoreTargetParams& params) {
+  if (!this->isConnected()) {
+    return -1;
+  }
+  uint8_t id = this->_motor_request_id++;
+  ToioPacket<13> packet = toioEncodeMoveToTarget(id, target, params);
+  this->_writeMotorCommand(packet.data, packet.length);
+  return id;
+}
+
+// ---------------------------------------------------------------
+// 複数目標指定付きモーター制御 (0x04)
+// - 1 パケットに入る目標地点の数は MTU で決まる (最大 29)
+// - 2 つめ以降のパケットは追加モードで書き込み、キューブ上で続けて実行させる
+// ---------------------------------------------------------------
+int ToioCore::moveToTargets(const ToioCoreTarget* targets, size_t count, const ToioCoreTargetParams& params, bool append) {
+  if (!this->isConnected() || count == 0) {
+    return -1;
+  }
+  uint16_t mtu = this->_client->getMTU();
+  size_t per_packet = (mtu > 3 + 8 + 6) ? (mtu - 3 - 8) / 6 : 1;
+  if (per_packet > TOIO_TARGETS_MAX) {
+    per_packet = TOIO_TARGETS_MAX;
+  }
+
+  // 複数パケットに分けた場合は、最後のパケットの ID で完了を通知する
+  // (応答が書き込みより先に届いても取りこぼさないように、書き込む前に経路を登録する。
+  //  経路の空きがなければ完了を通知できないので、何も書き込まずに -1 を返す)
+  size_t packets = (count + per_packet - 1) / per_packet;
+  if (packets > _MOTOR_PATH_MAX_PACKETS) {
+    // 要求 ID が一周すると、最初と最後の ID で経路を見分けられなくなる
+    return -1;
+  }
+  _MotorPath* path = nullptr;
+  if (packets > 1) {
+    for (size_t i = 0; i < _MOTOR_PATH_NUM; i++) {
+      uint8_t expected = _MOTOR_PATH_FREE;
+      if (this->_motor_paths[i].state.compare_exchange_strong(expected, _MOTOR_PATH_CLAIMED, std::memory_order_acquire)) {
+        path = &this->_motor_paths[i];
+        break;
+      }
+    }
+    if (path == nullptr) {
+      return -1;
+    }
+  }
+
+  // 書き込むパケットの数だけ ID を続けて確保する
+  uint8_t first_id = this->_motor_request_id.fetch_add((uint8_t)packets);
+  uint8_t last_id = first_id + (uint8_t)(packets - 1);
+  if (path != nullptr) {
+    path->failed = false;
+    path->first_id = first_id;
+    path->last_id = last_id;
+    path->state.store(_MOTOR_PATH_ACTIVE, std::memory_order_release);
+  }
+
+  ToioPacket<TOIO_TARGETS_PACKET_SIZE> packet;
+  uint8_t id = first_id;
+  for (size_t offset = 0; offset < count; offset += per_packet, id++) {
+    size_t n = count - offset;
+    if (n > per_packet) {
+      n = per_packet;
+    }
+    toioEncodeMoveToTargets(id, targets + offset, n, params, offset != 0 || append, packet);
+    this->_writeMotorCommand(packet.data, packet.length);
+  }
+  return last_id;
+}
+
+// ---------------------------------------------------------------
+// 加速度指定モーター制御 (0x05)
+// ---------------------------------------------------------------
+void ToioCore::controlAcceleration(uint8_t speed, uint8_t acceleration, uint16_t rotation, bool rotate_negative,
+                                   bool backward, bool rotation_priority, uint16_t duration) {
+  if (!this->isConnected()) {
+    return;
+  }
+  ToioPacket<9> packet = toioEncodeAcceleration(speed, acceleration, rotation, rotate_negative, backward, rotation_priority, duration);
+  this->_writeMotorCommand(packet.data, packet.length);
+}
+
+// ---------------------------------------------------------------
+// 目標指定付きモーター制御の応答のコールバックをセット
+// ---------------------------------------------------------------
+void ToioCore::onMotorResponse(OnMotorResponseCallback cb) {
+  this->_onmotorresponse = cb;
+}
+
+// ---------------------------------------------------------------
+// モーター制御を送信待ちのビット配置に変換
+// ---------------------------------------------------------------
+uint32_t ToioCore::_encodeMotor(bool ldir, uint8_t lspeed, bool rdir, uint8_t rspeed, uint16_t duration) {
+  uint32_t dur_data = duration / 10;
+  if (dur_data > 255) {
+    dur_data = 255;
+  }
+  uint32_t command = _MOTOR_CMD_TIMED | lspeed | ((uint32_t)rspeed << 8) | (dur_data << 16);
+  if (!ldir) {
+    command |= _MOTOR_CMD_LBACK;
+  }
+  if (!rdir) {
+    command |= _MOTOR_CMD_RBACK;
+  }
+  return command;
+}
+
+// ---------------------------------------------------------------
+// drive() の入力を送信待ちのビット配置に変換
+// (時間指定がなければ、時間指定なしのモーター制御 (0x01) にする)
+// ---------------------------------------------------------------
+uint32_t ToioCore::_mixDrive(int8_t a, int8_t b) {
+  if (!this->isConnected()) {
+    this->_drive_mixer.reset(); // 接続し直したら停止から加速する
+  }
+  ToioDriveOutput out = this->_drive_mixer.mix(a, b, micros());
+  uint32_t command = _encodeMotor(out.left >= 0, abs(out.left), out.right >= 0, abs(out.right), out.duration_ms);
+  if (out.duration_ms == 0) {
+    command &= ~_MOTOR_CMD_TIMED;
+  }
+  return command;
+}
+
+// ---------------------------------------------------------------
+// モーター制御の書き込み間隔 (ミリ秒) をセット
+// ---------------------------------------------------------------
+void ToioCore::setMotorWriteInterval(uint16_t msec) {
+  this->_motor_interval_us = (uint32_t)msec * 1000;
+}
+
+// ---------------------------------------------------------------
+// モーター制御の統計情報を取得
+// ---------------------------------------------------------------
+ToioCoreMotorStats ToioCore::getMotorStats() {
+  ToioCoreMotorStats stats;
+  stats.submitted = this->_motor_stats_submitted;
+  stats.sent = this->_motor_stats_sent;
+  stats.coalesced = this->_motor_stats_coalesced;
+  stats.dropped = this->_motor_stats_dropped;
+  stats.last_latency_us = this->_motor_stats_last_latency;
+  stats.max_latency_us = this->_motor_stats_max_latency;
+  stats.responses = this->_motor_stats_responses;
+  stats.failures = this->_motor_stats_failures;
+  stats.speed_notifications = this->_motor_feedback_seq;
+  stats.limited = this->_motor_stats_limited;
+  return stats;
+}
+
+// ---------------------------------------------------------------
+// モーターの速度情報の通知を有効・無効にする
+// ---------------------------------------------------------------
+bool ToioCore::setMotorSpeedNotify(bool enable) {
+  portENTER_CRITICAL(&this->_session_mux);
+  this->_session.motor_speed = enable;
+  portEXIT_CRITICAL(&this->_session_mux);
+  if (!this->isConnected()) {
+    return false;
+  }
+  ToioPacket<3> packet = toioEncodeMotorSpeedNotify(enable);
+  uint8_t res[3];
+  size_t len = this->requestConfig(packet.data, packet.length, TOIO_CONFIG_RESPONSE_MOTOR_SPEED, res, sizeof(res));
+  return toioDecodeConfigResult(res, len);
+}
+
+// ---------------------------------------------------------------
+// 最新のモーターの速度情報を取得
+// ---------------------------------------------------------------
+bool ToioCore::getMotorFeedback(ToioCoreMotorFeedback& feedback) {
+  return this->getMotorFeedbackHistory(&feedback, 1) == 1;
+}
+
+// ---------------------------------------------------------------
+// モーターの速度情報の履歴を新しい順に取得
+// ---------------------------------------------------------------
+size_t ToioCore::getMotorFeedbackHistory(ToioCoreMotorFeedback* feedbacks, size_t max) {
+  uint32_t seq = this->_motor_feedback_seq.load(std::memory_order_acquire);
+  size_t n = 0;
+  while (n < max && n < TOIO_CORE_MOTOR_FEEDBACK_SIZE && seq > n) {
+    uint32_t expected = seq - n;
+    ToioCoreMotorFeedback feedback;
+    this->_motor_feedback[(expected - 1) & (TOIO_CORE_MOTOR_FEEDBACK_SIZE - 1)].read(feedback);
+    // 読み出し中に上書きされた要素より古い履歴は返さない
+    if (feedback.seq != expected) {
+      break;
+    }
+    feedbacks[n++] = feedback;
+  }
+  return n;
+}
+
+// ---------------------------------------------------------------
+// モーター制御を送信待ちにする (どのタスクから呼んでもよい)
+// - 送信待ちの指示があれば新しい指示で上書きする (latest-wins)
+// - 前回の書き込みから書き込み間隔が経過していれば、すぐに送信する
+// ---------------------------------------------------------------
+void ToioCore::_submitMotor(uint32_t command) {
+  this->_motor_stats_submitted++;
+  if (!this->isConnected()) {
+    this->_motor_stats_dropped++;
+    return;
+  }
+  uint32_t prev = this->_motor_pending.exchange(command | _MOTOR_CMD_PENDING);
+  if (prev & _MOTOR_CMD_PENDING) {
+    this->_motor_stats_coalesced++;
+  } else {
+    this->_motor_submitted_at = micros();
+  }
+  this->_flushMotor();
+  if (this->_motor_pending.load() & _MOTOR_CMD_PENDING) {
+    this->_markReady();
+  }
+}
+
+// ---------------------------------------------------------------
+// 送信待ちのモーター制御をレスポンスなしで書き込む
+// (書き込み間隔が経過していなければ何もしない。Toio::loop() からも呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_flushMotor() {
+  if (!(this->_motor_pending.load() & _MOTOR_CMD_PENDING)) {
+    return;
+  }
+  uint32_t now = micros();
+  uint32_t interval = this->_motor_interval_us;
+  uint32_t floor = this->_link_floor_us.load(std::memory_order_relaxed);
+  if (floor > interval) {
+    interval = floor;
+  }
+  if (this->_motor_stats_sent > 0 && (int32_t)(now - this->_motor_sent_at - interval) < 0) {
+    return;
+  }
+  // 書き込みは 1 つのタスクだけが行う (古い指示が後から届かないようにする)
+  if (this->_motor_sending.exchange(true)) {
+    return;
+  }
+  uint32_t command = this->_motor_pending.exchange(0);
+  if (command & _MOTOR_CMD_PENDING) {
+    this->_writeMotor(command, now);
+  }
+  this->_motor_sending = false;
+}
+
+// ---------------------------------------------------------------
+// 送信待ちを経由せずにすぐにモーター制御を書き込む (ToioGroup から呼ばれる)
+// (他のタスクが書き込み中なら送信待ちにする)
+// ---------------------------------------------------------------
+bool ToioCore::_sendMotorNow(uint32_t command) {
+  this->_motor_stats_submitted++;
+  if (!this->isConnected()) {
+    this->_motor_stats_dropped++;
+    return false;
+  }
+  if (this->_motor_sending.exchange(true)) {
+    if (this->_motor_pending.exchange(command | _MOTOR_CMD_PENDING) & _MOTOR_CMD_PENDING) {
+      this->_motor_stats_coalesced++;
+    } else {
+      this->_motor_submitted_at = micros();
+    }
+    this->_markReady();
+    return false;
+  }
+  if (this->_motor_pending.exchange(0) & _MOTOR_CMD_PENDING) {
+    this->_motor_stats_coalesced++;
+  }
+  uint32_t now = micros();
+  this->_motor_submitted_at = now;
+  this->_writeMotor(command | _MOTOR_CMD_PENDING, now);
+  this->_motor_sending = false;
+  return true;
+}
+
+// ---------------------------------------------------------------
+// モーター制御をレスポンスなしで書き込む (_motor_sending を取得して呼ぶ)
+// (衝突回避の速度の上限があれば、ここで速度を下げる)
+// ---------------------------------------------------------------
+void ToioCore::_writeMotor(uint32_t command, uint32_t now) {
+  this->_motor_requested = command & ~_MOTOR_CMD_PENDING;
+  uint32_t limited = _limitMotor(command, this->_motor_limits.load(std::memory_order_relaxed));
+  if (limited != command) {
+    this->_motor_stats_limited++;
+    command = limited;
+  }
+  ToioPacket<8> packet = toioEncodeMotor(command & _MOTOR_CMD_LBACK, command, command & _MOTOR_CMD_RBACK, command >> 8,
+                                         command & _MOTOR_CMD_TIMED, command >> 16);
+  this->_write(TOIO_CORE_CHAR_MOTOR, packet.data, packet.length, false);
+  this->_motor_written_at = now;
+  this->_motor_written = command & ~_MOTOR_CMD_PENDING;
+  this->_motor_sent_at = now;
+  this->_motor_stats_sent++;
+  uint32_t latency = micros() - this->_motor_submitted_at;
+  this->_motor_stats_last_latency = latency;
+  if (latency > this->_motor_stats_max_latency) {
+    this->_motor_stats_max_latency = latency;
+  }
+}
+
+// ---------------------------------------------------------------
+// 目標指定などのモーター制御をレスポンスなしで書き込む
+// (送信待ちの drive() / controlMotor() の指示は破棄する。あとから
+// 送られると目標地点への移動が打ち切られてしまうため)
+// ---------------------------------------------------------------
+void ToioCore::_writeMotorCommand(const uint8_t* data, size_t length) {
+  while (this->_motor_sending.exchange(true)) {
+    yield();
+  }
+  if (this->_motor_pending.exchange(0) & _MOTOR_CMD_PENDING) {
+    this->_motor_stats_coalesced++;
+  }
+  this->_write(TOIO_CORE_CHAR_MOTOR, data, length, false);
+  this->_motor_written_at = micros();
+  this->_motor_written = _MOTOR_CMD_CUBE;
+  this->_motor_requested = 0;
+  this->_motor_sending = false;
+}
+
+// ---------------------------------------------------------------
+// 目標指定付きモーター制御の応答を処理 (loop タスクで呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_onMotorResponse(const ToioCoreMotorResponse& response) {
+  for (size_t i = 0; i < _MOTOR_PATH_NUM; i++) {
+    _MotorPath& path = this->_motor_paths[i];
+    if (path.state.load(std::memory_order_acquire) != _MOTOR_PATH_ACTIVE || (uint8_t)(response.request_id - path.first_id) > (uint8_t)(path.last_id - path.first_id)) {
+      continue;
+    }
+    bool last = (response.request_id == path.last_id);
+    bool report = false;
+    if (response.result != TOIO_CORE_MOTOR_RESULT_SUCCESS && !path.failed) {
+      // 途中のパケットで失敗したら、その時点で経路の失敗として通知する
+      path.failed = true;
+      report = true;
+    } else if (last && !path.failed) {
+      report = true;
+    }
+    uint8_t last_id = path.last_id;
+    if (last) {
+      path.state.store(_MOTOR_PATH_FREE, std::memory_order_release);
+    }
+    if (report && this->_onmotorresponse) {
+      this->_onmotorresponse(last_id, response.result);
+    }
+    return;
+  }
+  if (this->_onmotorresponse) {
+    this->_onmotorresponse(response.request_id, response.result);
+  }
+}
+
+// ---------------------------------------------------------------
+// 送信待ちのモーター制御を破棄 (切断時)
+// ---------------------------------------------------------------
+void ToioCore::_dropMotor() {
+  if (this->_motor_pending.exchange(0) & _MOTOR_CMD_PENDING) {
+    this->_motor_stats_dropped++;
+  }
+  this->_motor_written = 0; // 切断するとキューブは止まる
+  this->_motor_requested = 0;
+}
+
+// ---------------------------------------------------------------
+// 衝突回避の速度の上限をかける
+// (左右の速度の和の向きで前進・後退を決め、その向きの上限の割合で両方の速度を下げる。
+// その場での旋回は下げない)
+// ---------------------------------------------------------------
+uint32_t ToioCore::_limitMotor(uint32_t command, uint16_t limits) {
+  int32_t left = command & 0xff;
+  int32_t right = (command >> 8) & 0xff;
+  int32_t sum = ((command & _MOTOR_CMD_LBACK) ? -left : left) + ((command & _MOTOR_CMD_RBACK) ? -right : right);
+  uint32_t pct = _MOTOR_NO_LIMIT;
+  if (sum > 0) {
+    pct = limits & 0xff;
+  } else if (sum < 0) {
+    pct = limits >> 8;
+  }
+  if (pct >= _MOTOR_NO_LIMIT) {
+    return command;
+  }
+  left = left * pct / 100;
+  right = right * pct / 100;
+  return (command & ~0xffffUL) | left | (right << 8);
+}
+
+// ---------------------------------------------------------------
+// 衝突回避の速度の上限をセット (ToioSpatial から loop タスクで呼ばれる。変わったら true)
+// ---------------------------------------------------------------
+bool ToioCore::_setMotorLimits(uint8_t front, uint8_t rear) {
+  uint16_t limits = front | (rear << 8);
+  if (this->_motor_limits.exchange(limits) == limits) {
+    return false;
+  }
+  this->_resubmitMotor();
+  return true;
+}
+
+// ---------------------------------------------------------------
+// 書き込み済みのモーター制御を、新しい速度の上限で送り直す
+// (時間指定のない指示のみ。時間指定付きの指示は次の指示から上限がかかる。
+// 新しい指示が送信待ちならそれに任せる)
+// ---------------------------------------------------------------
+void ToioCore::_resubmitMotor() {
+  uint32_t command = this->_motor_requested.load();
+  if ((command & 0xffff) == 0 || (command & 0xff0000) != 0 || !this->isConnected()) {
+    return;
+  }
+  uint32_t expected = 0;
+  if (!this->_motor_pending.compare_exchange_strong(expected, command | _MOTOR_CMD_PENDING)) {
+    return;
+  }
+  this->_motor_submitted_at = micros();
+  this->_flushMotor();
+  if (this->_motor_pending.load() & _MOTOR_CMD_PENDING) {
+    this->_markReady();
+  }
+}
+
+// ---------------------------------------------------------------
+// イベントキューの統計情報を取得
+// ---------------------------------------------------------------
+ToioCoreEventQueueStats ToioCore::getEventQueueStats() {
+  ToioCoreEventQueueStats stats = this->_events.getStats();
+  ToioCoreEventQueueStats urgent = this->_urgent_events.getStats();
+  stats.pushed += urgent.pushed;
+  stats.dropped += urgent.dropped;
+  stats.overflows += urgent.overflows;
+  stats.high_water = (urgent.high_water > stats.high_water) ? urgent.high_water : stats.high_water;
+  return stats;
+}
+
+// ---------------------------------------------------------------
+// イベントの種類ごとの優先度をセット
+// ---------------------------------------------------------------
+void ToioCore::setEventPriority(ToioCoreEventType type, ToioCoreEventPriority priority) {
+  if (priority == TOIO_CORE_PRIORITY_HIGH) {
+    this->_urgent_types.fetch_or(1 << type);
+  } else {
+    this->_urgent_types.fetch_and(~(1 << type));
+  }
+}
+
+// ---------------------------------------------------------------
+// GATT ハンドルのキャッシュ
+// ---------------------------------------------------------------
+void ToioCore::useGattCache(bool enable) {
+  this->_gatt_cache_enabled = enable;
+}
+
+void ToioCore::clearGattCache() {
+  ToioCoreGattCache::erase(this->getAddress());
+}
+
+ToioCoreGattCacheStats ToioCore::getGattCacheStats() {
+  return this->_gatt_cache_stats;
+}
+
+// ---------------------------------------------------------------
+// 自動再接続
+// ---------------------------------------------------------------
+void ToioCore::setAutoReconnect(bool enable, uint32_t min_backoff_ms, uint32_t max_backoff_ms) {
+  this->_reconnect_enabled = enable;
+  this->_reconnect_min_ms = (min_backoff_ms == 0) ? 1 : min_backoff_ms;
+  this->_reconnect_max_ms = (max_backoff_ms < this->_reconnect_min_ms) ? this->_reconnect_min_ms : max_backoff_ms;
+  if (!enable) {
+    this->_reconnecting = false;
+  }
+}
+
+ToioCoreReconnectStats ToioCore::getReconnectStats() {
+  return this->_reconnect_stats;
+}
+
+// ---------------------------------------------------------------
+// 通知と書き込みの記録先をセット
+// ---------------------------------------------------------------
+void ToioCore::setRecorder(ToioRecorder* recorder) {
+  if (recorder) {
+    recorder->_addCube(this);
+  }
+  this->_recorder = recorder;
+}
+
+// ---------------------------------------------------------------
+// 接続状態の変化から、自動再接続の開始・再試行・完了を判断する
+// ---------------------------------------------------------------
+void ToioCore::_superviseConnection(const ToioCoreConnectionEvent& event) {
+  if (event.state == TOIO_CORE_CONNECTION_CONNECTED) {
+    if (this->_reconnecting) {
+      // 再接続できた (設定の再送はワーカータスクで済んでいる)
+      this->_reconnecting = false;
+      uint32_t elapsed = millis() - this->_reconnect_lost_at;
+      this->_reconnect_stats.recoveries++;
+      this->_reconnect_stats.last_recovery_ms = elapsed;
+      if (elapsed > this->_reconnect_stats.max_recovery_ms) {
+        this->_reconnect_stats.max_recovery_ms = elapsed;
+      }
+      this->_reconnect_total_ms += elapsed;
+      this->_reconnect_stats.avg_recovery_ms = this->_reconnect_total_ms / this->_reconnect_stats.recoveries;
+    }
+    return;
+  }
+  if (event.state != TOIO_CORE_CONNECTION_DISCONNECTED) {
+    return;
+  }
+  if (event.was_connected) {
+    // 予期しない切断 (disconnect() による切断は除く)
+    if (!this->_reconnect_enabled || this->_reconnect_suppressed) {
+      return;
+    }
+    this->_reconnect_stats.disconnects++;
+    this->_reconnecting = true;
+    this->_reconnect_lost_at = millis();
+    this->_reconnect_backoff = this->_reconnect_min_ms;
+    this->_scheduleReconnect();
+  } else if (this->_reconnecting) {
+    // 再接続に失敗したので、待ち時間を倍にして再試行する
+    this->_reconnect_backoff *= 2;
+    if (this->_reconnect_backoff > this->_reconnect_max_ms) {
+      this->_reconnect_backoff = this->_reconnect_max_ms;
+    }
+    this->_scheduleReconnect();
+  }
+}
+
+// ---------------------------------------------------------------
+// 次の再接続の時刻を決める
+// (多数のキューブが同時に切れても一斉に再接続しないように、待ち時間の
+// 後半の半分の範囲でランダムにずらす)
+// ---------------------------------------------------------------
+void ToioCore::_scheduleReconnect() {
+  uint32_t half = this->_reconnect_backoff / 2;
+  this->_reconnect_at = millis() + half + random(this->_reconnect_backoff - half + 1);
+}
+
+// ---------------------------------------------------------------
+// 接続のたびに再送する設定を写し取る (どのタスクから呼んでもよい)
+// ---------------------------------------------------------------
+ToioCore::_Session ToioCore::_getSession() {
+  _Session session;
+  portENTER_CRITICAL(&this->_session_mux);
+  session = this->_session;
+  portEXIT_CRITICAL(&this->_session_mux);
+  return session;
+}
+
+// ---------------------------------------------------------------
+// 再送する LED の色をセット (繰り返し続けるシナリオは取り消す)
+// ---------------------------------------------------------------
+void ToioCore::_setSessionLed(uint8_t r, uint8_t g, uint8_t b) {
+  portENTER_CRITICAL(&this->_session_mux);
+  this->_session.led = true;
+  this->_session.led_rgb[0] = r;
+  this->_session.led_rgb[1] = g;
+  this->_session.led_rgb[2] = b;
+  this->_session.led_scenario_len = 0;
+  portEXIT_CRITICAL(&this->_session_mux);
+}
+
+// ---------------------------------------------------------------
+// 最後にセットされた設定をまとめて再送する (接続処理の最後に呼ばれる)
+// - LED (繰り返し続けるシナリオか、最後の色) はレスポンスなしで書き込む
+// - 設定の Characteristic はレスポンスありの書き込みしか受け付けないので、
+//   セットされたしきい値と姿勢角・磁気センサー・モーターの速度情報の設定だけを続けて書き込む
+// ---------------------------------------------------------------
+void ToioCore::_restoreSession() {
+  uint32_t started = micros();
+  // 再送の途中でセッターが呼ばれても、揃った設定を送るように一度に写し取る
+  _Session session = this->_getSession();
+  if (session.mtu != 0) {
+    this->_client->setMTU(session.mtu);
+  }
+  this->_writeLinkInterval(session, false);
+  this->_forgetLight();
+  if (session.led_scenario_len > 0) {
+    this->_writeLight(session.led_scenario, session.led_scenario_len, false);
+  } else if (session.led) {
+    ToioPacket<7> packet = toioEncodeLed(session.led_rgb[0], session.led_rgb[1], session.led_rgb[2]);
+    this->_writeLight(packet.data, packet.length, false);
+  }
+  const ToioPacket<3> conf[3] = {
+    toioEncodeFlatThreshold(session.flat),
+    toioEncodeClashThreshold(session.clash),
+    toioEncodeDtapThreshold(session.dtap)
+  };
+  for (int i = 0; i < 3; i++) {
+    if (conf[i].data[2] == 0) {
+      continue;
+    }
+    this->_write(TOIO_CORE_CHAR_CONF, conf[i].data, conf[i].length, true);
+  }
+  if (session.motor_speed) {
+    ToioPacket<3> speed = toioEncodeMotorSpeedNotify(true);
+    this->_write(TOIO_CORE_CHAR_CONF, speed.data, speed.length, true);
+  }
+  const ToioPacket<5> sensors[2] = {
+    toioEncodePostureNotify(session.posture[0], session.posture[1], session.posture[2]),
+    toioEncodeMagneticNotify(session.magnetic[0], session.magnetic[1], session.magnetic[2])
+  };
+  for (int i = 0; i < 2; i++) {
+    if (sensors[i].data[2] == 0) {
+      continue;
+    }
+    this->_write(TOIO_CORE_CHAR_CONF, sensors[i].data, sensors[i].length, true);
+  }
+  this->_reconnect_stats.last_restore_us = micros() - started;
+}
+
+// ---------------------------------------------------------------
+// 接続状態の処理と送信待ちの書き込み (Toio::loop() から呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_service() {
+  // BLE の切断を検知したら接続処理の状態を更新
+  if (this->_connection_updated.exchange(false)) {
+    if (!this->_connected && this->_conn_state != TOIO_CORE_CONNECTION_DISCONNECTED) {
+      bool was_connected = (this->_conn_state == TOIO_CORE_CONNECTION_CONNECTED);
+      this->_setConnectionState(TOIO_CORE_CONNECTION_DISCONNECTED,
+                                was_connected ? TOIO_CORE_CONNECTION_ERROR_NONE : TOIO_CORE_CONNECTION_ERROR_DISCONNECTED);
+    }
+  }
+
+  // 非同期接続の処理を進める
+  this->_stepConnect();
+
+  // 送信待ちのモーター制御・LED のフレームを書き込む
+  if (this->isConnected()) {
+    this->_flushMotor();
+    this->_flushLedFrame();
+  } else {
+    this->_dropMotor();
+    this->_led_pending = 0;
+  }
+
+  // 接続状態イベント
+  ToioCoreConnectionEvent conn_event;
+  while (this->_conn_events.pop(conn_event)) {
+    this->_superviseConnection(conn_event);
+    if (this->_onconnectionstate) {
+      this->_onconnectionstate(conn_event.state, conn_event.error);
+    }
+    if (this->_onconnection) {
+      if (conn_event.state == TOIO_CORE_CONNECTION_CONNECTED) {
+        this->_onconnection(true);
+      } else if (conn_event.state == TOIO_CORE_CONNECTION_DISCONNECTED && conn_event.was_connected) {
+        this->_onconnection(false);
+      }
+    }
+  }
+
+  // 自動再接続の待ち時間が過ぎたら再接続を試みる
+  if (this->_reconnecting && this->_conn_state == TOIO_CORE_CONNECTION_DISCONNECTED &&
+      (int32_t)(millis() - this->_reconnect_at) >= 0) {
+    if (this->connectAsync()) {
+      this->_reconnect_stats.attempts++;
+    } else {
+      this->_scheduleReconnect();
+    }
+  }
+
+  // 非同期の設定の要求の応答・タイムアウトを通知
+  this->_loopConfigRequests();
+}
+
+// ---------------------------------------------------------------
+// 通知コールバックから積まれたイベントを最大 max 個まで到着順に処理
+// (Toio::loop() から呼ばれる。処理した数を返す)
+// ---------------------------------------------------------------
+size_t ToioCore::_dispatchEvents(bool urgent, size_t max) {
+  size_t count = 0;
+  ToioCoreEvent event;
+  while (count < max && (urgent ? this->_urgent_events.pop(event) : this->_events.pop(event))) {
+#if TOIO_STATS_ENABLED
+    this->_countDispatch(event);
+#endif
+    this->_dispatchEvent(event);
+    count++;
+  }
+  return count;
+}
+
+// ---------------------------------------------------------------
+// 処理すべきことがないか (Toio::loop() から呼ばれる)
+// (時間を待っている処理があれば、イベントがなくても false)
+// ---------------------------------------------------------------
+bool ToioCore::_isIdle() {
+  if (!this->_events.empty() || !this->_urgent_events.empty() || !this->_conn_events.empty() || this->_connection_updated) {
+    return false;
+  }
+  uint8_t state = this->_conn_state;
+  if ((state != TOIO_CORE_CONNECTION_DISCONNECTED && state != TOIO_CORE_CONNECTION_CONNECTED) || this->_reconnecting) {
+    return false;
+  }
+  if ((this->_motor_pending.load() & _MOTOR_CMD_PENDING) || this->_led_pending.load() != 0) {
+    return false;
+  }
+  for (size_t i = 0; i < TOIO_CORE_CONFIG_PENDING_NUM; i++) {
+    if (this->_config_requests[i].async) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------
+// Toio の処理待ちリストに登録する (どのタスクから呼んでもよい)
+// ---------------------------------------------------------------
+void ToioCore::_markReady() {
+  ToioReadyList<ToioCore>* list = this->_ready_list;
+  if (list) {
+    list->push(&this->_ready_node);
+  }
+}
+
+// ---------------------------------------------------------------
+// 接続処理の状態を更新し、状態変化をイベントとして積む
+// ---------------------------------------------------------------
+void ToioCore::_setConnectionState(ToioCoreConnectionState state, ToioCoreConnectionError error) {
+  ToioCoreConnectionEvent event;
+  event.state = state;
+  event.error = error;
+  uint8_t previous = this->_conn_state.exchange(state);
+  event.was_connected = (previous == TOIO_CORE_CONNECTION_CONNECTED);
+  if (this->_toio && previous != state) {
+    this->_toio->_onConnectionState(previous, state);
+  }
+  this->_conn_events.push(event);
+  this->_markReady();
+}
+
+// ---------------------------------------------------------------
+// 非同期接続の処理を進める
+// ---------------------------------------------------------------
+void ToioCore::_stepConnect() {
+  ToioCoreConnectionState state = (ToioCoreConnectionState)this->_conn_state.load();
+  if (state == TOIO_CORE_CONNECTION_DISCONNECTED || state == TOIO_CORE_CONNECTION_CONNECTED) {
+    return;
+  }
+  // 同期の connect() の処理中
+  if (!this->_job_busy) {
+    return;
+  }
+
+  if (!this->_job_done) {
+    // 全体のタイムアウト
+    if (millis() - this->_conn_started >= this->_CONNECT_TIMEOUT) {
+      this->_job_generation++;
+      this->_releaseConnectSlot();
+      this->_client->disconnect();
+      this->_setConnectionState(TOIO_CORE_CONNECTION_DISCONNECTED, TOIO_CORE_CONNECTION_ERROR_TIMEOUT);
+    }
+    return;
+  }
+
+  // ワーカータスクでの処理が完了した
+  ToioCoreConnectionError error = (ToioCoreConnectionError)this->_job_error.load();
+  this->_job_busy = false;
+  if (error != TOIO_CORE_CONNECTION_ERROR_NONE) {
+    this->_client->disconnect();
+    this->_setConnectionState(TOIO_CORE_CONNECTION_DISCONNECTED, error);
+    return;
+  }
+  ToioCoreConnectionState next = (ToioCoreConnectionState)(state + 1);
+  this->_setConnectionState(next, TOIO_CORE_CONNECTION_ERROR_NONE);
+  if (next != TOIO_CORE_CONNECTION_CONNECTED) {
+    this->_postConnectStep(next);
+  }
+}
+
+// ---------------------------------------------------------------
+// 接続処理の 1 段階をワーカータスクに依頼
+// ---------------------------------------------------------------
+void ToioCore::_postConnectStep(ToioCoreConnectionState state) {
+  ToioCoreJob job;
+  job.state = state;
+  job.generation = this->_job_generation;
+  job.read = TOIO_CORE_CHAR_NUM;
+  job.link = false;
+  this->_job_done = false;
+  this->_job_busy = true;
+  xQueueSend(this->_jobs, &job, portMAX_DELAY);
+}
+
+// ---------------------------------------------------------------
+// BLE 接続を始める (Toio::loop() が順番待ちのキューブに枠を割り当てたとき)
+// (接続処理のタイムアウトは順番待ちの時間を含めない)
+// ---------------------------------------------------------------
+void ToioCore::_grantConnect() {
+  this->_conn_waiting = false;
+  this->_conn_started = millis();
+  this->_postConnectStep(TOIO_CORE_CONNECTION_CONNECTING);
+}
+
+// ---------------------------------------------------------------
+// BLE 接続の枠を返す (BLE 接続が終わったとき。どのタスクから呼んでもよい)
+// ---------------------------------------------------------------
+void ToioCore::_releaseConnectSlot() {
+  if (this->_conn_slot.exchange(false) && this->_toio) {
+    this->_toio->_releaseConnectSlot();
+  }
+}
+
+// ---------------------------------------------------------------
+// Toio が決めた接続間隔を適用 (loop タスクで呼ばれる。0 なら取り消す)
+// - 接続中ならワーカータスクで要求を書き込み、接続していなければ次の接続時に書き込む
+// - 取り消したときは、requestConnectionInterval() で要求した接続間隔に戻す
+// - loop タスクを待たせないように、依頼はまとめてキューには待たずに積む (キューが
+//   一杯なら、ワーカータスクが次の処理の前に書き込む)
+// - モーター制御の書き込み間隔を接続間隔より短くしない (接続イベントに載りきらない
+//   書き込みで loop タスクが待たされないようにする)
+// ---------------------------------------------------------------
+void ToioCore::_applyLinkPlan(uint16_t interval) {
+  this->_link_interval = interval;
+  this->_link_floor_us = (uint32_t)interval * 1250;
+  if (!this->isConnected() || !this->_startWorker()) {
+    return;
+  }
+  if (this->_link_pending.exchange(true)) {
+    return;
+  }
+  ToioCoreJob job;
+  job.state = TOIO_CORE_CONNECTION_CONNECTED;
+  job.generation = this->_job_generation;
+  job.read = TOIO_CORE_CHAR_NUM;
+  job.link = true;
+  xQueueSend(this->_jobs, &job, 0);
+}
+
+// ---------------------------------------------------------------
+// ワーカータスクを起動 (初回のみ)
+// ---------------------------------------------------------------
+bool ToioCore::_startWorker() {
+  if (this->_worker) {
+    return true;
+  }
+  this->_jobs = xQueueCreate(4, sizeof(ToioCoreJob));
+  if (!this->_jobs) {
+    return false;
+  }
+  this->_worker_alive = true;
+  if (xTaskCreate(ToioCore::_workerTask, "ToioCore", this->_WORKER_STACK_SIZE, this, 1, &this->_worker) != pdPASS) {
+    vQueueDelete(this->_jobs);
+    this->_jobs = nullptr;
+    this->_worker = nullptr;
+    this->_worker_alive = false;
+    return false;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------
+// ワーカータスク (GATT の往復を伴う処理を loop タスクの代わりに実行する)
+// ---------------------------------------------------------------
+void ToioCore::_workerTask(void* arg) {
+  ToioCore* toiocore = (ToioCore*)arg;
+  ToioCoreJob job;
+  while (true) {
+    if (xQueueReceive(toiocore->_jobs, &job, portMAX_DELAY) != pdPASS) {
+      continue;
+    }
+    // デストラクタから止められた (_worker_alive を下ろしたあとは toiocore に触れない)
+    if (toiocore->_worker_stopping) {
+      toiocore->_worker_alive = false;
+      vTaskDelete(nullptr);
+      return;
+    }
+    // 接続間隔の要求 (依頼をキューに積めなかったときも、ここで書き込む)
+    if (toiocore->_link_pending.exchange(false) && toiocore->isConnected()) {
+      toiocore->_writeLinkInterval(toiocore->_getSession(), true);
+    }
+    if (job.link) {
+      continue;
+    }
+    // 状態の非同期の読み出し
+    if (job.read != TOIO_CORE_CHAR_NUM) {
+      if (toiocore->isConnected()) {
+        toiocore->_readState(job.read);
+      }
+      toiocore->_read_pending.fetch_and(~(1 << job.read));
+      continue;
+    }
+    ToioCoreConnectionError error = toiocore->_runConnectStep(job.state);
+    if (job.state == TOIO_CORE_CONNECTION_CONNECTING) {
+      toiocore->_releaseConnectSlot();
+    }
+    // タイムアウトなどで破棄された処理の結果は捨てる
+    if (job.generation != toiocore->_job_generation) {
+      toiocore->_job_busy = false;
+      continue;
+    }
+    toiocore->_job_error = error;
+    toiocore->_job_done = true;
+    toiocore->_markReady();
+  }
+}
+
+// ---------------------------------------------------------------
+// 接続処理の 1 段階を実行
+// ---------------------------------------------------------------
+ToioCoreConnectionError ToioCore::_runConnectStep(ToioCoreConnectionState state) {
+  switch (state) {
+    case TOIO_CORE_CONNECTION_CONNECTING:
+      return this->_connectClient();
+    case TOIO_CORE_CONNECTION_DISCOVERING:
+      return this->_discover();
+    case TOIO_CORE_CONNECTION_SUBSCRIBING:
+      return this->_subscribe();
+    case TOIO_CORE_CONNECTION_VERIFYING: {
+      ToioCoreConnectionError error = this->_verify();
+      if (error == TOIO_CORE_CONNECTION_ERROR_NONE) {
+        this->_restoreSession();
+      }
+      return error;
+    }
+    default:
+      return TOIO_CORE_CONNECTION_ERROR_NONE;
+  }
+}
+
+// ---------------------------------------------------------------
+// BLE 接続
+// ---------------------------------------------------------------
+ToioCoreConnectionError ToioCore::_connectClient() {
+  bool connected = this->_client->connect(this->_device);
+  if (!connected) {
+    return TOIO_CORE_CONNECTION_ERROR_CONNECT;
+  }
+  return TOIO_CORE_CONNECTION_ERROR_NONE;
+}
+
+// ---------------------------------------------------------------
+// サービスと Characteristic の探索
+// ---------------------------------------------------------------
+ToioCoreConnectionError ToioCore::_discover() {
+  unsigned long started = micros();
+
+  // Service を取得
+  BLERemoteService* service = this->_client->getService(this->_TOIO_SERVICE_UUID);
+  if (service == nullptr) {
+    Serial.print("Failed to find the service: UUID=" + String(this->_TOIO_SERVICE_UUID));
+    return TOIO_CORE_CONNECTION_ERROR_SERVICE;
+  }
+
+  // 取得する Characteristic (並び順はキャッシュレコードのハンドルの並び順)
+  BLERemoteCharacteristic** chars[TOIO_CORE_GATT_CACHE_CHAR_NUM] = {
+    &this->_char_battery,
+    &this->_char_light,
+    &this->_char_sound,
+    &this->_char_button,
+    &this->_char_motion,
+    &this->_char_conf,
+    &this->_char_motor,
+    &this->_char_id
+  };
+  const char* uuids[TOIO_CORE_GATT_CACHE_CHAR_NUM] = {
+    this->_TOIO_CHAR_UUID_BATT,
+    this->_TOIO_CHAR_UUID_LIGHT,
+    this->_TOIO_CHAR_UUID_SOUND,
+    this->_TOIO_CHAR_UUID_BUTTON,
+    this->_TOIO_CHAR_UUID_MOTION,
+    this->_TOIO_CHAR_UUID_CONF,
+    this->_TOIO_CHAR_UUID_MOTOR,
+    this->_TOIO_CHAR_UUID_ID
+  };
+  const char* names[TOIO_CORE_GATT_CACHE_CHAR_NUM] = {
+    "the battery",
+    "the light",
+    "the sound",
+    "the button",
+    "the motion sensor",
+    "the configuration",
+    "the motors",
+    "the ID information"
+  };
+
+  // キャッシュしたハンドルで Characteristic を割り当てる
+  bool cached = false;
+  std::string address = this->getAddress();
+  if (this->_gatt_cache_enabled) {
+    ToioCoreGattCacheRecord record;
+    if (ToioCoreGattCache::load(address, record)) {
+      cached = this->_bindFromGattCache(service, record, chars, uuids);
+      if (cached) {
+        this->_ble_version = record.ble_version;
+      } else {
+        // キャッシュが古いので破棄してフル探索する
+        this->_gatt_cache_stats.fallbacks++;
+        ToioCoreGattCache::erase(address);
+      }
+    } else {
+      this->_gatt_cache_stats.misses++;
+    }
+  }
+
+  // UUID で Characteristic を探索
+  if (!cached) {
+    for (int i = 0; i < TOIO_CORE_GATT_CACHE_CHAR_NUM; i++) {
+      *chars[i] = service->getCharacteristic(uuids[i]);
+      if (*chars[i] == nullptr) {
+        Serial.print("Failed to find the characteristic for " + String(names[i]) + ": UUID=" + String(uuids[i]));
+        return TOIO_CORE_CONNECTION_ERROR_CHARACTERISTIC;
+      }
+    }
+
+    // 次回の接続のためにハンドルを保存
+    if (this->_gatt_cache_enabled) {
+      ToioCoreGattCacheRecord record;
+      memset(&record, 0, sizeof(record));
+      strncpy(record.ble_version, this->_ble_version.c_str(), sizeof(record.ble_version) - 1);
+      for (int i = 0; i < TOIO_CORE_GATT_CACHE_CHAR_NUM; i++) {
+        record.handles[i] = (*chars[i])->getHandle();
+      }
+      ToioCoreGattCache::save(address, record);
+    }
+  }
+
+  // 探索時間を記録
+  uint32_t elapsed = micros() - started;
+  this->_gatt_cache_stats.last_discovery_us = elapsed;
+  if (cached) {
+    this->_gatt_cache_stats.hits++;
+    this->_gatt_cache_stats.cached_discovery_us = elapsed;
+  } else {
+    this->_gatt_cache_stats.full_discovery_us = elapsed;
+  }
+
+  return TOIO_CORE_CONNECTION_ERROR_NONE;
+}
+
+// ---------------------------------------------------------------
+// キャッシュしたハンドルで Characteristic を割り当てる
+// (ハンドルの Characteristic の UUID が一致しなければ false)
+// ---------------------------------------------------------------
+bool ToioCore::_bindFromGattCache(BLERemoteService* service, const ToioCoreGattCacheRecord& record, BLERemoteCharacteristic** chars[], const char* uuids[]) {
+  std::map<uint16_t, BLERemoteCharacteristic*>* by_handle = service->getCharacteristicsByHandle();
+  if (by_handle == nullptr) {
+    return false;
+  }
+  for (int i = 0; i < TOIO_CORE_GATT_CACHE_CHAR_NUM; i++) {
+    auto itr = by_handle->find(record.handles[i]);
+    if (itr == by_handle->end() || itr->second == nullptr) {
+      return false;
+    }
+    if (!itr->second->getUUID().equals(BLEUUID(uuids[i]))) {
+      return false;
+    }
+    *chars[i] = itr->second;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------
+// BLE プロトコルバージョンをキャッシュレコードに反映
+// (バージョンが変わっていたら、ファームウェアが更新されたものとして
+// レコードを破棄する)
+// ---------------------------------------------------------------
+void ToioCore::_updateGattCacheVersion(const std::string& version) {
+  if (!this->_gatt_cache_enabled || version == this->_ble_version) {
+    return;
+  }
+  std::string address = this->getAddress();
+  ToioCoreGattCacheRecord record;
+  if (ToioCoreGattCache::load(address, record)) {
+    if (record.ble_version[0] != '\0' && version != record.ble_version) {
+      ToioCoreGattCache::erase(address);
+    } else {
+      strncpy(record.ble_version, version.c_str(), sizeof(record.ble_version) - 1);
+      ToioCoreGattCache::save(address, record);
+    }
+  }
+  this->_ble_version = version;
+}
+
+// ---------------------------------------------------------------
+// 通知の購読
+// ---------------------------------------------------------------
+ToioCoreConnectionError ToioCore::_subscribe() {
+  // 前回の接続で通知された状態は使わない
+  this->_clearState();
+
+  // 通知はすべて記録してから _onNotify() でデコードする
+  // (ToioReplay はログの通知を同じ _onNotify() に流し込む)
+  BLERemoteCharacteristic* rchars[6] = {
+    this->_char_battery,
+    this->_char_button,
+    this->_char_motion,
+    this->_char_conf,
+    this->_char_motor,
+    this->_char_id
+  };
+  const ToioCoreCharacteristic types[6] = {
+    TOIO_CORE_CHAR_BATTERY,
+    TOIO_CORE_CHAR_BUTTON,
+    TOIO_CORE_CHAR_MOTION,
+    TOIO_CORE_CHAR_CONF,
+    TOIO_CORE_CHAR_MOTOR,
+    TOIO_CORE_CHAR_ID
+  };
+  for (size_t i = 0; i < 6; i++) {
+    ToioCoreCharacteristic ch = types[i];
+    rchars[i]->registerForNotify([this, ch](BLERemoteCharacteristic * rchar, uint8_t* data, size_t len, bool is_notify) {
+      uint32_t timestamp = micros();
+      ToioRecorder* recorder = this->_recorder;
+      if (recorder) {
+        recorder->_record(this, TOIO_RECORD_NOTIFY, ch, data, len, timestamp);
+      }
+      this->_onNotify(ch, data, len, timestamp);
+    });
+  }
+  return TOIO_CORE_CONNECTION_ERROR_NONE;
+}
+
+// ---------------------------------------------------------------
+// 通知の購読をやめる (コールバックを外す)
+// ---------------------------------------------------------------
+void ToioCore::_unsubscribe() {
+  BLERemoteCharacteristic* rchars[6] = {
+    this->_char_battery,
+    this->_char_button,
+    this->_char_motion,
+    this->_char_conf,
+    this->_char_motor,
+    this->_char_id
+  };
+  for (size_t i = 0; i < 6; i++) {
+    rchars[i]->registerForNotify(nullptr);
   }
 }
+
+// ---------------------------------------------------------------
+// 接続の準備完了の確認
+// (固定時間待つ代わりに、実際に GATT の読み出しが往復することを確認する)
+// ---------------------------------------------------------------
+ToioCoreConnectionError ToioCore::_verify() {
+  if (!this->_connected) {
+    return TOIO_CORE_CONNECTION_ERROR_DISCONNECTED;
+  }
+  std::string data = this->_char_battery->readValue();
+  if (data.size() != 1) {
+    return TOIO_CORE_CONNECTION_ERROR_NOT_READY;
+  }
+  return TOIO_CORE_CONNECTION_ERROR_NONE;
+}
+
+// ---------------------------------------------------------------
+// RSSI を更新 (Toio.cpp でアドバタイズを受信したときに呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_setRssi(int rssi) {
+  this->_rssi = rssi;
+}
+
+// ---------------------------------------------------------------
+// イベントをキューに積む (BLE タスクから呼ばれる)
+// ---------------------------------------------------------------
+bool ToioCore::_pushEvent(ToioCoreEvent& event) {
+  bool pushed = (this->_urgent_types.load(std::memory_order_relaxed) & (1 << event.type)) ?
+                this->_urgent_events.push(event) : this->_events.push(event);
+  this->_markReady();
+  return pushed;
+}
+
+// ---------------------------------------------------------------
+// 処理されていないイベントを破棄 (loop タスクで呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_clearEvents() {
+  this->_events.clear();
+  this->_urgent_events.clear();
+  this->_posture_queued = false;
+  this->_magnetic_queued = false;
+}
+
+// ---------------------------------------------------------------
+// 通知をデコードしてイベントキューに積む
+// (BLE タスク、または ToioReplay から呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_onNotify(ToioCoreCharacteristic ch, const uint8_t* data, size_t len, uint32_t timestamp) {
+  this->_notify_count.fetch_add(1, std::memory_order_relaxed);
+#if TOIO_STATS_ENABLED
+  this->_countNotify(ch, len, timestamp);
+#endif
+  ToioCoreEvent event;
+  event.timestamp = timestamp;
+  switch (ch) {
+    case TOIO_CORE_CHAR_BATTERY:
+      if (!toioDecodeBattery(data, len, event.battery_level)) {
+        return;
+      }
+      event.type = TOIO_CORE_EVENT_BATTERY;
+      this->_updateState(ch, data, len, timestamp);
+      break;
+    case TOIO_CORE_CHAR_BUTTON:
+      if (!toioDecodeButton(data, len, event.button_state)) {
+        return;
+      }
+      event.type = TOIO_CORE_EVENT_BUTTON;
+      this->_updateState(ch, data, len, timestamp);
+      break;
+    case TOIO_CORE_CHAR_MOTION:
+      if (len >= 1 && data[0] != 0x01) {
+        this->_onSensorNotify(data, len, timestamp);
+        return;
+      }
+      if (!toioDecodeMotion(data, len, event.motion)) {
+        return;
+      }
+      event.type = TOIO_CORE_EVENT_MOTION;
+      this->_updateState(ch, data, len, timestamp);
+      break;
+    case TOIO_CORE_CHAR_MOTOR: {
+      ToioCoreMotorSpeed speed;
+      if (toioDecodeMotorSpeed(data, len, speed)) {
+        this->_onMotorSpeed(speed, timestamp);
+        return;
+      }
+      if (!toioDecodeMotorResponse(data, len, event.motor_response)) {
+        return;
+      }
+      this->_motor_stats_responses++;
+      if (event.motor_response.result != TOIO_CORE_MOTOR_RESULT_SUCCESS) {
+        this->_motor_stats_failures++;
+      }
+      event.type = TOIO_CORE_EVENT_MOTOR_RESPONSE;
+      break;
+    }
+    case TOIO_CORE_CHAR_CONF:
+      this->_onConfigResponse(data, len);
+      return;
+    case TOIO_CORE_CHAR_ID:
+      this->_onIdNotify(data, len, timestamp);
+      return;
+    default:
+      return;
+  }
+  this->_pushEvent(event);
+}
+
+// ---------------------------------------------------------------
+// 種類に対応するキャラクタリスティックを返す
+// ---------------------------------------------------------------
+BLERemoteCharacteristic* ToioCore::_getChar(ToioCoreCharacteristic ch) {
+  switch (ch) {
+    case TOIO_CORE_CHAR_BATTERY: return this->_char_battery;
+    case TOIO_CORE_CHAR_LIGHT: return this->_char_light;
+    case TOIO_CORE_CHAR_SOUND: return this->_char_sound;
+    case TOIO_CORE_CHAR_BUTTON: return this->_char_button;
+    case TOIO_CORE_CHAR_MOTION: return this->_char_motion;
+    case TOIO_CORE_CHAR_CONF: return this->_char_conf;
+    case TOIO_CORE_CHAR_MOTOR: return this->_char_motor;
+    case TOIO_CORE_CHAR_ID: return this->_char_id;
+    default: return nullptr;
+  }
+}
+
+// ---------------------------------------------------------------
+// キャラクタリスティックに書き込む (記録先があれば記録する)
+// ---------------------------------------------------------------
+void ToioCore::_write(ToioCoreCharacteristic ch, const uint8_t* data, size_t length, bool response) {
+  ToioRecorder* recorder = this->_recorder;
+  if (recorder) {
+    recorder->_record(this, response ? TOIO_RECORD_WRITE_RESPONSE : TOIO_RECORD_WRITE, ch, data, length, micros());
+  }
+#if TOIO_STATS_ENABLED
+  uint32_t start = micros();
+  this->_getChar(ch)->writeValue((uint8_t*)data, length, response);
+  _LinkStats& stats = this->_link_stats[ch];
+  stats.write_time.record(micros() - start);
+  stats.writes.fetch_add(1, std::memory_order_relaxed);
+  stats.write_bytes.fetch_add(length, std::memory_order_relaxed);
+#else
+  this->_getChar(ch)->writeValue((uint8_t*)data, length, response);
+#endif
+}
+
+#if TOIO_STATS_ENABLED
+// ---------------------------------------------------------------
+// 通知の回数・バイト数・到着間隔を数える (_onNotify() から呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_countNotify(ToioCoreCharacteristic ch, size_t len, uint32_t timestamp) {
+  if (ch >= TOIO_CORE_CHAR_NUM) {
+    return;
+  }
+  _LinkStats& stats = this->_link_stats[ch];
+  stats.notifications.fetch_add(1, std::memory_order_relaxed);
+  stats.notify_bytes.fetch_add(len, std::memory_order_relaxed);
+  uint32_t last = stats.last_notify_at.load(std::memory_order_relaxed);
+  if (last != 0) {
+    stats.notify_interval.record(timestamp - last);
+  }
+  stats.last_notify_at.store(timestamp ? timestamp : 1, std::memory_order_relaxed);
+}
+
+// ---------------------------------------------------------------
+// 通知の受信からコールバックを呼ぶまでの時間を数える (loop タスクで呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_countDispatch(const ToioCoreEvent& event) {
+  ToioCoreCharacteristic ch;
+  switch (event.type) {
+    case TOIO_CORE_EVENT_BATTERY: ch = TOIO_CORE_CHAR_BATTERY; break;
+    case TOIO_CORE_EVENT_BUTTON: ch = TOIO_CORE_CHAR_BUTTON; break;
+    case TOIO_CORE_EVENT_MOTION: ch = TOIO_CORE_CHAR_MOTION; break;
+    case TOIO_CORE_EVENT_POSTURE: ch = TOIO_CORE_CHAR_MOTION; break;
+    case TOIO_CORE_EVENT_MAGNETIC: ch = TOIO_CORE_CHAR_MOTION; break;
+    case TOIO_CORE_EVENT_MOTOR_RESPONSE: ch = TOIO_CORE_CHAR_MOTOR; break;
+    default: ch = TOIO_CORE_CHAR_ID; break;
+  }
+  this->_link_stats[ch].dispatch_latency.record(micros() - event.timestamp);
+}
+#endif
+
+// ---------------------------------------------------------------
+// 通信の計測結果を取得
+// ---------------------------------------------------------------
+ToioCoreLinkStats ToioCore::getLinkStats() {
+  ToioCoreLinkStats result;
+  memset(&result, 0, sizeof(result));
+#if TOIO_STATS_ENABLED
+  result.elapsed_ms = millis() - this->_link_stats_since;
+  uint32_t elapsed_ms = result.elapsed_ms ? result.elapsed_ms : 1;
+  for (size_t i = 0; i < TOIO_CORE_CHAR_NUM; i++) {
+    _LinkStats& stats = this->_link_stats[i];
+    ToioCoreCharStats& out = result.chars[i];
+    out.writes = stats.writes.load(std::memory_order_relaxed);
+    out.write_bytes = stats.write_bytes.load(std::memory_order_relaxed);
+    out.write_bytes_per_sec = (uint64_t)out.write_bytes * 1000 / elapsed_ms;
+    out.notifications = stats.notifications.load(std::memory_order_relaxed);
+    out.notify_bytes = stats.notify_bytes.load(std::memory_order_relaxed);
+    out.notify_bytes_per_sec = (uint64_t)out.notify_bytes * 1000 / elapsed_ms;
+    stats.write_time.snapshot(out.write_time);
+    stats.notify_interval.snapshot(out.notify_interval);
+    stats.dispatch_latency.snapshot(out.dispatch_latency);
+  }
+#endif
+  return result;
+}
+
+// ---------------------------------------------------------------
+// 通信の計測結果をリセット
+// ---------------------------------------------------------------
+void ToioCore::resetLinkStats() {
+#if TOIO_STATS_ENABLED
+  for (size_t i = 0; i < TOIO_CORE_CHAR_NUM; i++) {
+    _LinkStats& stats = this->_link_stats[i];
+    stats.writes = 0;
+    stats.write_bytes = 0;
+    stats.notifications = 0;
+    stats.notify_bytes = 0;
+    stats.last_notify_at = 0;
+    stats.write_time.reset();
+    stats.notify_interval.reset();
+    stats.dispatch_latency.reset();
+  }
+  this->_link_stats_since = millis();
+#endif
+}
+
+// ---------------------------------------------------------------
+// 通信の計測結果を表示
+// (時間は 平均/99 パーセンタイル/最大 のマイクロ秒。パーセンタイルは
+// ヒストグラムのバケットの上限で近似した値)
+// ---------------------------------------------------------------
+void ToioCore::printLinkStats(Print& out) {
+#if TOIO_STATS_ENABLED
+  static const char* names[TOIO_CORE_CHAR_NUM] = {
+    "battery", "light", "sound", "button", "motion", "conf", "motor", "id"
+  };
+  ToioCoreLinkStats stats = this->getLinkStats();
+  std::string address = this->getAddress();
+  for (size_t i = 0; i < TOIO_CORE_CHAR_NUM; i++) {
+    const ToioCoreCharStats& c = stats.chars[i];
+    if (c.writes == 0 && c.notifications == 0) {
+      continue;
+    }
+    out.printf("%s %-7s w %u %uB/s %u/%u/%uus n %u %uB/s int %u/%u/%uus disp %u/%u/%uus\n",
+               address.c_str(), names[i],
+               c.writes, c.write_bytes_per_sec,
+               c.write_time.avg_us, toioStatsPercentile(c.write_time, 99), c.write_time.max_us,
+               c.notifications, c.notify_bytes_per_sec,
+               c.notify_interval.avg_us, toioStatsPercentile(c.notify_interval, 99), c.notify_interval.max_us,
+               c.dispatch_latency.avg_us, toioStatsPercentile(c.dispatch_latency, 99), c.dispatch_latency.max_us);
+  }
+#endif
+}
+
+// ---------------------------------------------------------------
+// イベントに応じたコールバックを呼び出す
+// ---------------------------------------------------------------
+void ToioCore::_dispatchEvent(const ToioCoreEvent& event) {
+  switch (event.type) {
+    case TOIO_CORE_EVENT_BATTERY:
+      if (this->_onbattery) {
+        this->_onbattery(event.battery_level);
+      }
+      break;
+    case TOIO_CORE_EVENT_BUTTON:
+      if (this->_onbutton) {
+        this->_onbutton(event.button_state);
+      }
+      break;
+    case TOIO_CORE_EVENT_MOTION:
+      if (this->_onmotion) {
+        this->_onmotion(event.motion);
+      }
+      break;
+    case TOIO_CORE_EVENT_POSITION:
+      if (this->_onposition) {
+        this->_onposition(event.position);
+      }
+      break;
+    case TOIO_CORE_EVENT_STANDARD_ID:
+      if (this->_onstandardid) {
+        this->_onstandardid(event.standard_id);
+      }
+      break;
+    case TOIO_CORE_EVENT_ID_MISSED:
+      if (this->_onidmissed) {
+        this->_onidmissed(event.missed_id);
+      }
+      break;
+    case TOIO_CORE_EVENT_MOTOR_RESPONSE:
+      this->_onMotorResponse(event.motor_response);
+      break;
+    case TOIO_CORE_EVENT_POSTURE:
+    case TOIO_CORE_EVENT_MAGNETIC: {
+      // 先にフラグを下ろし、読んだあとに届いた通知でイベントが積まれるようにする
+      bool posture = (event.type == TOIO_CORE_EVENT_POSTURE);
+      (posture ? this->_posture_queued : this->_magnetic_queued).store(false);
+      _State state;
+      this->_state.read(state);
+      if (posture && this->_onposture && state.posture_at) {
+        this->_onposture(state.posture);
+      } else if (!posture && this->_onmagnetic && state.magnetic_at) {
+        this->_onmagnetic(state.magnetic);
+      }
+      break;
+    }
+  }
+}
+
+// ---------------------------------------------------------------
+// ID 情報の通知をデコード (BLE タスクから呼ばれる)
+// (受信したバイト列を直接読み、ヒープを使わない)
+// ---------------------------------------------------------------
+void ToioCore::_onIdNotify(const uint8_t* data, size_t len, uint32_t timestamp) {
+  ToioCoreEvent event;
+  event.timestamp = timestamp;
+  if (toioDecodePosition(data, len, event.position)) {
+    event.type = TOIO_CORE_EVENT_POSITION;
+    this->_updatePose(event.timestamp, true, &event.position);
+  } else if (toioDecodeStandardId(data, len, event.standard_id)) {
+    event.type = TOIO_CORE_EVENT_STANDARD_ID;
+  } else if (toioDecodeIdMissed(data, len, event.missed_id)) {
+    event.type = TOIO_CORE_EVENT_ID_MISSED;
+    if (event.missed_id == TOIO_CORE_ID_POSITION) {
+      this->_updatePose(event.timestamp, false, nullptr);
+    }
+  } else {
+    return;
+  }
+  this->_pushEvent(event);
+}
+
+// ---------------------------------------------------------------
+// 姿勢角・磁気センサーの通知をデコード (BLE タスクから呼ばれる)
+// (値は固定小数点に変換して _State に書き、イベントは未処理のものがなければ積む)
+// ---------------------------------------------------------------
+void ToioCore::_onSensorNotify(const uint8_t* data, size_t len, uint32_t timestamp) {
+  ToioCorePostureData posture;
+  ToioCoreMagneticData magnetic;
+  bool is_posture = toioDecodePosture(data, len, posture);
+  if (!is_posture && !toioDecodeMagnetic(data, len, magnetic)) {
+    return;
+  }
+
+  uint32_t at = timestamp ? timestamp : 1;
+  portENTER_CRITICAL(&this->_state_mux);
+  _State state;
+  this->_state.read(state);
+  if (is_posture) {
+    state.posture = posture;
+    state.posture_at = at;
+  } else {
+    state.magnetic = magnetic;
+    state.magnetic_at = at;
+  }
+  this->_state.write(state);
+  portEXIT_CRITICAL(&this->_state_mux);
+
+  if (is_posture) {
+    this->_pushCoalesced(TOIO_CORE_EVENT_POSTURE, this->_posture_queued, timestamp);
+  } else {
+    this->_pushCoalesced(TOIO_CORE_EVENT_MAGNETIC, this->_magnetic_queued, timestamp);
+  }
+}
+
+// ---------------------------------------------------------------
+// モーターの速度情報を、書き込み済みの指示と並べて履歴に書く (BLE タスクから呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_onMotorSpeed(const ToioCoreMotorSpeed& speed, uint32_t timestamp) {
+  uint32_t command = this->_motor_written.load();
+  uint32_t age = timestamp - this->_motor_written_at.load();
+  ToioCoreMotorFeedback feedback;
+  feedback.timestamp = timestamp;
+  feedback.measured = speed;
+  feedback.commanded = !(command & _MOTOR_CMD_CUBE);
+  feedback.command_age_us = age;
+  feedback.commanded_left = 0;
+  feedback.commanded_right = 0;
+  // 時間指定付きの指示は、指定した時間が過ぎるとキューブが止める
+  uint32_t duration_us = ((command >> 16) & 0xff) * 10000;
+  bool expired = (command & _MOTOR_CMD_TIMED) && duration_us > 0 && age >= duration_us;
+  if (feedback.commanded && !expired) {
+    feedback.commanded_left = (command & _MOTOR_CMD_LBACK) ? -(int16_t)(command & 0xff) : (int16_t)(command & 0xff);
+    feedback.commanded_right = (command & _MOTOR_CMD_RBACK) ? -(int16_t)((command >> 8) & 0xff) : (int16_t)((command >> 8) & 0xff);
+  }
+  uint32_t seq = this->_motor_feedback_seq.load(std::memory_order_relaxed) + 1;
+  feedback.seq = seq;
+  this->_motor_feedback[(seq - 1) & (TOIO_CORE_MOTOR_FEEDBACK_SIZE - 1)].write(feedback);
+  this->_motor_feedback_seq.store(seq, std::memory_order_release);
+}
+
+// ---------------------------------------------------------------
+// 値を持たないイベントを、同じ種類のイベントがキューになければ積む
+// ---------------------------------------------------------------
+void ToioCore::_pushCoalesced(ToioCoreEventType type, std::atomic<bool>& queued, uint32_t timestamp) {
+  if (queued.exchange(true)) {
+    return;
+  }
+  ToioCoreEvent event;
+  event.timestamp = timestamp;
+  event.type = type;
+  if (!this->_pushEvent(event)) {
+    queued = false;
+  }
+}
+
+// ---------------------------------------------------------------
+// 最新の位置と位置の履歴を更新 (BLE タスクから呼ばれる)
+// ---------------------------------------------------------------
+void ToioCore::_updatePose(uint32_t timestamp, bool on_mat, const ToioCorePositionData* position) {
+  ToioCorePose pose;
+  if (position == nullptr) {
+    // マットから外れたときは最後に読み取った座標を引き継ぐ
+    // (最初の通知が Position ID missed なら、引き継ぐ座標はないので 0 にする)
+    if (!this->_pose.read(pose)) {
+      memset(&pose, 0, sizeof(pose));
+    }
+  } else {
+    pose.position = *position;
+  }
+  uint32_t seq = this->_pose_seq.load(std::memory_order_relaxed) + 1;
+  pose.timestamp = timestamp;
+  pose.seq = seq;
+  pose.on_mat = on_mat;
+  this->_pose_history[(seq - 1) & (TOIO_CORE_POSE_HISTORY_SIZE - 1)].write(pose);
+  this->_pose.write(pose);
+  this->_pose_seq.store(seq, std::memory_order_release);
+}
+
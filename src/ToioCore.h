@@ -12,23 +12,271 @@
 
 #include <Arduino.h>
 #include <string>
+#include <map>
 #include <functional>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
 #include <BLEDevice.h>
 #include <BLEUtils.h>
 #include <BLEScan.h>
 #include <BLEAdvertisedDevice.h>
+#include "ToioCodec.h"
+#include "ToioDriveMixer.h"
+#include "ToioRingBuffer.h"
+#include "ToioSeqLock.h"
+#include "ToioReadyList.h"
+#include "ToioCoreGattCache.h"
+#include "ToioStats.h"
+
+class ToioRecorder;
+class Toio;
+class ToioClientCallback;
+
+// イベントキューの大きさ (2 のべき乗)
+#ifndef TOIO_CORE_EVENT_QUEUE_SIZE
+#define TOIO_CORE_EVENT_QUEUE_SIZE 32
+#endif
+
+// 優先度の高いイベントのキューの大きさ (2 のべき乗)
+#ifndef TOIO_CORE_URGENT_QUEUE_SIZE
+#define TOIO_CORE_URGENT_QUEUE_SIZE 8
+#endif
+
+// 位置の履歴の大きさ (2 のべき乗)
+#ifndef TOIO_CORE_POSE_HISTORY_SIZE
+#define TOIO_CORE_POSE_HISTORY_SIZE 16
+#endif
+
+// モーターの速度情報の履歴の大きさ (2 のべき乗)
+#ifndef TOIO_CORE_MOTOR_FEEDBACK_SIZE
+#define TOIO_CORE_MOTOR_FEEDBACK_SIZE 16
+#endif
+
+// モーター制御の書き込み間隔の既定値 (ミリ秒)
+// (BLE の接続間隔に合わせる。1 回の接続イベントで送れる最新の指示だけを送る)
+#ifndef TOIO_CORE_MOTOR_WRITE_INTERVAL
+#define TOIO_CORE_MOTOR_WRITE_INTERVAL 30
+#endif
+
+// setLedFrame() の書き込み間隔の既定値 (ミリ秒)
+#ifndef TOIO_CORE_LED_WRITE_INTERVAL
+#define TOIO_CORE_LED_WRITE_INTERVAL 50
+#endif
+
+// 受信時刻付きの位置
+struct ToioCorePose {
+  uint32_t timestamp;            // 通知を受信した時刻 (マイクロ秒)
+  uint32_t seq;                  // 通し番号 (1 から)
+  bool on_mat;                   // false ならマットから外れた (position は最後に読み取った値)
+  ToioCorePositionData position;
+};
+
+// 受信時刻付きのモーターの速度情報と、そのとき指示していた速度
+// (measured は向きを含まない。指示値が 10 未満ならキューブは止まる)
+struct ToioCoreMotorFeedback {
+  uint32_t timestamp;          // 通知を受信した時刻 (マイクロ秒)
+  uint32_t seq;                // 通し番号 (1 から)
+  ToioCoreMotorSpeed measured; // キューブが測った左右のモーターの速度
+  int16_t commanded_left;      // 書き込み済みの左のモーターの速度指示値 (後退は負。時間指定が切れていれば 0)
+  int16_t commanded_right;     // 同、右
+  bool commanded;              // false なら目標指定などでキューブが速度を決めている (commanded_* は 0)
+  uint32_t command_age_us;     // 速度を書き込んでから通知を受信するまでの時間 (マイクロ秒)
+};
+
+// キャラクタリスティックの種類 (記録・再生のログで使う番号)
+enum ToioCoreCharacteristic : uint8_t {
+  TOIO_CORE_CHAR_BATTERY = 0,
+  TOIO_CORE_CHAR_LIGHT,
+  TOIO_CORE_CHAR_SOUND,
+  TOIO_CORE_CHAR_BUTTON,
+  TOIO_CORE_CHAR_MOTION,
+  TOIO_CORE_CHAR_CONF,
+  TOIO_CORE_CHAR_MOTOR,
+  TOIO_CORE_CHAR_ID,
+  TOIO_CORE_CHAR_NUM
+};
+
+// キャラクタリスティックごとの通信の計測結果
+struct ToioCoreCharStats {
+  uint32_t writes;                     // 書き込みの回数
+  uint32_t write_bytes;                // 書き込んだバイト数
+  uint32_t write_bytes_per_sec;        // 書き込みのスループット (バイト/秒)
+  uint32_t notifications;              // 通知の回数
+  uint32_t notify_bytes;               // 通知のバイト数
+  uint32_t notify_bytes_per_sec;       // 通知のスループット (バイト/秒)
+  ToioStatsHistogram write_time;       // writeValue() の所要時間 (レスポンスありなら往復時間)
+  ToioStatsHistogram notify_interval;  // 通知の到着間隔
+  ToioStatsHistogram dispatch_latency; // 通知の受信からコールバックを呼ぶまでの時間
+};
+
+// 通信の計測結果 (resetLinkStats() からの累計)
+struct ToioCoreLinkStats {
+  uint32_t elapsed_ms;                        // 計測を始めてからの時間 (ミリ秒)
+  ToioCoreCharStats chars[TOIO_CORE_CHAR_NUM]; // ToioCoreCharacteristic の順
+};
+
+// イベントの種類
+enum ToioCoreEventType : uint8_t {
+  TOIO_CORE_EVENT_BATTERY = 1,
+  TOIO_CORE_EVENT_BUTTON,
+  TOIO_CORE_EVENT_MOTION,
+  TOIO_CORE_EVENT_POSITION,
+  TOIO_CORE_EVENT_STANDARD_ID,
+  TOIO_CORE_EVENT_ID_MISSED,
+  TOIO_CORE_EVENT_MOTOR_RESPONSE,
+  TOIO_CORE_EVENT_POSTURE,   // 値は _State から読む (未処理のイベントがあれば積まない)
+  TOIO_CORE_EVENT_MAGNETIC   // 同上
+};
+
+// イベントの優先度
+// (Toio::loop() は、接続状態の処理、優先度の高いイベント、通常のイベントの順に処理する。
+//  時間の予算を使い切ったときに次の loop() へ持ち越されるのは通常のイベントだけ)
+enum ToioCoreEventPriority : uint8_t {
+  TOIO_CORE_PRIORITY_NORMAL = 0,
+  TOIO_CORE_PRIORITY_HIGH
+};
+
+// BLE タスクから loop タスクへ引き渡すイベント
+struct ToioCoreEvent {
+  uint32_t timestamp; // 通知を受信した時刻 (マイクロ秒)
+  ToioCoreEventType type;
+  union {
+    uint8_t battery_level;
+    bool button_state;
+    ToioCoreMotionData motion;
+    ToioCorePositionData position;
+    ToioCoreStandardIdData standard_id;
+    ToioCoreIdType missed_id;
+    ToioCoreMotorResponse motor_response;
+  };
+};
+
+typedef ToioRingBufferStats ToioCoreEventQueueStats;
+
+// モーター制御の統計情報
+struct ToioCoreMotorStats {
+  uint32_t submitted;       // drive() / controlMotor() で指示された数
+  uint32_t sent;            // キューブに書き込んだ数
+  uint32_t coalesced;       // 送信前に新しい指示で上書きされた数
+  uint32_t dropped;         // 未接続などで破棄された数
+  uint32_t last_latency_us; // 直近の指示から書き込みまでの時間 (マイクロ秒)
+  uint32_t max_latency_us;  // 指示から書き込みまでの時間の最大値 (マイクロ秒)
+  uint32_t responses;       // 受信した目標指定付きモーター制御の応答の数
+  uint32_t failures;        // そのうち成功 (目標地点に到着) 以外の数
+  uint32_t speed_notifications; // 受信したモーターの速度情報の数
+  uint32_t limited;         // 衝突回避で速度を下げて書き込んだ数
+};
+
+// LED の書き込みの統計情報
+struct ToioCoreLedStats {
+  uint32_t frames;    // setLedFrame() で指示された数
+  uint32_t coalesced; // 送信前に新しいフレームで上書きされた数
+  uint32_t skipped;   // 点灯中のものと同じなので書き込まなかった数
+  uint32_t writes;    // ライトに書き込んだ数
+};
+
+// 接続処理の状態
+enum ToioCoreConnectionState : uint8_t {
+  TOIO_CORE_CONNECTION_DISCONNECTED = 0, // 未接続
+  TOIO_CORE_CONNECTION_CONNECTING,       // BLE 接続中
+  TOIO_CORE_CONNECTION_DISCOVERING,      // サービスと Characteristic の探索中
+  TOIO_CORE_CONNECTION_SUBSCRIBING,      // 通知の購読中
+  TOIO_CORE_CONNECTION_VERIFYING,        // 準備完了の確認中
+  TOIO_CORE_CONNECTION_CONNECTED         // 接続完了
+};
+
+// 接続処理の失敗理由
+enum ToioCoreConnectionError : uint8_t {
+  TOIO_CORE_CONNECTION_ERROR_NONE = 0,
+  TOIO_CORE_CONNECTION_ERROR_CONNECT,        // BLE 接続に失敗
+  TOIO_CORE_CONNECTION_ERROR_SERVICE,        // toio のサービスが見つからない
+  TOIO_CORE_CONNECTION_ERROR_CHARACTERISTIC, // Characteristic が見つからない
+  TOIO_CORE_CONNECTION_ERROR_NOT_READY,      // 準備完了を確認できなかった
+  TOIO_CORE_CONNECTION_ERROR_DISCONNECTED,   // 接続処理の途中で切断された
+  TOIO_CORE_CONNECTION_ERROR_TIMEOUT,        // 接続処理がタイムアウトした
+  TOIO_CORE_CONNECTION_ERROR_LIMIT           // 同時に接続できるキューブの数の上限に達した
+};
+
+// 接続処理の状態変化
+struct ToioCoreConnectionEvent {
+  ToioCoreConnectionState state;
+  ToioCoreConnectionError error;
+  bool was_connected;
+};
+
+// 自動再接続の統計情報
+struct ToioCoreReconnectStats {
+  uint32_t disconnects;      // 予期しない切断の回数
+  uint32_t attempts;         // 再接続を試みた回数
+  uint32_t recoveries;       // 再接続に成功した回数
+  uint32_t last_recovery_ms; // 直近の切断の検知から再接続 (設定の再送を含む) までの時間 (ミリ秒)
+  uint32_t max_recovery_ms;  // 上記の最大値 (ミリ秒)
+  uint32_t avg_recovery_ms;  // 上記の平均値 (ミリ秒)
+  uint32_t last_restore_us;  // 直近の設定の再送にかかった時間 (マイクロ秒)
+};
+
+// 接続間隔の「要求なし」
+#define TOIO_CORE_CONN_INTERVAL_NONE 0xffff
+
+// 接続パラメーターのプリセット
+enum ToioCoreLinkPreset : uint8_t {
+  TOIO_CORE_LINK_DEFAULT = 0,  // 接続間隔を要求しない (セントラルの既定値に任せる)
+  TOIO_CORE_LINK_LOW_LATENCY,  // 少数のキューブを素早く制御する (接続間隔 7.5 ～ 15 ミリ秒, MTU 247)
+  TOIO_CORE_LINK_MANY_CUBES    // 多数のキューブを同時に接続する (接続間隔 30 ～ 50 ミリ秒)
+};
 
-struct ToioCoreMotionData {
-  bool flat;
-  bool clash;
-  bool dtap;
-  uint8_t attitude;
+// 接続パラメーター (接続間隔は 1.25 ミリ秒単位)
+struct ToioCoreConnParams {
+  uint16_t min_interval; // キューブが要求している接続間隔の最小値 (TOIO_CORE_CONN_INTERVAL_NONE なら要求なし)
+  uint16_t max_interval; // 同、最大値
+  uint16_t interval;     // 現在の接続間隔
+  uint16_t mtu;          // ATT MTU (バイト)
+};
+
+// 通信の実測値 (benchmarkLink() の結果)
+struct ToioCoreLinkBenchmark {
+  ToioCoreConnParams params;      // 計測したときの接続パラメーター
+  uint32_t round_trip_us;         // 設定の要求から応答までの時間の平均 (マイクロ秒)
+  uint32_t commands_per_sec;      // レスポンスなしで書き込めたモーター制御の数 (回/秒)
+  uint32_t notifications_per_sec; // 同時に受信できた通知の数 (回/秒)
+};
+
+// ワーカータスクに依頼する接続処理
+struct ToioCoreJob {
+  ToioCoreConnectionState state;
+  uint32_t generation;
+  ToioCoreCharacteristic read;  // 読み出すキャラクタリスティック (TOIO_CORE_CHAR_NUM なら接続処理)
+  bool link;                    // true なら、接続処理の代わりに接続間隔の要求を書き込み直す
+};
+
+// 応答を同時に待てる設定の要求の数
+#ifndef TOIO_CORE_CONFIG_PENDING_NUM
+#define TOIO_CORE_CONFIG_PENDING_NUM 4
+#endif
+
+// 設定の応答の最大長 (バイト)
+#define TOIO_CORE_CONFIG_RESPONSE_SIZE 20
+
+// バッテリー・ボタン・モーションセンサーの状態の取得方法
+enum ToioCoreReadMode : uint8_t {
+  TOIO_CORE_READ_BLOCKING = 0, // 毎回 GATT の読み出しを行い、応答を待つ (既定)
+  TOIO_CORE_READ_CACHED        // 通知された最新の値を返す (古ければ非同期に読み出す)
 };
 
 typedef std::function<void(bool connected)> OnConnectionCallback;
+typedef std::function<void(ToioCoreConnectionState state, ToioCoreConnectionError error)> OnConnectionStateCallback;
 typedef std::function<void(bool state)> OnButtonCallback;
 typedef std::function<void(uint8_t level)> OnBatteryCallback;
 typedef std::function<void(ToioCoreMotionData motion)> OnMotionCallback;
+typedef std::function<void(ToioCorePostureData posture)> OnPostureCallback;
+typedef std::function<void(ToioCoreMagneticData magnetic)> OnMagneticCallback;
+typedef std::function<void(ToioCorePositionData position)> OnPositionCallback;
+typedef std::function<void(ToioCoreStandardIdData standard_id)> OnStandardIdCallback;
+typedef std::function<void(ToioCoreIdType type)> OnIdMissedCallback;
+typedef std::function<void(uint8_t request_id, ToioCoreMotorResult result)> OnMotorResponseCallback;
+typedef std::function<void(bool success, const uint8_t* data, size_t length)> OnConfigResponseCallback;
 
 // ---------------------------------------------------------------
 // ToioCore クラス
@@ -36,6 +284,7 @@ typedef std::function<void(ToioCoreMotionData motion)> OnMotionCallback;
 class ToioCore {
   private:
     const char* _TOIO_SERVICE_UUID     = "10b20100-5b3b-4571-9508-cf3efcd7bbae";
+    const char* _TOIO_CHAR_UUID_ID     = "10b20101-5b3b-4571-9508-cf3efcd7bbae";
     const char* _TOIO_CHAR_UUID_BATT   = "10b20108-5b3b-4571-9508-cf3efcd7bbae";
     const char* _TOIO_CHAR_UUID_LIGHT  = "10b20103-5b3b-4571-9508-cf3efcd7bbae";
     const char* _TOIO_CHAR_UUID_SOUND  = "10b20104-5b3b-4571-9508-cf3efcd7bbae";
@@ -44,9 +293,35 @@ class ToioCore {
     const char* _TOIO_CHAR_UUID_CONF   = "10b201ff-5b3b-4571-9508-cf3efcd7bbae";
     const char* _TOIO_CHAR_UUID_MOTOR  = "10b20102-5b3b-4571-9508-cf3efcd7bbae";
 
+    // 非同期接続のタイムアウト (ミリ秒)
+    const unsigned long _CONNECT_TIMEOUT = 10000;
+
+    // デストラクタで切断の完了を待つ最大時間 (ミリ秒)
+    const unsigned long _DISCONNECT_TIMEOUT = 300;
+
+    // ワーカータスクのスタックサイズ
+    const uint32_t _WORKER_STACK_SIZE = 4096;
+
+    // 送信待ちのモーター制御のビット配置
+    // (bit 0-7: 左の速度, bit 8-15: 右の速度, bit 16-23: 時間 (10 ミリ秒単位))
+    static const uint32_t _MOTOR_CMD_LBACK   = 1UL << 24; // 左は後退
+    static const uint32_t _MOTOR_CMD_RBACK   = 1UL << 25; // 右は後退
+    static const uint32_t _MOTOR_CMD_TIMED   = 1UL << 26; // 時間指定付き (0x02)
+    static const uint32_t _MOTOR_CMD_CUBE    = 1UL << 27; // 目標指定などでキューブが速度を決める (書き込み済みの指示のみ)
+    static const uint32_t _MOTOR_CMD_PENDING = 1UL << 31; // 送信待ち
+
+    // 衝突回避による速度の上限 (パーセント) の既定値 (上限なし)
+    static const uint8_t _MOTOR_NO_LIMIT = 100;
+
+    // 送信待ちのフレームの色のビット配置 (bit 0-23: RGB)
+    static const uint32_t _LED_FRAME_PENDING = 1UL << 31;
+
     BLEAdvertisedDevice* _device;
     BLEClient* _client;
+    ToioClientCallback* _client_callback;
+    int _rssi;
 
+    BLERemoteCharacteristic* _char_id;
     BLERemoteCharacteristic* _char_battery;
     BLERemoteCharacteristic* _char_light;
     BLERemoteCharacteristic* _char_sound;
@@ -56,18 +331,317 @@ class ToioCore {
     BLERemoteCharacteristic* _char_motor;
 
     OnConnectionCallback _onconnection;
+    OnConnectionStateCallback _onconnectionstate;
     OnButtonCallback _onbutton;
     OnBatteryCallback _onbattery;
     OnMotionCallback _onmotion;
+    OnPostureCallback _onposture;
+    OnMagneticCallback _onmagnetic;
+    OnPositionCallback _onposition;
+    OnStandardIdCallback _onstandardid;
+    OnIdMissedCallback _onidmissed;
+    OnMotorResponseCallback _onmotorresponse;
+
+    // 接続状態 (BLE タスクから更新される)
+    std::atomic<bool> _connected;
+    std::atomic<bool> _connection_updated;
+
+    // 通知コールバックから Toio::loop() へ引き渡すイベントのキュー
+    // (優先度の高い種類のイベントは別のキューに積む。_urgent_types は種類ごとのビット)
+    ToioRingBuffer<ToioCoreEvent, TOIO_CORE_EVENT_QUEUE_SIZE> _events;
+    ToioRingBuffer<ToioCoreEvent, TOIO_CORE_URGENT_QUEUE_SIZE> _urgent_events;
+    std::atomic<uint16_t> _urgent_types;
+
+    // 処理すべきことがあれば Toio の処理待ちリストに登録する (Toio に登録されていなければ nullptr)
+    ToioReadyNode<ToioCore> _ready_node;
+    ToioReadyList<ToioCore>* _ready_list;
+
+    // 接続の順番と接続間隔を決める Toio (Toio に登録されていなければ nullptr)
+    // (_conn_waiting は BLE 接続の順番待ち、_conn_slot は BLE 接続の枠を使用中)
+    Toio* _toio;
+    bool _conn_waiting;
+    std::atomic<bool> _conn_slot;
+    std::atomic<uint16_t> _link_interval;  // Toio が決めた接続間隔 (0 なら計画なし。要求した接続間隔より優先する)
+    std::atomic<bool> _link_pending;       // 接続間隔の要求をワーカータスクに依頼済みで、まだ書き込んでいない
+    std::atomic<uint32_t> _link_floor_us;  // Toio が決めた接続間隔 (モーター制御の書き込み間隔の下限)
+
+    // 送信待ちのモーター制御 (最新の指示だけを保持する。0 なら送信待ちなし)
+    std::atomic<uint32_t> _motor_pending;
+    std::atomic<uint32_t> _motor_submitted_at;
+    std::atomic<uint32_t> _motor_sent_at;
+    std::atomic<bool> _motor_sending;
+    uint32_t _motor_interval_us;
+    std::atomic<uint32_t> _motor_stats_submitted;
+    std::atomic<uint32_t> _motor_stats_sent;
+    std::atomic<uint32_t> _motor_stats_coalesced;
+    std::atomic<uint32_t> _motor_stats_dropped;
+    std::atomic<uint32_t> _motor_stats_last_latency;
+    std::atomic<uint32_t> _motor_stats_max_latency;
+    std::atomic<uint32_t> _motor_stats_responses;
+    std::atomic<uint32_t> _motor_stats_failures;
+
+    // 書き込み済みのモーター制御と書き込んだ時刻 (速度情報と並べて記録する)
+    std::atomic<uint32_t> _motor_written;
+    std::atomic<uint32_t> _motor_written_at;
+
+    // 衝突回避の速度の上限と、上限をかける前の書き込み済みの指示
+    // (_motor_limits は bit 0-7: 前進の上限, bit 8-15: 後退の上限。ToioSpatial が loop タスクから更新する)
+    std::atomic<uint16_t> _motor_limits;
+    std::atomic<uint32_t> _motor_requested;
+    std::atomic<uint32_t> _motor_stats_limited;
+
+    // ToioSpatial のインデックス内の番号 (-1 なら未登録)
+    int32_t _spatial_slot;
+
+    // 最新のモーターの速度情報と履歴 (BLE タスクのみが書き込む)
+    static_assert((TOIO_CORE_MOTOR_FEEDBACK_SIZE & (TOIO_CORE_MOTOR_FEEDBACK_SIZE - 1)) == 0, "TOIO_CORE_MOTOR_FEEDBACK_SIZE must be a power of 2");
+    ToioSeqLock<ToioCoreMotorFeedback> _motor_feedback[TOIO_CORE_MOTOR_FEEDBACK_SIZE];
+    std::atomic<uint32_t> _motor_feedback_seq;
+
+    // drive() の入力を左右の速度指示値に変換する (drive() を呼ぶタスクだけが使う)
+    ToioDriveMixer _drive_mixer;
+
+    // 目標指定付きモーター制御の要求 ID と、複数パケットに分けた経路
+    // (経路の途中のパケットの応答はまとめて、最後のパケットの ID で通知する)
+    // - moveToTargets() を呼ぶタスクが空きを確保して ID を書き込み、最後に
+    //   state を _MOTOR_PATH_ACTIVE にして loop タスクに渡す
+    // - loop タスクが最後の応答を受け取ったら _MOTOR_PATH_FREE に戻す
+    static const size_t _MOTOR_PATH_NUM = 4;
+    static const size_t _MOTOR_PATH_MAX_PACKETS = 255;  // 要求 ID (8 ビット) が一周しないパケット数
+    enum : uint8_t {
+      _MOTOR_PATH_FREE = 0,
+      _MOTOR_PATH_CLAIMED,
+      _MOTOR_PATH_ACTIVE
+    };
+    struct _MotorPath {
+      std::atomic<uint8_t> state;
+      bool failed;
+      uint8_t first_id;
+      uint8_t last_id;
+    };
+    std::atomic<uint8_t> _motor_request_id;
+    _MotorPath _motor_paths[_MOTOR_PATH_NUM];
+
+    // 最新の位置と位置の履歴 (BLE タスクのみが書き込む)
+    static_assert((TOIO_CORE_POSE_HISTORY_SIZE & (TOIO_CORE_POSE_HISTORY_SIZE - 1)) == 0, "TOIO_CORE_POSE_HISTORY_SIZE must be a power of 2");
+    ToioSeqLock<ToioCorePose> _pose;
+    ToioSeqLock<ToioCorePose> _pose_history[TOIO_CORE_POSE_HISTORY_SIZE];
+    std::atomic<uint32_t> _pose_seq;
+
+    // 接続処理の状態 (loop タスクのみが更新する)
+    std::atomic<uint8_t> _conn_state;
+    unsigned long _conn_started;
+    ToioRingBuffer<ToioCoreConnectionEvent, 8> _conn_events;
+
+    // GATT の往復を伴う接続処理を実行するワーカータスク
+    // (_worker_stopping をセットしてキューに積むと、_worker_alive を下ろして終了する)
+    TaskHandle_t _worker;
+    QueueHandle_t _jobs;
+    std::atomic<bool> _worker_stopping;
+    std::atomic<bool> _worker_alive;
+    std::atomic<bool> _job_busy;
+    std::atomic<bool> _job_done;
+    std::atomic<uint8_t> _job_error;
+    std::atomic<uint32_t> _job_generation;
+
+    // GATT ハンドルのキャッシュ
+    bool _gatt_cache_enabled;
+    ToioCoreGattCacheStats _gatt_cache_stats;
+    std::string _ble_version;
+
+    // 自動再接続 (loop タスクのみが更新する)
+    bool _reconnect_enabled;
+    bool _reconnecting;          // 切断を検知し、再接続を試みている
+    bool _reconnect_suppressed;  // disconnect() で切断したので再接続しない
+    uint32_t _reconnect_min_ms;
+    uint32_t _reconnect_max_ms;
+    uint32_t _reconnect_backoff;
+    unsigned long _reconnect_at;
+    unsigned long _reconnect_lost_at;
+    uint64_t _reconnect_total_ms;
+    ToioCoreReconnectStats _reconnect_stats;
+
+    // 接続のたびに再送する設定 (最後にセットされた値。しきい値は 0 なら未設定)
+    // (loop タスクなどのセッターが _session_mux のクリティカルセクションで書き換え、
+    //  ワーカータスクは _getSession() で一度に写し取ってから再送する)
+    struct _Session {
+      uint8_t flat;
+      uint8_t clash;
+      uint8_t dtap;
+      uint8_t posture[3];   // 形式、間隔、条件 (形式が 0 なら未設定)
+      uint8_t magnetic[3];  // 機能、間隔、条件 (機能が 0 なら未設定)
+      bool motor_speed;     // モーターの速度情報を取得する
+      bool led;
+      uint8_t led_rgb[3];
+      uint8_t led_scenario[TOIO_LED_PACKET_SIZE]; // 繰り返し続けるシナリオ
+      size_t led_scenario_len;                   // 0 ならシナリオなし
+      uint16_t conn_interval[2];  // 要求した接続間隔の最小値・最大値 (0 なら未設定)
+      uint16_t mtu;               // 要求した MTU (0 なら未設定)
+    };
+    _Session _session;
+    portMUX_TYPE _session_mux = portMUX_INITIALIZER_UNLOCKED;
+
+    // 最後にライトに書き込んだデータ (同じなら書き込まない。長さが 0 なら不明)
+    uint8_t _led_last[TOIO_LED_PACKET_SIZE];
+    size_t _led_last_len;
+    portMUX_TYPE _led_mux = portMUX_INITIALIZER_UNLOCKED;
+
+    // 送信待ちのフレーム (最新の色だけを保持する。0 なら送信待ちなし)
+    std::atomic<uint32_t> _led_pending;
+    uint32_t _led_sent_at;
+    uint32_t _led_interval_us;
+    std::atomic<uint32_t> _led_stats_frames;
+    std::atomic<uint32_t> _led_stats_coalesced;
+    std::atomic<uint32_t> _led_stats_skipped;
+    std::atomic<uint32_t> _led_stats_writes;
+
+    // 通知と書き込みの記録先 (nullptr なら記録しない)
+    std::atomic<ToioRecorder*> _recorder;
+
+    // 通知された最新の状態 (時刻は micros()、0 なら値なし)
+    // (BLE タスク、ワーカータスク、loop タスクが _state_mux のクリティカルセクションで書き込む。
+    //  優先度の違うタスクが取り合うので、待つ側がスピンし続けるロックは使わない)
+    struct _State {
+      uint32_t battery_at;
+      uint32_t button_at;
+      uint32_t motion_at;
+      uint32_t posture_at;
+      uint32_t magnetic_at;
+      uint8_t battery_level;
+      bool button_state;
+      ToioCoreMotionData motion;
+      ToioCorePostureData posture;
+      ToioCoreMagneticData magnetic;
+    };
+    ToioSeqLock<_State> _state;
+    portMUX_TYPE _state_mux = portMUX_INITIALIZER_UNLOCKED;
+    ToioCoreReadMode _read_mode;
+    uint32_t _read_max_age_ms;
+    std::atomic<uint8_t> _read_pending;  // 非同期の読み出しを要求中 (キャラクタリスティックごとのビット)
+
+    // 受信した通知の数 (benchmarkLink() で使う)
+    std::atomic<uint32_t> _notify_count;
+
+    // 姿勢角・磁気センサーのイベントがキューにある (高頻度の通知はまとめて最新の値だけを渡す)
+    std::atomic<bool> _posture_queued;
+    std::atomic<bool> _magnetic_queued;
+
+    // 応答を待っている設定の要求
+    // (要求したタスクが予約して応答を待ち、BLE タスクが応答の種類で照合して書き込む)
+    enum _ConfigState : uint8_t {
+      _CONFIG_FREE = 0,
+      _CONFIG_RESERVED,  // 要求したタスクが使用中
+      _CONFIG_WAITING,   // 応答待ち
+      _CONFIG_FILLING,   // BLE タスクが応答を書き込み中
+      _CONFIG_DONE       // 応答あり
+    };
+    struct _ConfigRequest {
+      std::atomic<uint8_t> state;
+      uint8_t response_type;
+      bool async;
+      uint32_t seq;
+      unsigned long deadline;
+      OnConfigResponseCallback cb;
+      uint8_t length;
+      uint8_t data[TOIO_CORE_CONFIG_RESPONSE_SIZE];
+    };
+    _ConfigRequest _config_requests[TOIO_CORE_CONFIG_PENDING_NUM];
+    std::atomic<uint32_t> _config_seq;
+
+#if TOIO_STATS_ENABLED
+    // キャラクタリスティックごとの通信の計測
+    struct _LinkStats {
+      std::atomic<uint32_t> writes;
+      std::atomic<uint32_t> write_bytes;
+      std::atomic<uint32_t> notifications;
+      std::atomic<uint32_t> notify_bytes;
+      std::atomic<uint32_t> last_notify_at;  // 0 なら未受信 (通知を受けるタスクのみが更新する)
+      ToioStatsCounter write_time;
+      ToioStatsCounter notify_interval;
+      ToioStatsCounter dispatch_latency;
+    };
+    _LinkStats _link_stats[TOIO_CORE_CHAR_NUM];
+    std::atomic<uint32_t> _link_stats_since;
+#endif
 
   private:
-    void _wait(const unsigned long msec);
+    bool _pushEvent(ToioCoreEvent& event);
+    void _clearEvents();
+    void _markReady();
+    void _dispatchEvent(const ToioCoreEvent& event);
+    static uint32_t _encodeMotor(bool ldir, uint8_t lspeed, bool rdir, uint8_t rspeed, uint16_t duration);
+    uint32_t _mixDrive(int8_t a, int8_t b);
+    void _submitMotor(uint32_t command);
+    void _flushMotor();
+    bool _sendMotorNow(uint32_t command);
+    void _writeMotor(uint32_t command, uint32_t now);
+    void _dropMotor();
+    static uint32_t _limitMotor(uint32_t command, uint16_t limits);
+    bool _setMotorLimits(uint8_t front, uint8_t rear);
+    void _resubmitMotor();
+    void _writeMotorCommand(const uint8_t* data, size_t length);
+    bool _writeLight(const uint8_t* data, size_t length, bool skip_same);
+    void _forgetLight();
+    void _flushLedFrame();
+    void _onMotorResponse(const ToioCoreMotorResponse& response);
+    void _onNotify(ToioCoreCharacteristic ch, const uint8_t* data, size_t len, uint32_t timestamp);
+    void _onIdNotify(const uint8_t* data, size_t len, uint32_t timestamp);
+    void _onSensorNotify(const uint8_t* data, size_t len, uint32_t timestamp);
+    void _onMotorSpeed(const ToioCoreMotorSpeed& speed, uint32_t timestamp);
+    void _pushCoalesced(ToioCoreEventType type, std::atomic<bool>& queued, uint32_t timestamp);
+    BLERemoteCharacteristic* _getChar(ToioCoreCharacteristic ch);
+    bool _updateState(ToioCoreCharacteristic ch, const uint8_t* data, size_t len, uint32_t timestamp);
+    void _clearState();
+    bool _getState(ToioCoreCharacteristic ch, _State& state, uint32_t& age_ms);
+    bool _readState(ToioCoreCharacteristic ch);
+    void _requestRead(ToioCoreCharacteristic ch);
+    _ConfigRequest* _sendConfigRequest(const uint8_t* data, size_t length, uint8_t response_type, uint32_t timeout_ms, OnConfigResponseCallback cb);
+    void _onConfigResponse(const uint8_t* data, size_t len);
+    void _loopConfigRequests();
+    void _writeConnInterval(uint16_t min_interval, uint16_t max_interval);
+    void _writeLinkInterval(const _Session& session, bool cancel);
+    _Session _getSession();
+    void _setSessionLed(uint8_t r, uint8_t g, uint8_t b);
+    void _write(ToioCoreCharacteristic ch, const uint8_t* data, size_t length, bool response);
+#if TOIO_STATS_ENABLED
+    void _countNotify(ToioCoreCharacteristic ch, size_t len, uint32_t timestamp);
+    void _countDispatch(const ToioCoreEvent& event);
+#endif
+    void _updatePose(uint32_t timestamp, bool on_mat, const ToioCorePositionData* position);
+
+    void _setConnectionState(ToioCoreConnectionState state, ToioCoreConnectionError error);
+    void _stepConnect();
+    void _postConnectStep(ToioCoreConnectionState state);
+    void _grantConnect();
+    void _releaseConnectSlot();
+    void _applyLinkPlan(uint16_t interval);
+    bool _startWorker();
+    static void _workerTask(void* arg);
+    ToioCoreConnectionError _runConnectStep(ToioCoreConnectionState state);
+    ToioCoreConnectionError _connectClient();
+    ToioCoreConnectionError _discover();
+    ToioCoreConnectionError _subscribe();
+    void _unsubscribe();
+    ToioCoreConnectionError _verify();
+    bool _bindFromGattCache(BLERemoteService* service, const ToioCoreGattCacheRecord& record, BLERemoteCharacteristic** chars[], const char* uuids[]);
+    void _updateGattCacheVersion(const std::string& version);
+    void _restoreSession();
+    void _superviseConnection(const ToioCoreConnectionEvent& event);
+    void _scheduleReconnect();
+
+    friend class ToioClientCallback;
+    friend class Toio;
+    friend class ToioGroup;
+    friend class ToioReplay;
+    friend class ToioSpatial;
 
   public:
     // コンストラクタ
     ToioCore(BLEAdvertisedDevice& device);
 
-    // デストラクタ
+    // デストラクタ (Toio が発見したキューブは Toio が持ち続けるので delete しないこと。
+    // ToioGroup・ToioSpatial・ToioRecorder もキューブのポインタを持つので、
+    // 自分で生成したキューブは、それらから外してから delete すること)
     ~ToioCore();
 
     // アドレスを取得
@@ -76,9 +650,18 @@ class ToioCore {
     // デバイス名を取得
     std::string getName();
 
-    // 接続
+    // 最後に受信したアドバタイズの RSSI を取得
+    int getRssi();
+
+    // 接続 (接続が完了するまで処理を戻さない)
     bool connect();
 
+    // 非同期接続 (接続処理は Toio::loop() から進められ、結果は onConnection() で通知される)
+    bool connectAsync();
+
+    // 接続処理の状態を返す
+    ToioCoreConnectionState getConnectionState();
+
     // 切断
     void disconnect();
 
@@ -88,6 +671,9 @@ class ToioCore {
     // 接続状態イベントのコールバックをセット
     void onConnection(OnConnectionCallback cb);
 
+    // 接続処理の状態変化のコールバックをセット (進捗と失敗理由を通知)
+    void onConnection(OnConnectionStateCallback cb);
+
     // サウンド再生開始 (生データ指定)
     void playSoundRaw(uint8_t* data, size_t length);
 
@@ -103,24 +689,98 @@ class ToioCore {
     // LED 消灯
     void turnOffLed();
 
+    // LED のシナリオを再生 (repeat は繰り返す回数。0 なら次の LED の指示まで繰り返す)
+    // (繰り返し続けるシナリオが点灯中のものと同じなら書き込まない)
+    bool playLedScenario(const ToioCoreLedStep* steps, size_t count, uint8_t repeat = 0);
+
+    // LED を点滅 (シナリオとして書き込む)
+    bool blinkLed(uint8_t r, uint8_t g, uint8_t b, uint16_t on_ms = 500, uint16_t off_ms = 500, uint8_t repeat = 0);
+
+    // LED をゆっくり明滅 (消灯 → 指定の色 → 消灯を period_ms で 1 周。シナリオとして書き込む)
+    bool breatheLed(uint8_t r, uint8_t g, uint8_t b, uint16_t period_ms = 2000, uint8_t repeat = 0);
+
+    // フレームごとの LED の色をセット
+    // (最新の色だけを書き込み間隔ごとに書き込む。点灯中の色と同じなら書き込まない)
+    void setLedFrame(uint8_t r, uint8_t g, uint8_t b);
+
+    // setLedFrame() の書き込み間隔 (ミリ秒) をセット
+    void setLedWriteInterval(uint16_t msec);
+
+    // LED の書き込みの統計情報を取得
+    ToioCoreLedStats getLedStats();
+
+    // バッテリー・ボタン・モーションセンサーの状態の取得方法をセット
+    // (max_age_ms は TOIO_CORE_READ_CACHED で値を読み直すまでの時間。0 なら値がないときだけ読み出す)
+    void setReadMode(ToioCoreReadMode mode, uint32_t max_age_ms = 0);
+
     // バッテリーレベルを取得
     uint8_t getBatteryLevel();
 
+    // バッテリーレベルを取得 (待たずに最新の値と経過時間を返す。値がなければ false)
+    bool getBatteryLevel(uint8_t& level, uint32_t& age_ms);
+
     // バッテリーイベントのコールバックをセット
     void onBattery(OnBatteryCallback cb);
 
     // ボタンの状態を取得
     bool getButtonState();
 
+    // ボタンの状態を取得 (待たずに最新の値と経過時間を返す。値がなければ false)
+    bool getButtonState(bool& state, uint32_t& age_ms);
+
     // ボタンイベントのコールバックをセット
     void onButton(OnButtonCallback cb);
 
     // モーションセンサーの状態を取得
     ToioCoreMotionData getMotion();
 
+    // モーションセンサーの状態を取得 (待たずに最新の値と経過時間を返す。値がなければ false)
+    bool getMotion(ToioCoreMotionData& motion, uint32_t& age_ms);
+
     // モーションセンサーのコールバックをセット
     void onMotion(OnMotionCallback cb);
 
+    // 姿勢角の通知を設定 (interval_ms は 10 ミリ秒単位、0 なら通知しない。成功したら true)
+    bool setPostureNotify(ToioCorePostureType type, uint16_t interval_ms = 10, ToioCoreNotifyCondition condition = TOIO_CORE_NOTIFY_ALWAYS);
+
+    // 最新の姿勢角を取得 (待たずに最新の値と経過時間を返す。値がなければ false)
+    bool getPosture(ToioCorePostureData& posture, uint32_t& age_ms);
+
+    // 姿勢角のコールバックをセット (通知が続けて届いたときは最新の値で 1 回だけ呼ばれる)
+    void onPosture(OnPostureCallback cb);
+
+    // 磁気センサーの通知を設定 (interval_ms は 20 ミリ秒単位。成功したら true)
+    bool setMagneticNotify(ToioCoreMagneticMode mode, uint16_t interval_ms = 20, ToioCoreNotifyCondition condition = TOIO_CORE_NOTIFY_ALWAYS);
+
+    // 最新の磁気センサーの値を取得 (待たずに最新の値と経過時間を返す。値がなければ false)
+    bool getMagnetic(ToioCoreMagneticData& magnetic, uint32_t& age_ms);
+
+    // 磁気センサーのコールバックをセット (通知が続けて届いたときは最新の値で 1 回だけ呼ばれる)
+    void onMagnetic(OnMagneticCallback cb);
+
+    // Position ID のコールバックをセット
+    void onPosition(OnPositionCallback cb);
+
+    // Standard ID のコールバックをセット
+    void onStandardId(OnStandardIdCallback cb);
+
+    // ID を読み取れなくなったときのコールバックをセット
+    void onIdMissed(OnIdMissedCallback cb);
+
+    // 最新の位置を取得 (どのタスクからでも呼び出せる。一度も受信していなければ false)
+    bool getLatestPose(ToioCorePose& pose);
+
+    // 位置の履歴を新しい順に取得 (取得した数を返す)
+    size_t getPoseHistory(ToioCorePose* poses, size_t max);
+
+    // 設定を要求し、応答 (response_type で始まる通知) を待つ
+    // (応答を response にコピーしてその長さを返す。タイムアウトなら 0)
+    size_t requestConfig(const uint8_t* data, size_t length, uint8_t response_type, uint8_t* response, size_t response_size, uint32_t timeout_ms = 1000);
+
+    // 設定を要求し、応答を待たずに処理を戻す
+    // (応答またはタイムアウトで、Toio::loop() から cb が呼ばれる)
+    bool requestConfigAsync(const uint8_t* data, size_t length, uint8_t response_type, OnConfigResponseCallback cb, uint32_t timeout_ms = 1000);
+
     // BLE プロトコルバージョン取得
     std::string getBleProtocolVersion();
 
@@ -133,14 +793,105 @@ class ToioCore {
     // ダブルタップ検出の時間間隔の設定
     void setDtapThreshold(uint8_t level = 5);
 
+    // 接続間隔の変更を要求 (1.25 ミリ秒単位で 6 ～ 3200。BLE プロトコル 2.3.0 以降)
+    // (両方 TOIO_CORE_CONN_INTERVAL_NONE なら要求を取り消す。接続し直したときも再送する)
+    bool requestConnectionInterval(uint16_t min_interval, uint16_t max_interval);
+
+    // MTU の変更を要求 (接続し直したときも再送する)
+    bool requestMtu(uint16_t mtu);
+
+    // 接続パラメーターのプリセットを適用
+    // (接続間隔と MTU を要求し、モーター制御の書き込み間隔を接続間隔の最大値に合わせる)
+    bool applyLinkPreset(ToioCoreLinkPreset preset);
+
+    // 接続パラメーターを読み出す (応答を待つ。失敗したら false)
+    bool getConnectionParams(ToioCoreConnParams& params);
+
+    // 通信の実測 (duration_ms の間、停止のモーター制御をレスポンスなしで書き込み続け、
+    // 同時に最短間隔の姿勢角の通知を受信する。計測中は処理を戻さない)
+    ToioCoreLinkBenchmark benchmarkLink(uint32_t duration_ms = 1000);
+
     // モーター制御 (引数の値をそのまま送信するローレベルのメソッド)
     void controlMotor(bool ldir, uint8_t lspeed, bool rdir, uint8_t rspeed, uint16_t duration = 0);
 
     // 運転 (モーター制御をスロットルとステアリング操作に置き換える)
+    // (setDriveConfig() の設定で左右の速度指示値に変換する。TOIO_DRIVE_TANK なら左右の速度)
     void drive(int8_t throttle, int8_t steering);
 
+    // drive() の設定をセット・取得 (drive() を呼ぶタスクから呼ぶ)
+    void setDriveConfig(const ToioDriveConfig& config);
+    ToioDriveConfig getDriveConfig();
+
+    // 目標指定付きモーター制御 (要求 ID を返す。未接続なら -1)
+    int moveToTarget(const ToioCoreTarget& target, const ToioCoreTargetParams& params);
+
+    // 複数目標指定付きモーター制御 (MTU に収まるようにパケットを分け、
+    // 最後のパケットの要求 ID を返す。未接続なら -1)
+    // (追跡中の経路が 4 つあるときと、255 パケットを超える経路も -1 を返し、何も書き込まない)
+    int moveToTargets(const ToioCoreTarget* targets, size_t count, const ToioCoreTargetParams& params, bool append = false);
+
+    // 加速度指定モーター制御
+    void controlAcceleration(uint8_t speed, uint8_t acceleration, uint16_t rotation, bool rotate_negative = false,
+                             bool backward = false, bool rotation_priority = false, uint16_t duration = 0);
+
+    // 目標指定付きモーター制御の応答のコールバックをセット
+    void onMotorResponse(OnMotorResponseCallback cb);
+
+    // モーター制御の書き込み間隔 (ミリ秒) をセット
+    void setMotorWriteInterval(uint16_t msec);
+
+    // モーター制御の統計情報を取得
+    ToioCoreMotorStats getMotorStats();
+
+    // モーターの速度情報の通知を有効・無効にする (応答を待つ。成功すれば true)
+    bool setMotorSpeedNotify(bool enable);
+
+    // 最新のモーターの速度情報を取得 (どのタスクからでも呼び出せる。一度も受信していなければ false)
+    bool getMotorFeedback(ToioCoreMotorFeedback& feedback);
+
+    // モーターの速度情報の履歴を新しい順に取得 (取得した数を返す)
+    size_t getMotorFeedbackHistory(ToioCoreMotorFeedback* feedbacks, size_t max);
+
+    // イベントキューの統計情報を取得 (優先度の高いイベントのキューとの合計)
+    ToioCoreEventQueueStats getEventQueueStats();
+
+    // イベントの種類ごとの優先度をセット
+    // (既定ではボタン、Standard ID、ID の読み取り失敗、モーター制御の応答が TOIO_CORE_PRIORITY_HIGH)
+    void setEventPriority(ToioCoreEventType type, ToioCoreEventPriority priority);
+
+    // GATT ハンドルのキャッシュを使うかどうか (既定は使わない)
+    void useGattCache(bool enable);
+
+    // このキューブの GATT ハンドルのキャッシュを削除
+    void clearGattCache();
+
+    // GATT ハンドルのキャッシュの統計情報を取得
+    ToioCoreGattCacheStats getGattCacheStats();
+
+    // 自動再接続 (予期しない切断を検知したら、待ち時間を倍々に延ばしながら
+    // 再接続を試み、接続できたらしきい値や LED などの設定を再送する)
+    void setAutoReconnect(bool enable, uint32_t min_backoff_ms = 50, uint32_t max_backoff_ms = 5000);
+
+    // 自動再接続の統計情報を取得
+    ToioCoreReconnectStats getReconnectStats();
+
+    // 通知と書き込みの記録先をセット (nullptr で記録をやめる)
+    void setRecorder(ToioRecorder* recorder);
+
+    // 通信の計測結果を取得 (TOIO_STATS_ENABLED が 0 ならすべて 0)
+    ToioCoreLinkStats getLinkStats();
+
+    // 通信の計測結果をリセット
+    void resetLinkStats();
+
+    // 通信の計測結果を表示 (通信のあったキャラクタリスティックだけ 1 行ずつ)
+    void printLinkStats(Print& out);
+
     // Toio.cpp から呼ばれる (.ino からは直接呼ばない)
-    void _loop();
+    void _service();
+    size_t _dispatchEvents(bool urgent, size_t max);
+    bool _isIdle();
+    void _setRssi(int rssi);
 };
 
 #endif
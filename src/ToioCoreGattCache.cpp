@@ -0,0 +1,109 @@
+/* ----------------------------------------------------------------
+  ToioCoreGattCache.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include "ToioCoreGattCache.h"
+#include <string.h>
+#include <Preferences.h>
+
+// ===============================================================
+// ToioCoreGattCache クラス
+// ===============================================================
+
+const char* ToioCoreGattCache::_NAMESPACE = "toio_gatt";
+
+// ---------------------------------------------------------------
+// キーの生成 (NVS のキーは 15 文字までなので、アドレスのコロンを除く)
+// ---------------------------------------------------------------
+std::string ToioCoreGattCache::_key(const std::string& address) {
+  std::string key = "h";
+  for (size_t i = 0; i < address.size() && key.size() < 15; i++) {
+    if (address[i] != ':') {
+      key += address[i];
+    }
+  }
+  return key;
+}
+
+// ---------------------------------------------------------------
+// チェックサム (Fletcher-16)
+// ---------------------------------------------------------------
+uint16_t ToioCoreGattCache::_checksum(const ToioCoreGattCacheRecord& record) {
+  const uint8_t* data = (const uint8_t*)&record;
+  size_t len = offsetof(ToioCoreGattCacheRecord, checksum);
+  uint16_t sum1 = 0;
+  uint16_t sum2 = 0;
+  for (size_t i = 0; i < len; i++) {
+    sum1 = (sum1 + data[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  return (sum2 << 8) | sum1;
+}
+
+// ---------------------------------------------------------------
+// レコードの読み出し
+// ---------------------------------------------------------------
+bool ToioCoreGattCache::load(const std::string& address, ToioCoreGattCacheRecord& record) {
+  Preferences prefs;
+  if (!prefs.begin(_NAMESPACE, true)) {
+    return false;
+  }
+  std::string key = _key(address);
+  size_t len = prefs.getBytes(key.c_str(), &record, sizeof(record));
+  prefs.end();
+  if (len != sizeof(record)) {
+    return false;
+  }
+  if (record.format != _FORMAT || record.checksum != _checksum(record)) {
+    return false;
+  }
+  record.ble_version[sizeof(record.ble_version) - 1] = '\0';
+  return true;
+}
+
+// ---------------------------------------------------------------
+// レコードの保存
+// ---------------------------------------------------------------
+bool ToioCoreGattCache::save(const std::string& address, ToioCoreGattCacheRecord& record) {
+  record.format = _FORMAT;
+  record.ble_version[sizeof(record.ble_version) - 1] = '\0';
+  record.checksum = _checksum(record);
+  Preferences prefs;
+  if (!prefs.begin(_NAMESPACE, false)) {
+    return false;
+  }
+  std::string key = _key(address);
+  size_t len = prefs.putBytes(key.c_str(), &record, sizeof(record));
+  prefs.end();
+  return len == sizeof(record);
+}
+
+// ---------------------------------------------------------------
+// レコードの削除
+// ---------------------------------------------------------------
+void ToioCoreGattCache::erase(const std::string& address) {
+  Preferences prefs;
+  if (!prefs.begin(_NAMESPACE, false)) {
+    return;
+  }
+  std::string key = _key(address);
+  prefs.remove(key.c_str());
+  prefs.end();
+}
+
+// ---------------------------------------------------------------
+// すべてのレコードの削除
+// ---------------------------------------------------------------
+void ToioCoreGattCache::clear() {
+  Preferences prefs;
+  if (!prefs.begin(_NAMESPACE, false)) {
+    return;
+  }
+  prefs.clear();
+  prefs.end();
+}
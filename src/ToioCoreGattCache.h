@@ -0,0 +1,73 @@
+/* ----------------------------------------------------------------
+  ToioCoreGattCache.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioCoreGattCache_h
+#define ToioCoreGattCache_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// キャッシュ対象の Characteristic の数
+// (バッテリー, ライト, サウンド, ボタン, モーション, 設定, モーター, ID 情報)
+#define TOIO_CORE_GATT_CACHE_CHAR_NUM 8
+
+// ---------------------------------------------------------------
+// GATT ハンドルのキャッシュレコード
+// (不揮発性メモリにそのままのバイト列で保存する)
+// ---------------------------------------------------------------
+struct ToioCoreGattCacheRecord {
+  uint8_t format;                                  // レコードの形式
+  char ble_version[8];                             // BLE プロトコルバージョン (未取得なら空文字列)
+  uint16_t handles[TOIO_CORE_GATT_CACHE_CHAR_NUM]; // Characteristic のハンドル
+  uint16_t checksum;                               // 上記のチェックサム
+};
+
+// ---------------------------------------------------------------
+// GATT ハンドルのキャッシュの統計情報 (キューブごと)
+// ---------------------------------------------------------------
+struct ToioCoreGattCacheStats {
+  uint32_t hits;                // キャッシュしたハンドルで Characteristic を割り当てられた回数
+  uint32_t misses;              // キャッシュが無かった回数
+  uint32_t fallbacks;           // キャッシュが無効だったためフル探索に切り替えた回数
+  uint32_t last_discovery_us;   // 直近の探索時間 (マイクロ秒)
+  uint32_t cached_discovery_us; // 直近のキャッシュを使った探索の時間 (マイクロ秒)
+  uint32_t full_discovery_us;   // 直近のフル探索の時間 (マイクロ秒)
+};
+
+// ---------------------------------------------------------------
+// ToioCoreGattCache クラス
+//
+// キューブのアドレスごとに GATT ハンドルのレコードを不揮発性メモリ
+// (Preferences) に保存する。レコードには BLE プロトコルバージョンも
+// 記録し、バージョンが変わったキューブのレコードは破棄する。
+// ---------------------------------------------------------------
+class ToioCoreGattCache {
+  private:
+    static const char* _NAMESPACE;
+    static const uint8_t _FORMAT = 2;
+
+    static std::string _key(const std::string& address);
+    static uint16_t _checksum(const ToioCoreGattCacheRecord& record);
+
+  public:
+    // レコードを読み出す (無いか壊れていれば false)
+    static bool load(const std::string& address, ToioCoreGattCacheRecord& record);
+
+    // レコードを保存する (format と checksum はここでセットする)
+    static bool save(const std::string& address, ToioCoreGattCacheRecord& record);
+
+    // レコードを削除する
+    static void erase(const std::string& address);
+
+    // すべてのレコードを削除する
+    static void clear();
+};
+
+#endif
@@ -0,0 +1,208 @@
+/* ----------------------------------------------------------------
+  ToioDriveMixer.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioDriveMixer_h
+#define ToioDriveMixer_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 入力 100 のときの速度指示値の既定値
+#define TOIO_DRIVE_MAX_SPEED 115
+
+// 入力の混ぜ方
+enum ToioDriveMode : uint8_t {
+  TOIO_DRIVE_CURVATURE = 0, // スロットルとステアリング。曲がる側の車輪を減速する (旋回半径はステアリングだけで決まる)
+  TOIO_DRIVE_ARCADE,        // スロットルとステアリング。左右の車輪に足し引きする (スロットル 0 ならその場で旋回)
+  TOIO_DRIVE_TANK           // 左右の車輪の速度をそれぞれ指定する
+};
+
+// drive() の設定
+struct ToioDriveConfig {
+  ToioDriveMode mode;      // 入力の混ぜ方
+  uint8_t deadband;        // 入力の遊び (0 ～ 99。これ以下の入力は 0 とし、残りを 0 ～ 100 に広げる)
+  uint8_t expo;            // 入力の 3 乗を混ぜる割合 (0 ～ 100 %。大きいほど中央付近が穏やかになる)
+  uint8_t max_speed_left;  // 入力 100 のときの左のモーターの速度指示値 (キューブごとの校正用)
+  uint8_t max_speed_right; // 同、右
+  uint8_t min_speed;       // 0 でないときの最小の速度指示値 (モーターが回り始める値)
+  uint16_t accel_ms;       // 停止から最大まで加速するのにかける最短時間 (ミリ秒。0 なら制限なし)
+  uint16_t decel_ms;       // 最大から停止まで減速するのにかける最短時間 (ミリ秒。0 なら制限なし)
+  uint16_t timeout_ms;     // 0 でなければ時間指定付きで送り、次の指示が途切れたらこの時間で止まる (10 ～ 2550)
+};
+
+// 既定の設定 (従来の drive() と同じ動き)
+constexpr ToioDriveConfig toioDriveDefaults() {
+  return ToioDriveConfig{TOIO_DRIVE_CURVATURE, 0, 0, TOIO_DRIVE_MAX_SPEED, TOIO_DRIVE_MAX_SPEED, 0, 0, 0, 0};
+}
+
+// 左右のモーターの速度指示値 (負なら後退)
+struct ToioDriveOutput {
+  int16_t left;
+  int16_t right;
+  uint16_t duration_ms; // 0 なら時間指定なし
+};
+
+// ---------------------------------------------------------------
+// ToioDriveMixer クラス
+//
+// ジョイスティックなどの 2 つの入力 (-100 ～ +100) を左右のモーターの
+// 速度指示値に変換する。遊び、エクスポネンシャル、混ぜ合わせ、加減速の
+// 制限、速度指示値への換算をすべて整数で行う (入力 100 を 1024 とする
+// 固定小数点。加減速の状態はさらに 256 倍で持つ)。
+// 加減速の制限は mix() を呼んだ時刻の差で進めるので、一定の間隔で
+// 呼び出すこと。1 つのオブジェクトを複数のタスクから使わないこと。
+// ---------------------------------------------------------------
+class ToioDriveMixer {
+  private:
+    static const int32_t _ONE = 1024; // 入力 100
+
+    ToioDriveConfig _config;
+    int32_t _deadband;  // 遊び (1024 単位)
+    int32_t _wheel[2];  // 加減速を制限した左右の出力 (1024 × 256 単位)
+    uint32_t _mixed_at; // 前回 mix() を呼んだ時刻 (マイクロ秒。0 なら未呼び出し)
+
+    // 遊びとエクスポネンシャルをかけて 1024 単位にする
+    int32_t _shape(int32_t x) {
+      x = (x > 100) ? 100 : (x < -100) ? -100 : x;
+      int32_t m = ((x < 0) ? -x : x) * _ONE / 100;
+      if (m <= this->_deadband) {
+        return 0;
+      }
+      if (this->_deadband > 0) {
+        m = (m - this->_deadband) * _ONE / (_ONE - this->_deadband);
+      }
+      if (this->_config.expo > 0) {
+        int32_t cube = (m * m >> 10) * m >> 10;
+        m += (cube - m) * this->_config.expo / 100;
+      }
+      return (x < 0) ? -m : m;
+    }
+
+    // 加減速を制限する (1024 × 256 単位)
+    static int32_t _slew(int32_t current, int32_t target, int32_t up, int32_t down) {
+      if ((current >= 0 && target >= current) || (current <= 0 && target <= current)) {
+        // 加速 (停止からの加速を含む)
+        int32_t d = target - current;
+        int32_t m = (d < 0) ? -d : d;
+        return (up < 0 || m <= up) ? target : (d < 0) ? current - up : current + up;
+      }
+      // 減速 (向きが変わるときは、いったん 0 で止める)
+      int32_t stop = ((current > 0) == (target > 0)) ? target : 0;
+      int32_t d = stop - current;
+      int32_t m = (d < 0) ? -d : d;
+      return (down < 0 || m <= down) ? stop : (d < 0) ? current - down : current + down;
+    }
+
+    // 経過時間 dt_us に進められる量 (1024 × 256 単位。制限なしなら -1)
+    static int32_t _slewStep(uint16_t ramp_ms, uint32_t dt_us) {
+      if (ramp_ms == 0) {
+        return -1;
+      }
+      // 1024 × 256 / 1000 ≒ 262 (ramp_ms をマイクロ秒にする分を先に割っておく)
+      return (int32_t)(dt_us * 262 / ramp_ms);
+    }
+
+    // 1024 単位の出力を速度指示値に換算する
+    int16_t _speed(int32_t q, uint8_t max_speed) {
+      int32_t m = (q < 0) ? -q : q;
+      if (m == 0) {
+        return 0;
+      }
+      int32_t min_speed = (this->_config.min_speed < max_speed) ? this->_config.min_speed : max_speed;
+      int32_t speed = min_speed + (m * (max_speed - min_speed) >> 10);
+      return (int16_t)((q < 0) ? -speed : speed);
+    }
+
+  public:
+    // コンストラクタ
+    ToioDriveMixer() {
+      this->reset();
+      this->setConfig(toioDriveDefaults());
+    }
+
+    // 設定をセット (加減速の状態はリセットしない)
+    void setConfig(const ToioDriveConfig& config) {
+      this->_config = config;
+      uint8_t deadband = (config.deadband > 99) ? 99 : config.deadband;
+      this->_deadband = deadband * _ONE / 100;
+    }
+
+    // 設定を取得
+    ToioDriveConfig getConfig() {
+      return this->_config;
+    }
+
+    // 加減速の状態を停止にする (接続し直したときなど)
+    void reset() {
+      this->_wheel[0] = 0;
+      this->_wheel[1] = 0;
+      this->_mixed_at = 0;
+    }
+
+    // 2 つの入力を左右の速度指示値に変換する
+    // (TOIO_DRIVE_TANK なら a が左、b が右。それ以外は a がスロットル、b がステアリング (正なら右))
+    ToioDriveOutput mix(int8_t a, int8_t b, uint32_t now_us) {
+      int32_t ia = this->_shape(a);
+      int32_t ib = this->_shape(b);
+      int32_t left;
+      int32_t right;
+      switch (this->_config.mode) {
+        case TOIO_DRIVE_ARCADE: {
+          left = ia + ib;
+          right = ia - ib;
+          // どちらかが 100 を超えたら、左右の比を保って縮める
+          int32_t ml = (left < 0) ? -left : left;
+          int32_t mr = (right < 0) ? -right : right;
+          int32_t m = (ml > mr) ? ml : mr;
+          if (m > _ONE) {
+            left = left * _ONE / m;
+            right = right * _ONE / m;
+          }
+          break;
+        }
+        case TOIO_DRIVE_TANK:
+          left = ia;
+          right = ib;
+          break;
+        default: {
+          int32_t inner = ia * (_ONE - ((ib < 0) ? -ib : ib)) / _ONE;
+          left = (ib < 0) ? inner : ia;
+          right = (ib > 0) ? inner : ia;
+          break;
+        }
+      }
+
+      // 加減速の制限
+      left *= 256;
+      right *= 256;
+      if (this->_config.accel_ms != 0 || this->_config.decel_ms != 0) {
+        uint32_t dt = (this->_mixed_at == 0) ? 0 : now_us - this->_mixed_at;
+        if (dt > 1000000) {
+          dt = 1000000;
+        }
+        int32_t up = _slewStep(this->_config.accel_ms, dt);
+        int32_t down = _slewStep(this->_config.decel_ms, dt);
+        left = _slew(this->_wheel[0], left, up, down);
+        right = _slew(this->_wheel[1], right, up, down);
+      }
+      this->_wheel[0] = left;
+      this->_wheel[1] = right;
+      this->_mixed_at = now_us | 1;
+
+      ToioDriveOutput out;
+      out.left = this->_speed(left / 256, this->_config.max_speed_left);
+      out.right = this->_speed(right / 256, this->_config.max_speed_right);
+      uint16_t timeout = this->_config.timeout_ms;
+      timeout = (timeout == 0) ? 0 : (timeout < 10) ? 10 : (timeout > 2550) ? 2550 : timeout;
+      out.duration_ms = (out.left == 0 && out.right == 0) ? 0 : timeout;
+      return out;
+    }
+};
+
+#endif
@@ -0,0 +1,209 @@
+/* ----------------------------------------------------------------
+  ToioGroup.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include "ToioGroup.h"
+#include "Toio.h"
+#include <algorithm>
+
+// ===============================================================
+// ToioGroup クラス
+// ===============================================================
+
+// ---------------------------------------------------------------
+// コンストラクタ
+// ---------------------------------------------------------------
+ToioGroup::ToioGroup() {
+  this->_toio = nullptr;
+  this->_start = 0;
+  this->resetDispatchStats();
+}
+
+ToioGroup::ToioGroup(Toio& toio) {
+  this->_toio = &toio;
+  this->_start = 0;
+  this->resetDispatchStats();
+}
+
+// ---------------------------------------------------------------
+// キューブを追加
+// ---------------------------------------------------------------
+void ToioGroup::add(ToioCore* toiocore) {
+  if (toiocore == nullptr) {
+    return;
+  }
+  if (std::find(this->_members.begin(), this->_members.end(), toiocore) != this->_members.end()) {
+    return;
+  }
+  this->_members.push_back(toiocore);
+}
+
+// ---------------------------------------------------------------
+// キューブを削除
+// ---------------------------------------------------------------
+void ToioGroup::remove(ToioCore* toiocore) {
+  auto itr = std::find(this->_members.begin(), this->_members.end(), toiocore);
+  if (itr != this->_members.end()) {
+    this->_members.erase(itr);
+  }
+}
+
+// ---------------------------------------------------------------
+// すべてのキューブを削除
+// ---------------------------------------------------------------
+void ToioGroup::clear() {
+  this->_members.clear();
+}
+
+// ---------------------------------------------------------------
+// Toio オブジェクトが発見済みのキューブをすべて追加
+// ---------------------------------------------------------------
+void ToioGroup::addAll() {
+  if (this->_toio == nullptr) {
+    return;
+  }
+  for (auto& device : this->_toio->_devices) {
+    this->add(device.second);
+  }
+}
+
+// ---------------------------------------------------------------
+// キューブの一覧と数
+// ---------------------------------------------------------------
+std::vector<ToioCore*> ToioGroup::getMembers() {
+  return this->_members;
+}
+
+size_t ToioGroup::size() {
+  return this->_members.size();
+}
+
+// ---------------------------------------------------------------
+// 全キューブに書き込み、最初と最後の書き込みの時刻の差を記録する
+// ---------------------------------------------------------------
+template <typename F>
+void ToioGroup::_dispatch(F write) {
+  size_t n = this->_members.size();
+  if (n == 0) {
+    return;
+  }
+  uint32_t members = 0;
+  uint32_t skipped = 0;
+  uint32_t first = 0;
+  uint32_t last = 0;
+  for (size_t i = 0; i < n; i++) {
+    ToioCore* toiocore = this->_members[(this->_start + i) % n];
+    if (!toiocore->isConnected()) {
+      skipped++;
+      continue;
+    }
+    write(toiocore);
+    last = micros();
+    if (members == 0) {
+      first = last;
+    }
+    members++;
+  }
+  this->_start = (this->_start + 1) % n;
+
+  uint32_t skew = last - first;
+  this->_stats.dispatches++;
+  this->_stats.last_members = members;
+  this->_stats.last_skipped = skipped;
+  this->_stats.last_skew_us = skew;
+  if (skew > this->_stats.max_skew_us) {
+    this->_stats.max_skew_us = skew;
+  }
+  this->_skew_total += skew;
+  this->_stats.avg_skew_us = this->_skew_total / this->_stats.dispatches;
+}
+
+// ---------------------------------------------------------------
+// モーター制御
+// ---------------------------------------------------------------
+void ToioGroup::controlMotor(bool ldir, uint8_t lspeed, bool rdir, uint8_t rspeed, uint16_t duration) {
+  uint32_t command = ToioCore::_encodeMotor(ldir, lspeed, rdir, rspeed, duration);
+  this->_dispatch([command](ToioCore* toiocore) {
+    toiocore->_sendMotorNow(command);
+  });
+}
+
+// ---------------------------------------------------------------
+// 運転
+// ---------------------------------------------------------------
+void ToioGroup::drive(int8_t throttle, int8_t steering) {
+  // キューブごとの drive() の設定 (校正した最大速度など) で変換する
+  this->_dispatch([throttle, steering](ToioCore* toiocore) {
+    toiocore->_sendMotorNow(toiocore->_mixDrive(throttle, steering));
+  });
+}
+
+// ---------------------------------------------------------------
+// LED 点灯
+// ---------------------------------------------------------------
+void ToioGroup::turnOnLed(uint8_t r, uint8_t g, uint8_t b) {
+  ToioPacket<7> packet = toioEncodeLed(r, g, b);
+  this->_writeLight(packet.data, packet.length);
+}
+
+// ---------------------------------------------------------------
+// LED 消灯
+// ---------------------------------------------------------------
+void ToioGroup::turnOffLed() {
+  this->turnOnLed(0x00, 0x00, 0x00);
+}
+
+// ---------------------------------------------------------------
+// サウンド再生開始 (効果音)
+// ---------------------------------------------------------------
+void ToioGroup::playSoundEffect(uint8_t sound_id, uint8_t volume) {
+  ToioPacket<3> packet = toioEncodeSoundEffect(sound_id, volume);
+  this->_writeSound(packet.data, packet.length);
+}
+
+// ---------------------------------------------------------------
+// サウンド再生開始 (生データ指定)
+// ---------------------------------------------------------------
+void ToioGroup::playSoundRaw(uint8_t* data, size_t length) {
+  this->_writeSound(data, length);
+}
+
+// ---------------------------------------------------------------
+// サウンド再生停止
+// ---------------------------------------------------------------
+void ToioGroup::stopSound() {
+  ToioPacket<1> packet = toioEncodeSoundStop();
+  this->_writeSound(packet.data, packet.length);
+}
+
+// ---------------------------------------------------------------
+// ライト / サウンドの Characteristic にレスポンスなしで書き込む
+// ---------------------------------------------------------------
+void ToioGroup::_writeLight(const uint8_t* data, size_t length) {
+  this->_dispatch([data, length](ToioCore* toiocore) {
+    toiocore->_writeLight(data, length, false);
+  });
+}
+
+void ToioGroup::_writeSound(const uint8_t* data, size_t length) {
+  this->_dispatch([data, length](ToioCore* toiocore) {
+    toiocore->_write(TOIO_CORE_CHAR_SOUND, data, length, false);
+  });
+}
+
+// ---------------------------------------------------------------
+// 一斉送信の統計情報
+// ---------------------------------------------------------------
+ToioGroupDispatchStats ToioGroup::getDispatchStats() {
+  return this->_stats;
+}
+
+void ToioGroup::resetDispatchStats() {
+  memset(&this->_stats, 0, sizeof(this->_stats));
+  this->_skew_total = 0;
+}
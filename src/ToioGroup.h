@@ -0,0 +1,87 @@
+/* ----------------------------------------------------------------
+  ToioGroup.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioGroup_h
+#define ToioGroup_h
+
+#include <Arduino.h>
+#include <vector>
+#include "ToioCore.h"
+
+class Toio;
+
+// 一斉送信の統計情報
+struct ToioGroupDispatchStats {
+  uint32_t dispatches;   // 一斉送信の回数
+  uint32_t last_members; // 直近の一斉送信で書き込んだキューブの数
+  uint32_t last_skipped; // 直近の一斉送信で未接続のため送らなかったキューブの数
+  uint32_t last_skew_us; // 直近の一斉送信で最初と最後のキューブに書き込んだ時刻の差 (マイクロ秒)
+  uint32_t max_skew_us;  // 上記の最大値 (マイクロ秒)
+  uint32_t avg_skew_us;  // 上記の平均値 (マイクロ秒)
+};
+
+// ---------------------------------------------------------------
+// ToioGroup クラス
+//
+// 複数の toio コア キューブに同じコマンドを一斉に送る。コマンドは
+// 1 度だけエンコードし、全キューブにレスポンスなしで続けて書き込む。
+// 書き込む順番は一斉送信ごとにずらし、特定のキューブだけが常に
+// 遅れないようにする。
+// ---------------------------------------------------------------
+class ToioGroup {
+  private:
+    Toio* _toio;
+    std::vector<ToioCore*> _members;
+    size_t _start;
+
+    ToioGroupDispatchStats _stats;
+    uint64_t _skew_total;
+
+  private:
+    template <typename F>
+    void _dispatch(F write);
+    void _writeLight(const uint8_t* data, size_t length);
+    void _writeSound(const uint8_t* data, size_t length);
+
+  public:
+    // コンストラクタ
+    ToioGroup();
+    ToioGroup(Toio& toio);
+
+    // キューブを追加 / 削除
+    void add(ToioCore* toiocore);
+    void remove(ToioCore* toiocore);
+    void clear();
+
+    // Toio オブジェクトが発見済みのキューブをすべて追加
+    void addAll();
+
+    // キューブの一覧と数
+    std::vector<ToioCore*> getMembers();
+    size_t size();
+
+    // モーター制御 (各キューブの送信待ちの指示は破棄して、すぐに書き込む)
+    void controlMotor(bool ldir, uint8_t lspeed, bool rdir, uint8_t rspeed, uint16_t duration = 0);
+    void drive(int8_t throttle, int8_t steering);
+
+    // LED 点灯 / 消灯
+    void turnOnLed(uint8_t r, uint8_t g, uint8_t b);
+    void turnOffLed();
+
+    // サウンド
+    void playSoundEffect(uint8_t sound_id, uint8_t volume = 0xff);
+    void playSoundRaw(uint8_t* data, size_t length);
+    void stopSound();
+
+    // 一斉送信の統計情報
+    ToioGroupDispatchStats getDispatchStats();
+    void resetDispatchStats();
+};
+
+#endif
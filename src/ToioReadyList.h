@@ -0,0 +1,72 @@
+/* ----------------------------------------------------------------
+  ToioReadyList.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioReadyList_h
+#define ToioReadyList_h
+
+#include <stddef.h>
+#include <atomic>
+
+// ---------------------------------------------------------------
+// ToioReadyList の要素 (登録するオブジェクトが 1 つずつ持つ)
+// ---------------------------------------------------------------
+template <typename T>
+struct ToioReadyNode {
+  T* owner;
+  std::atomic<bool> queued;   // リストに登録済み、またはコンシューマが処理中
+  ToioReadyNode* next;
+
+  ToioReadyNode() : owner(nullptr), queued(false), next(nullptr) {}
+};
+
+// ---------------------------------------------------------------
+// ToioReadyList クラス
+//
+// 処理すべきことがあるオブジェクトを登録する、複数プロデューサ・
+// 単一コンシューマのロックフリーなリスト。BLE タスクやワーカー
+// タスク、loop タスクが push() し、loop タスクが takeAll() でまとめて
+// 取り出す。
+// - 同じ要素は、コンシューマが release() するまで二重に登録されない
+// - takeAll() は登録と逆の順に要素をつないで返す
+// ---------------------------------------------------------------
+template <typename T>
+class ToioReadyList {
+  private:
+    std::atomic<ToioReadyNode<T>*> _head;
+
+  public:
+    // コンストラクタ
+    ToioReadyList() : _head(nullptr) {
+    }
+
+    // 要素を登録 (登録済みなら何もしない。どのタスクから呼んでもよい)
+    bool push(ToioReadyNode<T>* node) {
+      if (node->queued.exchange(true, std::memory_order_acq_rel)) {
+        return false;
+      }
+      ToioReadyNode<T>* head = this->_head.load(std::memory_order_relaxed);
+      do {
+        node->next = head;
+      } while (!this->_head.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+      return true;
+    }
+
+    // 登録されている要素をすべて取り出す (コンシューマ側から呼び出す)
+    ToioReadyNode<T>* takeAll() {
+      return this->_head.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    // 取り出した要素の処理が終わったことを示す (コンシューマ側から呼び出す)
+    // (この後の push() で再び登録される)
+    void release(ToioReadyNode<T>* node) {
+      node->queued.store(false, std::memory_order_release);
+    }
+};
+
+#endif
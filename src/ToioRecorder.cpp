@@ -0,0 +1,235 @@
+/* ----------------------------------------------------------------
+  ToioRecorder.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include "ToioRecorder.h"
+
+// ---------------------------------------------------------------
+// コンストラクタ
+// (バッファはここで確保し、記録中には確保しない。ログの先頭の
+// マジックナンバーもここで積んでおく)
+// ---------------------------------------------------------------
+ToioRecorder::ToioRecorder(size_t buffer_size) {
+  this->_buffer = (uint8_t*)malloc(buffer_size);
+  this->_size = this->_buffer ? buffer_size : 0;
+  this->_head = 0;
+  this->_tail = 0;
+  this->_flush_mutex = xSemaphoreCreateMutex();
+  memset(this->_cubes, 0, sizeof(this->_cubes));
+  this->_cube_num = 0;
+  this->_sink = nullptr;
+  this->_task = nullptr;
+  this->_running = false;
+  this->_task_alive = false;
+  this->_flush_interval_ms = 50;
+  this->_stats_records = 0;
+  this->_stats_dropped = 0;
+  this->_stats_bytes = 0;
+  this->_stats_flushes = 0;
+  this->_stats_high_water = 0;
+
+  const size_t magic_len = sizeof(TOIO_RECORDER_MAGIC) - 1;
+  if (this->_size >= magic_len + 1) {
+    memcpy(this->_buffer, TOIO_RECORDER_MAGIC, magic_len);
+    this->_buffer[magic_len] = TOIO_RECORDER_VERSION;
+    this->_head = magic_len + 1;
+  }
+}
+
+ToioRecorder::~ToioRecorder() {
+  this->end();
+  free(this->_buffer);
+  if (this->_flush_mutex) {
+    vSemaphoreDelete(this->_flush_mutex);
+  }
+}
+
+// ---------------------------------------------------------------
+// 書き出しタスクを開始
+// ---------------------------------------------------------------
+bool ToioRecorder::begin(Print* sink, uint32_t flush_interval_ms, BaseType_t core, UBaseType_t priority) {
+  if (this->_task_alive) {
+    return true;
+  }
+  if (!sink || this->_size == 0) {
+    return false;
+  }
+  this->_sink = sink;
+  this->_flush_interval_ms = (flush_interval_ms > 0) ? flush_interval_ms : 1;
+  this->_running = true;
+  this->_task_alive = true;
+  if (xTaskCreatePinnedToCore(ToioRecorder::_flushTask, "ToioRecorder", _TASK_STACK_SIZE,
+                              this, priority, &this->_task, core) != pdPASS) {
+    this->_running = false;
+    this->_task_alive = false;
+    this->_task = nullptr;
+    return false;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------
+// 書き出しタスクを止める (タスクは止まる前に残りを書き出す)
+// ---------------------------------------------------------------
+void ToioRecorder::end() {
+  if (!this->_task_alive) {
+    return;
+  }
+  this->_running = false;
+  while (this->_task_alive) {
+    delay(1);
+  }
+  this->_task = nullptr;
+}
+
+// ---------------------------------------------------------------
+// 書き出しタスク
+// ---------------------------------------------------------------
+void ToioRecorder::_flushTask(void* arg) {
+  ToioRecorder* recorder = (ToioRecorder*)arg;
+  while (recorder->_running) {
+    vTaskDelay(pdMS_TO_TICKS(recorder->_flush_interval_ms));
+    recorder->flush();
+  }
+  recorder->flush();
+  recorder->_task_alive = false;
+  vTaskDelete(NULL);
+}
+
+// ---------------------------------------------------------------
+// バッファにあるレコードを出力先に書き出す
+// (レコードの途中で折り返していても、そのまま 2 回に分けて書き出す)
+// ---------------------------------------------------------------
+void ToioRecorder::flush() {
+  if (!this->_sink || !this->_flush_mutex) {
+    return;
+  }
+  xSemaphoreTake(this->_flush_mutex, portMAX_DELAY);
+  uint32_t head = this->_head.load(std::memory_order_acquire);
+  uint32_t tail = this->_tail.load(std::memory_order_relaxed);
+  if (head != tail) {
+    while (tail != head) {
+      size_t offset = tail % this->_size;
+      size_t chunk = head - tail;
+      if (chunk > this->_size - offset) {
+        chunk = this->_size - offset;
+      }
+      this->_sink->write(this->_buffer + offset, chunk);
+      tail += chunk;
+      this->_stats_bytes += chunk;
+    }
+    this->_tail.store(tail, std::memory_order_release);
+    this->_stats_flushes++;
+  }
+  xSemaphoreGive(this->_flush_mutex);
+}
+
+// ---------------------------------------------------------------
+// 統計情報
+// ---------------------------------------------------------------
+ToioRecorderStats ToioRecorder::getStats() {
+  ToioRecorderStats stats;
+  stats.records = this->_stats_records;
+  stats.dropped = this->_stats_dropped;
+  stats.bytes = this->_stats_bytes;
+  stats.flushes = this->_stats_flushes;
+  stats.high_water = this->_stats_high_water;
+  return stats;
+}
+
+// ---------------------------------------------------------------
+// 記録する側の排他 (BLE タスク、loop タスク、制御タスクなどから呼ばれる)
+// (待つ側がスピンし続けると、同じコアで割り込まれた優先度の低いタスクが
+// 排他を解けなくなるので、クリティカルセクションにする。中でメモリを確保しないこと)
+// ---------------------------------------------------------------
+void ToioRecorder::_lockRecord() {
+  portENTER_CRITICAL(&this->_record_mux);
+}
+
+void ToioRecorder::_unlockRecord() {
+  portEXIT_CRITICAL(&this->_record_mux);
+}
+
+// ---------------------------------------------------------------
+// キューブの番号を探す (未登録なら -1)
+// ---------------------------------------------------------------
+int ToioRecorder::_findCube(ToioCore* toiocore) {
+  uint8_t num = this->_cube_num;
+  for (uint8_t i = 0; i < num; i++) {
+    if (this->_cubes[i] == toiocore) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// ---------------------------------------------------------------
+// レコードをバッファに積む (_lockRecord() の中で呼ぶ)
+// ---------------------------------------------------------------
+bool ToioRecorder::_append(uint32_t timestamp, uint8_t kind, uint8_t cube, const uint8_t* data, size_t length) {
+  if (length > 255) {
+    length = 255;
+  }
+  uint32_t head = this->_head.load(std::memory_order_relaxed);
+  uint32_t used = head - this->_tail.load(std::memory_order_acquire);
+  size_t need = _RECORD_HEADER_SIZE + length;
+  if (need > this->_size - used) {
+    this->_stats_dropped++;
+    return false;
+  }
+  uint8_t header[_RECORD_HEADER_SIZE] = {
+    (uint8_t)timestamp, (uint8_t)(timestamp >> 8), (uint8_t)(timestamp >> 16), (uint8_t)(timestamp >> 24),
+    kind, cube, (uint8_t)length
+  };
+  for (size_t i = 0; i < need; i++) {
+    uint8_t c = (i < _RECORD_HEADER_SIZE) ? header[i] : data[i - _RECORD_HEADER_SIZE];
+    this->_buffer[(head + i) % this->_size] = c;
+  }
+  this->_head.store(head + need, std::memory_order_release);
+  this->_stats_records++;
+  if (used + need > this->_stats_high_water) {
+    this->_stats_high_water = used + need;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------
+// キューブを登録し、アドレスをログに記録する
+// ---------------------------------------------------------------
+void ToioRecorder::_addCube(ToioCore* toiocore) {
+  if (this->_size == 0) {
+    return;
+  }
+  std::string address = toiocore->getAddress();
+  this->_lockRecord();
+  if (this->_findCube(toiocore) < 0 && this->_cube_num < TOIO_RECORDER_MAX_CUBES) {
+    uint8_t index = this->_cube_num;
+    if (this->_append(micros(), TOIO_RECORD_CUBE, index, (const uint8_t*)address.c_str(), address.size())) {
+      this->_cubes[index] = toiocore;
+      this->_cube_num = index + 1;
+    }
+  }
+  this->_unlockRecord();
+}
+
+// ---------------------------------------------------------------
+// 通知・書き込みを記録する (ToioCore から呼ばれる)
+// ---------------------------------------------------------------
+void ToioRecorder::_record(ToioCore* toiocore, ToioRecordKind kind, ToioCoreCharacteristic ch, const uint8_t* data, size_t length, uint32_t timestamp) {
+  if (this->_size == 0) {
+    return;
+  }
+  int cube = this->_findCube(toiocore);
+  if (cube < 0) {
+    this->_stats_dropped++;
+    return;
+  }
+  this->_lockRecord();
+  this->_append(timestamp, kind | (ch & 0x3f), cube, data, length);
+  this->_unlockRecord();
+}
@@ -0,0 +1,132 @@
+/* ----------------------------------------------------------------
+  ToioRecorder.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioRecorder_h
+#define ToioRecorder_h
+
+#include <Arduino.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "ToioCore.h"
+
+// 記録用バッファの大きさの既定値 (バイト)
+#ifndef TOIO_RECORDER_BUFFER_SIZE
+#define TOIO_RECORDER_BUFFER_SIZE 16384
+#endif
+
+// 1 つのログに記録できるキューブの最大数
+#ifndef TOIO_RECORDER_MAX_CUBES
+#define TOIO_RECORDER_MAX_CUBES 32
+#endif
+
+// ログの先頭に書き出すマジックナンバーとフォーマットのバージョン
+#define TOIO_RECORDER_MAGIC "TOIOLOG"
+#define TOIO_RECORDER_VERSION 1
+
+// レコードの種類
+// (ログでは種類とキャラクタリスティック (ToioCoreCharacteristic) を
+// 1 バイトにまとめる。上位 2 ビットが種類、下位 6 ビットがキャラクタリスティック)
+enum ToioRecordKind : uint8_t {
+  TOIO_RECORD_NOTIFY = 0x00,          // 受信した通知
+  TOIO_RECORD_WRITE = 0x40,           // レスポンスなしの書き込み
+  TOIO_RECORD_WRITE_RESPONSE = 0x80,  // レスポンスありの書き込み
+  TOIO_RECORD_CUBE = 0xc0             // キューブの定義 (データはアドレスの文字列)
+};
+
+// ログの 1 レコード
+// (ログ上では [時刻 4 バイト (リトルエンディアン)][種類 1 バイト]
+// [キューブの番号 1 バイト][データ長 1 バイト][データ] の形式)
+struct ToioRecord {
+  uint32_t timestamp;      // 記録した時刻 (micros())
+  ToioRecordKind kind;
+  uint8_t characteristic;  // ToioCoreCharacteristic
+  uint8_t cube;            // キューブの番号 (TOIO_RECORD_CUBE のレコードで定義される)
+  uint8_t length;
+  uint8_t data[255];
+};
+
+// 記録の統計情報
+struct ToioRecorderStats {
+  uint32_t records;     // バッファに記録したレコードの数
+  uint32_t dropped;     // バッファが一杯などの理由で捨てたレコードの数
+  uint32_t bytes;       // 出力先に書き出したバイト数
+  uint32_t flushes;     // 出力先に書き出した回数
+  uint32_t high_water;  // バッファの最大使用量 (バイト)
+};
+
+// ---------------------------------------------------------------
+// ToioRecorder クラス
+//
+// ToioCore が受信したすべての通知と、送ったすべての書き込みを
+// マイクロ秒単位の時刻付きでバイナリのログに記録する。レコードは
+// コンストラクタで確保したリングバッファに積むだけで、出力先
+// (Serial や SD カードのファイルなど) への書き出しはバックグラウンドの
+// タスクがまとめて行う。BLE タスクや制御タスクは書き出しを待たない。
+// ---------------------------------------------------------------
+class ToioRecorder {
+  private:
+    static const size_t _RECORD_HEADER_SIZE = 7;
+    static const uint32_t _TASK_STACK_SIZE = 4096;
+
+    uint8_t* _buffer;
+    size_t _size;
+    std::atomic<uint32_t> _head;  // 記録した位置 (先頭からの累計バイト数)
+    std::atomic<uint32_t> _tail;  // 書き出した位置 (先頭からの累計バイト数)
+    // 記録する側 (優先度の違う複数のタスク) の排他。積むだけの短い処理なのでクリティカルセクションにする
+    portMUX_TYPE _record_mux = portMUX_INITIALIZER_UNLOCKED;
+    // 書き出す側の排他。出力先への書き込みを待つので、優先度継承のあるミューテックスにする
+    SemaphoreHandle_t _flush_mutex;
+
+    ToioCore* _cubes[TOIO_RECORDER_MAX_CUBES];
+    std::atomic<uint8_t> _cube_num;
+
+    Print* _sink;
+    TaskHandle_t _task;
+    std::atomic<bool> _running;
+    std::atomic<bool> _task_alive;
+    uint32_t _flush_interval_ms;
+
+    std::atomic<uint32_t> _stats_records;
+    std::atomic<uint32_t> _stats_dropped;
+    std::atomic<uint32_t> _stats_bytes;
+    std::atomic<uint32_t> _stats_flushes;
+    std::atomic<uint32_t> _stats_high_water;
+
+  private:
+    static void _flushTask(void* arg);
+    void _lockRecord();
+    void _unlockRecord();
+    int _findCube(ToioCore* toiocore);
+    bool _append(uint32_t timestamp, uint8_t kind, uint8_t cube, const uint8_t* data, size_t length);
+    void _addCube(ToioCore* toiocore);
+    void _record(ToioCore* toiocore, ToioRecordKind kind, ToioCoreCharacteristic ch, const uint8_t* data, size_t length, uint32_t timestamp);
+
+    friend class ToioCore;
+
+  public:
+    // コンストラクタ (buffer_size はリングバッファの大きさ)
+    ToioRecorder(size_t buffer_size = TOIO_RECORDER_BUFFER_SIZE);
+    ~ToioRecorder();
+
+    // 書き出しタスクを開始 (flush_interval_ms ごとに sink へ書き出す)
+    bool begin(Print* sink, uint32_t flush_interval_ms = 50, BaseType_t core = 0, UBaseType_t priority = 1);
+
+    // 書き出しタスクを止め、残りのレコードを書き出す
+    void end();
+
+    // バッファにあるレコードをすぐに書き出す
+    void flush();
+
+    // 統計情報
+    ToioRecorderStats getStats();
+};
+
+#endif
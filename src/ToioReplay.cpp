@@ -0,0 +1,203 @@
+/* ----------------------------------------------------------------
+  ToioReplay.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include "ToioReplay.h"
+#include "Toio.h"
+
+// ---------------------------------------------------------------
+// コンストラクタ
+// ---------------------------------------------------------------
+ToioReplay::ToioReplay() {
+  this->_source = nullptr;
+  this->_started = false;
+  this->_done = false;
+  this->_speed = 1.0f;
+  this->_has_pending = false;
+  this->_has_first = false;
+  this->_first_timestamp = 0;
+  this->_base_us = 0;
+  memset(&this->_stats, 0, sizeof(this->_stats));
+  this->_onwrite = nullptr;
+}
+
+// ---------------------------------------------------------------
+// ログの読み出しを開始
+// ---------------------------------------------------------------
+bool ToioReplay::begin(Stream* source, float speed) {
+  this->_source = source;
+  this->_started = false;
+  this->_done = true;
+  this->_speed = (speed > 0) ? speed : 0;
+  this->_has_pending = false;
+  this->_has_first = false;
+  for (size_t i = 0; i < TOIO_RECORDER_MAX_CUBES; i++) {
+    this->_addresses[i].clear();
+  }
+  memset(&this->_stats, 0, sizeof(this->_stats));
+  if (!source) {
+    return false;
+  }
+
+  const size_t magic_len = sizeof(TOIO_RECORDER_MAGIC) - 1;
+  uint8_t header[magic_len + 1];
+  if (source->readBytes(header, magic_len + 1) != magic_len + 1) {
+    return false;
+  }
+  if (memcmp(header, TOIO_RECORDER_MAGIC, magic_len) != 0 || header[magic_len] != TOIO_RECORDER_VERSION) {
+    return false;
+  }
+  this->_started = true;
+  this->_done = false;
+  return true;
+}
+
+// ---------------------------------------------------------------
+// ログのキューブに ToioCore を割り当てる
+// ---------------------------------------------------------------
+void ToioReplay::bind(const std::string& address, ToioCore* toiocore) {
+  this->_bindings[address] = toiocore;
+}
+
+void ToioReplay::bindAll(Toio& toio) {
+  for (auto& device : toio._devices) {
+    this->_bindings[device.first] = device.second;
+  }
+}
+
+// ---------------------------------------------------------------
+// 再生時刻になったレコードを処理する
+// (通知の時刻は、ログ上の間隔を保ったまま再生開始の時刻に合わせる)
+// ---------------------------------------------------------------
+size_t ToioReplay::feed(size_t max_records) {
+  size_t count = 0;
+  while (count < max_records && !this->_done) {
+    if (!this->_has_pending) {
+      if (!this->_read(this->_pending)) {
+        this->_done = true;
+        break;
+      }
+      this->_has_pending = true;
+    }
+    if (!this->_has_first) {
+      this->_first_timestamp = this->_pending.timestamp;
+      this->_base_us = micros();
+      this->_has_first = true;
+    }
+    int32_t offset = (int32_t)(this->_pending.timestamp - this->_first_timestamp);
+    if (offset < 0) {
+      offset = 0;
+    }
+    uint32_t due = (this->_speed > 0) ? (uint32_t)(offset / this->_speed) : (uint32_t)offset;
+    if (this->_speed > 0 && (int32_t)(micros() - this->_base_us - due) < 0) {
+      break;
+    }
+    this->_has_pending = false;
+    this->_pending.timestamp = this->_base_us + due;
+    this->_apply(this->_pending);
+    count++;
+  }
+  return count;
+}
+
+// ---------------------------------------------------------------
+// 次のレコードをそのまま読み出す
+// ---------------------------------------------------------------
+bool ToioReplay::next(ToioRecord& record) {
+  if (this->_done) {
+    return false;
+  }
+  if (this->_has_pending) {
+    record = this->_pending;
+    this->_has_pending = false;
+    return true;
+  }
+  if (!this->_read(record)) {
+    this->_done = true;
+    return false;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------
+// ログの終わりまで再生したか
+// ---------------------------------------------------------------
+bool ToioReplay::isDone() {
+  return this->_done;
+}
+
+// ---------------------------------------------------------------
+// ログに記録された書き込みのコールバックをセット
+// ---------------------------------------------------------------
+void ToioReplay::onWrite(OnReplayWriteCallback cb) {
+  this->_onwrite = cb;
+}
+
+// ---------------------------------------------------------------
+// 統計情報
+// ---------------------------------------------------------------
+ToioReplayStats ToioReplay::getStats() {
+  return this->_stats;
+}
+
+// ---------------------------------------------------------------
+// ログから 1 レコードを読む (キューブの定義はここで覚える)
+// ---------------------------------------------------------------
+bool ToioReplay::_read(ToioRecord& record) {
+  if (!this->_started) {
+    return false;
+  }
+  uint8_t header[7];
+  size_t n = this->_source->readBytes(header, 7);
+  if (n == 0) {
+    return false;
+  }
+  if (n < 7) {
+    this->_stats.errors++;
+    return false;
+  }
+  record.timestamp = (uint32_t)header[0] | ((uint32_t)header[1] << 8) | ((uint32_t)header[2] << 16) | ((uint32_t)header[3] << 24);
+  record.kind = (ToioRecordKind)(header[4] & 0xc0);
+  record.characteristic = header[4] & 0x3f;
+  record.cube = header[5];
+  record.length = header[6];
+  if (this->_source->readBytes(record.data, record.length) != record.length) {
+    this->_stats.errors++;
+    return false;
+  }
+  this->_stats.records++;
+  if (record.kind == TOIO_RECORD_CUBE && record.cube < TOIO_RECORDER_MAX_CUBES) {
+    this->_addresses[record.cube].assign((const char*)record.data, record.length);
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------
+// レコードを処理する
+// ---------------------------------------------------------------
+void ToioReplay::_apply(const ToioRecord& record) {
+  if (record.kind == TOIO_RECORD_CUBE) {
+    return;
+  }
+  const std::string empty;
+  const std::string& address = (record.cube < TOIO_RECORDER_MAX_CUBES) ? this->_addresses[record.cube] : empty;
+  if (record.kind == TOIO_RECORD_NOTIFY) {
+    auto it = this->_bindings.find(address);
+    if (address.empty() || it == this->_bindings.end() || it->second == nullptr) {
+      this->_stats.unbound++;
+      return;
+    }
+    it->second->_onNotify((ToioCoreCharacteristic)record.characteristic, record.data, record.length, record.timestamp);
+    this->_stats.notifications++;
+  } else {
+    this->_stats.writes++;
+    if (this->_onwrite) {
+      this->_onwrite(address, record);
+    }
+  }
+}
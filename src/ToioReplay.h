@@ -0,0 +1,97 @@
+/* ----------------------------------------------------------------
+  ToioReplay.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioReplay_h
+#define ToioReplay_h
+
+#include <Arduino.h>
+#include <string>
+#include <map>
+#include <functional>
+#include "ToioCore.h"
+#include "ToioRecorder.h"
+
+class Toio;
+
+// ログに記録された書き込みのコールバック (address は書き込み先のキューブ)
+typedef std::function<void(const std::string& address, const ToioRecord& record)> OnReplayWriteCallback;
+
+// 再生の統計情報
+struct ToioReplayStats {
+  uint32_t records;        // 読み出したレコードの数
+  uint32_t notifications;  // ToioCore に流し込んだ通知の数
+  uint32_t writes;         // 書き込みのレコードの数 (キューブには送らない)
+  uint32_t unbound;        // 割り当てのないキューブの通知で、捨てたものの数
+  uint32_t errors;         // 途中で切れているなど、読めなかったレコードの数
+};
+
+// ---------------------------------------------------------------
+// ToioReplay クラス
+//
+// ToioRecorder で記録したログを読み、通知のレコードを記録した
+// キューブと同じアドレスの ToioCore に流し込む。通知は実機から
+// 受信したときと同じデコード処理を通ってイベントキューに積まれ、
+// Toio::loop() からコールバックが呼ばれる。実機なしで、記録した
+// ときの不具合や処理時間を再現できる。
+//
+// 通知を流し込む ToioCore は接続していないものにすること
+// (BLE タスクからの通知と混ざらないように)。
+// ---------------------------------------------------------------
+class ToioReplay {
+  private:
+    Stream* _source;
+    bool _started;
+    bool _done;
+    float _speed;
+    std::map<std::string, ToioCore*> _bindings;
+    std::string _addresses[TOIO_RECORDER_MAX_CUBES];
+    ToioRecord _pending;
+    bool _has_pending;
+    bool _has_first;
+    uint32_t _first_timestamp;
+    uint32_t _base_us;
+    ToioReplayStats _stats;
+    OnReplayWriteCallback _onwrite;
+
+  private:
+    bool _read(ToioRecord& record);
+    void _apply(const ToioRecord& record);
+
+  public:
+    // コンストラクタ
+    ToioReplay();
+
+    // ログの読み出しを開始 (先頭のマジックナンバーを確認する)
+    // speed は再生速度の倍率 (0 なら待たずに読めるだけ流し込む)
+    bool begin(Stream* source, float speed = 1.0f);
+
+    // ログのキューブ (アドレス) に ToioCore を割り当てる
+    void bind(const std::string& address, ToioCore* toiocore);
+
+    // 発見済みのすべての ToioCore を同じアドレスのキューブに割り当てる
+    void bindAll(Toio& toio);
+
+    // 再生時刻になったレコードを処理する (.ino の loop() 内で Toio::loop() の前に呼ぶ)
+    // 処理したレコードの数を返す
+    size_t feed(size_t max_records = 16);
+
+    // 次のレコードをそのまま読み出す (feed() の代わりにログを解析するときに使う)
+    bool next(ToioRecord& record);
+
+    // ログの終わりまで再生したか
+    bool isDone();
+
+    // ログに記録された書き込みのコールバックをセット
+    void onWrite(OnReplayWriteCallback cb);
+
+    // 統計情報
+    ToioReplayStats getStats();
+};
+
+#endif
@@ -0,0 +1,123 @@
+/* ----------------------------------------------------------------
+  ToioRingBuffer.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioRingBuffer_h
+#define ToioRingBuffer_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// ---------------------------------------------------------------
+// ToioRingBuffer の統計情報
+// ---------------------------------------------------------------
+struct ToioRingBufferStats {
+  uint32_t pushed;     // キューに積まれた要素数の累計
+  uint32_t dropped;    // キューが満杯だったために破棄された要素数の累計
+  uint32_t overflows;  // キューが満杯になった回数 (連続した破棄は 1 回と数える)
+  uint32_t high_water; // キューに溜まった要素数の最大値
+};
+
+// ---------------------------------------------------------------
+// ToioRingBuffer クラス
+//
+// 単一プロデューサ・単一コンシューマ (SPSC) のロックフリーなリング
+// バッファ。BLE タスク (プロデューサ) が push() し、Arduino の loop
+// タスク (コンシューマ) が pop() することを想定している。
+// - N は 2 のべき乗であること
+// - 満杯のときは新しい要素を破棄し、その数を統計情報に記録する
+// ---------------------------------------------------------------
+template <typename T, size_t N>
+class ToioRingBuffer {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "ToioRingBuffer size must be a power of 2");
+
+  private:
+    T _buf[N];
+    std::atomic<uint32_t> _head; // 次に書き込む位置 (プロデューサのみが更新)
+    std::atomic<uint32_t> _tail; // 次に読み出す位置 (コンシューマのみが更新)
+
+    // 以下の統計情報はプロデューサのみが更新する
+    std::atomic<uint32_t> _pushed;
+    std::atomic<uint32_t> _dropped;
+    std::atomic<uint32_t> _overflows;
+    std::atomic<uint32_t> _high_water;
+    bool _overflowing;
+
+  public:
+    // コンストラクタ
+    ToioRingBuffer() : _head(0), _tail(0), _pushed(0), _dropped(0), _overflows(0), _high_water(0), _overflowing(false) {
+    }
+
+    // 要素を追加 (プロデューサ側から呼び出す)
+    bool push(const T& item) {
+      uint32_t head = this->_head.load(std::memory_order_relaxed);
+      uint32_t tail = this->_tail.load(std::memory_order_acquire);
+      uint32_t used = head - tail;
+      if (used >= N) {
+        this->_dropped.store(this->_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (!this->_overflowing) {
+          this->_overflowing = true;
+          this->_overflows.store(this->_overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        return false;
+      }
+      this->_overflowing = false;
+      this->_buf[head & (N - 1)] = item;
+      this->_head.store(head + 1, std::memory_order_release);
+      this->_pushed.store(this->_pushed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      if (used + 1 > this->_high_water.load(std::memory_order_relaxed)) {
+        this->_high_water.store(used + 1, std::memory_order_relaxed);
+      }
+      return true;
+    }
+
+    // 要素を取り出す (コンシューマ側から呼び出す)
+    bool pop(T& item) {
+      uint32_t tail = this->_tail.load(std::memory_order_relaxed);
+      uint32_t head = this->_head.load(std::memory_order_acquire);
+      if (tail == head) {
+        return false;
+      }
+      item = this->_buf[tail & (N - 1)];
+      this->_tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    // 溜まっている要素をすべて破棄 (コンシューマ側から呼び出す)
+    void clear() {
+      this->_tail.store(this->_head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    // 溜まっている要素数
+    size_t size() const {
+      return this->_head.load(std::memory_order_acquire) - this->_tail.load(std::memory_order_acquire);
+    }
+
+    // 空かどうか
+    bool empty() const {
+      return this->size() == 0;
+    }
+
+    // 容量
+    size_t capacity() const {
+      return N;
+    }
+
+    // 統計情報を取得
+    ToioRingBufferStats getStats() const {
+      ToioRingBufferStats stats;
+      stats.pushed = this->_pushed.load(std::memory_order_relaxed);
+      stats.dropped = this->_dropped.load(std::memory_order_relaxed);
+      stats.overflows = this->_overflows.load(std::memory_order_relaxed);
+      stats.high_water = this->_high_water.load(std::memory_order_relaxed);
+      return stats;
+    }
+};
+
+#endif
@@ -0,0 +1,87 @@
+/* ----------------------------------------------------------------
+  ToioSeqLock.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioSeqLock_h
+#define ToioSeqLock_h
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+// ---------------------------------------------------------------
+// ToioSeqLock クラス
+//
+// 単一ライターのシーケンスロック。BLE タスク (ライター) が書き込んだ
+// 最新の値を、任意のタスク (リーダー) がロックを取らずに読み出せる。
+// - ライターは待たされない
+// - リーダーは書き込み中の値を読んだ場合に読み直す
+// - T はトリビアルにコピーできる型であること
+//
+// read() は書き込みが終わるまで読み直し続けるので、ライターより優先度の
+// 高いタスクが同じコアで read() すると、割り込まれたライターが書き込みを
+// 終えられずに止まる。ライターの方が優先度が低い場合は tryRead() を使い、
+// 読めなければタスクを譲ってから読み直すか、前回の値を使うこと。
+// ---------------------------------------------------------------
+template <typename T>
+class ToioSeqLock {
+  private:
+    std::atomic<uint32_t> _seq; // 奇数なら書き込み中
+    T _value;
+
+  public:
+    // コンストラクタ
+    ToioSeqLock() : _seq(0) {
+      memset(&this->_value, 0, sizeof(T));
+    }
+
+    // 値を書き込む (ライター側から呼び出す)
+    void write(const T& value) {
+      uint32_t seq = this->_seq.load(std::memory_order_relaxed);
+      this->_seq.store(seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      memcpy(&this->_value, &value, sizeof(T));
+      this->_seq.store(seq + 2, std::memory_order_release);
+    }
+
+    // 値を読み出す (一度も書き込まれていなければ false)
+    bool read(T& value) const {
+      while (true) {
+        uint32_t seq1 = this->_seq.load(std::memory_order_acquire);
+        if (seq1 & 1) {
+          continue;
+        }
+        memcpy(&value, &this->_value, sizeof(T));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint32_t seq2 = this->_seq.load(std::memory_order_relaxed);
+        if (seq1 == seq2) {
+          return seq1 != 0;
+        }
+      }
+    }
+
+    // 値を 1 回だけ読み出す (書き込み中か、一度も書き込まれていなければ false)
+    // (false のとき value の中身は不定)
+    bool tryRead(T& value) const {
+      uint32_t seq1 = this->_seq.load(std::memory_order_acquire);
+      if (seq1 & 1) {
+        return false;
+      }
+      memcpy(&value, &this->_value, sizeof(T));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint32_t seq2 = this->_seq.load(std::memory_order_relaxed);
+      return seq1 == seq2 && seq1 != 0;
+    }
+
+    // 書き込まれた回数
+    uint32_t version() const {
+      return this->_seq.load(std::memory_order_acquire) >> 1;
+    }
+};
+
+#endif
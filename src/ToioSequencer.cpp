@@ -0,0 +1,158 @@
+/* ----------------------------------------------------------------
+  ToioSequencer.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include "ToioSequencer.h"
+
+// ---------------------------------------------------------------
+// コンストラクタ
+// ---------------------------------------------------------------
+ToioSequencer::ToioSequencer() {
+  this->_toiocore = nullptr;
+  this->_notes = nullptr;
+  this->_count = 0;
+  this->_repeat = 1;
+  this->_played = 0;
+  this->_next = 0;
+  this->_playing = false;
+  this->_send_at = 0;
+  this->_end_at = 0;
+  this->_write_us = 0;
+  memset(&this->_stats, 0, sizeof(this->_stats));
+}
+
+// ---------------------------------------------------------------
+// 再生するキューブをセット
+// ---------------------------------------------------------------
+void ToioSequencer::begin(ToioCore* toiocore) {
+  this->stop();
+  this->_toiocore = toiocore;
+}
+
+// ---------------------------------------------------------------
+// 再生を開始 (最初の区切りはすぐに書き込む)
+// ---------------------------------------------------------------
+bool ToioSequencer::play(const ToioNote* notes, size_t count, uint8_t repeat) {
+  if (!this->_toiocore || !this->_toiocore->isConnected() || !notes || count == 0) {
+    return false;
+  }
+  this->_notes = notes;
+  this->_count = count;
+  this->_repeat = repeat;
+  this->_played = 0;
+  this->_next = 0;
+  this->_playing = true;
+  memset(&this->_stats, 0, sizeof(this->_stats));
+  uint32_t now = micros();
+  this->_send_at = now;
+  this->_sendSegment(now);
+  return true;
+}
+
+// ---------------------------------------------------------------
+// 再生を停止
+// ---------------------------------------------------------------
+void ToioSequencer::stop() {
+  if (this->_playing && this->_toiocore) {
+    this->_toiocore->stopSound();
+  }
+  this->_playing = false;
+}
+
+// ---------------------------------------------------------------
+// 再生中か
+// ---------------------------------------------------------------
+bool ToioSequencer::isPlaying() {
+  return this->_playing;
+}
+
+// ---------------------------------------------------------------
+// 書き込む時刻になった区切りを書き込む
+// ---------------------------------------------------------------
+void ToioSequencer::loop() {
+  if (!this->_playing) {
+    return;
+  }
+  if (!this->_toiocore->isConnected()) {
+    this->_playing = false;
+    return;
+  }
+  uint32_t now = micros();
+  if (this->_next >= this->_count) {
+    // すべて書き込んだので、鳴り終わるのを待つ
+    if ((int32_t)(now - this->_end_at) >= 0) {
+      this->_playing = false;
+    }
+    return;
+  }
+  if ((int32_t)(now - this->_send_at) >= 0) {
+    this->_sendSegment(now);
+  }
+}
+
+// ---------------------------------------------------------------
+// 統計情報
+// ---------------------------------------------------------------
+ToioSequencerStats ToioSequencer::getStats() {
+  return this->_stats;
+}
+
+// ---------------------------------------------------------------
+// start から始まる区切りの終わり (含まない) を返す
+// (最大数で区切る前に休符があれば、その休符の直後で区切る)
+// ---------------------------------------------------------------
+size_t ToioSequencer::_segmentEnd(size_t start) {
+  size_t end = start + TOIO_MIDI_MAX_NOTES;
+  if (end >= this->_count) {
+    return this->_count;
+  }
+  for (size_t i = end; i > end - TOIO_SEQUENCER_SPLIT_WINDOW && i > start + 1; i--) {
+    if (this->_notes[i - 1].note == TOIO_NOTE_REST) {
+      return i;
+    }
+  }
+  return end;
+}
+
+// ---------------------------------------------------------------
+// 次の区切りを書き込み、その次を書き込む時刻を決める
+// (書き込みの完了を、キューブが再生を始めた時刻とみなす)
+// ---------------------------------------------------------------
+void ToioSequencer::_sendSegment(uint32_t now) {
+  int32_t late = (int32_t)(now - this->_send_at);
+  if (late > 0 && (uint32_t)late > this->_stats.max_late_us) {
+    this->_stats.max_late_us = late;
+  }
+
+  size_t start = this->_next;
+  size_t end = this->_segmentEnd(start);
+  size_t n = end - start;
+  uint32_t duration_ms = 0;
+  toioEncodeMidi(this->_notes + start, n, 1, this->_packet); // 繰り返しは区切りごとに書き込むので 1 回
+  for (size_t i = start; i < end; i++) {
+    duration_ms += this->_notes[i].duration * 10;
+  }
+
+  uint32_t started = micros();
+  this->_toiocore->playSoundRaw(this->_packet.data, this->_packet.length);
+  uint32_t done = micros();
+  uint32_t write_us = done - started;
+
+  // 所要時間の見積もりは急に延びたときにすぐ追従し、縮むときはゆっくり戻す
+  this->_write_us = (write_us > this->_write_us) ? write_us : (this->_write_us * 3 + write_us) / 4;
+  this->_stats.segments++;
+  this->_stats.notes += n;
+  this->_stats.last_write_us = write_us;
+
+  this->_end_at = done + duration_ms * 1000;
+  this->_send_at = this->_end_at - this->_write_us;
+  this->_next = end;
+  if (this->_next >= this->_count && (this->_repeat == 0 || ++this->_played < this->_repeat)) {
+    this->_next = 0;
+  }
+}
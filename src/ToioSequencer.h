@@ -0,0 +1,86 @@
+/* ----------------------------------------------------------------
+  ToioSequencer.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioSequencer_h
+#define ToioSequencer_h
+
+#include <Arduino.h>
+#include "ToioCore.h"
+
+// 区切りを探す範囲 (音の数)
+// (区切りの直前に休符があれば、そこで区切って書き込みのつなぎ目を目立たなくする)
+#ifndef TOIO_SEQUENCER_SPLIT_WINDOW
+#define TOIO_SEQUENCER_SPLIT_WINDOW 16
+#endif
+
+// 再生の統計情報
+struct ToioSequencerStats {
+  uint32_t segments;        // 書き込んだ区切りの数
+  uint32_t notes;           // 書き込んだ音の数
+  uint32_t last_write_us;   // 直近の書き込みの所要時間 (マイクロ秒)
+  uint32_t max_late_us;     // 予定より遅れて書き込んだ時間の最大値 (マイクロ秒)
+};
+
+// ---------------------------------------------------------------
+// ToioSequencer クラス
+//
+// ToioNote の配列 (constexpr で作っておけばフラッシュに置かれる) を
+// 59 音ずつに区切り、1 つ前の区切りが鳴り終わる時刻に合わせて次の
+// 区切りを書き込む。書き込みの所要時間を計って、その分だけ早めに
+// 書き込むので、区切りのつなぎ目で音が途切れない。再生中のメモリの
+// 確保はなく、書き込みのデータはオブジェクト内のバッファで組み立てる。
+// ---------------------------------------------------------------
+class ToioSequencer {
+  private:
+    ToioCore* _toiocore;
+    const ToioNote* _notes;
+    size_t _count;
+    uint8_t _repeat;        // 0 なら無限に繰り返す
+    uint8_t _played;        // 最後まで書き込んだ回数
+    size_t _next;           // 次に書き込む音
+    bool _playing;
+    uint32_t _send_at;      // 次の区切りを書き込む時刻 (micros())
+    uint32_t _end_at;       // 書き込んだ区切りが鳴り終わる時刻 (micros())
+    uint32_t _write_us;     // 書き込みの所要時間の見積もり (マイクロ秒)
+    ToioSequencerStats _stats;
+    ToioPacket<TOIO_MIDI_PACKET_SIZE> _packet;
+
+    size_t _segmentEnd(size_t start);
+    void _sendSegment(uint32_t now);
+
+  public:
+    // コンストラクタ
+    ToioSequencer();
+
+    // 再生するキューブをセット
+    void begin(ToioCore* toiocore);
+
+    // 再生を開始 (repeat は繰り返す回数。0 なら stop() まで繰り返す)
+    // (notes は再生が終わるまで有効なままにしておくこと)
+    bool play(const ToioNote* notes, size_t count, uint8_t repeat = 1);
+
+    template <size_t N>
+    bool play(const ToioNote (&notes)[N], uint8_t repeat = 1) {
+      return this->play(notes, N, repeat);
+    }
+
+    // 再生を停止
+    void stop();
+
+    // 再生中か (最後の区切りが鳴り終わるまで true)
+    bool isPlaying();
+
+    // 書き込む時刻になった区切りを書き込む (.ino の loop() から呼ぶ)
+    void loop();
+
+    // 統計情報
+    ToioSequencerStats getStats();
+};
+
+#endif
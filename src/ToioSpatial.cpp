@@ -0,0 +1,325 @@
+/* ----------------------------------------------------------------
+  ToioSpatial.cpp
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#include "ToioSpatial.h"
+#include <math.h>
+
+static_assert((TOIO_SPATIAL_BUCKETS & (TOIO_SPATIAL_BUCKETS - 1)) == 0, "TOIO_SPATIAL_BUCKETS must be a power of 2");
+
+// 座標をセルの列・行にする (負の座標も切り捨てる)
+static inline int32_t toioSpatialCell(int32_t v, int32_t cell_size) {
+  return (v >= 0) ? v / cell_size : -((-v + cell_size - 1) / cell_size);
+}
+
+// ===============================================================
+// ToioSpatial クラス
+// ===============================================================
+
+// ---------------------------------------------------------------
+// コンストラクタ
+// ---------------------------------------------------------------
+ToioSpatial::ToioSpatial() {
+  for (size_t i = 0; i < TOIO_SPATIAL_BUCKETS; i++) {
+    this->_buckets[i] = -1;
+  }
+  this->_enabled = false;
+  this->_cell_size = TOIO_SPATIAL_CELL_SIZE;
+  this->_avoid = false;
+  this->_stop_distance = TOIO_SPATIAL_STOP_DISTANCE;
+  this->_slow_distance = TOIO_SPATIAL_SLOW_DISTANCE;
+  memset(&this->_stats, 0, sizeof(this->_stats));
+}
+
+// ---------------------------------------------------------------
+// 有効・無効にする
+// (インデックスは空にして、次に位置を反映するときに入れ直す)
+// ---------------------------------------------------------------
+void ToioSpatial::setEnabled(bool enable, uint16_t cell_size) {
+  for (size_t i = 0; i < TOIO_SPATIAL_BUCKETS; i++) {
+    this->_buckets[i] = -1;
+  }
+  for (_Entry& entry : this->_entries) {
+    entry.bucket = -1;
+    entry.seq = 0;
+    entry.cube->_setMotorLimits(ToioCore::_MOTOR_NO_LIMIT, ToioCore::_MOTOR_NO_LIMIT);
+  }
+  this->_stats.indexed = 0;
+  this->_enabled = enable;
+  this->_cell_size = cell_size ? cell_size : 1;
+}
+
+bool ToioSpatial::isEnabled() {
+  return this->_enabled;
+}
+
+// ---------------------------------------------------------------
+// 衝突回避を設定
+// (有効にしたら、インデックスに入っているすべてのキューブの速度の上限を決める)
+// ---------------------------------------------------------------
+void ToioSpatial::setAvoidance(bool enable, uint16_t stop_distance, uint16_t slow_distance) {
+  this->_avoid = enable;
+  this->_stop_distance = stop_distance;
+  this->_slow_distance = (slow_distance > stop_distance) ? slow_distance : stop_distance + 1;
+  for (size_t i = 0; i < this->_entries.size(); i++) {
+    if (enable && this->_entries[i].bucket >= 0) {
+      this->_limit(i);
+    } else {
+      this->_entries[i].cube->_setMotorLimits(ToioCore::_MOTOR_NO_LIMIT, ToioCore::_MOTOR_NO_LIMIT);
+    }
+  }
+}
+
+// ---------------------------------------------------------------
+// キューブの最新の位置をインデックスに反映する
+// - 未接続かマットから外れていればインデックスから外す
+// - セルが変わったときだけバケットを付け替える
+// - 衝突回避が有効なら、このキューブと移動前後の近くのキューブの速度の上限を決め直す
+// ---------------------------------------------------------------
+void ToioSpatial::update(ToioCore* toiocore) {
+  if (!this->_enabled) {
+    return;
+  }
+  int32_t slot = this->_slot(toiocore);
+  if (!toiocore->isConnected()) {
+    this->remove(toiocore);
+    return;
+  }
+  uint32_t seq = toiocore->_pose_seq.load(std::memory_order_acquire);
+  _Entry& entry = this->_entries[slot];
+  if (seq == entry.seq) {
+    return;
+  }
+  entry.seq = seq;
+  ToioCorePose pose;
+  if (!toiocore->getLatestPose(pose) || !pose.on_mat) {
+    this->remove(toiocore);
+    return;
+  }
+  this->_stats.updates++;
+  bool indexed = (entry.bucket >= 0);
+  int32_t old_x = entry.x;
+  int32_t old_y = entry.y;
+  entry.x = pose.position.x;
+  entry.y = pose.position.y;
+  float rad = pose.position.angle * (float)M_PI / 180.0f;
+  entry.hx = cosf(rad);
+  entry.hy = sinf(rad);
+  int32_t cx = toioSpatialCell(entry.x, this->_cell_size);
+  int32_t cy = toioSpatialCell(entry.y, this->_cell_size);
+  if (!indexed || cx != entry.cx || cy != entry.cy) {
+    if (indexed) {
+      this->_unlink(slot);
+    }
+    entry.cx = cx;
+    entry.cy = cy;
+    this->_link(slot);
+    this->_stats.cell_moves++;
+  }
+
+  if (!this->_avoid) {
+    return;
+  }
+  this->_touched.clear();
+  this->_touched.push_back(slot);
+  if (indexed) {
+    this->_collectNear(old_x, old_y);
+  }
+  this->_collectNear(this->_entries[slot].x, this->_entries[slot].y);
+  for (int32_t touched : this->_touched) {
+    this->_limit(touched);
+  }
+}
+
+// ---------------------------------------------------------------
+// キューブをインデックスから外す
+// (衝突回避が有効なら、近くにいたキューブの速度の上限を決め直す)
+// ---------------------------------------------------------------
+void ToioSpatial::remove(ToioCore* toiocore) {
+  int32_t slot = toiocore->_spatial_slot;
+  if (slot < 0 || this->_entries[slot].bucket < 0) {
+    return;
+  }
+  this->_unlink(slot);
+  toiocore->_setMotorLimits(ToioCore::_MOTOR_NO_LIMIT, ToioCore::_MOTOR_NO_LIMIT);
+  if (!this->_avoid) {
+    return;
+  }
+  this->_touched.clear();
+  this->_collectNear(this->_entries[slot].x, this->_entries[slot].y);
+  for (int32_t touched : this->_touched) {
+    this->_limit(touched);
+  }
+}
+
+// ---------------------------------------------------------------
+// インデックスに入っているキューブから radius 以内の他のキューブを探す
+// ---------------------------------------------------------------
+size_t ToioSpatial::findNeighbors(ToioCore* toiocore, uint16_t radius, ToioCore** cubes, size_t max) {
+  int32_t slot = toiocore->_spatial_slot;
+  if (!this->_enabled || slot < 0 || this->_entries[slot].bucket < 0) {
+    return 0;
+  }
+  return this->findNear(this->_entries[slot].x, this->_entries[slot].y, radius, cubes, max, toiocore);
+}
+
+// ---------------------------------------------------------------
+// 座標 (x, y) から radius 以内のキューブを探す
+// ---------------------------------------------------------------
+size_t ToioSpatial::findNear(int32_t x, int32_t y, uint16_t radius, ToioCore** cubes, size_t max, ToioCore* except) {
+  size_t n = 0;
+  this->_forEachNear(x, y, radius, [&](int32_t slot, int32_t dx, int32_t dy, int32_t d2) {
+    ToioCore* cube = this->_entries[slot].cube;
+    if (cube != except && n < max) {
+      cubes[n++] = cube;
+    }
+  });
+  return n;
+}
+
+// ---------------------------------------------------------------
+// 統計情報を取得
+// ---------------------------------------------------------------
+ToioSpatialStats ToioSpatial::getStats() {
+  return this->_stats;
+}
+
+// ---------------------------------------------------------------
+// キューブの番号を返す (初めてのキューブなら登録する)
+// ---------------------------------------------------------------
+int32_t ToioSpatial::_slot(ToioCore* toiocore) {
+  if (toiocore->_spatial_slot < 0) {
+    _Entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.cube = toiocore;
+    entry.bucket = -1;
+    entry.prev = -1;
+    entry.next = -1;
+    this->_entries.push_back(entry);
+    toiocore->_spatial_slot = this->_entries.size() - 1;
+  }
+  return toiocore->_spatial_slot;
+}
+
+// ---------------------------------------------------------------
+// セルの列・行をバケットに振り分ける
+// ---------------------------------------------------------------
+uint32_t ToioSpatial::_hash(int32_t cx, int32_t cy) {
+  return ((uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u) & (TOIO_SPATIAL_BUCKETS - 1);
+}
+
+// ---------------------------------------------------------------
+// セルのバケットの先頭につなぐ / バケットから外す
+// ---------------------------------------------------------------
+void ToioSpatial::_link(int32_t slot) {
+  _Entry& entry = this->_entries[slot];
+  uint32_t bucket = _hash(entry.cx, entry.cy);
+  entry.bucket = bucket;
+  entry.prev = -1;
+  entry.next = this->_buckets[bucket];
+  if (entry.next >= 0) {
+    this->_entries[entry.next].prev = slot;
+  }
+  this->_buckets[bucket] = slot;
+  this->_stats.indexed++;
+}
+
+void ToioSpatial::_unlink(int32_t slot) {
+  _Entry& entry = this->_entries[slot];
+  if (entry.prev >= 0) {
+    this->_entries[entry.prev].next = entry.next;
+  } else {
+    this->_buckets[entry.bucket] = entry.next;
+  }
+  if (entry.next >= 0) {
+    this->_entries[entry.next].prev = entry.prev;
+  }
+  entry.bucket = -1;
+  entry.prev = -1;
+  entry.next = -1;
+  this->_stats.indexed--;
+}
+
+// ---------------------------------------------------------------
+// 座標 (x, y) から radius 以内のキューブごとに visit(番号, dx, dy, 距離の 2 乗) を呼ぶ
+// (半径にかかるセルのバケットだけを調べ、ハッシュが衝突した他のセルのキューブは除く)
+// ---------------------------------------------------------------
+template <typename F>
+void ToioSpatial::_forEachNear(int32_t x, int32_t y, uint16_t radius, F visit) {
+  this->_stats.queries++;
+  int32_t r = radius;
+  int32_t x0 = toioSpatialCell(x - r, this->_cell_size);
+  int32_t x1 = toioSpatialCell(x + r, this->_cell_size);
+  int32_t y0 = toioSpatialCell(y - r, this->_cell_size);
+  int32_t y1 = toioSpatialCell(y + r, this->_cell_size);
+  for (int32_t cy = y0; cy <= y1; cy++) {
+    for (int32_t cx = x0; cx <= x1; cx++) {
+      for (int32_t i = this->_buckets[_hash(cx, cy)]; i >= 0; i = this->_entries[i].next) {
+        const _Entry& entry = this->_entries[i];
+        if (entry.cx != cx || entry.cy != cy) {
+          continue;
+        }
+        this->_stats.candidates++;
+        int32_t dx = entry.x - x;
+        int32_t dy = entry.y - y;
+        int32_t d2 = dx * dx + dy * dy;
+        if (d2 <= r * r) {
+          visit(i, dx, dy, d2);
+        }
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------
+// 座標 (x, y) の近く (減速を始める距離以内) のキューブを _touched に加える
+// ---------------------------------------------------------------
+void ToioSpatial::_collectNear(int32_t x, int32_t y) {
+  this->_forEachNear(x, y, this->_slow_distance, [this](int32_t slot, int32_t dx, int32_t dy, int32_t d2) {
+    this->_touched.push_back(slot);
+  });
+}
+
+// ---------------------------------------------------------------
+// 前方・後方 (向きから左右 60 度以内) の最も近いキューブまでの距離で速度の上限を決める
+// (止まる距離以内なら 0 %、減速を始める距離以上なら 100 %、その間は距離に比例)
+// ---------------------------------------------------------------
+void ToioSpatial::_limit(int32_t slot) {
+  const _Entry& self = this->_entries[slot];
+  int32_t front = INT32_MAX;
+  int32_t rear = INT32_MAX;
+  this->_forEachNear(self.x, self.y, this->_slow_distance, [&](int32_t i, int32_t dx, int32_t dy, int32_t d2) {
+    if (i == slot) {
+      return;
+    }
+    float d = sqrtf((float)d2);
+    float along = dx * self.hx + dy * self.hy;
+    if (along > d * 0.5f) {
+      front = (d2 < front) ? d2 : front;
+    } else if (along < -d * 0.5f) {
+      rear = (d2 < rear) ? d2 : rear;
+    }
+  });
+  int32_t stop = this->_stop_distance;
+  int32_t slow = this->_slow_distance;
+  uint8_t pct[2];
+  int32_t d2s[2] = {front, rear};
+  for (int k = 0; k < 2; k++) {
+    if (d2s[k] >= slow * slow) {
+      pct[k] = ToioCore::_MOTOR_NO_LIMIT;
+    } else if (d2s[k] <= stop * stop) {
+      pct[k] = 0;
+    } else {
+      int32_t d = (int32_t)sqrtf((float)d2s[k]);
+      pct[k] = (uint8_t)((d - stop) * 100 / (slow - stop));
+    }
+  }
+  if (self.cube->_setMotorLimits(pct[0], pct[1])) {
+    this->_stats.limits++;
+  }
+}
@@ -0,0 +1,121 @@
+/* ----------------------------------------------------------------
+  ToioSpatial.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioSpatial_h
+#define ToioSpatial_h
+
+#include <Arduino.h>
+#include <vector>
+#include "ToioCore.h"
+
+// 空間インデックスのセルの一辺の既定値 (マットの座標単位)
+// (近くのキューブを探す半径をこれ以下にすると、調べるセルは 3 x 3 以内になる)
+#ifndef TOIO_SPATIAL_CELL_SIZE
+#define TOIO_SPATIAL_CELL_SIZE 80
+#endif
+
+// セルを振り分けるバケットの数 (2 のべき乗)
+#ifndef TOIO_SPATIAL_BUCKETS
+#define TOIO_SPATIAL_BUCKETS 64
+#endif
+
+// 衝突回避の距離の既定値 (キューブの中心どうしの距離。マットの座標単位)
+#ifndef TOIO_SPATIAL_STOP_DISTANCE
+#define TOIO_SPATIAL_STOP_DISTANCE 40
+#endif
+#ifndef TOIO_SPATIAL_SLOW_DISTANCE
+#define TOIO_SPATIAL_SLOW_DISTANCE 80
+#endif
+
+// 空間インデックスの統計情報
+struct ToioSpatialStats {
+  uint32_t indexed;    // インデックスに入っているキューブの数
+  uint32_t updates;    // 位置の更新を反映した回数
+  uint32_t cell_moves; // そのうちセルが変わった回数
+  uint32_t queries;    // 近くのキューブを探した回数 (衝突回避の分を含む)
+  uint32_t candidates; // 探したときに距離を比べたキューブの数の累計
+  uint32_t limits;     // 衝突回避の速度の上限を変えた回数
+};
+
+// ---------------------------------------------------------------
+// ToioSpatial クラス (Toio が内部で使う)
+//
+// 接続中のキューブをマットの座標の一様なグリッドで管理する。
+// セルは (列, 行) のハッシュでバケットに振り分け、バケットごとに
+// キューブを連結リストでつなぐ。位置が更新されたキューブだけを
+// 付け替えるので、近くのキューブを探す手間はキューブの総数によらない。
+// 衝突回避を有効にすると、位置が更新されたキューブとその近くの
+// キューブについて、前方・後方のキューブまでの距離から速度の上限を
+// 決め直し、ToioCore に渡す。すべて loop タスクから呼ぶこと。
+// ---------------------------------------------------------------
+class ToioSpatial {
+  private:
+    struct _Entry {
+      ToioCore* cube;
+      uint32_t seq;      // 反映した位置の通し番号
+      int32_t x;
+      int32_t y;
+      float hx;          // 向いている方向の単位ベクトル
+      float hy;
+      int32_t cx;        // セルの列・行
+      int32_t cy;
+      int32_t bucket;    // バケット (-1 ならインデックスに入っていない)
+      int32_t prev;      // 同じバケットの前後のキューブ (-1 なら端)
+      int32_t next;
+    };
+    std::vector<_Entry> _entries;
+    int32_t _buckets[TOIO_SPATIAL_BUCKETS];
+    bool _enabled;
+    uint16_t _cell_size;
+
+    bool _avoid;
+    uint16_t _stop_distance;
+    uint16_t _slow_distance;
+    std::vector<int32_t> _touched;
+
+    ToioSpatialStats _stats;
+
+  private:
+    int32_t _slot(ToioCore* toiocore);
+    static uint32_t _hash(int32_t cx, int32_t cy);
+    void _link(int32_t slot);
+    void _unlink(int32_t slot);
+    template <typename F>
+    void _forEachNear(int32_t x, int32_t y, uint16_t radius, F visit);
+    void _collectNear(int32_t x, int32_t y);
+    void _limit(int32_t slot);
+
+  public:
+    // コンストラクタ
+    ToioSpatial();
+
+    // 有効・無効にする (無効にするとインデックスと衝突回避の速度の上限を消す)
+    void setEnabled(bool enable, uint16_t cell_size = TOIO_SPATIAL_CELL_SIZE);
+    bool isEnabled();
+
+    // 衝突回避を設定
+    void setAvoidance(bool enable, uint16_t stop_distance, uint16_t slow_distance);
+
+    // キューブの最新の位置をインデックスに反映する (位置が変わっていなければ何もしない)
+    void update(ToioCore* toiocore);
+
+    // キューブをインデックスから外す
+    void remove(ToioCore* toiocore);
+
+    // インデックスに入っているキューブから radius 以内の他のキューブを探す (見つけた数を返す)
+    size_t findNeighbors(ToioCore* toiocore, uint16_t radius, ToioCore** cubes, size_t max);
+
+    // 座標 (x, y) から radius 以内のキューブを探す (見つけた数を返す)
+    size_t findNear(int32_t x, int32_t y, uint16_t radius, ToioCore** cubes, size_t max, ToioCore* except = nullptr);
+
+    // 統計情報を取得
+    ToioSpatialStats getStats();
+};
+
+#endif
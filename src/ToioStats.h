@@ -0,0 +1,114 @@
+/* ----------------------------------------------------------------
+  ToioStats.h
+
+  Copyright (c) 2020 Futomi Hatano. All right reserved.
+  https://github.com/futomi
+
+  Licensed under the MIT license.
+  See LICENSE file in the project root for full license information.
+  -------------------------------------------------------------- */
+#ifndef ToioStats_h
+#define ToioStats_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// 通信の計測を有効にするか (0 にすると計測のコードはすべてコンパイルされない)
+#ifndef TOIO_STATS_ENABLED
+#define TOIO_STATS_ENABLED 1
+#endif
+
+// ヒストグラムのバケット数
+// (バケット i は (16 << i) マイクロ秒未満。最後のバケットはそれ以上すべて)
+#define TOIO_STATS_BUCKETS 16
+
+// ---------------------------------------------------------------
+// ヒストグラムのスナップショット
+// ---------------------------------------------------------------
+struct ToioStatsHistogram {
+  uint32_t count;                       // 計測した回数
+  uint32_t avg_us;                      // 平均値 (マイクロ秒)
+  uint32_t max_us;                      // 最大値 (マイクロ秒)
+  uint32_t buckets[TOIO_STATS_BUCKETS]; // バケットごとの回数
+};
+
+// バケット i の上限 (マイクロ秒、この値を含まない)
+inline uint32_t toioStatsBucketLimit(size_t i) {
+  return 16UL << i;
+}
+
+// パーセンタイル (該当するバケットの上限で近似。最後のバケットなら最大値)
+inline uint32_t toioStatsPercentile(const ToioStatsHistogram& histogram, uint8_t percent) {
+  if (histogram.count == 0) {
+    return 0;
+  }
+  uint64_t target = ((uint64_t)histogram.count * percent + 99) / 100;
+  uint64_t total = 0;
+  for (size_t i = 0; i < TOIO_STATS_BUCKETS - 1; i++) {
+    total += histogram.buckets[i];
+    if (total >= target) {
+      uint32_t limit = toioStatsBucketLimit(i);
+      return (limit < histogram.max_us) ? limit : histogram.max_us;
+    }
+  }
+  return histogram.max_us;
+}
+
+// ---------------------------------------------------------------
+// ToioStatsCounter クラス
+//
+// 所要時間や間隔をバケットの固定されたヒストグラムに数える。
+// 複数のタスクから record() してよい (各値は個別にアトミックに
+// 更新するので、スナップショットは厳密には同時刻の値ではない)。
+// ---------------------------------------------------------------
+class ToioStatsCounter {
+  private:
+    std::atomic<uint32_t> _count;
+    std::atomic<uint64_t> _total;
+    std::atomic<uint32_t> _max;
+    std::atomic<uint32_t> _buckets[TOIO_STATS_BUCKETS];
+
+  public:
+    // コンストラクタ
+    ToioStatsCounter() {
+      this->reset();
+    }
+
+    // 値 (マイクロ秒) を数える
+    void record(uint32_t us) {
+      size_t i = (us < 16) ? 0 : (size_t)(32 - __builtin_clz(us) - 4);
+      if (i >= TOIO_STATS_BUCKETS) {
+        i = TOIO_STATS_BUCKETS - 1;
+      }
+      this->_buckets[i].fetch_add(1, std::memory_order_relaxed);
+      this->_count.fetch_add(1, std::memory_order_relaxed);
+      this->_total.fetch_add(us, std::memory_order_relaxed);
+      uint32_t max = this->_max.load(std::memory_order_relaxed);
+      while (us > max && !this->_max.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+      }
+    }
+
+    // スナップショットを取得
+    void snapshot(ToioStatsHistogram& histogram) const {
+      histogram.count = this->_count.load(std::memory_order_relaxed);
+      uint64_t total = this->_total.load(std::memory_order_relaxed);
+      histogram.avg_us = histogram.count ? (uint32_t)(total / histogram.count) : 0;
+      histogram.max_us = this->_max.load(std::memory_order_relaxed);
+      for (size_t i = 0; i < TOIO_STATS_BUCKETS; i++) {
+        histogram.buckets[i] = this->_buckets[i].load(std::memory_order_relaxed);
+      }
+    }
+
+    // リセット
+    void reset() {
+      this->_count.store(0, std::memory_order_relaxed);
+      this->_total.store(0, std::memory_order_relaxed);
+      this->_max.store(0, std::memory_order_relaxed);
+      for (size_t i = 0; i < TOIO_STATS_BUCKETS; i++) {
+        this->_buckets[i].store(0, std::memory_order_relaxed);
+      }
+    }
+};
+
+#endif